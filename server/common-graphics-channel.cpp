@@ -50,7 +50,7 @@ bool CommonGraphicsChannelClient::config_socket()
     RedStream *stream = get_stream();
     gboolean is_low_bandwidth;
 
-    // TODO - this should be dynamic, not one time at channel creation
+    // initial setting, DisplayChannelClient updates it when the estimate changes
     is_low_bandwidth = mcc->is_low_bandwidth();
     if (!red_stream_set_auto_flush(stream, false)) {
         /* FIXME: Using Nagle's Algorithm can lead to apparent delays, depending
@@ -0,0 +1,179 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <string.h>
+#include <glib.h>
+#include <common/rect.h>
+
+#include "damage-tracker.h"
+
+DamageTracker::~DamageTracker()
+{
+    g_free(tiles);
+}
+
+void DamageTracker::resize(int new_width, int new_height)
+{
+    if (tiles && new_width == width && new_height == height) {
+        return;
+    }
+
+    g_free(tiles);
+    width = new_width;
+    height = new_height;
+    cols = (width + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    rows = (height + DAMAGE_TILE_SIZE - 1) / DAMAGE_TILE_SIZE;
+    tiles = cols * rows > 0 ? g_new0(Tile, cols * rows) : nullptr;
+    reset();
+}
+
+void DamageTracker::reset()
+{
+    if (tiles) {
+        memset(tiles, 0, sizeof(Tile) * cols * rows);
+    }
+    last_update_time = 0;
+    candidate = {};
+    stable_updates = 0;
+    has_region = false;
+}
+
+void DamageTracker::add_damage(const SpiceRect &rect, red_time_t now)
+{
+    SpiceRect bounds = { 0, 0, width, height };
+    SpiceRect damage = rect;
+
+    if (!tiles) {
+        return;
+    }
+    rect_sect(&damage, &bounds);
+    if (rect_is_empty(&damage)) {
+        return;
+    }
+
+    for (int row = damage.top / DAMAGE_TILE_SIZE;
+         row <= (damage.bottom - 1) / DAMAGE_TILE_SIZE; row++) {
+        for (int col = damage.left / DAMAGE_TILE_SIZE;
+             col <= (damage.right - 1) / DAMAGE_TILE_SIZE; col++) {
+            Tile *tile = &tiles[row * cols + col];
+            SpiceRect part = {
+                col * DAMAGE_TILE_SIZE, row * DAMAGE_TILE_SIZE,
+                (col + 1) * DAMAGE_TILE_SIZE, (row + 1) * DAMAGE_TILE_SIZE
+            };
+
+            rect_sect(&part, &damage);
+            if (tile->frames == 0 || now - tile->last_update > DAMAGE_MAX_FRAME_INTERVAL) {
+                tile->frames = 1;
+                tile->last_update = now;
+                tile->extents = part;
+                continue;
+            }
+            rect_union(&tile->extents, &part);
+            /* many drawables can update a tile for the same frame */
+            if (now - tile->last_update >= DAMAGE_MIN_FRAME_INTERVAL) {
+                tile->frames = MIN(tile->frames + 1, (unsigned) DAMAGE_HOT_FRAMES);
+                tile->last_update = now;
+            }
+        }
+    }
+}
+
+bool DamageTracker::tile_is_hot(const Tile *tile, red_time_t now) const
+{
+    return tile->frames >= DAMAGE_HOT_FRAMES &&
+           now - tile->last_update <= DAMAGE_MAX_FRAME_INTERVAL;
+}
+
+bool DamageTracker::find_candidate(SpiceRect *extents, red_time_t now) const
+{
+    int hot_tiles = 0;
+    int min_col = cols, max_col = -1, min_row = rows, max_row = -1;
+
+    for (int row = 0; row < rows; row++) {
+        for (int col = 0; col < cols; col++) {
+            const Tile *tile = &tiles[row * cols + col];
+
+            if (!tile_is_hot(tile, now)) {
+                continue;
+            }
+            if (hot_tiles++ == 0) {
+                *extents = tile->extents;
+            } else {
+                rect_union(extents, &tile->extents);
+            }
+            min_col = MIN(min_col, col);
+            max_col = MAX(max_col, col);
+            min_row = MIN(min_row, row);
+            max_row = MAX(max_row, row);
+        }
+    }
+
+    if (hot_tiles == 0) {
+        return false;
+    }
+    /* scattered updates, like text typed in several windows, are
+     * not a video */
+    if (hot_tiles * 2 < (max_col - min_col + 1) * (max_row - min_row + 1)) {
+        return false;
+    }
+    return rect_get_area(extents) >= DAMAGE_MIN_REGION_SIZE;
+}
+
+void DamageTracker::update(red_time_t now)
+{
+    SpiceRect extents;
+
+    if (!tiles || (last_update_time != 0 && now - last_update_time < DAMAGE_UPDATE_INTERVAL)) {
+        return;
+    }
+    last_update_time = now;
+
+    if (!find_candidate(&extents, now)) {
+        stable_updates = 0;
+        has_region = false;
+        return;
+    }
+
+    /* some parts of a video can stay still for a while, the region
+     * is kept as long as most of it is updated */
+    if (has_region && rect_contains(&region, &extents) &&
+        rect_get_area(&extents) * 2 >= rect_get_area(&region)) {
+        return;
+    }
+
+    if (stable_updates > 0 && rect_is_equal(&extents, &candidate)) {
+        stable_updates++;
+    } else {
+        candidate = extents;
+        stable_updates = 1;
+    }
+    has_region = stable_updates >= DAMAGE_STABLE_UPDATES;
+    if (has_region) {
+        region = candidate;
+    }
+}
+
+bool DamageTracker::get_region(SpiceRect *rect) const
+{
+    if (!has_region) {
+        return false;
+    }
+    *rect = region;
+    return true;
+}
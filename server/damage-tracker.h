@@ -0,0 +1,99 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DAMAGE_TRACKER_H_
+#define DAMAGE_TRACKER_H_
+
+#include <common/draw.h>
+
+#include "utils.h"
+
+#include "push-visibility.h"
+
+/* side of the square tiles the damage is accounted in, in pixels */
+#define DAMAGE_TILE_SIZE 64
+/* minimum number of updates per tile before it is considered a video */
+#define DAMAGE_HOT_FRAMES 20
+/* updates closer than this are part of the same frame */
+#define DAMAGE_MIN_FRAME_INTERVAL (NSEC_PER_SEC / 60)
+/* a tile not updated for this time is not a video anymore */
+#define DAMAGE_MAX_FRAME_INTERVAL (NSEC_PER_SEC / 5)
+/* the video region is evaluated at most once in this interval */
+#define DAMAGE_UPDATE_INTERVAL (NSEC_PER_SEC / 10)
+/* number of evaluations the region must stay the same to be used */
+#define DAMAGE_STABLE_UPDATES 5
+/* the smallest video region, in pixels */
+#define DAMAGE_MIN_REGION_SIZE (96 * 96)
+
+/**
+ * Detection of the part of a surface updated like a video.
+ *
+ * Some applications draw a video with many small drawables, or with
+ * drawables that are not a simple copy of a bitmap, so the video
+ * cannot be detected from the geometry of the drawables.
+ * The surface is split in tiles and the updates of each tile are
+ * counted, a tile updated at a video frame rate for long enough is
+ * hot. The extents of the damage of the hot tiles become the video
+ * region once they are stable.
+ */
+class DamageTracker
+{
+public:
+    DamageTracker() = default;
+    DamageTracker(const DamageTracker&) = delete;
+    void operator=(const DamageTracker&) = delete;
+    ~DamageTracker();
+
+    /* sets the size of the surface, forgets the updates if it changed */
+    void resize(int width, int height);
+    /* forgets all the updates */
+    void reset();
+    /* records an update of @rect at @now */
+    void add_damage(const SpiceRect &rect, red_time_t now);
+    /* re-evaluates the video region, at most every DAMAGE_UPDATE_INTERVAL */
+    void update(red_time_t now);
+    /* returns false if there is no video region */
+    bool get_region(SpiceRect *region) const;
+
+private:
+    struct Tile {
+        red_time_t last_update;
+        unsigned frames;
+        /* union of the damage since the tile became active */
+        SpiceRect extents;
+    };
+
+    bool tile_is_hot(const Tile *tile, red_time_t now) const;
+    bool find_candidate(SpiceRect *candidate, red_time_t now) const;
+
+    int width = 0;
+    int height = 0;
+    int cols = 0;
+    int rows = 0;
+    Tile *tiles = nullptr;
+
+    red_time_t last_update_time = 0;
+    SpiceRect candidate = {};
+    unsigned stable_updates = 0;
+    bool has_region = false;
+    SpiceRect region = {};
+};
+
+#include "pop-visibility.h"
+
+#endif /* DAMAGE_TRACKER_H_ */
@@ -67,6 +67,9 @@ struct DisplayChannelClientPrivate
     uint32_t streams_max_latency;
     uint64_t streams_max_bit_rate;
     bool gl_draw_ongoing;
+
+    /* last time is_low_bandwidth changed */
+    uint64_t bandwidth_switch_time = 0;
 };
 
 #include "pop-visibility.h"
@@ -50,26 +50,22 @@ struct BitmapData {
 static int dcc_pixmap_cache_unlocked_hit(DisplayChannelClient *dcc, uint64_t id, int *lossy)
 {
     PixmapCache *cache = dcc->priv->pixmap_cache;
-    NewCacheItem *item;
+    PixmapCacheEntry *item;
     uint64_t serial;
 
     serial = dcc->get_message_serial();
-    item = cache->hash_table[BITS_CACHE_HASH_KEY(id)];
-
-    while (item) {
-        if (item->id == id) {
-            ring_remove(&item->lru_link);
-            ring_add(&cache->lru, &item->lru_link);
-            spice_assert(dcc->priv->id < MAX_CACHE_CLIENTS);
-            item->sync[dcc->priv->id] = serial;
-            cache->sync[dcc->priv->id] = serial;
-            *lossy = item->lossy;
-            break;
-        }
-        item = item->next;
+    item = pixmap_cache_unlocked_lookup(cache, id);
+    if (!item) {
+        return FALSE;
     }
 
-    return !!item;
+    ring_remove(&item->lru_link);
+    ring_add(&cache->lru, &item->lru_link);
+    spice_assert(dcc->priv->id < MAX_CACHE_CLIENTS);
+    item->sync[dcc->priv->id] = serial;
+    cache->sync[dcc->priv->id] = serial;
+    *lossy = item->lossy;
+    return TRUE;
 }
 
 static int dcc_pixmap_cache_hit(DisplayChannelClient *dcc, uint64_t id, int *lossy)
@@ -196,7 +192,8 @@ static void red_display_add_image_to_pixmap_cache(DisplayChannelClient *dcc,
         spice_assert(image->descriptor.width * image->descriptor.height > 0);
         if (!(io_image->descriptor.flags & SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME)) {
             if (dcc_pixmap_cache_unlocked_add(dcc, image->descriptor.id,
-                                              image->descriptor.width * image->descriptor.height,
+                                              uint64_t{image->descriptor.width} *
+                                              image->descriptor.height,
                                               is_lossy)) {
                 io_image->descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_ME;
                 dcc->priv->send_data.pixmap_cache_items[dcc->priv->send_data.num_pixmap_cache_items++] =
@@ -395,12 +392,17 @@ static FillBitsType fill_bits(DisplayChannelClient *dcc, SpiceMarshaller *m,
                 spice_assert(bitmap_palette_out == nullptr);
                 spice_assert(lzplt_palette_out == nullptr);
                 stat_inc_counter(display->priv->cache_hits_counter, 1);
+                stat_inc_counter(dcc->priv->pixmap_cache->hits, 1);
+                // the client keeps the pixmaps with 32 bits per pixel
+                stat_inc_counter(dcc->priv->pixmap_cache->saved_bytes,
+                                 uint64_t{image.descriptor.width} * image.descriptor.height * 4);
                 pthread_mutex_unlock(&dcc->priv->pixmap_cache->lock);
                 return FILL_BITS_TYPE_CACHE;
             }
             pixmap_cache_unlocked_set_lossy(dcc->priv->pixmap_cache, simage->descriptor.id, FALSE);
             image.descriptor.flags |= SPICE_IMAGE_FLAGS_CACHE_REPLACE_ME;
         }
+        stat_inc_counter(dcc->priv->pixmap_cache->misses, 1);
     }
 
     switch (simage->descriptor.type) {
@@ -1671,6 +1673,7 @@ static bool red_marshall_stream_data(DisplayChannelClient *dcc,
     frame_mm_time =  drawable->red_drawable->mm_time ?
                         drawable->red_drawable->mm_time :
                         reds_get_mm_time();
+    uint64_t encode_start = spice_get_monotonic_time_ns();
     ret = !agent->video_encoder ? VIDEO_ENCODER_FRAME_UNSUPPORTED :
           agent->video_encoder->encode_frame(agent->video_encoder,
                                              frame_mm_time,
@@ -1680,6 +1683,7 @@ static bool red_marshall_stream_data(DisplayChannelClient *dcc,
                                              &outbuf);
     switch (ret) {
     case VIDEO_ENCODER_FRAME_DROP:
+        stat_inc_counter(agent->stat.server_drops, 1);
 #ifdef STREAM_STATS
         agent->stats.num_drops_fps++;
 #endif
@@ -1687,6 +1691,8 @@ static bool red_marshall_stream_data(DisplayChannelClient *dcc,
     case VIDEO_ENCODER_FRAME_UNSUPPORTED:
         return FALSE;
     case VIDEO_ENCODER_FRAME_ENCODE_DONE:
+        stat_inc_counter(agent->stat.encode_time_us,
+                         (spice_get_monotonic_time_ns() - encode_start) / NSEC_PER_MICROSEC);
         break;
     default:
         spice_error("bad return value (%d) from VideoEncoder::encode_frame", ret);
@@ -1721,6 +1727,8 @@ static bool red_marshall_stream_data(DisplayChannelClient *dcc,
     }
     spice_marshaller_add_by_ref_full(base_marshaller, outbuf->data, outbuf->size,
                                      &red_release_video_encoder_buffer, outbuf);
+    stat_inc_counter(agent->stat.frames_encoded, 1);
+    stat_inc_counter(agent->stat.bytes_sent, outbuf->size);
 #ifdef STREAM_STATS
     agent->stats.num_frames_sent++;
     agent->stats.size_sent += outbuf->size;
@@ -2152,6 +2160,9 @@ static void marshall_stream_clip(DisplayChannelClient *dcc,
     stream_clip.clip.type = item->clip_type;
     stream_clip.clip.rects = item->rects.get();
 
+    /* the following frames are encoded for the new clip */
+    video_stream_agent_update_visible_region(agent, item->clip_type == SPICE_CLIP_TYPE_RECTS ?
+                                                    item->rects.get() : nullptr);
     spice_marshall_msg_display_stream_clip(base_marshaller, &stream_clip);
 }
 
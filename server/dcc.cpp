@@ -433,6 +433,7 @@ static void dcc_destroy_stream_agents(DisplayChannelClient *dcc)
             agent.video_encoder->destroy(agent.video_encoder);
             agent.video_encoder = nullptr;
         }
+        video_stream_agent_remove_stat(&agent);
     }
 }
 
@@ -741,16 +742,14 @@ static void dcc_push_release(DisplayChannelClient *dcc, uint8_t type, uint64_t i
 }
 
 bool dcc_pixmap_cache_unlocked_add(DisplayChannelClient *dcc, uint64_t id,
-                                   uint32_t size, int lossy)
+                                   uint64_t size, int lossy)
 {
     PixmapCache *cache = dcc->priv->pixmap_cache;
-    NewCacheItem *item;
+    PixmapCacheEntry *item;
     uint64_t serial;
-    int key;
 
     spice_assert(size > 0);
 
-    item = g_new(NewCacheItem, 1);
     serial = dcc->get_message_serial();
 
     if (cache->generation != dcc->priv->pixmap_cache_generation) {
@@ -758,43 +757,32 @@ bool dcc_pixmap_cache_unlocked_add(DisplayChannelClient *dcc, uint64_t id,
             dcc->pipe_add_type(RED_PIPE_ITEM_TYPE_PIXMAP_SYNC);
             dcc->priv->pending_pixmaps_sync = TRUE;
         }
-        g_free(item);
+        return FALSE;
+    }
+
+    if (!pixmap_cache_unlocked_admit(cache, id, size)) {
+        stat_inc_counter(cache->not_admitted, 1);
         return FALSE;
     }
 
     cache->available -= size;
     while (cache->available < 0) {
-        NewCacheItem *tail;
-        NewCacheItem **now;
+        PixmapCacheEntry *tail;
 
-        SPICE_VERIFY(SPICE_OFFSETOF(NewCacheItem, lru_link) == 0);
-        if (!(tail = SPICE_CONTAINEROF(ring_get_tail(&cache->lru), NewCacheItem, lru_link)) ||
-                                                     tail->sync[dcc->priv->id] == serial) {
+        SPICE_VERIFY(SPICE_OFFSETOF(PixmapCacheEntry, lru_link) == 0);
+        if (!(tail = SPICE_CONTAINEROF(ring_get_tail(&cache->lru), PixmapCacheEntry, lru_link)) ||
+                                                          tail->sync[dcc->priv->id] == serial) {
             cache->available += size;
-            g_free(item);
             return FALSE;
         }
 
-        now = &cache->hash_table[BITS_CACHE_HASH_KEY(tail->id)];
-        for (;;) {
-            spice_assert(*now);
-            if (*now == tail) {
-                *now = tail->next;
-                break;
-            }
-            now = &(*now)->next;
-        }
-        ring_remove(&tail->lru_link);
         cache->available += tail->size;
         cache->sync[dcc->priv->id] = serial;
         dcc_push_release(dcc, SPICE_RES_TYPE_PIXMAP, tail->id, tail->sync);
-        g_free(tail);
+        stat_inc_counter(cache->evictions, 1);
+        pixmap_cache_unlocked_remove(cache, tail);
     }
-    item->next = cache->hash_table[(key = BITS_CACHE_HASH_KEY(id))];
-    cache->hash_table[key] = item;
-    ring_item_init(&item->lru_link);
-    ring_add(&cache->lru, &item->lru_link);
-    item->id = id;
+    item = pixmap_cache_unlocked_insert(cache, id);
     item->size = size;
     item->lossy = lossy;
     memset(item->sync, 0, sizeof(item->sync));
@@ -861,6 +849,7 @@ static bool dcc_handle_stream_report(DisplayChannelClient *dcc,
         return TRUE;
     }
 
+    stat_inc_counter(agent->stat.client_drops, report->num_drops);
     agent->video_encoder->client_stream_report(agent->video_encoder,
                                                report->num_frames,
                                                report->num_drops,
@@ -1192,6 +1181,37 @@ bool DisplayChannelClient::config_socket()
     return CommonGraphicsChannelClient::config_socket();
 }
 
+/* minimum time between two changes of the bandwidth profile */
+#define DCC_BANDWIDTH_SWITCH_INTERVAL (NSEC_PER_SEC * 2)
+
+/* Follow the changes of the network conditions of the client:
+ * switch between low and high bandwidth profiles, with a gap
+ * between the thresholds to avoid changing the profile too often.
+ * The ack window is adapted separately, see RedChannelClient::update_ack_window */
+void DisplayChannelClient::on_net_estimate_update()
+{
+    NetEstimator estimate = get_client()->get_net_estimate();
+    uint64_t now = spice_get_monotonic_time_ns();
+    bool low_bandwidth;
+
+    if (!estimate.has_bit_rate() ||
+        now - priv->bandwidth_switch_time < DCC_BANDWIDTH_SWITCH_INTERVAL) {
+        return;
+    }
+
+    low_bandwidth = estimate.get_bit_rate() <
+        (is_low_bandwidth ? NET_HIGH_BANDWIDTH_BIT_RATE : NET_LOW_BANDWIDTH_BIT_RATE);
+    if (low_bandwidth == !!is_low_bandwidth) {
+        return;
+    }
+
+    spice_debug("bit rate %.2f Mbps, switching to %s bandwidth profile",
+                estimate.get_bit_rate() / 1024.0 / 1024.0, low_bandwidth ? "low" : "high");
+    is_low_bandwidth = low_bandwidth;
+    priv->bandwidth_switch_time = now;
+    display_channel_update_compression(DCC_TO_DC(this), this);
+}
+
 void DisplayChannelClient::on_disconnect()
 {
     DisplayChannel *display;
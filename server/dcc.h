@@ -51,7 +51,9 @@ protected:
     virtual bool handle_message(uint16_t type, uint32_t size, void *msg) override;
     virtual bool config_socket() override;
     virtual void on_disconnect() override;
+    virtual void on_net_estimate_update() override;
     virtual void send_item(RedPipeItem *item) override;
+    virtual bool hold_when_congested() const override { return true; }
     virtual bool handle_migrate_data(uint32_t size, void *message) override;
     virtual void migrate() override;
     virtual void handle_migrate_flush_mark() override;
@@ -122,7 +124,7 @@ void                       dcc_palette_cache_palette                 (DisplayCha
                                                                       SpicePalette *palette,
                                                                       uint8_t *flags);
 bool                       dcc_pixmap_cache_unlocked_add             (DisplayChannelClient *dcc,
-                                                                      uint64_t id, uint32_t size, int lossy);
+                                                                      uint64_t id, uint64_t size, int lossy);
 void                       dcc_prepend_drawable                      (DisplayChannelClient *dcc,
                                                                       Drawable *drawable);
 void                       dcc_append_drawable                       (DisplayChannelClient *dcc,
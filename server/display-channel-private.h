@@ -19,6 +19,7 @@
 #define DISPLAY_CHANNEL_PRIVATE_H_
 
 #include "display-channel.h"
+#include "damage-tracker.h"
 
 #define TRACE_ITEMS_SHIFT 3
 #define NUM_TRACE_ITEMS (1 << TRACE_ITEMS_SHIFT)
@@ -114,6 +115,18 @@ struct DisplayChannelPrivate
     std::array<ItemTrace, NUM_TRACE_ITEMS> items_trace;
     uint32_t next_item_trace;
     uint64_t streams_size_total;
+    /* makes the stat node of each stream agent unique */
+    uint32_t stream_stat_serial;
+
+    /* region of the primary surface updated like a video and streamed
+     * from the contents of the surface */
+    DamageTracker damage_tracker;
+    bool has_video_region;
+    SpiceRect video_region;
+    /* drawables were drawn in the region since its last frame */
+    bool video_region_pending;
+    red_time_t video_region_frame_time;
+    uint32_t video_region_generation;
 
     std::array<RedSurface *, NUM_SURFACES> surfaces;
     uint32_t n_surfaces;
@@ -184,6 +197,13 @@ uint32_t display_channel_generate_uid(DisplayChannel *display);
 int display_channel_get_video_stream_id(DisplayChannel *display, VideoStream *stream);
 VideoStream *display_channel_get_nth_video_stream(DisplayChannel *display, gint i);
 
+/* Whether a drawable at @bbox is inside the video @region and is not sent,
+ * the next frame of the region replacing it. This is only the case while
+ * one of the @streams shows the region, until then the frames of the
+ * region are sent as images and the drawables are sent too. */
+bool video_region_hides_drawable(Ring *streams, const SpiceRect *region,
+                                 const SpiceRect *bbox);
+
 struct RedSurfaceDestroyItem: public RedPipeItemNum<RED_PIPE_ITEM_TYPE_DESTROY_SURFACE> {
     RedSurfaceDestroyItem(uint32_t surface_id);
     SpiceMsgSurfaceDestroy surface_destroy;
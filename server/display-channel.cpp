@@ -154,6 +154,20 @@ int display_channel_get_streams_timeout(DisplayChannel *display)
         }
         timeout = MIN(timeout, (unsigned int)(delta / NSEC_PER_MILLISEC));
     }
+
+    if (display->priv->video_region_pending) {
+        red_time_t delta = (display->priv->video_region_frame_time +
+                            NSEC_PER_SEC / MAX_FPS) - now;
+
+        if (delta < NSEC_PER_MILLISEC) {
+            return 0;
+        }
+        timeout = MIN(timeout, (unsigned int)(delta / NSEC_PER_MILLISEC));
+    }
+    if (display->priv->has_video_region) {
+        /* the end of the video is detected by the timeout */
+        timeout = MIN(timeout, (unsigned int)(DAMAGE_UPDATE_INTERVAL / NSEC_PER_MILLISEC));
+    }
     return timeout;
 }
 
@@ -178,6 +192,8 @@ void display_channel_set_stream_video(DisplayChannel *display, int stream_video)
     }
 
     display->priv->stream_video = stream_video;
+    /* the video region is dropped at the next timeout if the streams are off */
+    display->priv->damage_tracker.reset();
 }
 
 void display_channel_set_video_codecs(DisplayChannel *display, GArray *video_codecs)
@@ -238,6 +254,9 @@ static void display_channel_surface_unref(DisplayChannel *display, RedSurface *s
     // only primary surface streams are supported
     if (is_primary_surface(display, surface)) {
         stop_streams(display);
+        display->priv->damage_tracker.reset();
+        display->priv->has_video_region = false;
+        display->priv->video_region_pending = false;
     }
     spice_assert(surface->context.canvas);
 
@@ -271,7 +290,7 @@ static void streams_update_visible_region(DisplayChannel *display, Drawable *dra
         return;
     }
 
-    if (!is_primary_surface(display, drawable->surface)) {
+    if (!is_primary_surface(display, drawable->surface) || drawable->in_video_region) {
         return;
     }
 
@@ -306,6 +325,10 @@ static void pipes_add_drawable(DisplayChannel *display, Drawable *drawable)
     DisplayChannelClient *dcc;
 
     spice_warn_if_fail(drawable->pipes == nullptr);
+    /* the clients get it with the next frame of the video region */
+    if (drawable->in_video_region) {
+        return;
+    }
     FOREACH_DCC(display, dcc) {
         dcc_prepend_drawable(dcc, drawable);
     }
@@ -318,6 +341,9 @@ static void pipes_add_drawable_after(DisplayChannel *display,
     DisplayChannelClient *dcc;
     int num_other_linked = 0;
 
+    if (drawable->in_video_region) {
+        return;
+    }
     for (GList *l = pos_after->pipes; l != nullptr; l = l->next) {
         dpi_pos_after = static_cast<RedDrawablePipeItem *>(l->data);
 
@@ -1130,23 +1156,20 @@ static void surface_read_bits(DisplayChannel *display, RedSurface *surface,
     canvas->ops->read_bits(canvas, dest, dest_stride, area);
 }
 
-static void handle_self_bitmap(DisplayChannel *display, Drawable *drawable)
+/* Returns a bitmap of the @area of the @surface */
+static SpiceImage *surface_read_image(DisplayChannel *display, RedSurface *surface,
+                                      const SpiceRect *area)
 {
-    RedDrawable *red_drawable = drawable->red_drawable.get();
     SpiceImage *image;
     int32_t width;
     int32_t height;
     uint8_t *dest;
     int dest_stride;
-    RedSurface *surface;
     int bpp;
-    int all_set;
-
-    surface = drawable->surface;
 
     bpp = SPICE_SURFACE_FMT_DEPTH(surface->context.format) / 8;
-    width = red_drawable->self_bitmap_area.right - red_drawable->self_bitmap_area.left;
-    height = red_drawable->self_bitmap_area.bottom - red_drawable->self_bitmap_area.top;
+    width = area->right - area->left;
+    height = area->bottom - area->top;
     dest_stride = SPICE_ALIGN(width * bpp, 4);
 
     image = g_new0(SpiceImage, 1);
@@ -1165,16 +1188,26 @@ static void handle_self_bitmap(DisplayChannel *display, Drawable *drawable)
     image->u.bitmap.data = spice_chunks_new_linear(dest, height * dest_stride);
     image->u.bitmap.data->flags |= SPICE_CHUNKS_FLAGS_FREE;
 
-    display_channel_surface_draw(display, drawable->surface,
-                                 &red_drawable->self_bitmap_area);
-    surface_read_bits(display, drawable->surface,
-        &red_drawable->self_bitmap_area, dest, dest_stride);
+    display_channel_surface_draw(display, surface, area);
+    surface_read_bits(display, surface, area, dest, dest_stride);
+
+    return image;
+}
+
+static void handle_self_bitmap(DisplayChannel *display, Drawable *drawable)
+{
+    RedDrawable *red_drawable = drawable->red_drawable.get();
+    SpiceImage *image;
+    int all_set;
+
+    image = surface_read_image(display, drawable->surface, &red_drawable->self_bitmap_area);
 
     /* For 32bit non-primary surfaces we need to keep any non-zero
        high bytes as the surface may be used as source to an alpha_blend */
     if (!is_primary_surface(display, drawable->surface) &&
         image->u.bitmap.format == SPICE_BITMAP_FMT_32BIT &&
-        rgb32_data_has_alpha(width, height, dest_stride, dest, &all_set)) {
+        rgb32_data_has_alpha(image->u.bitmap.x, image->u.bitmap.y, image->u.bitmap.stride,
+                             image->u.bitmap.data->chunk[0].data, &all_set)) {
         if (all_set) {
             image->descriptor.flags |= SPICE_IMAGE_FLAGS_HIGH_BITS_SET;
         } else {
@@ -1363,6 +1396,170 @@ static void display_channel_add_drawable(DisplayChannel *display, Drawable *draw
 #endif
 }
 
+/*
+ * Video region
+ *
+ * Some applications draw a video with many small drawables or with
+ * drawables the stream detection does not handle. The damage of the
+ * primary surface is tracked to find the region updated like a video.
+ * At most MAX_FPS times per second the region is read from the surface
+ * and added as a copy of a bitmap, these frames become a stream like
+ * any other video. Once they do, the drawables inside the region are
+ * not sent, the next frame of the region replaces them.
+ */
+
+/* Whether the clients read the primary surface to draw @red_drawable */
+static bool drawable_reads_primary(const RedDrawable *red_drawable)
+{
+    if (red_drawable->surface_id == 0 && has_shadow(red_drawable)) {
+        return true;
+    }
+    for (const auto surface_id : red_drawable->surface_deps) {
+        /* the contents of a self bitmap are read by the server */
+        if (surface_id == 0 &&
+            !(red_drawable->surface_id == 0 && red_drawable->self_bitmap)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void video_region_add_frame(DisplayChannel *display)
+{
+    DisplayChannelPrivate *priv = display->priv;
+    RedSurface *surface = priv->surfaces[0];
+    const SpiceRect *area = &priv->video_region;
+    Drawable *drawable;
+
+    priv->video_region_pending = false;
+    priv->video_region_frame_time = spice_get_monotonic_time_ns();
+    if (!surface) {
+        return;
+    }
+
+    auto red_drawable = red::make_shared<RedDrawable>();
+    red_drawable->surface_id = 0;
+    red_drawable->effect = QXL_EFFECT_OPAQUE;
+    red_drawable->type = QXL_DRAW_COPY;
+    red_drawable->bbox = *area;
+    red_drawable->clip.type = SPICE_CLIP_TYPE_NONE;
+    for (auto &surface_id : red_drawable->surface_deps) {
+        surface_id = -1;
+    }
+    red_drawable->u.copy.src_bitmap = surface_read_image(display, surface, area);
+    red_drawable->u.copy.src_area.right = area->right - area->left;
+    red_drawable->u.copy.src_area.bottom = area->bottom - area->top;
+    red_drawable->u.copy.rop_descriptor = SPICE_ROPD_OP_PUT;
+    red_drawable->u.copy.scale_mode = SPICE_IMAGE_SCALE_MODE_NEAREST;
+
+    /* each frame is a separate generation for the drop accounting */
+    drawable = display_channel_get_drawable(display, QXL_EFFECT_OPAQUE, std::move(red_drawable),
+                                            ++priv->video_region_generation);
+    if (!drawable) {
+        return;
+    }
+    display_channel_add_drawable(display, drawable);
+    drawable_unref(drawable);
+}
+
+static void video_region_update(DisplayChannel *display, red_time_t now)
+{
+    DisplayChannelPrivate *priv = display->priv;
+    SpiceRect region;
+    bool has_region;
+
+    priv->damage_tracker.update(now);
+    has_region = priv->damage_tracker.get_region(&region);
+    if (has_region == priv->has_video_region &&
+        (!has_region || rect_is_equal(&region, &priv->video_region))) {
+        return;
+    }
+
+    /* the drawables hidden by the old region are replaced by its last frame */
+    if (priv->video_region_pending) {
+        video_region_add_frame(display);
+    }
+    priv->has_video_region = has_region;
+    if (has_region) {
+        spice_debug("video region %dx%d at %d,%d",
+                    region.right - region.left, region.bottom - region.top,
+                    region.left, region.top);
+        priv->video_region = region;
+    }
+}
+
+bool video_region_hides_drawable(Ring *streams, const SpiceRect *region,
+                                 const SpiceRect *bbox)
+{
+    RingItem *item = streams;
+
+    if (!rect_contains(region, bbox)) {
+        return false;
+    }
+    while ((item = ring_next(streams, item))) {
+        VideoStream *stream = SPICE_CONTAINEROF(item, VideoStream, link);
+
+        if (rect_is_equal(&stream->dest_area, region)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+/* Accounts the damage of @drawable, returns true if it is inside the
+ * video region and should not be sent */
+static bool video_region_add_damage(DisplayChannel *display, Drawable *drawable)
+{
+    DisplayChannelPrivate *priv = display->priv;
+    RedDrawable *red_drawable = drawable->red_drawable.get();
+    red_time_t now;
+
+    if (priv->video_region_pending && drawable_reads_primary(red_drawable)) {
+        video_region_add_frame(display);
+    }
+    if (!is_primary_surface(display, drawable->surface)) {
+        return false;
+    }
+
+    /* drawables big enough to be streamed by themselves are left to
+     * the stream detection */
+    if (priv->stream_video != SPICE_STREAM_VIDEO_OFF &&
+        !(drawable_can_stream(display, drawable) &&
+          rect_get_area(&red_drawable->bbox) >= RED_STREAM_MIN_SIZE)) {
+        now = spice_get_monotonic_time_ns();
+        priv->damage_tracker.resize(drawable->surface->context.width,
+                                    drawable->surface->context.height);
+        priv->damage_tracker.add_damage(red_drawable->bbox, now);
+        video_region_update(display, now);
+    }
+
+    if (!priv->has_video_region || !rect_intersects(&priv->video_region, &red_drawable->bbox)) {
+        return false;
+    }
+    /* the drawables partly inside the region are sent, but the clients
+     * may draw them on an old frame */
+    priv->video_region_pending = true;
+    return video_region_hides_drawable(&priv->streams, &priv->video_region,
+                                       &red_drawable->bbox);
+}
+
+void display_channel_video_region_timeout(DisplayChannel *display)
+{
+    DisplayChannelPrivate *priv = display->priv;
+    red_time_t now;
+
+    if (!priv->has_video_region && !priv->video_region_pending) {
+        return;
+    }
+
+    now = spice_get_monotonic_time_ns();
+    video_region_update(display, now);
+    if (priv->video_region_pending &&
+        now >= priv->video_region_frame_time + NSEC_PER_SEC / MAX_FPS) {
+        video_region_add_frame(display);
+    }
+}
+
 void display_channel_process_draw(DisplayChannel *display,
                                   red::shared_ptr<RedDrawable> &&red_drawable,
                                   uint32_t process_commands_generation)
@@ -1375,6 +1572,7 @@ void display_channel_process_draw(DisplayChannel *display,
         return;
     }
 
+    drawable->in_video_region = video_region_add_damage(display, drawable);
     display_channel_add_drawable(display, drawable);
 
     drawable_unref(drawable);
@@ -2288,7 +2486,7 @@ void display_channel_process_surface_cmd(DisplayChannel *display,
     };
 }
 
-static void display_channel_update_compression(DisplayChannel *display, DisplayChannelClient *dcc)
+void display_channel_update_compression(DisplayChannel *display, DisplayChannelClient *dcc)
 {
     if (dcc_get_jpeg_state(dcc) == SPICE_WAN_COMPRESSION_AUTO) {
         display->priv->enable_jpeg = dcc_is_low_bandwidth(dcc);
@@ -76,6 +76,8 @@ struct Drawable {
     int last_gradual_frame;
     VideoStream *stream;
     int streamable;
+    /* inside the video region, not sent to the clients */
+    bool in_video_region;
     BitmapGradualType copy_bitmap_graduality;
     std::array<DependItem, 3> depend_items;
 
@@ -114,6 +116,7 @@ void                       display_channel_set_stream_video          (DisplayCha
 void                       display_channel_set_video_codecs          (DisplayChannel *display,
                                                                       GArray *video_codecs);
 int                        display_channel_get_streams_timeout       (DisplayChannel *display);
+void                       display_channel_video_region_timeout      (DisplayChannel *display);
 void                       display_channel_compress_stats_print      (DisplayChannel *display);
 void                       display_channel_compress_stats_reset      (DisplayChannel *display);
 bool                       display_channel_wait_for_migrate_data     (DisplayChannel *display);
@@ -147,6 +150,8 @@ void display_channel_debug_oom(DisplayChannel *display, const char *msg);
 void display_channel_update_qxl_running(DisplayChannel *display, bool running);
 void display_channel_set_image_compression(DisplayChannel *display,
                                            SpiceImageCompression image_compression);
+/* enable wan compressions according to the bandwidth of the client */
+void display_channel_update_compression(DisplayChannel *display, DisplayChannelClient *dcc);
 
 #include "pop-visibility.h"
 
@@ -25,6 +25,10 @@
 /** Maximum number of streams created by spice-server */
 #define NUM_STREAMS 50
 
+/** Number of statistics nodes of a stream sent to a client, the node of the
+ * stream and its 7 counters (see VideoStreamAgentStat) */
+#define NUM_STREAM_STAT_NODES 8
+
 /** Maximum length of the device address string */
 #define MAX_DEVICE_ADDRESS_LEN 256
 
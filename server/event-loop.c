@@ -20,9 +20,15 @@
  * This file exports a global variable:
  *
  * const SpiceCoreInterfaceInternal event_loop_core;
+ *
+ * the coarse timers and, if epoll is available, the EventLoopEpoll loop.
  */
 #include <config.h>
 
+#ifdef HAVE_SYS_EPOLL_H
+#include <sys/epoll.h>
+#endif
+
 #include "red-common.h"
 
 typedef struct SpiceCoreFuncs {
@@ -332,6 +338,523 @@ const SpiceCoreInterfaceInternal event_loop_core = {
     .watch_add = watch_add,
 };
 
+/*
+ * Hashed timer wheel
+ *
+ * Timers are kept in a wheel with a slot per tick so starting,
+ * cancelling and expiring a timer does not depend on the number of
+ * timers. A timer further than a turn of the wheel stays in its slot
+ * until its turn comes.
+ * The epoll loop keeps its timers in a wheel with a tick of a
+ * millisecond. The coarse timers of the other loops are kept in a wheel
+ * driven by a single timer of the loop, armed for the next expiration.
+ */
+
+/* must be a power of 2 */
+#define TIMER_WHEEL_SIZE 1024
+/* 16 seconds for a turn of the wheel of the coarse timers */
+#define COARSE_TIMER_RESOLUTION_MS 16
+
+static const SpiceCoreFuncs wheel_core_funcs;
+
+typedef struct SpiceTimerWheel SpiceTimerWheel;
+
+struct SpiceTimerWheel {
+    SpiceTimer base;
+    TimerWheel *wheel;
+    SpiceTimerFunc func;
+    void *opaque;
+    /* ticks */
+    uint64_t expiry;
+    /* link in a slot of the wheel or in the list of the expired timers,
+     * pprev is NULL if the timer is not started */
+    SpiceTimerWheel *next;
+    SpiceTimerWheel **pprev;
+};
+
+struct TimerWheel {
+    unsigned resolution_ms;
+    /* last tick processed */
+    uint64_t now;
+    unsigned num_timers;
+    /* timer of the loop driving the wheel, NULL if the loop runs the
+     * wheel itself, and the tick it is started for */
+    SpiceTimer *tick_timer;
+    uint64_t tick_timer_expiry;
+    bool running;
+    SpiceTimerWheel *slots[TIMER_WHEEL_SIZE];
+};
+
+/* current tick */
+static uint64_t timer_wheel_get_time(TimerWheel *wheel)
+{
+    return spice_get_monotonic_time_ns() / (wheel->resolution_ms * NSEC_PER_MILLISEC);
+}
+
+static void timer_wheel_init(TimerWheel *wheel, unsigned resolution_ms)
+{
+    wheel->resolution_ms = resolution_ms;
+    wheel->now = timer_wheel_get_time(wheel);
+    wheel->tick_timer_expiry = UINT64_MAX;
+}
+
+static void timer_wheel_link(SpiceTimerWheel **head, SpiceTimerWheel *timer)
+{
+    timer->next = *head;
+    if (timer->next) {
+        timer->next->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+    timer->wheel->num_timers++;
+}
+
+static void timer_wheel_unlink(SpiceTimerWheel *timer)
+{
+    if (!timer->pprev) {
+        return;
+    }
+    *timer->pprev = timer->next;
+    if (timer->next) {
+        timer->next->pprev = timer->pprev;
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->wheel->num_timers--;
+}
+
+/* next expiration in ticks, UINT64_MAX if there are no timers */
+static uint64_t timer_wheel_get_next(TimerWheel *wheel)
+{
+    uint64_t next = UINT64_MAX, slot;
+    unsigned found = 0;
+
+    /* in a slot, the timers of the current turn expire at the tick of
+     * the slot (or before for the first slot), the other ones at least
+     * a turn later, so the first slot with a timer of the current turn
+     * has the next expiration */
+    for (slot = wheel->now + 1;
+         slot <= wheel->now + TIMER_WHEEL_SIZE && found < wheel->num_timers && next > slot;
+         slot++) {
+        SpiceTimerWheel *timer;
+
+        for (timer = wheel->slots[slot & (TIMER_WHEEL_SIZE - 1)]; timer; timer = timer->next) {
+            next = MIN(next, timer->expiry);
+            found++;
+        }
+    }
+    return next;
+}
+
+/* milliseconds before the tick @expiry, rounded up */
+static uint32_t timer_wheel_get_delay(TimerWheel *wheel, uint64_t expiry)
+{
+    uint64_t now = spice_get_monotonic_time_ns();
+    uint64_t expiry_ns = expiry * wheel->resolution_ms * NSEC_PER_MILLISEC;
+
+    if (expiry_ns <= now) {
+        return 0;
+    }
+    return MIN((expiry_ns - now + NSEC_PER_MILLISEC - 1) / NSEC_PER_MILLISEC,
+               (uint64_t) G_MAXINT);
+}
+
+/* milliseconds before the next timer expires, -1 if there are none */
+static int timer_wheel_get_timeout(TimerWheel *wheel)
+{
+    uint64_t next = timer_wheel_get_next(wheel);
+
+    return next == UINT64_MAX ? -1 : timer_wheel_get_delay(wheel, next);
+}
+
+/* start the timer driving the wheel if it would expire too late */
+static void timer_wheel_arm(TimerWheel *wheel, uint64_t expiry)
+{
+    if (!wheel->tick_timer || wheel->running || expiry >= wheel->tick_timer_expiry) {
+        return;
+    }
+    wheel->tick_timer_expiry = expiry;
+    red_timer_start(wheel->tick_timer, timer_wheel_get_delay(wheel, expiry));
+}
+
+static void timer_wheel_run(TimerWheel *wheel)
+{
+    SpiceTimerWheel *expired = NULL;
+    uint64_t now = timer_wheel_get_time(wheel);
+    uint64_t slot, last;
+
+    /* the timers started with an expiration already reached are in
+     * the next slot, which is always visited. A single turn visits all
+     * the slots if the loop was late */
+    last = MIN(MAX(now, wheel->now + 1), wheel->now + TIMER_WHEEL_SIZE);
+    for (slot = wheel->now + 1; slot <= last; slot++) {
+        SpiceTimerWheel *timer, *next;
+
+        for (timer = wheel->slots[slot & (TIMER_WHEEL_SIZE - 1)]; timer; timer = next) {
+            next = timer->next;
+            if (timer->expiry <= now) {
+                timer_wheel_unlink(timer);
+                timer_wheel_link(&expired, timer);
+            }
+        }
+    }
+    wheel->now = MAX(wheel->now, now);
+
+    /* callbacks can start, cancel or remove any timer, including the
+     * expired ones which are unlinked from the list in this case */
+    wheel->running = true;
+    while (expired) {
+        SpiceTimerWheel *timer = expired;
+
+        timer_wheel_unlink(timer);
+        timer->func(timer->opaque);
+        /* timer might be free after func(), don't touch */
+    }
+    wheel->running = false;
+}
+
+static SpiceTimer *timer_wheel_timer_add(TimerWheel *wheel, SpiceTimerFunc func, void *opaque)
+{
+    SpiceTimerWheel *timer = g_new0(SpiceTimerWheel, 1);
+
+    timer->base.funcs = &wheel_core_funcs;
+    timer->wheel = wheel;
+    timer->func = func;
+    timer->opaque = opaque;
+
+    return &timer->base;
+}
+
+static void wheel_timer_start(SpiceTimer *timer_base, uint32_t ms)
+{
+    SpiceTimerWheel *timer = SPICE_UPCAST(SpiceTimerWheel, timer_base);
+    TimerWheel *wheel = timer->wheel;
+    uint64_t resolution = wheel->resolution_ms * NSEC_PER_MILLISEC;
+    uint64_t slot;
+
+    timer_wheel_unlink(timer);
+
+    /* rounded up, a timer never expires early, except the ones started
+     * for 0 ms which expire at the next iteration of the loop */
+    timer->expiry = ms == 0 ? timer_wheel_get_time(wheel) :
+        (spice_get_monotonic_time_ns() + ms * NSEC_PER_MILLISEC + resolution - 1) / resolution;
+    /* the slots up to wheel->now were already processed */
+    slot = MAX(timer->expiry, wheel->now + 1);
+    timer_wheel_link(&wheel->slots[slot & (TIMER_WHEEL_SIZE - 1)], timer);
+    timer_wheel_arm(wheel, timer->expiry);
+}
+
+static void wheel_timer_cancel(SpiceTimer *timer_base)
+{
+    SpiceTimerWheel *timer = SPICE_UPCAST(SpiceTimerWheel, timer_base);
+
+    /* the timer driving the wheel is left, it will find nothing to do */
+    timer_wheel_unlink(timer);
+}
+
+static void wheel_timer_remove(SpiceTimer *timer_base)
+{
+    SpiceTimerWheel *timer = SPICE_UPCAST(SpiceTimerWheel, timer_base);
+
+    timer_wheel_unlink(timer);
+    g_free(timer);
+}
+
+static const SpiceCoreFuncs wheel_core_funcs = {
+    .timer_start = wheel_timer_start,
+    .timer_cancel = wheel_timer_cancel,
+    .timer_remove = wheel_timer_remove,
+};
+
+static void timer_wheel_tick(void *opaque)
+{
+    TimerWheel *wheel = (TimerWheel *) opaque;
+    uint64_t next;
+
+    wheel->tick_timer_expiry = UINT64_MAX;
+    timer_wheel_run(wheel);
+    next = timer_wheel_get_next(wheel);
+    if (next != UINT64_MAX) {
+        timer_wheel_arm(wheel, next);
+    }
+}
+
+TimerWheel *timer_wheel_new(const SpiceCoreInterfaceInternal *iface)
+{
+    TimerWheel *wheel = g_new0(TimerWheel, 1);
+
+    timer_wheel_init(wheel, COARSE_TIMER_RESOLUTION_MS);
+    wheel->tick_timer = iface->timer_add(iface, timer_wheel_tick, wheel);
+    if (!wheel->tick_timer) {
+        g_free(wheel);
+        return NULL;
+    }
+
+    return wheel;
+}
+
+void timer_wheel_free(TimerWheel *wheel)
+{
+    if (!wheel) {
+        return;
+    }
+    spice_warn_if_fail(wheel->num_timers == 0);
+    red_timer_remove(wheel->tick_timer);
+    g_free(wheel);
+}
+
+SpiceTimer *red_coarse_timer_add(const SpiceCoreInterfaceInternal *iface,
+                                 SpiceTimerFunc func, void *opaque)
+{
+    if (!iface->coarse_timers) {
+        return iface->timer_add(iface, func, opaque);
+    }
+    return timer_wheel_timer_add(iface->coarse_timers, func, opaque);
+}
+
+#ifdef HAVE_SYS_EPOLL_H
+/*
+ * epoll implementation
+ *
+ * Watches are edge triggered, an event costs a single epoll_wait() for
+ * all the file descriptors and updating the event mask a single
+ * epoll_ctl(), none if the mask does not change.
+ */
+
+#define EPOLL_MAX_EVENTS 64
+
+static const SpiceCoreFuncs epoll_core_funcs;
+
+typedef struct SpiceWatchEpoll SpiceWatchEpoll;
+
+struct SpiceWatchEpoll {
+    SpiceWatch base;
+    EventLoopEpoll *loop;
+    int fd;
+    int event_mask;
+    /* NULL once removed */
+    SpiceWatchFunc func;
+    void *opaque;
+    /* watches removed while dispatching events are freed after */
+    SpiceWatchEpoll *next_removed;
+};
+
+struct EventLoopEpoll {
+    int epoll_fd;
+    bool quit;
+    bool dispatching;
+    SpiceWatchEpoll *removed_watches;
+    TimerWheel timers;
+};
+
+static SpiceTimer *epoll_timer_add(const SpiceCoreInterfaceInternal *iface,
+                                   SpiceTimerFunc func, void *opaque)
+{
+    return timer_wheel_timer_add(&iface->epoll_loop->timers, func, opaque);
+}
+
+static uint32_t spice_event_to_epoll(int event_mask)
+{
+    uint32_t events = EPOLLET;
+
+    if (event_mask & SPICE_WATCH_EVENT_READ)
+        events |= EPOLLIN;
+    if (event_mask & SPICE_WATCH_EVENT_WRITE)
+        events |= EPOLLOUT;
+
+    return events;
+}
+
+static int epoll_to_spice_event(uint32_t events)
+{
+    int event = 0;
+
+    if (events & EPOLLIN)
+        event |= SPICE_WATCH_EVENT_READ;
+    if (events & EPOLLOUT)
+        event |= SPICE_WATCH_EVENT_WRITE;
+
+    return event;
+}
+
+static SpiceWatch *epoll_watch_add(const SpiceCoreInterfaceInternal *iface,
+                                   int fd, int event_mask, SpiceWatchFunc func, void *opaque)
+{
+    SpiceWatchEpoll *watch;
+    struct epoll_event ev;
+
+    spice_return_val_if_fail(fd != -1, NULL);
+    spice_return_val_if_fail(func != NULL, NULL);
+
+    watch = g_new0(SpiceWatchEpoll, 1);
+    watch->base.funcs = &epoll_core_funcs;
+    watch->loop = iface->epoll_loop;
+    watch->fd = fd;
+    watch->event_mask = event_mask;
+    watch->func = func;
+    watch->opaque = opaque;
+
+    memset(&ev, 0, sizeof(ev));
+    ev.events = spice_event_to_epoll(event_mask);
+    ev.data.ptr = watch;
+    if (epoll_ctl(watch->loop->epoll_fd, EPOLL_CTL_ADD, fd, &ev) == -1) {
+        spice_warning("failed to add fd %d to epoll: %s", fd, g_strerror(errno));
+        g_free(watch);
+        return NULL;
+    }
+
+    return &watch->base;
+}
+
+static void epoll_watch_update_mask(SpiceWatch *watch_base, int event_mask)
+{
+    SpiceWatchEpoll *watch = SPICE_UPCAST(SpiceWatchEpoll, watch_base);
+    struct epoll_event ev;
+
+    if (event_mask == watch->event_mask) {
+        return;
+    }
+    watch->event_mask = event_mask;
+
+    /* modifying the registration reports again the events pending */
+    memset(&ev, 0, sizeof(ev));
+    ev.events = spice_event_to_epoll(event_mask);
+    ev.data.ptr = watch;
+    if (epoll_ctl(watch->loop->epoll_fd, EPOLL_CTL_MOD, watch->fd, &ev) == -1) {
+        spice_warning("failed to modify fd %d in epoll: %s", watch->fd, g_strerror(errno));
+    }
+}
+
+static void epoll_watch_remove(SpiceWatch *watch_base)
+{
+    SpiceWatchEpoll *watch = SPICE_UPCAST(SpiceWatchEpoll, watch_base);
+    EventLoopEpoll *loop = watch->loop;
+
+    /* can fail if the file descriptor was already closed */
+    epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, watch->fd, NULL);
+
+    watch->func = NULL;
+    if (loop->dispatching) {
+        /* there could be an event for the watch in the events
+         * being dispatched */
+        watch->next_removed = loop->removed_watches;
+        loop->removed_watches = watch;
+        return;
+    }
+    g_free(watch);
+}
+
+static void epoll_loop_dispatch_watches(EventLoopEpoll *loop, int timeout)
+{
+    struct epoll_event events[EPOLL_MAX_EVENTS];
+    int i, n;
+
+    n = epoll_wait(loop->epoll_fd, events, EPOLL_MAX_EVENTS, timeout);
+    if (n == -1) {
+        if (errno != EINTR) {
+            spice_warning("epoll_wait failed: %s", g_strerror(errno));
+        }
+        return;
+    }
+
+    loop->dispatching = true;
+    for (i = 0; i < n; i++) {
+        SpiceWatchEpoll *watch = (SpiceWatchEpoll *) events[i].data.ptr;
+        int event;
+
+        if (!watch->func) {
+            continue;
+        }
+        /* a previous callback could have changed the mask */
+        event = epoll_to_spice_event(events[i].events) & watch->event_mask;
+        if (event == 0 && !(events[i].events & (EPOLLERR|EPOLLHUP))) {
+            continue;
+        }
+        watch->func(watch->fd, event, watch->opaque);
+    }
+    loop->dispatching = false;
+
+    while (loop->removed_watches) {
+        SpiceWatchEpoll *watch = loop->removed_watches;
+
+        loop->removed_watches = watch->next_removed;
+        g_free(watch);
+    }
+}
+
+static const SpiceCoreFuncs epoll_core_funcs = {
+    .watch_update_mask = epoll_watch_update_mask,
+    .watch_remove = epoll_watch_remove,
+};
+
+static const SpiceCoreInterfaceInternal epoll_loop_core = {
+    .timer_add = epoll_timer_add,
+    .watch_add = epoll_watch_add,
+};
+
+EventLoopEpoll *event_loop_epoll_new(SpiceCoreInterfaceInternal *core)
+{
+    EventLoopEpoll *loop;
+    int fd;
+
+    fd = epoll_create1(EPOLL_CLOEXEC);
+    if (fd == -1) {
+        spice_warning("epoll_create1 failed: %s", g_strerror(errno));
+        return NULL;
+    }
+
+    loop = g_new0(EventLoopEpoll, 1);
+    loop->epoll_fd = fd;
+    timer_wheel_init(&loop->timers, 1);
+
+    *core = epoll_loop_core;
+    core->epoll_loop = loop;
+
+    return loop;
+}
+
+void event_loop_epoll_free(EventLoopEpoll *loop)
+{
+    if (!loop) {
+        return;
+    }
+    close(loop->epoll_fd);
+    g_free(loop);
+}
+
+void event_loop_epoll_run(EventLoopEpoll *loop, const EventLoopEpollHooks *hooks, void *opaque)
+{
+    loop->quit = false;
+    while (!loop->quit) {
+        int timeout = timer_wheel_get_timeout(&loop->timers);
+        bool ready = false;
+
+        if (hooks) {
+            int hooks_timeout = -1;
+
+            ready = hooks->prepare(opaque, &hooks_timeout);
+            if (ready) {
+                timeout = 0;
+            } else if (hooks_timeout >= 0 && (timeout < 0 || hooks_timeout < timeout)) {
+                timeout = hooks_timeout;
+            }
+        }
+
+        epoll_loop_dispatch_watches(loop, timeout);
+        timer_wheel_run(&loop->timers);
+
+        if (hooks && !loop->quit && (ready || hooks->check(opaque))) {
+            hooks->dispatch(opaque);
+        }
+    }
+}
+
+void event_loop_epoll_quit(EventLoopEpoll *loop)
+{
+    loop->quit = true;
+}
+#endif
+
 /*
  * Adapter for SpiceCodeInterface
  */
@@ -37,11 +37,11 @@
 
 #include "red-common.h"
 #include "video-encoder.h"
+#include "video-rate-control.h"
+#include "video-visible-region.h"
 #include "utils.h"
 
 
-#define SPICE_GST_DEFAULT_FPS 30
-
 #ifndef HAVE_GSTREAMER_0_10
 # define DO_ZERO_COPY
 #endif
@@ -80,18 +80,6 @@ typedef struct SpiceGstVideoBuffer {
 #endif
 } SpiceGstVideoBuffer;
 
-typedef struct {
-    uint32_t mm_time;
-    uint32_t size;
-    uint64_t duration;
-} SpiceGstFrameInformation;
-
-typedef enum SpiceGstBitRateStatus {
-    SPICE_GST_BITRATE_DECREASING,
-    SPICE_GST_BITRATE_INCREASING,
-    SPICE_GST_BITRATE_STABLE,
-} SpiceGstBitRateStatus;
-
 typedef struct SpiceGstEncoder {
     VideoEncoder base;
 
@@ -103,12 +91,6 @@ typedef struct SpiceGstEncoder {
     GAsyncQueue *unused_bitmap_opaques;
 #endif
 
-    /* Rate control callbacks */
-    VideoEncoderRateControlCbs cbs;
-
-    /* Spice's initial bit rate estimation in bits per second. */
-    uint64_t starting_bit_rate;
-
     /* ---------- Video characteristics ---------- */
 
     uint32_t width;
@@ -140,172 +122,38 @@ typedef struct SpiceGstEncoder {
 #   define SPICE_GST_VIDEO_PIPELINE_CAPS     0x4
     uint32_t set_pipeline;
 
+#ifndef HAVE_GSTREAMER_0_10
+    /* Recycles the buffers the frames are copied to when they cannot be
+     * wrapped as is. The pool is recreated when the frame size changes.
+     */
+#   define SPICE_GST_POOL_BUFFERS 4
+    GstBufferPool *buffer_pool;
+    gsize buffer_pool_size;
+
+    /* The visible parts of the frames are attached to the buffers as
+     * regions of interest for the encoders that support them.
+     */
+    VideoVisibleRegion visible_region;
+#endif
+
+    /* Copy statistics */
+    uint64_t num_frames;
+    uint64_t copied_bytes;
+    uint64_t num_buffer_allocs;
+
     /* Output buffer */
     pthread_mutex_t outbuf_mutex;
     pthread_cond_t outbuf_cond;
     VideoBuffer *outbuf;
 
-    /* The video bit rate. */
-    uint64_t video_bit_rate;
-
     /* Don't bother changing the GStreamer bit rate if close enough. */
 #   define SPICE_GST_VIDEO_BITRATE_MARGIN 0.05
 
-
-    /* ---------- Encoded frame statistics ---------- */
-
-    /* Should be >= than FRAME_STATISTICS_COUNT. This is also used to
-     * annotate the client report debug traces with bit rate information.
-     */
-#   define SPICE_GST_HISTORY_SIZE 60
-
-    /* A circular buffer containing the past encoded frames information. */
-    SpiceGstFrameInformation history[SPICE_GST_HISTORY_SIZE];
-
-    /* The indices of the oldest and newest frames in the history buffer. */
-    uint32_t history_first;
-    uint32_t history_last;
-
-    /* How many frames to take into account when computing the effective
-     * bit rate, average frame size, etc. This should be large enough so the
-     * I and P frames average out, and short enough for it to reflect the
-     * current situation.
-     */
-#   define SPICE_GST_FRAME_STATISTICS_COUNT 21
-
-    /* The index of the oldest frame taken into account for the statistics. */
-    uint32_t stat_first;
-
-    /* Used to compute the average frame encoding time. */
-    uint64_t stat_duration_sum;
-
-    /* Used to compute the average frame size. */
-    uint64_t stat_size_sum;
-
-    /* Tracks the maximum frame size. */
-    uint32_t stat_size_max;
-
-
-    /* ---------- Encoder bit rate control ----------
-     *
-     * GStreamer encoders don't follow the specified video_bit_rate very
-     * closely. These fields are used to ensure we don't exceed the desired
-     * stream bit rate, regardless of the GStreamer encoder's output.
-     */
-
-    /* The bit rate target for the outgoing network stream. (bits per second) */
-    uint64_t bit_rate;
-
-    /* The minimum bit rate / bit rate increment. */
-#   define SPICE_GST_MIN_BITRATE (128 * 1024)
-
-    /* The default bit rate. */
-#   define SPICE_GST_DEFAULT_BITRATE (8 * 1024 * 1024)
-
-    /* The bit rate control is performed using a virtual buffer to allow
-     * short term variations: bursts are allowed until the virtual buffer is
-     * full. Then frames are dropped to limit the bit rate. VBUFFER_SIZE
-     * defines the size of the virtual buffer in milliseconds worth of data
-     * while vbuffer_size holds the limit in bytes for the current bit rate.
-     */
-#   define SPICE_GST_VBUFFER_SIZE 300
-
-    int32_t vbuffer_size;
-    int32_t vbuffer_free;
-
-    /* When dropping frames, this is set to the minimum mm_time of the next
-     * frame to encode. Otherwise set to zero.
-     */
-    uint32_t next_frame_mm_time;
-
-    /* Defines the minimum allowed fps. */
-#   define SPICE_GST_MAX_PERIOD (NSEC_PER_SEC / 3)
-
-    /* How big of a margin to take to cover for latency jitter. */
-#   define SPICE_GST_LATENCY_MARGIN 0.1
-
-
-    /* ---------- Network bit rate control ----------
-     *
-     * State information for figuring out the optimal bit rate for the
-     * current network conditions.
-     */
-
-    /* The mm_time of the last bit rate change. */
-    uint32_t last_change;
-
-    /* How much to reduce the bit rate in case of network congestion. */
-#   define SPICE_GST_BITRATE_CUT 2
-#   define SPICE_GST_BITRATE_REDUCE (4.0 / 3.0)
-
-    /* Never increase the bit rate by more than this amount (bits per second). */
-#   define SPICE_GST_BITRATE_MAX_STEP (1024 * 1024)
-
-    /* The maximum bit rate that one can maybe use without causing network
-     * congestion.
-     */
-    uint64_t max_bit_rate;
-
-    /* The last bit rate that let us recover from network congestion. */
-    uint64_t min_bit_rate;
-
-    /* Defines when the spread between max_bit_rate and min_bit_rate has been
-     * narrowed down enough. Note that this value should be large enough for
-     * min_bit_rate to allow recovery from network congestion in a reasonable
-     * time frame, and to absorb transient traffic spikes (potentially from
-     * other sources).
-     * This is also used as a multiplier for the video_bit_rate so it does
-     * not have to be changed too often.
-     */
-#   define SPICE_GST_BITRATE_MARGIN SPICE_GST_BITRATE_REDUCE
-
-    /* Whether the bit rate was last decreased, increased or kept stable. */
-    SpiceGstBitRateStatus status;
-
-    /* The network bit rate control uses an AIMD scheme (Additive Increase,
-     * Multiplicative Decrease). The increment step depends on the spread
-     * between the minimum and maximum bit rates.
-     */
-    uint64_t bit_rate_step;
-
-    /* How often to increase the bit rate. */
-    uint32_t increase_interval;
-
-#   define SPICE_GST_BITRATE_UP_INTERVAL (MSEC_PER_SEC * 2)
-#   define SPICE_GST_BITRATE_UP_CLIENT_STABLE (MSEC_PER_SEC * 60 * 2)
-#   define SPICE_GST_BITRATE_UP_SERVER_STABLE (MSEC_PER_SEC * 3600 * 4)
-#   define SPICE_GST_BITRATE_UP_RESET_MAX (MSEC_PER_SEC * 30)
-
-
-    /* ---------- Client feedback ---------- */
-
-    /* TRUE if gst_encoder_client_stream_report() is being called. */
-    gboolean has_client_reports;
-
-    /* The margin is the amount of time between the reception of a piece of
-     * media data by the client and the time when it should be displayed.
-     * Increasing the bit rate increases the transmission time and thus
-     * reduces the margin.
+    /* GStreamer encoders don't follow the specified video bit rate very
+     * closely so the rate control drops frames as needed to ensure we don't
+     * exceed the desired stream bit rate.
      */
-    int32_t last_video_margin;
-    int32_t max_video_margin;
-    uint32_t max_audio_margin;
-
-#   define SPICE_GST_VIDEO_MARGIN_GOOD 0.75
-#   define SPICE_GST_VIDEO_MARGIN_AVERAGE 0.5
-#   define SPICE_GST_VIDEO_MARGIN_BAD 0.3
-
-#   define SPICE_GST_VIDEO_DELTA_BAD 0.2
-#   define SPICE_GST_VIDEO_DELTA_AVERAGE 0.15
-
-#   define SPICE_GST_AUDIO_MARGIN_BAD 0.5
-#   define SPICE_GST_AUDIO_VIDEO_RATIO 1.25
-
-
-    /* ---------- Server feedback ---------- */
-
-    /* How many frames were dropped by the server since the last encoded frame. */
-    uint32_t server_drops;
+    VideoRateControl rate_control;
 } SpiceGstEncoder;
 
 
@@ -333,25 +181,12 @@ static SpiceGstVideoBuffer* create_gst_video_buffer(void)
 
 /* ---------- Miscellaneous SpiceGstEncoder helpers ---------- */
 
-static inline double get_mbps(uint64_t bit_rate)
-{
-    return (double)bit_rate / 1024 / 1024;
-}
-
 /* Returns the source frame rate which may change at any time so don't store
  * the result.
  */
 static uint32_t get_source_fps(const SpiceGstEncoder *encoder)
 {
-    return encoder->cbs.get_source_fps ?
-        encoder->cbs.get_source_fps(encoder->cbs.opaque) : SPICE_GST_DEFAULT_FPS;
-}
-
-static uint32_t get_network_latency(const SpiceGstEncoder *encoder)
-{
-    /* Assume that the network latency is symmetric */
-    return encoder->cbs.get_roundtrip_ms ?
-        encoder->cbs.get_roundtrip_ms(encoder->cbs.opaque) / 2 : 0;
+    return video_rate_control_get_source_fps(&encoder->rate_control);
 }
 
 static void set_pipeline_changes(SpiceGstEncoder *encoder, uint32_t flags)
@@ -376,403 +211,6 @@ static void free_pipeline(SpiceGstEncoder *encoder)
 }
 
 
-/* ---------- Encoded frame statistics ---------- */
-
-static inline uint32_t get_last_frame_mm_time(const SpiceGstEncoder *encoder)
-{
-    return encoder->history[encoder->history_last].mm_time;
-}
-
-/* Returns the current bit rate based on the last
- * SPICE_GST_FRAME_STATISTICS_COUNT frames.
- */
-static uint64_t get_effective_bit_rate(const SpiceGstEncoder *encoder)
-{
-    uint32_t next_mm_time = encoder->next_frame_mm_time ?
-                            encoder->next_frame_mm_time :
-                            get_last_frame_mm_time(encoder) +
-                                MSEC_PER_SEC / get_source_fps(encoder);
-    uint32_t elapsed = next_mm_time - encoder->history[encoder->stat_first].mm_time;
-    return elapsed ? encoder->stat_size_sum * 8 * MSEC_PER_SEC / elapsed : 0;
-}
-
-static uint64_t get_average_encoding_time(const SpiceGstEncoder *encoder)
-{
-    uint32_t count = encoder->history_last +
-        (encoder->history_last < encoder->stat_first ? SPICE_GST_HISTORY_SIZE : 0) -
-        encoder->stat_first + 1;
-    return encoder->stat_duration_sum / count;
-}
-
-static uint32_t get_average_frame_size(const SpiceGstEncoder *encoder)
-{
-    uint32_t count = encoder->history_last +
-        (encoder->history_last < encoder->stat_first ? SPICE_GST_HISTORY_SIZE : 0) -
-        encoder->stat_first + 1;
-    return encoder->stat_size_sum / count;
-}
-
-/* Look for the largest frame and store it in stat_size_max to reduce how
- * often we have to scan the history for the largest frame.
- * Then all we need to keep things consistent is to:
- * - Update stat_size_max when adding a larger frame to the history.
- * - Reset stat_size_max to zero when the largest frame falls out of
- *   the history.
- */
-static uint32_t get_maximum_frame_size(SpiceGstEncoder *encoder)
-{
-    if (encoder->stat_size_max == 0) {
-        uint32_t index = encoder->history_last;
-        while (1) {
-            encoder->stat_size_max = MAX(encoder->stat_size_max,
-                                         encoder->history[index].size);
-            if (index == encoder->stat_first) {
-                break;
-            }
-            index = (index ? index : SPICE_GST_HISTORY_SIZE) - 1;
-        }
-    }
-    return encoder->stat_size_max;
-}
-
-/* Returns the bit rate of the specified period. from and to must be the
- * mm time of the first and last frame to consider.
- */
-static uint64_t get_period_bit_rate(const SpiceGstEncoder *encoder,
-                                    uint32_t from, uint32_t to)
-{
-    uint32_t sum = 0;
-    uint32_t last_mm_time = 0;
-    uint32_t index = encoder->history_last;
-    while (1) {
-        if (encoder->history[index].mm_time == to) {
-            if (last_mm_time == 0) {
-                /* We don't know how much time elapsed between the period's
-                 * last frame and the next so we cannot include it.
-                 */
-                sum = 1;
-                last_mm_time = to;
-            } else {
-                sum = encoder->history[index].size + 1;
-            }
-
-        } else if (encoder->history[index].mm_time == from) {
-            sum += encoder->history[index].size;
-            return (sum - 1) * 8 * MSEC_PER_SEC / (last_mm_time - from);
-
-        } else if (sum > 0) {
-            sum += encoder->history[index].size;
-
-        } else {
-            last_mm_time = encoder->history[index].mm_time;
-        }
-
-        if (index == encoder->history_first) {
-            /* This period is outside the recorded history */
-            spice_debug("period (%u-%u) outside known history (%u-%u)",
-                        from, to,
-                        encoder->history[encoder->history_first].mm_time,
-                        encoder->history[encoder->history_last].mm_time);
-           return 0;
-        }
-        index = (index ? index : SPICE_GST_HISTORY_SIZE) - 1;
-    }
-
-}
-
-static void add_frame(SpiceGstEncoder *encoder, uint32_t frame_mm_time,
-                      uint64_t duration, uint32_t size)
-{
-    /* Update the statistics */
-    uint32_t count = encoder->history_last +
-        (encoder->history_last < encoder->stat_first ? SPICE_GST_HISTORY_SIZE : 0) -
-        encoder->stat_first + 1;
-    if (count == SPICE_GST_FRAME_STATISTICS_COUNT) {
-        encoder->stat_duration_sum -= encoder->history[encoder->stat_first].duration;
-        encoder->stat_size_sum -= encoder->history[encoder->stat_first].size;
-        if (encoder->stat_size_max == encoder->history[encoder->stat_first].size) {
-            encoder->stat_size_max = 0;
-        }
-        encoder->stat_first = (encoder->stat_first + 1) % SPICE_GST_HISTORY_SIZE;
-    }
-    encoder->stat_duration_sum += duration;
-    encoder->stat_size_sum += size;
-    if (encoder->stat_size_max > 0 && size > encoder->stat_size_max) {
-        encoder->stat_size_max = size;
-    }
-
-    /* Update the frame history */
-    encoder->history_last = (encoder->history_last + 1) % SPICE_GST_HISTORY_SIZE;
-    if (encoder->history_last == encoder->history_first) {
-        encoder->history_first = (encoder->history_first + 1) % SPICE_GST_HISTORY_SIZE;
-    }
-    encoder->history[encoder->history_last].mm_time = frame_mm_time;
-    encoder->history[encoder->history_last].duration = duration;
-    encoder->history[encoder->history_last].size = size;
-}
-
-
-/* ---------- Encoder bit rate control ---------- */
-
-static void set_gstenc_bitrate(SpiceGstEncoder *encoder);
-
-static void set_video_bit_rate(SpiceGstEncoder *encoder, uint64_t bit_rate)
-{
-    if (encoder->video_bit_rate != bit_rate &&
-        encoder->gstenc_bitrate_is_dynamic) {
-        encoder->video_bit_rate = bit_rate;
-        set_gstenc_bitrate(encoder);
-
-    } else if (i64abs((int64_t)(bit_rate - encoder->video_bit_rate)) >
-               encoder->video_bit_rate * SPICE_GST_VIDEO_BITRATE_MARGIN) {
-        encoder->video_bit_rate = bit_rate;
-        set_pipeline_changes(encoder, SPICE_GST_VIDEO_PIPELINE_BITRATE);
-    }
-}
-
-static uint32_t get_min_playback_delay(SpiceGstEncoder *encoder)
-{
-    /* Make sure the delay is large enough to send a large frame (typically
-     * an I frame) and an average frame. This also takes into account the
-     * frames dropped by the encoder bit rate control.
-     */
-    uint32_t size = get_maximum_frame_size(encoder) + get_average_frame_size(encoder);
-    uint32_t send_time = ((uint64_t)MSEC_PER_SEC * 8) * size / encoder->bit_rate;
-
-    /* Also factor in the network latency with a margin for jitter. */
-    uint32_t net_latency = get_network_latency(encoder) * (1.0 + SPICE_GST_LATENCY_MARGIN);
-
-    return send_time + net_latency + get_average_encoding_time(encoder) / NSEC_PER_MILLISEC;
-}
-
-static void update_client_playback_delay(SpiceGstEncoder *encoder)
-{
-    if (encoder->cbs.update_client_playback_delay) {
-        uint32_t min_delay = get_min_playback_delay(encoder);
-        encoder->cbs.update_client_playback_delay(encoder->cbs.opaque, min_delay);
-    }
-}
-
-static void update_next_frame_mm_time(SpiceGstEncoder *encoder)
-{
-    uint64_t period_ns = NSEC_PER_SEC / get_source_fps(encoder);
-    uint64_t min_delay_ns = get_average_encoding_time(encoder);
-    if (min_delay_ns > period_ns) {
-        spice_warning("your system seems to be too slow to encode this %dx%d@%d video in real time",
-                      encoder->width, encoder->height, get_source_fps(encoder));
-    }
-
-    min_delay_ns = MIN(min_delay_ns, SPICE_GST_MAX_PERIOD);
-    if (encoder->vbuffer_free >= 0) {
-        encoder->next_frame_mm_time = get_last_frame_mm_time(encoder) +
-                                      min_delay_ns / NSEC_PER_MILLISEC;
-        return;
-    }
-
-    /* Figure out how many frames to drop to not exceed the current bit rate.
-     * Use nanoseconds to avoid precision loss.
-     */
-    uint64_t delay_ns = -encoder->vbuffer_free * 8 * NSEC_PER_SEC / encoder->bit_rate;
-    uint32_t drops = (delay_ns + period_ns - 1) / period_ns; /* round up */
-    spice_debug("drops=%u vbuffer %d/%d", drops, encoder->vbuffer_free,
-                encoder->vbuffer_size);
-
-    delay_ns = drops * period_ns + period_ns / 2;
-    if (delay_ns > SPICE_GST_MAX_PERIOD) {
-        /* Reduce the video bit rate so we don't have to drop so many frames. */
-        if (encoder->video_bit_rate > encoder->bit_rate * SPICE_GST_BITRATE_MARGIN) {
-            set_video_bit_rate(encoder, encoder->bit_rate * SPICE_GST_BITRATE_MARGIN);
-        } else {
-            set_video_bit_rate(encoder, encoder->bit_rate);
-        }
-        delay_ns = SPICE_GST_MAX_PERIOD;
-    }
-    encoder->next_frame_mm_time = get_last_frame_mm_time(encoder) +
-                                  MAX(delay_ns, min_delay_ns) / NSEC_PER_MILLISEC;
-
-    /* Drops mean a higher delay between encoded frames so update the
-     * playback delay.
-     */
-    update_client_playback_delay(encoder);
-}
-
-
-/* ---------- Network bit rate control ---------- */
-
-/* The maximum bit rate we will use for the current video.
- *
- * This is based on a 10x compression ratio which should be more than enough
- * for even MJPEG to provide good quality.
- */
-static uint64_t get_bit_rate_cap(const SpiceGstEncoder *encoder)
-{
-    uint32_t raw_frame_bits = encoder->width * encoder->height * encoder->format->bpp;
-    return raw_frame_bits * get_source_fps(encoder) / 10;
-}
-
-static void set_bit_rate(SpiceGstEncoder *encoder, uint64_t bit_rate)
-{
-    if (bit_rate == 0) {
-        /* Use the default value */
-        bit_rate = SPICE_GST_DEFAULT_BITRATE;
-    }
-    if (bit_rate == encoder->bit_rate) {
-        return;
-    }
-    if (bit_rate < SPICE_GST_MIN_BITRATE) {
-        /* Don't let the bit rate go too low... */
-        bit_rate = SPICE_GST_MIN_BITRATE;
-    } else if (bit_rate > encoder->bit_rate) {
-        /* or too high */
-        bit_rate = MIN(bit_rate, get_bit_rate_cap(encoder));
-    }
-
-    if (bit_rate < encoder->min_bit_rate) {
-        encoder->min_bit_rate = bit_rate;
-        encoder->bit_rate_step = 0;
-    } else if (encoder->status == SPICE_GST_BITRATE_DECREASING &&
-               bit_rate > encoder->bit_rate) {
-        encoder->min_bit_rate = encoder->bit_rate;
-        encoder->bit_rate_step = 0;
-    } else if (encoder->status != SPICE_GST_BITRATE_DECREASING &&
-               bit_rate < encoder->bit_rate) {
-        encoder->max_bit_rate = encoder->bit_rate - SPICE_GST_MIN_BITRATE;
-        encoder->bit_rate_step = 0;
-    }
-    encoder->increase_interval = SPICE_GST_BITRATE_UP_INTERVAL;
-
-    if (encoder->bit_rate_step == 0) {
-        encoder->bit_rate_step = MAX(SPICE_GST_MIN_BITRATE,
-                                     MIN(SPICE_GST_BITRATE_MAX_STEP,
-                                         (encoder->max_bit_rate - encoder->min_bit_rate) / 10));
-        encoder->status = (bit_rate < encoder->bit_rate) ? SPICE_GST_BITRATE_DECREASING : SPICE_GST_BITRATE_INCREASING;
-        if (encoder->max_bit_rate / SPICE_GST_BITRATE_MARGIN < encoder->min_bit_rate) {
-            /* We have sufficiently narrowed down the optimal bit rate range.
-             * Settle on the lower end to keep a safety margin and stop
-             * rocking the boat.
-             */
-            bit_rate = encoder->min_bit_rate;
-            encoder->status = SPICE_GST_BITRATE_STABLE;
-            encoder->increase_interval = encoder->has_client_reports ? SPICE_GST_BITRATE_UP_CLIENT_STABLE : SPICE_GST_BITRATE_UP_SERVER_STABLE;
-            set_video_bit_rate(encoder, bit_rate);
-        }
-    }
-    spice_debug("%u set_bit_rate(%.3fMbps) eff %.3f %.3f-%.3f %d",
-                get_last_frame_mm_time(encoder) - encoder->last_change,
-                get_mbps(bit_rate), get_mbps(get_effective_bit_rate(encoder)),
-                get_mbps(encoder->min_bit_rate),
-                get_mbps(encoder->max_bit_rate), encoder->status);
-
-    encoder->last_change = get_last_frame_mm_time(encoder);
-    encoder->bit_rate = bit_rate;
-    /* Adjust the vbuffer size without ever increasing vbuffer_free to avoid
-     * sudden bit rate increases.
-     */
-    int32_t new_size = bit_rate * SPICE_GST_VBUFFER_SIZE / MSEC_PER_SEC / 8;
-    if (new_size < encoder->vbuffer_size && encoder->vbuffer_free > 0) {
-        encoder->vbuffer_free = MAX(0, encoder->vbuffer_free + new_size - encoder->vbuffer_size);
-    }
-    encoder->vbuffer_size = new_size;
-    update_next_frame_mm_time(encoder);
-
-    /* Frames preceding the bit rate change are not relevant to the current
-     * situation anymore.
-     */
-    encoder->stat_first = encoder->history_last;
-    encoder->stat_duration_sum = encoder->history[encoder->history_last].duration;
-    encoder->stat_size_sum = encoder->stat_size_max = encoder->history[encoder->history_last].size;
-
-    if (bit_rate > encoder->video_bit_rate) {
-        set_video_bit_rate(encoder, bit_rate * SPICE_GST_BITRATE_MARGIN);
-    }
-}
-
-static void increase_bit_rate(SpiceGstEncoder *encoder)
-{
-    if (get_effective_bit_rate(encoder) < encoder->bit_rate) {
-        /* The GStreamer encoder currently uses less bandwidth than allowed.
-         * So increasing the limit again makes no sense.
-         */
-        return;
-    }
-
-    if (encoder->bit_rate == encoder->max_bit_rate &&
-        get_last_frame_mm_time(encoder) - encoder->last_change > SPICE_GST_BITRATE_UP_RESET_MAX) {
-        /* The maximum bit rate seems to be sustainable so it was probably
-         * set too low. Probe for the maximum bit rate again.
-         */
-        encoder->max_bit_rate = get_bit_rate_cap(encoder);
-        encoder->status = SPICE_GST_BITRATE_INCREASING;
-    }
-
-    uint64_t new_bit_rate = MIN(encoder->bit_rate + encoder->bit_rate_step,
-                                encoder->max_bit_rate);
-    spice_debug("increase bit rate to %.3fMbps %.3f-%.3fMbps %d",
-                get_mbps(new_bit_rate), get_mbps(encoder->min_bit_rate),
-                get_mbps(encoder->max_bit_rate), encoder->status);
-    set_bit_rate(encoder, new_bit_rate);
-}
-
-
-/* ---------- Server feedback ---------- */
-
-/* A helper for gst_encoder_encode_frame()
- *
- * Checks how many frames got dropped since the last encoded frame and
- * adjusts the bit rate accordingly.
- */
-static inline gboolean handle_server_drops(SpiceGstEncoder *encoder,
-                                           uint32_t frame_mm_time)
-{
-    if (encoder->server_drops == 0) {
-        return FALSE;
-    }
-
-    spice_debug("server report: got %u drops in %ums after %ums",
-                encoder->server_drops,
-                frame_mm_time - get_last_frame_mm_time(encoder),
-                frame_mm_time - encoder->last_change);
-
-    /* The server dropped a frame so clearly the buffer is full. */
-    encoder->vbuffer_free = MIN(encoder->vbuffer_free, 0);
-    /* Add a 0 byte frame so the time spent dropping frames is not counted as
-     * time during which the buffer was refilling. This implies dropping this
-     * frame.
-     */
-    add_frame(encoder, frame_mm_time, 0, 0);
-
-    if (encoder->server_drops >= get_source_fps(encoder)) {
-        spice_debug("cut the bit rate");
-        uint64_t bit_rate = (encoder->bit_rate == encoder->min_bit_rate) ?
-            encoder->bit_rate / SPICE_GST_BITRATE_CUT :
-            MAX(encoder->min_bit_rate, encoder->bit_rate / SPICE_GST_BITRATE_CUT);
-        set_bit_rate(encoder, bit_rate);
-
-    } else {
-        spice_debug("reduce the bit rate");
-        uint64_t bit_rate = (encoder->bit_rate == encoder->min_bit_rate) ?
-            encoder->bit_rate / SPICE_GST_BITRATE_REDUCE :
-            MAX(encoder->min_bit_rate, encoder->bit_rate / SPICE_GST_BITRATE_REDUCE);
-        set_bit_rate(encoder, bit_rate);
-    }
-    encoder->server_drops = 0;
-    return TRUE;
-}
-
-/* A helper for gst_encoder_encode_frame() */
-static inline void server_increase_bit_rate(SpiceGstEncoder *encoder,
-                                            uint32_t frame_mm_time)
-{
-    /* Let gst_encoder_client_stream_report() deal with bit rate increases if
-     * we receive client reports.
-     */
-    if (!encoder->has_client_reports && encoder->server_drops == 0 &&
-        frame_mm_time - encoder->last_change >= encoder->increase_interval) {
-        increase_bit_rate(encoder);
-    }
-}
-
-
 /* ---------- GStreamer pipeline ---------- */
 
 /* See GStreamer's part-mediatype-video-raw.txt and
@@ -1038,14 +476,14 @@ static gboolean create_pipeline(SpiceGstEncoder *encoder)
 }
 
 /* A helper for configure_pipeline() */
-static void set_gstenc_bitrate(SpiceGstEncoder *encoder)
+static void set_gstenc_bitrate(SpiceGstEncoder *encoder, uint64_t bit_rate)
 {
     GParamSpec *param = encoder->gstenc_bitrate_param;
     if (!param) {
         return;
     }
 
-    uint64_t gst_bit_rate = encoder->video_bit_rate;
+    uint64_t gst_bit_rate = bit_rate;
     if (strstr(g_param_spec_get_blurb(param), "kbit")) {
         gst_bit_rate = gst_bit_rate / 1024;
     }
@@ -1096,6 +534,24 @@ static void set_gstenc_bitrate(SpiceGstEncoder *encoder)
     spice_debug("setting the GStreamer %s to %" G_GUINT64_FORMAT, prop, gst_bit_rate);
 }
 
+/* The rate control callback to change the video bit rate */
+static bool set_video_bit_rate(void *opaque, uint64_t bit_rate)
+{
+    SpiceGstEncoder *encoder = (SpiceGstEncoder*)opaque;
+    uint64_t video_bit_rate = encoder->rate_control.video_bit_rate;
+
+    if (encoder->gstenc_bitrate_is_dynamic) {
+        set_gstenc_bitrate(encoder, bit_rate);
+        return true;
+    }
+    if (i64abs((int64_t)(bit_rate - video_bit_rate)) >
+        video_bit_rate * SPICE_GST_VIDEO_BITRATE_MARGIN) {
+        set_pipeline_changes(encoder, SPICE_GST_VIDEO_PIPELINE_BITRATE);
+        return true;
+    }
+    return false;
+}
+
 /* A helper for spice_gst_encoder_encode_frame() */
 static gboolean configure_pipeline(SpiceGstEncoder *encoder)
 {
@@ -1119,7 +575,7 @@ static gboolean configure_pipeline(SpiceGstEncoder *encoder)
 
     /* Configure the encoder bitrate */
     if (encoder->set_pipeline & SPICE_GST_VIDEO_PIPELINE_BITRATE) {
-        set_gstenc_bitrate(encoder);
+        set_gstenc_bitrate(encoder, encoder->rate_control.video_bit_rate);
     }
 
     /* Set the source caps */
@@ -1250,9 +706,23 @@ static void clear_zero_copy_queue(SpiceGstEncoder *encoder, gboolean unref_queue
 #endif
 
 /* A helper for push_raw_frame() */
+static gboolean are_chunks_stride_aligned(const SpiceBitmap *bitmap)
+{
+    const SpiceChunks *chunks = bitmap->data;
+    for (uint32_t i = 0; i < chunks->num_chunks; i++) {
+        if (chunks->chunk[i].len % bitmap->stride != 0) {
+            return FALSE;
+        }
+    }
+    return TRUE;
+}
+
+/* A helper for push_raw_frame()
+ * Copies line_size bytes of each line, which may straddle chunks.
+ */
 static inline int line_copy(SpiceGstEncoder *encoder, const SpiceBitmap *bitmap,
-                            uint32_t chunk_offset, uint32_t stream_stride,
-                            uint32_t height, uint8_t *buffer)
+                            uint32_t chunk_offset, uint32_t line_size,
+                            uint32_t stream_stride, uint32_t height, uint8_t *buffer)
 {
      uint8_t *dst = buffer;
      SpiceChunks *chunks = bitmap->data;
@@ -1261,17 +731,28 @@ static inline int line_copy(SpiceGstEncoder *encoder, const SpiceBitmap *bitmap,
          /* We may have to move forward by more than one chunk the first
           * time around. This also protects us against 0-byte chunks.
           */
-         while (chunk_offset >= chunks->chunk[chunk_index].len) {
-             if (!is_chunk_stride_aligned(bitmap, chunk_index)) {
-                 return FALSE;
-             }
+         while (chunk_index < chunks->num_chunks &&
+                chunk_offset >= chunks->chunk[chunk_index].len) {
              chunk_offset -= chunks->chunk[chunk_index].len;
              chunk_index++;
          }
 
-         /* Copy the line */
-         uint8_t *src = chunks->chunk[chunk_index].data + chunk_offset;
-         memcpy(dst, src, MIN(stream_stride, bitmap->stride));
+         /* Copy the line, usually in one go */
+         uint32_t index = chunk_index;
+         uint32_t offset = chunk_offset;
+         uint32_t left = line_size;
+         uint8_t *line = dst;
+         while (left) {
+             spice_return_val_if_fail(index < chunks->num_chunks, FALSE);
+             uint32_t thislen = MIN(chunks->chunk[index].len - offset, left);
+             memcpy(line, chunks->chunk[index].data + offset, thislen);
+             line += thislen;
+             left -= thislen;
+             offset = 0;
+             index++;
+         }
+         /* Don't leave stale data from a recycled buffer in the padding */
+         memset(line, 0, stream_stride - line_size);
          dst += stream_stride;
          chunk_offset += bitmap->stride;
      }
@@ -1319,6 +800,69 @@ typedef struct {
 } GstMapInfo;
 #endif
 
+#ifndef HAVE_GSTREAMER_0_10
+static void free_buffer_pool(SpiceGstEncoder *encoder)
+{
+    if (encoder->buffer_pool) {
+        gst_buffer_pool_set_active(encoder->buffer_pool, FALSE);
+        gst_object_unref(encoder->buffer_pool);
+        encoder->buffer_pool = NULL;
+    }
+}
+
+/* A helper for acquire_frame_buffer() */
+static GstBuffer *acquire_pool_buffer(SpiceGstEncoder *encoder, gsize size)
+{
+    if (encoder->buffer_pool && encoder->buffer_pool_size != size) {
+        free_buffer_pool(encoder);
+    }
+    if (!encoder->buffer_pool) {
+        GstBufferPool *pool = gst_buffer_pool_new();
+        GstStructure *config = gst_buffer_pool_get_config(pool);
+        /* All the buffers are allocated upfront and the pool never grows */
+        gst_buffer_pool_config_set_params(config, NULL, size, SPICE_GST_POOL_BUFFERS,
+                                          SPICE_GST_POOL_BUFFERS);
+        if (!gst_buffer_pool_set_config(pool, config) ||
+            !gst_buffer_pool_set_active(pool, TRUE)) {
+            spice_warning("GStreamer error: could not set up the buffer pool");
+            gst_object_unref(pool);
+            return NULL;
+        }
+        encoder->buffer_pool = pool;
+        encoder->buffer_pool_size = size;
+        encoder->num_buffer_allocs += SPICE_GST_POOL_BUFFERS;
+    }
+
+    /* Don't wait for the pipeline to release a buffer if they are all in
+     * use, just allocate a new one.
+     */
+    GstBufferPoolAcquireParams params = { .flags = GST_BUFFER_POOL_ACQUIRE_FLAG_DONTWAIT };
+    GstBuffer *buffer = NULL;
+    if (gst_buffer_pool_acquire_buffer(encoder->buffer_pool, &buffer, &params) != GST_FLOW_OK) {
+        return NULL;
+    }
+    return buffer;
+}
+#endif
+
+/* A helper for push_raw_frame()
+ * Returns a buffer of the specified size for the frame copy.
+ */
+static GstBuffer *acquire_frame_buffer(SpiceGstEncoder *encoder, gsize size)
+{
+#ifdef HAVE_GSTREAMER_0_10
+    encoder->num_buffer_allocs++;
+    return gst_buffer_new_and_alloc(size);
+#else
+    GstBuffer *buffer = acquire_pool_buffer(encoder, size);
+    if (!buffer) {
+        encoder->num_buffer_allocs++;
+        buffer = gst_buffer_new_allocate(NULL, size, NULL);
+    }
+    return buffer;
+#endif
+}
+
 /* A helper for push_raw_frame()
  * Note: In case of error the buffer is unref-ed.
  */
@@ -1354,6 +898,25 @@ static void unmap_and_release_memory(GstMapInfo *map, GstBuffer *buffer)
     gst_buffer_unref(buffer);
 }
 
+#ifndef HAVE_GSTREAMER_0_10
+/* A helper for push_raw_frame() */
+static void add_visible_region_metas(SpiceGstEncoder *encoder, GstBuffer *buffer,
+                                     int top_down)
+{
+    const VideoVisibleRegion *region = &encoder->visible_region;
+    uint32_t i;
+
+    for (i = 0; i < region->num_rects; i++) {
+        const SpiceRect *rect = &region->rects[i];
+        /* The buffer lines are in the bitmap order */
+        uint32_t top = top_down ? rect->top : encoder->height - rect->bottom;
+        gst_buffer_add_video_region_of_interest_meta(buffer, "visible", rect->left, top,
+                                                     rect->right - rect->left,
+                                                     rect->bottom - rect->top);
+    }
+}
+#endif
+
 /* A helper for spice_gst_encoder_encode_frame() */
 static VideoEncodeResults
 push_raw_frame(SpiceGstEncoder *encoder,
@@ -1365,7 +928,7 @@ push_raw_frame(SpiceGstEncoder *encoder,
     // GStreamer require the stream to be 4 bytes aligned
     uint32_t stream_stride = GST_ROUND_UP_4((src->right - src->left) * encoder->format->bpp / 8);
     uint32_t len = stream_stride * height;
-    GstBuffer *buffer = gst_buffer_new();
+    GstBuffer *buffer;
     /* TODO Use GST_MAP_INFO_INIT once GStreamer 1.4.5 is no longer relevant */
     GstMapInfo map = { .memory = NULL };
 
@@ -1375,23 +938,42 @@ push_raw_frame(SpiceGstEncoder *encoder,
     uint32_t skip_lines = top_down ? src->top : bitmap->y - (src->bottom - 0);
     uint32_t chunk_offset = bitmap->stride * skip_lines;
 
-    if (stream_stride != bitmap->stride) {
+    if (stream_stride != bitmap->stride || !are_chunks_stride_aligned(bitmap)) {
         /* We have to do a line-by-line copy because for each we have to
-         * leave out pixels on the left or right.
+         * leave out pixels on the left or right, or because some lines
+         * straddle two chunks.
          */
-        uint8_t *dst = allocate_and_map_memory(len, &map, buffer);
-        if (!dst) {
+        buffer = acquire_frame_buffer(encoder, len);
+        if (!buffer) {
             return VIDEO_ENCODER_FRAME_UNSUPPORTED;
         }
+#ifdef HAVE_GSTREAMER_0_10
+        uint8_t *dst = GST_BUFFER_DATA(buffer);
+#else
+        GstMapInfo buffer_map;
+        if (!gst_buffer_map(buffer, &buffer_map, GST_MAP_WRITE)) {
+            gst_buffer_unref(buffer);
+            return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+        }
+        uint8_t *dst = buffer_map.data;
+#endif
 
         chunk_offset += src->left * encoder->format->bpp / 8;
-        if (!line_copy(encoder, bitmap, chunk_offset, stream_stride, height, dst)) {
-            unmap_and_release_memory(&map, buffer);
+        uint32_t line_size = (src->right - src->left) * encoder->format->bpp / 8;
+        int copied = line_copy(encoder, bitmap, chunk_offset, line_size,
+                               stream_stride, height, dst);
+#ifndef HAVE_GSTREAMER_0_10
+        gst_buffer_unmap(buffer, &buffer_map);
+#endif
+        if (!copied) {
+            gst_buffer_unref(buffer);
             return VIDEO_ENCODER_FRAME_UNSUPPORTED;
         }
+        encoder->copied_bytes += len;
     } else {
         /* We can copy the bitmap chunk by chunk */
         uint32_t chunk_index = 0;
+        buffer = gst_buffer_new();
 #ifdef DO_ZERO_COPY
         if (!zero_copy(encoder, bitmap, bitmap_opaque, buffer, &chunk_index,
                        &chunk_offset, &len)) {
@@ -1415,6 +997,8 @@ push_raw_frame(SpiceGstEncoder *encoder,
                 unmap_and_release_memory(&map, buffer);
                 return VIDEO_ENCODER_FRAME_UNSUPPORTED;
             }
+            encoder->num_buffer_allocs++;
+            encoder->copied_bytes += len;
         }
     }
 #ifdef HAVE_GSTREAMER_0_10
@@ -1424,6 +1008,7 @@ push_raw_frame(SpiceGstEncoder *encoder,
         gst_memory_unmap(map.memory, &map);
         gst_buffer_append_memory(buffer, map.memory);
     }
+    add_visible_region_metas(encoder, buffer, top_down);
 #endif
 
     GstFlowReturn ret = gst_app_src_push_buffer(encoder->appsrc, buffer);
@@ -1431,6 +1016,7 @@ push_raw_frame(SpiceGstEncoder *encoder,
         spice_warning("GStreamer error: unable to push source buffer (%d)", ret);
         return VIDEO_ENCODER_FRAME_UNSUPPORTED;
     }
+    encoder->num_frames++;
 
     return VIDEO_ENCODER_FRAME_ENCODE_DONE;
 }
@@ -1465,6 +1051,10 @@ static void spice_gst_encoder_destroy(VideoEncoder *video_encoder)
     SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
 
     free_pipeline(encoder);
+#ifndef HAVE_GSTREAMER_0_10
+    free_buffer_pool(encoder);
+    video_visible_region_clear(&encoder->visible_region);
+#endif
     pthread_mutex_destroy(&encoder->outbuf_mutex);
     pthread_cond_destroy(&encoder->outbuf_cond);
 
@@ -1505,14 +1095,10 @@ spice_gst_encoder_encode_frame(VideoEncoder *video_encoder,
         encoder->spice_format = (SpiceBitmapFmt) bitmap->format;
         encoder->width = width;
         encoder->height = height;
-        if (encoder->bit_rate == 0) {
-            encoder->history[0].mm_time = frame_mm_time;
-            encoder->max_bit_rate = get_bit_rate_cap(encoder);
-            encoder->min_bit_rate = SPICE_GST_MIN_BITRATE;
-            encoder->status = SPICE_GST_BITRATE_DECREASING;
-            set_bit_rate(encoder, encoder->starting_bit_rate);
-            encoder->vbuffer_free = 0; /* Slow start */
-        } else if (encoder->pipeline) {
+        bool started = encoder->rate_control.bit_rate != 0;
+        video_rate_control_set_video_format(&encoder->rate_control, width, height,
+                                            encoder->format->bpp, frame_mm_time);
+        if (started && encoder->pipeline) {
             set_pipeline_changes(encoder, SPICE_GST_VIDEO_PIPELINE_CAPS);
         }
         encoder->errors = 0;
@@ -1530,8 +1116,7 @@ spice_gst_encoder_encode_frame(VideoEncoder *video_encoder,
         return VIDEO_ENCODER_FRAME_UNSUPPORTED;
     }
 
-    if (handle_server_drops(encoder, frame_mm_time) ||
-        frame_mm_time < encoder->next_frame_mm_time) {
+    if (video_rate_control_drop_frame(&encoder->rate_control, frame_mm_time)) {
         /* Drop the frame to limit the outgoing bit rate. */
         return VIDEO_ENCODER_FRAME_DROP;
     }
@@ -1562,16 +1147,8 @@ spice_gst_encoder_encode_frame(VideoEncoder *video_encoder,
     if (rc != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
         return rc;
     }
-    uint32_t last_mm_time = get_last_frame_mm_time(encoder);
-    add_frame(encoder, frame_mm_time, spice_get_monotonic_time_ns() - start,
-              (*outbuf)->size);
-
-    int32_t refill = encoder->bit_rate * (frame_mm_time - last_mm_time) / MSEC_PER_SEC / 8;
-    encoder->vbuffer_free = MIN(encoder->vbuffer_free + refill,
-                                encoder->vbuffer_size) - (*outbuf)->size;
-
-    server_increase_bit_rate(encoder, frame_mm_time);
-    update_next_frame_mm_time(encoder);
+    video_rate_control_add_frame(&encoder->rate_control, frame_mm_time,
+                                 spice_get_monotonic_time_ns() - start, (*outbuf)->size);
 
     return rc;
 }
@@ -1585,117 +1162,21 @@ static void spice_gst_encoder_client_stream_report(VideoEncoder *video_encoder,
                                              uint32_t audio_margin)
 {
     SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
-    encoder->has_client_reports = TRUE;
-
-    encoder->max_video_margin = MAX(encoder->max_video_margin, video_margin);
-    encoder->max_audio_margin = MAX(encoder->max_audio_margin, audio_margin);
-    int32_t margin_delta = video_margin - encoder->last_video_margin;
-    encoder->last_video_margin = video_margin;
-
-    uint64_t period_bit_rate = get_period_bit_rate(encoder, start_frame_mm_time, end_frame_mm_time);
-    spice_debug("client report: %u/%u drops in %ums margins video %3d/%3d audio %3u/%3u bw %.3f/%.3fMbps%s",
-                num_drops, num_frames, end_frame_mm_time - start_frame_mm_time,
-                video_margin, encoder->max_video_margin,
-                audio_margin, encoder->max_audio_margin,
-                get_mbps(period_bit_rate),
-                get_mbps(get_effective_bit_rate(encoder)),
-                start_frame_mm_time < encoder->last_change ? " obsolete" : "");
-    if (encoder->status == SPICE_GST_BITRATE_DECREASING &&
-        start_frame_mm_time < encoder->last_change) {
-        /* Some of this data predates the last bit rate reduction
-         * so it is obsolete.
-         */
-        return;
-    }
-
-    /* We normally arrange for even the largest frames to arrive a bit over
-     * one period before they should be displayed.
-     */
-    uint32_t min_margin = MSEC_PER_SEC / get_source_fps(encoder) +
-        get_network_latency(encoder) * SPICE_GST_LATENCY_MARGIN;
-
-    /* A low video margin indicates that the bit rate is too high. */
-    uint32_t score;
-    if (num_drops) {
-        score = 4;
-    } else if (margin_delta >= 0) {
-        /* The situation was bad but seems to be improving */
-        score = 0;
-    } else if (video_margin < min_margin * SPICE_GST_VIDEO_MARGIN_BAD ||
-               video_margin < encoder->max_video_margin * SPICE_GST_VIDEO_MARGIN_BAD) {
-        score = 3;
-    } else if (video_margin < min_margin ||
-               video_margin < encoder->max_video_margin * SPICE_GST_VIDEO_MARGIN_AVERAGE) {
-        score = 2;
-    } else if (video_margin < encoder->max_video_margin * SPICE_GST_VIDEO_MARGIN_GOOD) {
-        score = 1;
-    } else {
-        score = 0;
-    }
-    /* A fast dropping video margin is a compounding factor. */
-    if (margin_delta < -abs(encoder->max_video_margin) * SPICE_GST_VIDEO_DELTA_BAD) {
-        score += 2;
-    } else if (margin_delta < -abs(encoder->max_video_margin) * SPICE_GST_VIDEO_DELTA_AVERAGE) {
-        score += 1;
-    }
-
-    if (score > 3) {
-        spice_debug("score %u, cut the bit rate", score);
-        uint64_t bit_rate = (encoder->bit_rate == encoder->min_bit_rate) ?
-            encoder->bit_rate / SPICE_GST_BITRATE_CUT :
-            MAX(encoder->min_bit_rate, encoder->bit_rate / SPICE_GST_BITRATE_CUT);
-        set_bit_rate(encoder, bit_rate);
-
-    } else if (score == 3) {
-        spice_debug("score %u, reduce the bit rate", score);
-        uint64_t bit_rate = (encoder->bit_rate == encoder->min_bit_rate) ?
-            encoder->bit_rate / SPICE_GST_BITRATE_REDUCE :
-            MAX(encoder->min_bit_rate, encoder->bit_rate / SPICE_GST_BITRATE_REDUCE);
-        set_bit_rate(encoder, bit_rate);
-
-    } else if (score == 2) {
-        spice_debug("score %u, decrement the bit rate", score);
-        set_bit_rate(encoder, encoder->bit_rate - encoder->bit_rate_step);
-
-    } else if (audio_margin < encoder->max_audio_margin * SPICE_GST_AUDIO_MARGIN_BAD &&
-               audio_margin * SPICE_GST_AUDIO_VIDEO_RATIO < video_margin) {
-        /* The audio margin has decreased a lot while the video_margin
-         * remained higher. It may be that the video stream is starving the
-         * audio one of bandwidth. So reduce the bit rate.
-         */
-        spice_debug("free some bandwidth for the audio stream");
-        set_bit_rate(encoder, encoder->bit_rate - encoder->bit_rate_step);
-
-    } else if (score == 1 && period_bit_rate <= encoder->bit_rate &&
-               encoder->status == SPICE_GST_BITRATE_INCREASING) {
-        /* We only increase the bit rate when score == 0 so things got worse
-         * since the last increase, and not because of a transient bit rate
-         * peak.
-         */
-        spice_debug("degraded margin, decrement bit rate %.3f <= %.3fMbps",
-                    get_mbps(period_bit_rate), get_mbps(encoder->bit_rate));
-        set_bit_rate(encoder, encoder->bit_rate - encoder->bit_rate_step);
-
-    } else if (score == 0 &&
-               get_last_frame_mm_time(encoder) - encoder->last_change >= encoder->increase_interval) {
-        /* The video margin is consistently high so increase the bit rate. */
-        increase_bit_rate(encoder);
-    }
+    video_rate_control_client_stream_report(&encoder->rate_control, num_frames, num_drops,
+                                            start_frame_mm_time, end_frame_mm_time,
+                                            video_margin, audio_margin);
 }
 
 static void spice_gst_encoder_notify_server_frame_drop(VideoEncoder *video_encoder)
 {
     SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
-    if (encoder->server_drops == 0) {
-        spice_debug("server report: getting frame drops...");
-    }
-    encoder->server_drops++;
+    video_rate_control_server_frame_drop(&encoder->rate_control);
 }
 
 static uint64_t spice_gst_encoder_get_bit_rate(VideoEncoder *video_encoder)
 {
     SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
-    return get_effective_bit_rate(encoder);
+    return video_rate_control_get_effective_bit_rate(&encoder->rate_control);
 }
 
 static void spice_gst_encoder_get_stats(VideoEncoder *video_encoder,
@@ -1705,16 +1186,42 @@ static void spice_gst_encoder_get_stats(VideoEncoder *video_encoder,
     uint64_t raw_bit_rate = encoder->width * encoder->height * encoder->format->bpp * get_source_fps(encoder);
 
     spice_return_if_fail(stats != NULL);
-    stats->starting_bit_rate = encoder->starting_bit_rate;
-    stats->cur_bit_rate = get_effective_bit_rate(encoder);
+    stats->starting_bit_rate = encoder->rate_control.starting_bit_rate;
+    stats->cur_bit_rate = video_rate_control_get_effective_bit_rate(&encoder->rate_control);
 
     /* Use the compression level as a proxy for the quality */
     stats->avg_quality = stats->cur_bit_rate ? 100.0 - raw_bit_rate / stats->cur_bit_rate : 0;
     if (stats->avg_quality < 0) {
         stats->avg_quality = 0;
     }
+
+    stats->avg_copy_size = encoder->num_frames ?
+        (double)encoder->copied_bytes / encoder->num_frames : 0;
+    stats->num_buffer_allocs = encoder->num_buffer_allocs;
 }
 
+static void spice_gst_encoder_request_key_frame(VideoEncoder *video_encoder)
+{
+    SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
+
+    /* A new pipeline starts with a key frame. Rebuilding it is slow but
+     * only happens when a client starts watching an existing stream.
+     */
+    if (encoder->pipeline) {
+        spice_debug("rebuilding the pipeline to get a key frame");
+        free_pipeline(encoder);
+    }
+}
+
+#ifndef HAVE_GSTREAMER_0_10
+static void spice_gst_encoder_set_visible_region(VideoEncoder *video_encoder,
+                                                 const SpiceClipRects *visible)
+{
+    SpiceGstEncoder *encoder = (SpiceGstEncoder*)video_encoder;
+    video_visible_region_set(&encoder->visible_region, visible);
+}
+#endif
+
 /* Check if ORC library can work.
  * ORC library is used quite extensively by GStreamer
  * to generate code dynamically. If ORC cannot work, GStreamer
@@ -1745,7 +1252,6 @@ VideoEncoder *gstreamer_encoder_new(SpiceVideoCodecType codec_type,
                                     bitmap_ref_t bitmap_ref,
                                     bitmap_unref_t bitmap_unref)
 {
-    SPICE_VERIFY(SPICE_GST_FRAME_STATISTICS_COUNT <= SPICE_GST_HISTORY_SIZE);
     spice_return_val_if_fail(codec_type == SPICE_VIDEO_CODEC_TYPE_MJPEG ||
                              codec_type == SPICE_VIDEO_CODEC_TYPE_VP8 ||
                              codec_type == SPICE_VIDEO_CODEC_TYPE_VP9 ||
@@ -1770,13 +1276,19 @@ VideoEncoder *gstreamer_encoder_new(SpiceVideoCodecType codec_type,
     encoder->base.notify_server_frame_drop = spice_gst_encoder_notify_server_frame_drop;
     encoder->base.get_bit_rate = spice_gst_encoder_get_bit_rate;
     encoder->base.get_stats = spice_gst_encoder_get_stats;
+    if (codec_type != SPICE_VIDEO_CODEC_TYPE_MJPEG) {
+        encoder->base.request_key_frame = spice_gst_encoder_request_key_frame;
+    }
+#ifndef HAVE_GSTREAMER_0_10
+    encoder->base.set_visible_region = spice_gst_encoder_set_visible_region;
+#endif
     encoder->base.codec_type = codec_type;
 #ifdef DO_ZERO_COPY
     encoder->unused_bitmap_opaques = g_async_queue_new();
 #endif
 
-    encoder->starting_bit_rate = starting_bit_rate;
-    encoder->cbs = *cbs;
+    video_rate_control_init(&encoder->rate_control, cbs, starting_bit_rate, false,
+                            set_video_bit_rate, encoder);
     encoder->bitmap_ref = bitmap_ref;
     encoder->bitmap_unref = bitmap_unref;
     encoder->format = GSTREAMER_FORMAT_INVALID;
@@ -372,6 +372,10 @@ void MainChannelClient::handle_pong(SpiceMsgPing *ping, uint32_t size)
         priv->bitrate_per_sec =
             uint64_t{NET_TEST_BYTES * 8} * 1000000 / (roundtrip - priv->latency);
         priv->net_test_stage = NET_TEST_STAGE_COMPLETE;
+        /* the test gives the first estimate, it's then updated
+         * continuously by the channels of the client */
+        get_client()->add_net_bit_rate_sample(priv->bitrate_per_sec, false);
+        get_client()->add_net_rtt_sample(priv->latency * NSEC_PER_MICROSEC);
         red_channel_debug(get_channel(),
                           "net test: latency %f ms, bitrate %" G_GUINT64_FORMAT " bps (%f Mbps)%s",
                           (double)priv->latency / 1000,
@@ -478,23 +482,24 @@ MainChannelClient *main_channel_client_create(MainChannel *main_chan, RedClient
 
 bool MainChannelClient::is_network_info_initialized() const
 {
-    return priv->net_test_stage == NET_TEST_STAGE_COMPLETE;
+    return priv->net_test_stage == NET_TEST_STAGE_COMPLETE ||
+           get_client()->get_net_estimate().has_bit_rate();
 }
 
 bool MainChannelClient::is_low_bandwidth() const
 {
     // TODO: configurable?
-    return priv->bitrate_per_sec < 10 * 1024 * 1024;
+    return get_bitrate_per_sec() < NET_LOW_BANDWIDTH_BIT_RATE;
 }
 
 uint64_t MainChannelClient::get_bitrate_per_sec() const
 {
-    return priv->bitrate_per_sec;
+    return get_client()->get_net_estimate().get_bit_rate();
 }
 
 uint64_t MainChannelClient::get_roundtrip_ms() const
 {
-    return priv->latency / 1000;
+    return get_client()->get_net_estimate().get_min_rtt_ns() / NSEC_PER_MILLISEC;
 }
 
 void MainChannelClient::migrate()
@@ -774,6 +779,12 @@ static void main_channel_marshall_registered_channel(RedChannelClient *rcc,
     spice_marshall_msg_main_channels_list(m, channels_info);
 }
 
+/* agent data, like file transfers, should not delay the display */
+bool MainChannelClient::is_bulk_item(const RedPipeItem *item) const
+{
+    return item->type == RED_PIPE_ITEM_TYPE_MAIN_AGENT_DATA;
+}
+
 void MainChannelClient::send_item(RedPipeItem *item)
 {
     SpiceMarshaller *m = get_marshaller();
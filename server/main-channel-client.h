@@ -87,6 +87,7 @@ protected:
     virtual void on_disconnect() override;
     virtual bool handle_message(uint16_t type, uint32_t size, void *message) override;
     virtual void send_item(RedPipeItem *item)  override;
+    virtual bool is_bulk_item(const RedPipeItem *item) const override;
     virtual bool handle_migrate_data(uint32_t size, void *message) override;
     virtual void migrate() override;
     virtual void handle_migrate_flush_mark() override;
@@ -24,11 +24,14 @@
 
 #include <stdio.h>
 #include <inttypes.h>
+#include <pthread.h>
 #include <jerror.h>
 #include <jpeglib.h>
 
 #include "red-common.h"
 #include "video-encoder.h"
+#include "video-rate-control.h"
+#include "video-visible-region.h"
 #include "utils.h"
 
 #define MJPEG_MAX_FPS 25
@@ -42,38 +45,23 @@ static const int mjpeg_quality_samples[MJPEG_QUALITY_SAMPLE_NUM] = {20, 30, 40,
 
 #define MJPEG_AVERAGE_SIZE_WINDOW 3
 
-#define MJPEG_BIT_RATE_EVAL_MIN_NUM_FRAMES 3
-
-#define MJPEG_SERVER_STATUS_EVAL_FPS_INTERVAL 1
-#define MJPEG_SERVER_STATUS_DOWNGRADE_DROP_FACTOR_TH 0.1
-
-/*
- * acting on positive client reports only if enough frame mm time
- * has passed since the last bit rate change and the report.
- * time
- */
-#define MJPEG_CLIENT_POSITIVE_REPORT_TIMEOUT 2000
-#define MJPEG_CLIENT_POSITIVE_REPORT_STRICT_TIMEOUT 3000
-
 #define MJPEG_ADJUST_FPS_TIMEOUT 500
 
-/*
- * avoid interrupting the playback when there are temporary
- * incidents of instability (with respect to server and client drops)
- */
-#define MJPEG_MAX_CLIENT_PLAYBACK_DELAY (MSEC_PER_SEC * 5)
+/* The compressed buffer initial size. */
+#define MJPEG_INITIAL_BUFFER_SIZE (32 * 1024)
 
 /*
- * The stream starts after lossless frames were sent to the client,
- * and without rate control (except for pipe congestion). Thus, on the beginning
- * of the stream, we might observe frame drops on the client and server side which
- * are not necessarily related to mis-estimation of the bit rate, and we would
- * like to wait till the stream stabilizes.
+ * Large frames are split in horizontal slices compressed in parallel.
+ * Each slice is compressed as a separate JPEG image, then the slices
+ * are joined in a single image with a restart marker at the start of
+ * each slice.
  */
-#define MJPEG_WARMUP_TIME (NSEC_PER_SEC * 3)
-
-/* The compressed buffer initial size. */
-#define MJPEG_INITIAL_BUFFER_SIZE (32 * 1024)
+#define MJPEG_SLICE_MIN_PIXELS (1280 * 720)
+#define MJPEG_SLICE_MIN_HEIGHT 128
+#define MJPEG_MAX_SLICES 16
+/* The MCU size with the default 2x2 chroma subsampling. All the slices
+ * but the last one are made of whole rows of MCUs. */
+#define MJPEG_MCU_SIZE 16
 
 #ifdef JCS_EXTENSIONS
 #  ifndef WORDS_BIGENDIAN
@@ -112,28 +100,6 @@ typedef struct MJpegEncoderQualityEval {
     int max_sampled_fps_quality_id;
 } MJpegEncoderQualityEval;
 
-typedef struct MJpegEncoderClientState {
-    int max_video_latency;
-    uint32_t max_audio_latency;
-} MJpegEncoderClientState;
-
-typedef struct MJpegEncoderServerState {
-    uint32_t num_frames_encoded;
-    uint32_t num_frames_dropped;
-} MJpegEncoderServerState;
-
-typedef struct MJpegEncoderBitRateInfo {
-    uint64_t change_start_time;
-    uint64_t last_frame_time;
-    uint32_t change_start_mm_time;
-    int was_upgraded;
-
-    /* gathering data about the frames that
-     * were encoded since the last bit rate change*/
-    uint32_t num_enc_frames;
-    uint64_t sum_enc_size;
-} MJpegEncoderBitRateInfo;
-
 /*
  * Adjusting the stream jpeg quality and frame rate (fps):
  * When during_quality_eval=TRUE, we compress different frames with different
@@ -147,11 +113,10 @@ typedef struct MJpegEncoderBitRateInfo {
 typedef struct MJpegEncoderRateControl {
     int during_quality_eval;
     MJpegEncoderQualityEval quality_eval_data;
-    MJpegEncoderBitRateInfo bit_rate_info;
-    MJpegEncoderClientState client_state;
-    MJpegEncoderServerState server_state;
 
+    /* the byte rate set by the video rate control */
     uint64_t byte_rate;
+    uint64_t last_frame_time;
     int quality_id;
     uint32_t fps;
     double adjusted_fps;
@@ -165,8 +130,6 @@ typedef struct MJpegEncoderRateControl {
 
     uint64_t sum_recent_enc_size;
     uint32_t num_recent_enc_frames;
-
-    uint64_t warmup_start_time;
 } MJpegEncoderRateControl;
 
 typedef struct MJpegVideoBuffer {
@@ -174,6 +137,27 @@ typedef struct MJpegVideoBuffer {
     size_t maxsize;
 } MJpegVideoBuffer;
 
+struct MJpegEncoder;
+
+typedef struct MJpegSlice {
+    struct MJpegEncoder *encoder;
+    struct jpeg_compress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    int initialized;
+    uint8_t *row;
+    uint32_t row_size;
+
+    /* the slice lines are encoder->lines[first_line, first_line + num_lines) */
+    uint32_t first_line;
+    uint32_t num_lines;
+
+    /* the compressed slice, a complete JPEG image */
+    uint8_t *data;
+    size_t maxsize;
+    size_t size;
+    size_t scan_offset;
+} MJpegSlice;
+
 typedef struct MJpegEncoder {
     VideoEncoder base;
     uint8_t *row;
@@ -186,19 +170,32 @@ typedef struct MJpegEncoder {
     unsigned int bytes_per_pixel; /* bytes per pixel of the input buffer */
     void (*pixel_converter)(void *src, uint8_t *dest);
 
+    /* the hidden parts of the frames are compressed as black */
+    VideoVisibleRegion visible_region;
+    int top_down;
+
     MJpegEncoderRateControl rate_control;
-    VideoEncoderRateControlCbs cbs;
+    /* picks the bit rate, and drops frames to not exceed it */
+    VideoRateControl video_rate_control;
+
+    /* slices of the current frame, num_slices is 1 if the frame is not split */
+    uint32_t max_slices;
+    uint32_t num_slices;
+    uint32_t slice_height;
+    uint32_t restart_interval;
+    int quality;
+    uint8_t **lines;
+    uint32_t lines_size;
+    MJpegSlice *slices;
+    pthread_mutex_t slices_mutex;
+    pthread_cond_t slices_cond;
+    uint32_t slices_pending;
 
     /* stats */
-    uint64_t starting_bit_rate;
     uint64_t avg_quality;
     uint32_t num_frames;
 } MJpegEncoder;
 
-static void mjpeg_encoder_process_server_drops(MJpegEncoder *encoder);
-static uint32_t get_min_required_playback_delay(const MJpegEncoder *encoder,
-                                                uint64_t frame_enc_size);
-
 static void mjpeg_video_buffer_free(VideoBuffer *video_buffer)
 {
     MJpegVideoBuffer *buffer = (MJpegVideoBuffer*)video_buffer;
@@ -222,9 +219,26 @@ static MJpegVideoBuffer* create_mjpeg_video_buffer(void)
 static void mjpeg_encoder_destroy(VideoEncoder *video_encoder)
 {
     MJpegEncoder *encoder = SPICE_CONTAINEROF(video_encoder, MJpegEncoder, base);
+    uint32_t i;
+
+    for (i = 0; encoder->slices && i < encoder->max_slices; i++) {
+        MJpegSlice *slice = &encoder->slices[i];
+
+        if (slice->initialized) {
+            g_free(slice->cinfo.dest);
+            jpeg_destroy_compress(&slice->cinfo);
+        }
+        g_free(slice->row);
+        g_free(slice->data);
+    }
+    g_free(encoder->slices);
+    g_free(encoder->lines);
+    pthread_cond_destroy(&encoder->slices_cond);
+    pthread_mutex_destroy(&encoder->slices_mutex);
     g_free(encoder->cinfo.dest);
     jpeg_destroy_compress(&encoder->cinfo);
     g_free(encoder->row);
+    video_visible_region_clear(&encoder->visible_region);
     g_free(encoder);
 }
 
@@ -353,14 +367,14 @@ spice_jpeg_mem_dest(j_compress_ptr cinfo,
 
 static inline uint32_t mjpeg_encoder_get_source_fps(const MJpegEncoder *encoder)
 {
-    return encoder->cbs.get_source_fps ?
-        encoder->cbs.get_source_fps(encoder->cbs.opaque) : MJPEG_MAX_FPS;
+    const VideoEncoderRateControlCbs *cbs = &encoder->video_rate_control.cbs;
+    return cbs->get_source_fps ? cbs->get_source_fps(cbs->opaque) : MJPEG_MAX_FPS;
 }
 
 static inline uint32_t mjpeg_encoder_get_latency(const MJpegEncoder *encoder)
 {
-    return encoder->cbs.get_roundtrip_ms ?
-        encoder->cbs.get_roundtrip_ms(encoder->cbs.opaque) / 2 : 0;
+    const VideoEncoderRateControlCbs *cbs = &encoder->video_rate_control.cbs;
+    return cbs->get_roundtrip_ms ? cbs->get_roundtrip_ms(cbs->opaque) / 2 : 0;
 }
 
 static uint32_t get_max_fps(uint64_t frame_size, uint64_t bytes_per_sec)
@@ -382,9 +396,6 @@ static void mjpeg_encoder_reset_quality(MJpegEncoder *encoder,
         rate_control->last_enc_size = 0;
     }
 
-    if (rate_control->quality_eval_data.reason == MJPEG_QUALITY_EVAL_REASON_RATE_CHANGE) {
-        memset(&rate_control->server_state, 0, sizeof(MJpegEncoderServerState));
-    }
     rate_control->quality_id = quality_id;
     memset(&rate_control->quality_eval_data, 0, sizeof(MJpegEncoderQualityEval));
     rate_control->quality_eval_data.max_quality_id = MJPEG_QUALITY_SAMPLE_NUM - 1;
@@ -549,11 +560,7 @@ complete_sample:
 
     spice_debug("MJpeg quality sample end %p: quality %d fps %d",
                 encoder, mjpeg_quality_samples[rate_control->quality_id], rate_control->fps);
-    if (encoder->cbs.update_client_playback_delay) {
-        uint32_t min_delay = get_min_required_playback_delay(encoder, final_quality_enc_size);
-
-        encoder->cbs.update_client_playback_delay(encoder->cbs.opaque, min_delay);
-    }
+    video_rate_control_update_client_playback_delay(&encoder->video_rate_control);
 }
 
 static void mjpeg_encoder_quality_eval_set_upgrade(MJpegEncoder *encoder,
@@ -660,8 +667,6 @@ end:
     if (rate_control->during_quality_eval) {
         quality_eval->encoded_size_by_quality[rate_control->quality_id] = new_avg_enc_size;
         mjpeg_encoder_eval_quality(encoder);
-    } else {
-        mjpeg_encoder_process_server_drops(encoder);
     }
 }
 
@@ -711,6 +716,33 @@ static void mjpeg_encoder_adjust_fps(MJpegEncoder *encoder, uint64_t now)
     }
 }
 
+/* Decides in how many slices the frame is split */
+static void mjpeg_encoder_plan_slices(MJpegEncoder *encoder)
+{
+    uint32_t width = encoder->cinfo.image_width;
+    uint32_t height = encoder->cinfo.image_height;
+    uint32_t mcus_per_row = (width + MJPEG_MCU_SIZE - 1) / MJPEG_MCU_SIZE;
+    uint32_t mcu_rows = (height + MJPEG_MCU_SIZE - 1) / MJPEG_MCU_SIZE;
+    uint32_t num_slices, slice_mcu_rows;
+
+    encoder->num_slices = 1;
+    if (encoder->max_slices < 2 || (uint64_t) width * height < MJPEG_SLICE_MIN_PIXELS) {
+        return;
+    }
+    num_slices = MIN(encoder->max_slices, height / MJPEG_SLICE_MIN_HEIGHT);
+    if (num_slices < 2) {
+        return;
+    }
+    slice_mcu_rows = (mcu_rows + num_slices - 1) / num_slices;
+    /* the restart interval, the number of MCUs of a slice, has 16 bits */
+    if ((uint64_t) slice_mcu_rows * mcus_per_row > 0xffff) {
+        return;
+    }
+    encoder->slice_height = slice_mcu_rows * MJPEG_MCU_SIZE;
+    encoder->restart_interval = slice_mcu_rows * mcus_per_row;
+    encoder->num_slices = (height + encoder->slice_height - 1) / encoder->slice_height;
+}
+
 /*
  * dest must be either NULL or allocated by g_malloc, since it might be freed
  * during the encoding, if its size is too small.
@@ -720,14 +752,14 @@ static void mjpeg_encoder_adjust_fps(MJpegEncoder *encoder, uint64_t now)
  *  MJPEG_ENCODER_FRAME_DROP        : frame should be dropped. This value can only be returned
  *                                    if mjpeg rate control is active.
  *  MJPEG_ENCODER_FRAME_ENCODE_DONE : frame encoding started. Continue with
- *                                    mjpeg_encoder_encode_scanline.
+ *                                    mjpeg_encoder_encode_scanline, or with
+ *                                    encode_frame_slices if num_slices > 1.
  */
 static VideoEncodeResults
 mjpeg_encoder_start_frame(MJpegEncoder *encoder,
                           SpiceBitmapFmt format,
                           const SpiceRect *src,
-                          MJpegVideoBuffer *buffer,
-                          uint32_t frame_mm_time)
+                          MJpegVideoBuffer *buffer)
 {
     uint32_t quality;
 
@@ -741,7 +773,7 @@ mjpeg_encoder_start_frame(MJpegEncoder *encoder,
         rate_control->adjusted_fps_start_time = now;
     }
     mjpeg_encoder_adjust_fps(encoder, now);
-    interval = (now - rate_control->bit_rate_info.last_frame_time);
+    interval = (now - rate_control->last_frame_time);
 
     if (interval < NSEC_PER_SEC / rate_control->adjusted_fps) {
         return VIDEO_ENCODER_FRAME_DROP;
@@ -751,15 +783,7 @@ mjpeg_encoder_start_frame(MJpegEncoder *encoder,
 
     if (!rate_control->during_quality_eval ||
         rate_control->quality_eval_data.reason == MJPEG_QUALITY_EVAL_REASON_SIZE_CHANGE) {
-        MJpegEncoderBitRateInfo *bit_rate_info;
-
-        bit_rate_info = &encoder->rate_control.bit_rate_info;
-
-        if (!bit_rate_info->change_start_time) {
-            bit_rate_info->change_start_time = now;
-            bit_rate_info->change_start_mm_time = frame_mm_time;
-        }
-        bit_rate_info->last_frame_time = now;
+        rate_control->last_frame_time = now;
     }
 
     encoder->cinfo.in_color_space   = JCS_RGB;
@@ -796,8 +820,8 @@ mjpeg_encoder_start_frame(MJpegEncoder *encoder,
 
     encoder->cinfo.image_width = src->right - src->left;
     encoder->cinfo.image_height = src->bottom - src->top;
-    if (encoder->pixel_converter != NULL) {
-        JDIMENSION stride = encoder->cinfo.image_width * 3;
+    if (encoder->pixel_converter != NULL || encoder->visible_region.clipped) {
+        JDIMENSION stride = encoder->cinfo.image_width * encoder->cinfo.input_components;
         /* check for integer overflow */
         if (stride < encoder->cinfo.image_width) {
             return VIDEO_ENCODER_FRAME_UNSUPPORTED;
@@ -808,39 +832,74 @@ mjpeg_encoder_start_frame(MJpegEncoder *encoder,
         }
     }
 
-    spice_jpeg_mem_dest(&encoder->cinfo, &buffer->base.data, &buffer->maxsize);
-
-    jpeg_set_defaults(&encoder->cinfo);
-    encoder->cinfo.dct_method       = JDCT_IFAST;
     quality = mjpeg_quality_samples[encoder->rate_control.quality_id];
-    jpeg_set_quality(&encoder->cinfo, quality, TRUE);
-    jpeg_start_compress(&encoder->cinfo, encoder->first_frame);
+    mjpeg_encoder_plan_slices(encoder);
+    if (encoder->num_slices > 1) {
+        /* the slices are compressed by encode_frame_slices() */
+        encoder->quality = quality;
+    } else {
+        spice_jpeg_mem_dest(&encoder->cinfo, &buffer->base.data, &buffer->maxsize);
+
+        jpeg_set_defaults(&encoder->cinfo);
+        encoder->cinfo.dct_method       = JDCT_IFAST;
+        jpeg_set_quality(&encoder->cinfo, quality, TRUE);
+        jpeg_start_compress(&encoder->cinfo, encoder->first_frame);
+    }
 
     encoder->num_frames++;
     encoder->avg_quality += quality;
     return VIDEO_ENCODER_FRAME_ENCODE_DONE;
 }
 
+/* Returns the pixels to compress for the line-th line of the frame, in
+ * memory order. They are put in row if they need to be converted or if
+ * parts of the line are hidden, these being left black.
+ */
+static uint8_t *mjpeg_encoder_prepare_line(MJpegEncoder *encoder, uint8_t *src_pixels,
+                                           uint32_t line, uint8_t *row)
+{
+    const VideoVisibleRegion *region = &encoder->visible_region;
+    const uint32_t width = encoder->cinfo.image_width;
+    const uint32_t row_bpp = encoder->cinfo.input_components;
+    uint32_t y, x, end;
+
+    if (!region->clipped && !encoder->pixel_converter) {
+        return src_pixels;
+    }
+    if (region->clipped) {
+        memset(row, 0, width * row_bpp);
+    }
+
+    y = encoder->top_down ? line : encoder->cinfo.image_height - 1 - line;
+    x = 0;
+    while (video_visible_region_next_span(region, y, width, &x, &end)) {
+        uint8_t *src = src_pixels + x * encoder->bytes_per_pixel;
+        uint8_t *dest = row + x * row_bpp;
+
+        if (encoder->pixel_converter) {
+            for (; x < end; x++) {
+                /* src_pixels is expected to be 4 bytes aligned */
+                encoder->pixel_converter(src, dest);
+                dest += 3;
+                src += encoder->bytes_per_pixel;
+            }
+        } else {
+            memcpy(dest, src, (end - x) * row_bpp);
+            x = end;
+        }
+    }
+    return row;
+}
+
 static int mjpeg_encoder_encode_scanline(MJpegEncoder *encoder,
                                          uint8_t *src_pixels,
-                                         size_t image_width)
+                                         uint32_t line)
 {
     unsigned int scanlines_written;
     uint8_t *row;
 
-    row = encoder->row;
-    if (encoder->pixel_converter) {
-        unsigned int x;
-        for (x = 0; x < image_width; x++) {
-            /* src_pixels is expected to be 4 bytes aligned */
-            encoder->pixel_converter(src_pixels, row);
-            row += 3;
-            src_pixels += encoder->bytes_per_pixel;
-        }
-        scanlines_written = jpeg_write_scanlines(&encoder->cinfo, &encoder->row, 1);
-    } else {
-        scanlines_written = jpeg_write_scanlines(&encoder->cinfo, &src_pixels, 1);
-    }
+    row = mjpeg_encoder_prepare_line(encoder, src_pixels, line, encoder->row);
+    scanlines_written = jpeg_write_scanlines(&encoder->cinfo, &row, 1);
     if (scanlines_written == 0) { /* Not enough space */
         jpeg_abort_compress(&encoder->cinfo);
         encoder->rate_control.last_enc_size = 0;
@@ -850,31 +909,30 @@ static int mjpeg_encoder_encode_scanline(MJpegEncoder *encoder,
     return scanlines_written;
 }
 
-static size_t mjpeg_encoder_end_frame(MJpegEncoder *encoder)
+static size_t mjpeg_encoder_end_frame(MJpegEncoder *encoder, MJpegVideoBuffer *buffer)
 {
-    mem_destination_mgr *dest = (mem_destination_mgr *) encoder->cinfo.dest;
     MJpegEncoderRateControl *rate_control = &encoder->rate_control;
 
-    jpeg_finish_compress(&encoder->cinfo);
+    if (encoder->num_slices > 1) {
+        /* the slices were already joined in buffer */
+        rate_control->last_enc_size = buffer->base.size;
+    } else {
+        mem_destination_mgr *dest = (mem_destination_mgr *) encoder->cinfo.dest;
 
-    encoder->first_frame = FALSE;
-    rate_control->last_enc_size = dest->pub.next_output_byte - dest->buffer;
-    rate_control->server_state.num_frames_encoded++;
+        jpeg_finish_compress(&encoder->cinfo);
 
-    if (!rate_control->during_quality_eval ||
-        rate_control->quality_eval_data.reason == MJPEG_QUALITY_EVAL_REASON_SIZE_CHANGE) {
+        encoder->first_frame = FALSE;
+        rate_control->last_enc_size = dest->pub.next_output_byte - dest->buffer;
+    }
 
-        if (!rate_control->during_quality_eval) {
-            if (rate_control->num_recent_enc_frames >= MJPEG_AVERAGE_SIZE_WINDOW) {
-                rate_control->num_recent_enc_frames = 0;
-                rate_control->sum_recent_enc_size = 0;
-            }
-            rate_control->sum_recent_enc_size += rate_control->last_enc_size;
-            rate_control->num_recent_enc_frames++;
-            rate_control->adjusted_fps_num_frames++;
+    if (!rate_control->during_quality_eval) {
+        if (rate_control->num_recent_enc_frames >= MJPEG_AVERAGE_SIZE_WINDOW) {
+            rate_control->num_recent_enc_frames = 0;
+            rate_control->sum_recent_enc_size = 0;
         }
-        rate_control->bit_rate_info.sum_enc_size += encoder->rate_control.last_enc_size;
-        rate_control->bit_rate_info.num_enc_frames++;
+        rate_control->sum_recent_enc_size += rate_control->last_enc_size;
+        rate_control->num_recent_enc_frames++;
+        rate_control->adjusted_fps_num_frames++;
     }
     return encoder->rate_control.last_enc_size;
 }
@@ -924,7 +982,6 @@ static bool encode_frame(MJpegEncoder *encoder, const SpiceRect *src,
     }
 
     const unsigned int stream_height = src->bottom - src->top;
-    const unsigned int stream_width = src->right - src->left;
 
     for (i = 0; i < stream_height; i++) {
         uint8_t *src_line = get_image_line(chunks, &offset, &chunk, image_stride);
@@ -934,7 +991,7 @@ static bool encode_frame(MJpegEncoder *encoder, const SpiceRect *src,
         }
 
         src_line += src->left * mjpeg_encoder_get_bytes_per_pixel(encoder);
-        if (mjpeg_encoder_encode_scanline(encoder, src_line, stream_width) == 0) {
+        if (mjpeg_encoder_encode_scanline(encoder, src_line, i) == 0) {
             return FALSE;
         }
     }
@@ -942,6 +999,223 @@ static bool encode_frame(MJpegEncoder *encoder, const SpiceRect *src,
     return TRUE;
 }
 
+static void mjpeg_slice_encode(MJpegSlice *slice)
+{
+    MJpegEncoder *encoder = slice->encoder;
+    struct jpeg_compress_struct *cinfo = &slice->cinfo;
+    uint8_t **lines = encoder->lines + slice->first_line;
+    mem_destination_mgr *dest;
+
+    if (!slice->initialized) {
+        cinfo->err = jpeg_std_error(&slice->jerr);
+        jpeg_create_compress(cinfo);
+        slice->maxsize = MJPEG_INITIAL_BUFFER_SIZE;
+        slice->data = (uint8_t*) g_malloc(slice->maxsize);
+        slice->initialized = TRUE;
+    }
+
+    cinfo->in_color_space = encoder->cinfo.in_color_space;
+    cinfo->input_components = encoder->cinfo.input_components;
+    cinfo->image_width = encoder->cinfo.image_width;
+    cinfo->image_height = slice->num_lines;
+    spice_jpeg_mem_dest(cinfo, &slice->data, &slice->maxsize);
+
+    jpeg_set_defaults(cinfo);
+    cinfo->dct_method = JDCT_IFAST;
+    jpeg_set_quality(cinfo, encoder->quality, TRUE);
+    /* A slice is a single restart interval, this only matters for the
+     * header of the first slice which becomes the header of the frame */
+    cinfo->restart_interval = encoder->restart_interval;
+    jpeg_start_compress(cinfo, TRUE);
+
+    if (encoder->pixel_converter || encoder->visible_region.clipped) {
+        uint32_t stride = cinfo->image_width * cinfo->input_components;
+        uint32_t i;
+
+        if (slice->row_size < stride) {
+            slice->row = (uint8_t*) g_realloc(slice->row, stride);
+            slice->row_size = stride;
+        }
+        for (i = 0; i < slice->num_lines; i++) {
+            uint8_t *row = mjpeg_encoder_prepare_line(encoder, lines[i],
+                                                      slice->first_line + i, slice->row);
+            jpeg_write_scanlines(cinfo, &row, 1);
+        }
+    } else {
+        while (cinfo->next_scanline < cinfo->image_height) {
+            jpeg_write_scanlines(cinfo, lines + cinfo->next_scanline,
+                                 cinfo->image_height - cinfo->next_scanline);
+        }
+    }
+    jpeg_finish_compress(cinfo);
+
+    dest = (mem_destination_mgr *) cinfo->dest;
+    slice->size = dest->pub.next_output_byte - dest->buffer;
+}
+
+static void mjpeg_slice_job(gpointer data, gpointer user_data)
+{
+    MJpegSlice *slice = data;
+    MJpegEncoder *encoder = slice->encoder;
+
+    mjpeg_slice_encode(slice);
+
+    pthread_mutex_lock(&encoder->slices_mutex);
+    if (--encoder->slices_pending == 0) {
+        pthread_cond_signal(&encoder->slices_cond);
+    }
+    pthread_mutex_unlock(&encoder->slices_mutex);
+}
+
+/* The threads compressing the slices, shared by all the encoders */
+static GThreadPool *mjpeg_get_slice_pool(void)
+{
+    static gsize initialized = 0;
+    static GThreadPool *pool = NULL;
+
+    if (g_once_init_enter(&initialized)) {
+        pool = g_thread_pool_new(mjpeg_slice_job, NULL, MJPEG_MAX_SLICES - 1, FALSE, NULL);
+        g_once_init_leave(&initialized, 1);
+    }
+    return pool;
+}
+
+/* Returns the offset of the entropy coded data of a JPEG image written by
+ * libjpeg or 0 on error. If height is not 0 it replaces the image height
+ * in the frame header. */
+static size_t mjpeg_find_scan_data(uint8_t *data, size_t size, uint32_t height)
+{
+    size_t pos = 2; /* skip SOI */
+
+    while (pos + 4 <= size && data[pos] == 0xff) {
+        uint8_t marker = data[pos + 1];
+        size_t len = (data[pos + 2] << 8) | data[pos + 3];
+
+        if (height && (marker == 0xc0 || marker == 0xc1) && pos + 7 <= size) {
+            /* SOF0 or SOF1 */
+            data[pos + 5] = height >> 8;
+            data[pos + 6] = height & 0xff;
+        }
+        pos += 2 + len;
+        if (marker == 0xda) {
+            /* SOS, the scan data follows */
+            return pos + 2 <= size ? pos : 0;
+        }
+    }
+    return 0;
+}
+
+/* Joins the compressed slices in a single JPEG image: the first slice with
+ * the height of the frame, then the entropy coded data of the other slices,
+ * each starting with a restart marker. */
+static bool mjpeg_encoder_join_slices(MJpegEncoder *encoder, MJpegVideoBuffer *buffer)
+{
+    MJpegSlice *first = &encoder->slices[0];
+    size_t size;
+    uint8_t *out;
+    uint32_t i;
+
+    if (!mjpeg_find_scan_data(first->data, first->size, encoder->cinfo.image_height)) {
+        return FALSE;
+    }
+    size = first->size; /* including the EOI marker */
+    for (i = 1; i < encoder->num_slices; i++) {
+        MJpegSlice *slice = &encoder->slices[i];
+
+        slice->scan_offset = mjpeg_find_scan_data(slice->data, slice->size, 0);
+        if (!slice->scan_offset) {
+            return FALSE;
+        }
+        /* the scan data without the EOI marker, with a restart marker */
+        size += slice->size - slice->scan_offset;
+    }
+
+    if (buffer->maxsize < size) {
+        out = (uint8_t*) g_try_realloc(buffer->base.data, size);
+        if (!out) {
+            return FALSE;
+        }
+        buffer->base.data = out;
+        buffer->maxsize = size;
+    }
+
+    out = buffer->base.data;
+    memcpy(out, first->data, first->size - 2);
+    out += first->size - 2;
+    for (i = 1; i < encoder->num_slices; i++) {
+        MJpegSlice *slice = &encoder->slices[i];
+        size_t scan_size = slice->size - 2 - slice->scan_offset;
+
+        *out++ = 0xff;
+        *out++ = 0xd0 + ((i - 1) & 7); /* RSTn */
+        memcpy(out, slice->data + slice->scan_offset, scan_size);
+        out += scan_size;
+    }
+    *out++ = 0xff;
+    *out++ = 0xd9; /* EOI */
+    buffer->base.size = size;
+    return TRUE;
+}
+
+static bool encode_frame_slices(MJpegEncoder *encoder, const SpiceRect *src,
+                                const SpiceBitmap *image, int top_down,
+                                MJpegVideoBuffer *buffer)
+{
+    GThreadPool *pool = mjpeg_get_slice_pool();
+    SpiceChunks *chunks;
+    uint32_t image_stride;
+    size_t offset;
+    int i, chunk;
+
+    chunks = image->data;
+    offset = 0;
+    chunk = 0;
+    image_stride = image->stride;
+
+    const int skip_lines = top_down ? src->top : image->y - (src->bottom - 0);
+    for (i = 0; i < skip_lines; i++) {
+        get_image_line(chunks, &offset, &chunk, image_stride);
+    }
+
+    /* Locate all the lines first, the chunks can only be walked in order */
+    const unsigned int stream_height = src->bottom - src->top;
+    if (encoder->lines_size < stream_height) {
+        encoder->lines = g_renew(uint8_t *, encoder->lines, stream_height);
+        encoder->lines_size = stream_height;
+    }
+    for (i = 0; i < stream_height; i++) {
+        uint8_t *src_line = get_image_line(chunks, &offset, &chunk, image_stride);
+
+        if (!src_line) {
+            return FALSE;
+        }
+        encoder->lines[i] = src_line + src->left * mjpeg_encoder_get_bytes_per_pixel(encoder);
+    }
+
+    for (i = 0; i < encoder->num_slices; i++) {
+        MJpegSlice *slice = &encoder->slices[i];
+
+        slice->encoder = encoder;
+        slice->first_line = i * encoder->slice_height;
+        slice->num_lines = MIN(encoder->slice_height, stream_height - slice->first_line);
+    }
+
+    /* The first slice is compressed by this thread */
+    encoder->slices_pending = encoder->num_slices - 1;
+    for (i = 1; i < encoder->num_slices; i++) {
+        g_thread_pool_push(pool, &encoder->slices[i], NULL);
+    }
+    mjpeg_slice_encode(&encoder->slices[0]);
+
+    pthread_mutex_lock(&encoder->slices_mutex);
+    while (encoder->slices_pending > 0) {
+        pthread_cond_wait(&encoder->slices_cond, &encoder->slices_mutex);
+    }
+    pthread_mutex_unlock(&encoder->slices_mutex);
+
+    return mjpeg_encoder_join_slices(encoder, buffer);
+}
+
 static VideoEncodeResults
 mjpeg_encoder_encode_frame(VideoEncoder *video_encoder,
                            uint32_t frame_mm_time,
@@ -951,17 +1225,33 @@ mjpeg_encoder_encode_frame(VideoEncoder *video_encoder,
                            VideoBuffer **outbuf)
 {
     MJpegEncoder *encoder = SPICE_CONTAINEROF(video_encoder, MJpegEncoder, base);
+
+    /* the frames are compressed as 24 bit RGB */
+    video_rate_control_set_video_format(&encoder->video_rate_control,
+                                        src->right - src->left, src->bottom - src->top,
+                                        24, frame_mm_time);
+    if (video_rate_control_drop_frame(&encoder->video_rate_control, frame_mm_time)) {
+        return VIDEO_ENCODER_FRAME_DROP;
+    }
+
     MJpegVideoBuffer *buffer = create_mjpeg_video_buffer();
     if (!buffer) {
         return VIDEO_ENCODER_FRAME_UNSUPPORTED;
     }
 
+    uint64_t start = spice_get_monotonic_time_ns();
+    encoder->top_down = top_down;
     VideoEncodeResults ret = mjpeg_encoder_start_frame(encoder, (SpiceBitmapFmt) bitmap->format,
-                                                       src, buffer, frame_mm_time);
+                                                       src, buffer);
     if (ret == VIDEO_ENCODER_FRAME_ENCODE_DONE) {
-        if (encode_frame(encoder, src, bitmap, top_down)) {
-            buffer->base.size = mjpeg_encoder_end_frame(encoder);
+        if (encoder->num_slices > 1 ?
+            encode_frame_slices(encoder, src, bitmap, top_down, buffer) :
+            encode_frame(encoder, src, bitmap, top_down)) {
+            buffer->base.size = mjpeg_encoder_end_frame(encoder, buffer);
             *outbuf = (VideoBuffer*)buffer;
+            video_rate_control_add_frame(&encoder->video_rate_control, frame_mm_time,
+                                         spice_get_monotonic_time_ns() - start,
+                                         buffer->base.size);
         } else {
             ret = VIDEO_ENCODER_FRAME_UNSUPPORTED;
         }
@@ -1006,201 +1296,42 @@ static void mjpeg_encoder_quality_eval_stop(MJpegEncoder *encoder)
                 mjpeg_quality_samples[rate_control->quality_id], rate_control->fps);
 }
 
-static void mjpeg_encoder_decrease_bit_rate(MJpegEncoder *encoder)
-{
-    MJpegEncoderRateControl *rate_control = &encoder->rate_control;
-    MJpegEncoderBitRateInfo *bit_rate_info = &rate_control->bit_rate_info;
-    uint64_t measured_byte_rate;
-    uint32_t measured_fps;
-    uint64_t decrease_size;
-
-    mjpeg_encoder_quality_eval_stop(encoder);
-
-    rate_control->client_state.max_video_latency = 0;
-    rate_control->client_state.max_audio_latency = 0;
-    if (rate_control->warmup_start_time) {
-        uint64_t now;
-
-        now = spice_get_monotonic_time_ns();
-        if (now - rate_control->warmup_start_time < MJPEG_WARMUP_TIME) {
-            spice_debug("during warmup. ignoring");
-            return;
-        }
-        rate_control->warmup_start_time = 0;
-    }
-
-    if (bit_rate_info->num_enc_frames > MJPEG_BIT_RATE_EVAL_MIN_NUM_FRAMES ||
-        bit_rate_info->num_enc_frames > rate_control->fps) {
-        double duration_sec;
-
-        duration_sec = (bit_rate_info->last_frame_time - bit_rate_info->change_start_time);
-        duration_sec /= NSEC_PER_SEC;
-        measured_byte_rate = bit_rate_info->sum_enc_size / duration_sec;
-        measured_fps = bit_rate_info->num_enc_frames / duration_sec;
-        decrease_size = bit_rate_info->sum_enc_size / bit_rate_info->num_enc_frames;
-        spice_debug("bit rate estimation %.2f (Mbps) fps %u",
-                    measured_byte_rate*8/1024.0/1024,
-                    measured_fps);
-    } else {
-        measured_byte_rate = rate_control->byte_rate;
-        measured_fps = rate_control->fps;
-        decrease_size = measured_byte_rate/measured_fps;
-        spice_debug("bit rate not re-estimated %.2f (Mbps) fps %u",
-                    measured_byte_rate*8/1024.0/1024,
-                    measured_fps);
-    }
-
-    measured_byte_rate = MIN(rate_control->byte_rate, measured_byte_rate);
-
-    if (decrease_size >=  measured_byte_rate) {
-        decrease_size = measured_byte_rate / 2;
-    }
-
-    rate_control->byte_rate = measured_byte_rate - decrease_size;
-    bit_rate_info->change_start_time = 0;
-    bit_rate_info->change_start_mm_time = 0;
-    bit_rate_info->last_frame_time = 0;
-    bit_rate_info->num_enc_frames = 0;
-    bit_rate_info->sum_enc_size = 0;
-    bit_rate_info->was_upgraded = FALSE;
-
-    spice_debug("decrease bit rate %.2f (Mbps)", rate_control->byte_rate * 8 / 1024.0/1024.0);
-    mjpeg_encoder_quality_eval_set_downgrade(encoder,
-                                             MJPEG_QUALITY_EVAL_REASON_RATE_CHANGE,
-                                             rate_control->quality_id,
-                                             rate_control->fps);
-}
-
-static void mjpeg_encoder_handle_negative_client_stream_report(MJpegEncoder *encoder,
-                                                               uint32_t report_end_frame_mm_time)
-{
-    MJpegEncoderRateControl *rate_control = &encoder->rate_control;
-
-    spice_debug("trace");
-
-    if ((rate_control->bit_rate_info.change_start_mm_time > report_end_frame_mm_time ||
-        !rate_control->bit_rate_info.change_start_mm_time) &&
-         !rate_control->bit_rate_info.was_upgraded) {
-        spice_debug("ignoring, a downgrade has already occurred later to the report time");
-        return;
-    }
-
-    mjpeg_encoder_decrease_bit_rate(encoder);
-}
-
-static void mjpeg_encoder_increase_bit_rate(MJpegEncoder *encoder)
-{
-    MJpegEncoderRateControl *rate_control = &encoder->rate_control;
-    MJpegEncoderBitRateInfo *bit_rate_info = &rate_control->bit_rate_info;
-    uint64_t measured_byte_rate;
-    uint32_t measured_fps;
-    uint64_t increase_size;
-
-
-    if (bit_rate_info->num_enc_frames > MJPEG_BIT_RATE_EVAL_MIN_NUM_FRAMES ||
-        bit_rate_info->num_enc_frames > rate_control->fps) {
-        uint64_t avg_frame_size;
-        double duration_sec;
-
-        duration_sec = (bit_rate_info->last_frame_time - bit_rate_info->change_start_time);
-        duration_sec /= NSEC_PER_SEC;
-        measured_byte_rate = bit_rate_info->sum_enc_size / duration_sec;
-        measured_fps = bit_rate_info->num_enc_frames / duration_sec;
-        avg_frame_size = bit_rate_info->sum_enc_size / bit_rate_info->num_enc_frames;
-        spice_debug("bit rate estimation %.2f (Mbps) defined %.2f"
-                    " fps %u avg-frame-size=%.2f (KB)",
-                    measured_byte_rate*8/1024.0/1024,
-                    rate_control->byte_rate*8/1024.0/1024,
-                    measured_fps,
-                    avg_frame_size/1024.0);
-        increase_size = avg_frame_size;
-    } else {
-        spice_debug("not enough samples for measuring the bit rate. no change");
-        return;
-    }
-
-
-    mjpeg_encoder_quality_eval_stop(encoder);
-
-    if (measured_byte_rate + increase_size < rate_control->byte_rate) {
-        spice_debug("measured byte rate is small: not upgrading, just re-evaluating");
-    } else {
-        rate_control->byte_rate = MIN(measured_byte_rate, rate_control->byte_rate) + increase_size;
-    }
-
-    bit_rate_info->change_start_time = 0;
-    bit_rate_info->change_start_mm_time = 0;
-    bit_rate_info->last_frame_time = 0;
-    bit_rate_info->num_enc_frames = 0;
-    bit_rate_info->sum_enc_size = 0;
-    bit_rate_info->was_upgraded = TRUE;
-
-    spice_debug("increase bit rate %.2f (Mbps)", rate_control->byte_rate * 8 / 1024.0/1024.0);
-    mjpeg_encoder_quality_eval_set_upgrade(encoder,
-                                           MJPEG_QUALITY_EVAL_REASON_RATE_CHANGE,
-                                           rate_control->quality_id,
-                                           rate_control->fps);
-}
-
-static void mjpeg_encoder_handle_positive_client_stream_report(MJpegEncoder *encoder,
-                                                               uint32_t report_start_frame_mm_time)
+/*
+ * The video rate control callback: the quality and frame rate are
+ * re-evaluated for the new bit rate.
+ */
+static bool mjpeg_encoder_set_video_bit_rate(void *opaque, uint64_t bit_rate)
 {
+    MJpegEncoder *encoder = (MJpegEncoder*)opaque;
     MJpegEncoderRateControl *rate_control = &encoder->rate_control;
-    MJpegEncoderBitRateInfo *bit_rate_info = &rate_control->bit_rate_info;
-    int stable_client_mm_time;
-    int timeout;
+    uint64_t byte_rate = bit_rate / 8;
 
     if (rate_control->during_quality_eval &&
-        rate_control->quality_eval_data.reason == MJPEG_QUALITY_EVAL_REASON_RATE_CHANGE) {
-        spice_debug("during quality evaluation (rate change). ignoring report");
-        return;
+        rate_control->quality_eval_data.type == MJPEG_QUALITY_EVAL_TYPE_SET) {
+        /* the initial evaluation is not over yet, it uses the new rate */
+        rate_control->byte_rate = byte_rate;
+        return true;
     }
 
-    if ((rate_control->fps > MJPEG_IMPROVE_QUALITY_FPS_STRICT_TH ||
-         rate_control->fps >= mjpeg_encoder_get_source_fps(encoder)) &&
-         rate_control->quality_id > MJPEG_QUALITY_SAMPLE_NUM / 2) {
-        timeout = MJPEG_CLIENT_POSITIVE_REPORT_STRICT_TIMEOUT;
+    mjpeg_encoder_quality_eval_stop(encoder);
+    if (byte_rate < rate_control->byte_rate) {
+        spice_debug("decrease bit rate %.2f (Mbps)", byte_rate * 8 / 1024.0 / 1024.0);
+        mjpeg_encoder_quality_eval_set_downgrade(encoder,
+                                                 MJPEG_QUALITY_EVAL_REASON_RATE_CHANGE,
+                                                 rate_control->quality_id,
+                                                 rate_control->fps);
     } else {
-        timeout = MJPEG_CLIENT_POSITIVE_REPORT_TIMEOUT;
-    }
-
-    stable_client_mm_time = (int)report_start_frame_mm_time - bit_rate_info->change_start_mm_time;
-
-    if (!bit_rate_info->change_start_mm_time || stable_client_mm_time < timeout) {
-        /* assessing the stability of the current setting and only then
-         * respond to the report */
-        spice_debug("no drops, but not enough time has passed for assessing "
-                    "the playback stability since the last bit rate change");
-        return;
-    }
-    mjpeg_encoder_increase_bit_rate(encoder);
-}
-
-/*
- * the video playback jitter buffer should be at least (send_time*2 + net_latency) for
- * preventing underflow
- */
-static uint32_t get_min_required_playback_delay(const MJpegEncoder *encoder,
-                                                uint64_t frame_enc_size)
-{
-    uint64_t byte_rate = encoder->rate_control.byte_rate;
-    uint32_t latency = mjpeg_encoder_get_latency(encoder);
-    uint32_t one_frame_time;
-    uint32_t min_delay;
-
-    if (!frame_enc_size || !byte_rate) {
-        return latency;
+        spice_debug("increase bit rate %.2f (Mbps)", byte_rate * 8 / 1024.0 / 1024.0);
+        mjpeg_encoder_quality_eval_set_upgrade(encoder,
+                                               MJPEG_QUALITY_EVAL_REASON_RATE_CHANGE,
+                                               rate_control->quality_id,
+                                               rate_control->fps);
     }
-    one_frame_time = (frame_enc_size * MSEC_PER_SEC) / byte_rate;
-
-    min_delay = MIN(one_frame_time*2 + latency, MJPEG_MAX_CLIENT_PLAYBACK_DELAY);
-    return min_delay;
+    rate_control->byte_rate = byte_rate;
+    rate_control->last_frame_time = 0;
+    return true;
 }
 
-#define MJPEG_PLAYBACK_LATENCY_DECREASE_FACTOR 0.5
-#define MJPEG_VIDEO_VS_AUDIO_LATENCY_FACTOR 1.25
-#define MJPEG_VIDEO_DELAY_TH -15
-
 static void mjpeg_encoder_client_stream_report(VideoEncoder *video_encoder,
                                                uint32_t num_frames,
                                                uint32_t num_drops,
@@ -1210,144 +1341,22 @@ static void mjpeg_encoder_client_stream_report(VideoEncoder *video_encoder,
                                                uint32_t audio_delay)
 {
     MJpegEncoder *encoder = SPICE_CONTAINEROF(video_encoder, MJpegEncoder, base);
-    MJpegEncoderRateControl *rate_control = &encoder->rate_control;
-    MJpegEncoderClientState *client_state = &rate_control->client_state;
-    uint64_t avg_enc_size = 0;
-    uint32_t min_playback_delay;
-    int is_video_delay_small = FALSE;
-
-    spice_debug("client report: #frames %u, #drops %d, duration %u video-delay %d audio-delay %u",
-                num_frames, num_drops,
-                end_frame_mm_time - start_frame_mm_time,
-                end_frame_delay, audio_delay);
-
-    if (rate_control->during_quality_eval) {
-        if (rate_control->quality_eval_data.type == MJPEG_QUALITY_EVAL_TYPE_DOWNGRADE &&
-            rate_control->quality_eval_data.reason == MJPEG_QUALITY_EVAL_REASON_RATE_CHANGE) {
-            spice_debug("during rate downgrade evaluation");
-            return;
-        }
-    }
-
-    if (rate_control->num_recent_enc_frames) {
-        avg_enc_size = rate_control->sum_recent_enc_size /
-                       rate_control->num_recent_enc_frames;
-    }
-    spice_debug("recent size avg %.2f (KB)", avg_enc_size / 1024.0);
-    min_playback_delay = get_min_required_playback_delay(encoder, avg_enc_size);
-    spice_debug("min-delay %u client-delay %d", min_playback_delay, end_frame_delay);
-
-    if (min_playback_delay > end_frame_delay) {
-        uint32_t src_fps = mjpeg_encoder_get_source_fps(encoder);
-        /*
-        * if the stream is at its highest rate, we can't estimate the "real"
-        * network bit rate and the min_playback_delay
-        */
-        if (rate_control->quality_id != MJPEG_QUALITY_SAMPLE_NUM - 1 ||
-            rate_control->fps < MIN(src_fps, MJPEG_MAX_FPS) || end_frame_delay < 0) {
-            is_video_delay_small = TRUE;
-            if (encoder->cbs.update_client_playback_delay) {
-                encoder->cbs.update_client_playback_delay(encoder->cbs.opaque,
-                                                          min_playback_delay);
-            }
-        }
-    }
-
-
-    /*
-     * If the audio latency has decreased (since the start of the current
-     * sequence of positive reports), and the video latency is bigger, slow down
-     * the video rate
-     */
-    if (end_frame_delay > 0 &&
-        audio_delay < MJPEG_PLAYBACK_LATENCY_DECREASE_FACTOR*client_state->max_audio_latency &&
-        end_frame_delay > MJPEG_VIDEO_VS_AUDIO_LATENCY_FACTOR*audio_delay) {
-        spice_debug("video_latency >> audio_latency && audio_latency << max (%u)",
-                    client_state->max_audio_latency);
-        mjpeg_encoder_handle_negative_client_stream_report(encoder,
-                                                           end_frame_mm_time);
-        return;
-    }
-
-    if (end_frame_delay < MJPEG_VIDEO_DELAY_TH) {
-        mjpeg_encoder_handle_negative_client_stream_report(encoder,
-                                                           end_frame_mm_time);
-    } else {
-        double major_delay_decrease_thresh;
-        double medium_delay_decrease_thresh;
-
-        client_state->max_video_latency = MAX(end_frame_delay, client_state->max_video_latency);
-        client_state->max_audio_latency = MAX(audio_delay, client_state->max_audio_latency);
-
-        medium_delay_decrease_thresh = client_state->max_video_latency;
-        medium_delay_decrease_thresh *= MJPEG_PLAYBACK_LATENCY_DECREASE_FACTOR;
-
-        major_delay_decrease_thresh = medium_delay_decrease_thresh;
-        major_delay_decrease_thresh *= MJPEG_PLAYBACK_LATENCY_DECREASE_FACTOR;
-        /*
-         * since the bit rate and the required latency are only evaluation based on the
-         * reports we got till now, we assume that the latency is too low only if it
-         * was higher during the time that passed since the last report that resulted
-         * in a bit rate decrement. If we find that the latency has decreased, it might
-         * suggest that the stream bit rate is too high.
-         */
-        if ((end_frame_delay < medium_delay_decrease_thresh &&
-            is_video_delay_small) || end_frame_delay < major_delay_decrease_thresh) {
-            spice_debug("downgrade due to short video delay (last=%u, past-max=%u",
-                end_frame_delay, client_state->max_video_latency);
-            mjpeg_encoder_handle_negative_client_stream_report(encoder,
-                                                               end_frame_mm_time);
-        } else if (!num_drops) {
-            mjpeg_encoder_handle_positive_client_stream_report(encoder,
-                                                               start_frame_mm_time);
-
-        }
-    }
+    video_rate_control_client_stream_report(&encoder->video_rate_control,
+                                            num_frames, num_drops,
+                                            start_frame_mm_time, end_frame_mm_time,
+                                            end_frame_delay, audio_delay);
 }
 
 static void mjpeg_encoder_notify_server_frame_drop(VideoEncoder *video_encoder)
 {
     MJpegEncoder *encoder = SPICE_CONTAINEROF(video_encoder, MJpegEncoder, base);
-    encoder->rate_control.server_state.num_frames_dropped++;
-    mjpeg_encoder_process_server_drops(encoder);
-}
-
-/*
- * decrease the bit rate if the drop rate on the sever side exceeds a pre defined
- * threshold.
- */
-static void mjpeg_encoder_process_server_drops(MJpegEncoder *encoder)
-{
-    MJpegEncoderServerState *server_state = &encoder->rate_control.server_state;
-    uint32_t num_frames_total;
-    double drop_factor;
-    uint32_t fps;
-
-    fps = MIN(encoder->rate_control.fps, mjpeg_encoder_get_source_fps(encoder));
-    if (server_state->num_frames_encoded < fps * MJPEG_SERVER_STATUS_EVAL_FPS_INTERVAL) {
-        return;
-    }
-
-    num_frames_total = server_state->num_frames_dropped + server_state->num_frames_encoded;
-    drop_factor = ((double)server_state->num_frames_dropped) / num_frames_total;
-
-    spice_debug("#drops %u total %u fps %u src-fps %u",
-                server_state->num_frames_dropped,
-                num_frames_total,
-                encoder->rate_control.fps,
-                mjpeg_encoder_get_source_fps(encoder));
-
-    if (drop_factor > MJPEG_SERVER_STATUS_DOWNGRADE_DROP_FACTOR_TH) {
-        mjpeg_encoder_decrease_bit_rate(encoder);
-    }
-    server_state->num_frames_encoded = 0;
-    server_state->num_frames_dropped = 0;
+    video_rate_control_server_frame_drop(&encoder->video_rate_control);
 }
 
 static uint64_t mjpeg_encoder_get_bit_rate(VideoEncoder *video_encoder)
 {
     MJpegEncoder *encoder = SPICE_CONTAINEROF(video_encoder, MJpegEncoder, base);
-    return encoder->rate_control.byte_rate * 8;
+    return video_rate_control_get_effective_bit_rate(&encoder->video_rate_control);
 }
 
 static void mjpeg_encoder_get_stats(VideoEncoder *video_encoder,
@@ -1355,11 +1364,37 @@ static void mjpeg_encoder_get_stats(VideoEncoder *video_encoder,
 {
     MJpegEncoder *encoder = SPICE_CONTAINEROF(video_encoder, MJpegEncoder, base);
     spice_assert(encoder != NULL && stats != NULL);
-    stats->starting_bit_rate = encoder->starting_bit_rate;
+    stats->starting_bit_rate = encoder->video_rate_control.starting_bit_rate;
     stats->cur_bit_rate = mjpeg_encoder_get_bit_rate(video_encoder);
     stats->avg_quality = (double)encoder->avg_quality / encoder->num_frames;
 }
 
+static void mjpeg_encoder_set_visible_region(VideoEncoder *video_encoder,
+                                             const SpiceClipRects *visible)
+{
+    MJpegEncoder *encoder = SPICE_CONTAINEROF(video_encoder, MJpegEncoder, base);
+    video_visible_region_set(&encoder->visible_region, visible);
+}
+
+/* The maximum number of slices a frame is split in, one per processor
+ * unless set by the SPICE_MJPEG_SLICES environment variable */
+static uint32_t mjpeg_encoder_get_max_slices(void)
+{
+    const char *env_slices = getenv("SPICE_MJPEG_SLICES");
+    uint64_t max_slices = g_get_num_processors();
+
+    if (env_slices != NULL) {
+        char *end;
+
+        max_slices = g_ascii_strtoull(env_slices, &end, 10);
+        if (*end != '\0' || max_slices == 0) {
+            spice_warning("error parsing SPICE_MJPEG_SLICES: %s", env_slices);
+            max_slices = 1;
+        }
+    }
+    return MIN(max_slices, MJPEG_MAX_SLICES);
+}
+
 VideoEncoder *mjpeg_encoder_new(SpiceVideoCodecType codec_type,
                                 uint64_t starting_bit_rate,
                                 VideoEncoderRateControlCbs *cbs,
@@ -1377,20 +1412,29 @@ VideoEncoder *mjpeg_encoder_new(SpiceVideoCodecType codec_type,
     encoder->base.notify_server_frame_drop = mjpeg_encoder_notify_server_frame_drop;
     encoder->base.get_bit_rate = mjpeg_encoder_get_bit_rate;
     encoder->base.get_stats = mjpeg_encoder_get_stats;
+    /* all the frames are key frames */
+    encoder->base.request_key_frame = NULL;
+    encoder->base.set_visible_region = mjpeg_encoder_set_visible_region;
     encoder->base.codec_type = codec_type;
     encoder->first_frame = TRUE;
     encoder->rate_control.byte_rate = starting_bit_rate / 8;
-    encoder->starting_bit_rate = starting_bit_rate;
 
-    encoder->cbs = *cbs;
+    video_rate_control_init(&encoder->video_rate_control, cbs, starting_bit_rate, true,
+                            mjpeg_encoder_set_video_bit_rate, encoder);
     mjpeg_encoder_reset_quality(encoder, MJPEG_QUALITY_SAMPLE_NUM / 2, 5, 0);
     encoder->rate_control.during_quality_eval = TRUE;
     encoder->rate_control.quality_eval_data.type = MJPEG_QUALITY_EVAL_TYPE_SET;
     encoder->rate_control.quality_eval_data.reason = MJPEG_QUALITY_EVAL_REASON_RATE_CHANGE;
-    encoder->rate_control.warmup_start_time = spice_get_monotonic_time_ns();
 
     encoder->cinfo.err = jpeg_std_error(&encoder->jerr);
     jpeg_create_compress(&encoder->cinfo);
 
+    encoder->max_slices = mjpeg_encoder_get_max_slices();
+    if (encoder->max_slices > 1) {
+        encoder->slices = g_new0(MJpegSlice, encoder->max_slices);
+    }
+    pthread_mutex_init(&encoder->slices_mutex, NULL);
+    pthread_cond_init(&encoder->slices_cond, NULL);
+
     return (VideoEncoder*)encoder;
 }
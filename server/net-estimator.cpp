@@ -0,0 +1,71 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include "red-common.h"
+#include "net-estimator.h"
+
+/* the minimum round trip time is forgotten after this time so
+ * the estimate follows a path that got longer */
+#define NET_ESTIMATOR_RTT_WINDOW (NSEC_PER_SEC * 10)
+/* weight of a new bit rate sample is 1/2^NET_ESTIMATOR_RATE_SHIFT,
+ * the first samples are simply averaged */
+#define NET_ESTIMATOR_RATE_SHIFT 2
+/* intervals too short give meaningless rates */
+#define NET_ESTIMATOR_MIN_INTERVAL (NSEC_PER_MILLISEC)
+
+void NetEstimator::add_rtt_sample(uint64_t rtt_ns, uint64_t now_ns)
+{
+    if (rtt_ns == 0) {
+        return;
+    }
+    if (!has_rtt() || rtt_ns <= min_rtt_ns ||
+        now_ns - min_rtt_time_ns > NET_ESTIMATOR_RTT_WINDOW) {
+        min_rtt_ns = rtt_ns;
+        min_rtt_time_ns = now_ns ? now_ns : 1;
+    }
+}
+
+void NetEstimator::add_delivery_sample(uint64_t bytes, uint64_t interval_ns, bool app_limited)
+{
+    if (interval_ns < NET_ESTIMATOR_MIN_INTERVAL || bytes == 0) {
+        return;
+    }
+    add_bit_rate_sample(bytes * 8 * NSEC_PER_SEC / interval_ns, app_limited);
+}
+
+void NetEstimator::add_bit_rate_sample(uint64_t sample, bool app_limited)
+{
+    /* the sender did not use all the bandwidth, the real
+     * bandwidth is at least the sample */
+    if (app_limited && has_bit_rate() && sample <= bit_rate) {
+        return;
+    }
+
+    if (num_rate_samples < (1u << NET_ESTIMATOR_RATE_SHIFT)) {
+        num_rate_samples++;
+        bit_rate += ((int64_t) sample - (int64_t) bit_rate) / (int64_t) num_rate_samples;
+        return;
+    }
+    bit_rate += ((int64_t) sample - (int64_t) bit_rate) / (1 << NET_ESTIMATOR_RATE_SHIFT);
+}
+
+uint64_t NetEstimator::get_bit_rate() const
+{
+    return has_bit_rate() ? bit_rate : ~uint64_t{0};
+}
@@ -0,0 +1,69 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef NET_ESTIMATOR_H_
+#define NET_ESTIMATOR_H_
+
+#include <stdint.h>
+
+#include "push-visibility.h"
+
+/* Bit rate under which a client is considered on a low bandwidth network */
+#define NET_LOW_BANDWIDTH_BIT_RATE (10 * 1024 * 1024)
+/* Bit rate over which a low bandwidth client is considered on a high
+ * bandwidth network again, the gap avoids switching back and forth */
+#define NET_HIGH_BANDWIDTH_BIT_RATE (12 * 1024 * 1024)
+
+/**
+ * Continuous estimation of the bandwidth and round trip time
+ * of a network path, fed with samples measured while sending data.
+ *
+ * The round trip time is the minimum of the samples of the last
+ * NET_ESTIMATOR_RTT_WINDOW nanoseconds, the bandwidth a moving
+ * average of the delivery rate samples.
+ * Samples measured while the sender did not have enough data to
+ * fill the network (application limited) can only raise the
+ * bandwidth estimate.
+ */
+class NetEstimator
+{
+public:
+    /* add a round trip time sample, in nanoseconds */
+    void add_rtt_sample(uint64_t rtt_ns, uint64_t now_ns);
+    /* add a delivery rate sample, @bytes delivered in @interval_ns nanoseconds */
+    void add_delivery_sample(uint64_t bytes, uint64_t interval_ns, bool app_limited);
+    /* add a bit rate measured in other ways, like the network test */
+    void add_bit_rate_sample(uint64_t bit_rate, bool app_limited);
+
+    bool has_bit_rate() const { return num_rate_samples > 0; }
+    bool has_rtt() const { return min_rtt_time_ns != 0; }
+    /* bits per second, ~0 if not known */
+    uint64_t get_bit_rate() const;
+    /* nanoseconds, 0 if not known */
+    uint64_t get_min_rtt_ns() const { return min_rtt_ns; }
+
+private:
+    uint64_t bit_rate = 0;
+    unsigned num_rate_samples = 0;
+    uint64_t min_rtt_ns = 0;
+    uint64_t min_rtt_time_ns = 0;
+};
+
+#include "pop-visibility.h"
+
+#endif /* NET_ESTIMATOR_H_ */
@@ -28,6 +28,11 @@
 #include <netinet/ip.h>
 #include <netinet/tcp.h>
 #include <sys/socket.h>
+#include <sys/ioctl.h>
+#endif
+
+#ifdef HAVE_LINUX_SOCKIOS_H
+#include <linux/sockios.h> /* SIOCOUTQ */
 #endif
 
 #include <common/log.h>
@@ -181,6 +186,96 @@ int red_socket_get_no_delay(int fd)
     return delay_val;
 }
 
+/**
+ * red_socket_get_rtt:
+ * @fd: a socket file descriptor
+ * @rtt_us: where to store the smoothed round trip time
+ *
+ * Retrieve the round trip time estimated by the TCP stack.
+ *
+ * Returns: #true if the round trip time is known, #false otherwise
+ */
+bool red_socket_get_rtt(int fd, uint32_t *rtt_us)
+{
+#ifdef TCP_INFO
+    struct tcp_info info;
+    socklen_t info_size = sizeof(info);
+
+    if (getsockopt(fd, IPPROTO_TCP, TCP_INFO, &info, &info_size) == -1 ||
+        info.tcpi_rtt == 0) {
+        return false;
+    }
+    *rtt_us = info.tcpi_rtt;
+    return true;
+#else
+    return false;
+#endif
+}
+
+/**
+ * red_socket_get_send_queue_size:
+ * @fd: a socket file descriptor
+ *
+ * Returns: The number of bytes in the send queue of @fd, not sent or
+ * not acknowledged by the peer, -1 if not available
+ */
+int red_socket_get_send_queue_size(int fd)
+{
+#ifdef HAVE_LINUX_SOCKIOS_H
+    int size;
+
+    if (ioctl(fd, SIOCOUTQ, &size) == -1) {
+        return -1;
+    }
+    return size;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * red_socket_get_unsent_size:
+ * @fd: a socket file descriptor
+ *
+ * Unlike red_socket_get_send_queue_size() the data sent but not
+ * acknowledged yet are not counted, these are a round trip time
+ * worth of data on a busy connection.
+ *
+ * Returns: The number of bytes in the send queue of @fd not sent
+ * yet, -1 if not available
+ */
+int red_socket_get_unsent_size(int fd)
+{
+#if defined(HAVE_LINUX_SOCKIOS_H) && defined(SIOCOUTQNSD)
+    int size;
+
+    if (ioctl(fd, SIOCOUTQNSD, &size) == -1) {
+        return -1;
+    }
+    return size;
+#else
+    return -1;
+#endif
+}
+
+/**
+ * red_socket_set_send_buffer_size:
+ * @fd: a socket file descriptor
+ * @size: size of the send buffer
+ *
+ * Note that on Linux this disables the automatic tuning of the buffer.
+ *
+ * Returns: #true if the operation succeeded, #false otherwise.
+ */
+bool red_socket_set_send_buffer_size(int fd, int size)
+{
+    if (setsockopt(fd, SOL_SOCKET, SO_SNDBUF, (const void *) &size, sizeof(size)) != 0) {
+        spice_warning("setsockopt(SO_SNDBUF) failed, %s", strerror(errno));
+        return false;
+    }
+    return true;
+}
+
 /**
  * red_socket_set_nosigpipe
  * @fd: a socket file descriptor
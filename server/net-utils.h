@@ -19,6 +19,7 @@
 #define RED_NET_UTILS_H_
 
 #include <stdbool.h>
+#include <stdint.h>
 #include <spice/macros.h>
 
 SPICE_BEGIN_DECLS
@@ -26,6 +27,10 @@ SPICE_BEGIN_DECLS
 bool red_socket_set_keepalive(int fd, bool enable, int timeout);
 bool red_socket_set_no_delay(int fd, bool no_delay);
 int red_socket_get_no_delay(int fd);
+bool red_socket_get_rtt(int fd, uint32_t *rtt_us);
+int red_socket_get_send_queue_size(int fd);
+int red_socket_get_unsent_size(int fd);
+bool red_socket_set_send_buffer_size(int fd, int size);
 bool red_socket_set_non_blocking(int fd, bool non_blocking);
 void red_socket_set_nosigpipe(int fd, bool enable);
 
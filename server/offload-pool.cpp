@@ -0,0 +1,106 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include "red-common.h"
+#include "offload-pool.h"
+
+struct OffloadPool::Job {
+    JobFunc work;
+    JobFunc done;
+    JobFunc cancel;
+    void *opaque;
+    /* the completion was sent to the dispatcher */
+    bool posted;
+    /* cancelled by the destruction of the pool, the completion
+     * sent to the dispatcher must be ignored */
+    bool cancelled;
+    OffloadPool *pool;
+};
+
+OffloadPool::OffloadPool(Dispatcher *init_dispatcher, unsigned max_threads):
+    dispatcher(init_dispatcher),
+    stopping(false)
+{
+    pthread_mutex_init(&lock, nullptr);
+    pool = g_thread_pool_new(run_job, this, max_threads, FALSE, nullptr);
+    spice_assert(pool);
+}
+
+OffloadPool::~OffloadPool()
+{
+    /* the dispatcher thread is here, it would not read the completions */
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_mutex_unlock(&lock);
+
+    g_thread_pool_free(pool, TRUE, TRUE);
+
+    for (auto job : jobs) {
+        job->cancel(job->opaque);
+        if (job->posted) {
+            /* freed if the dispatcher handles the completion */
+            job->cancelled = true;
+        } else {
+            g_free(job);
+        }
+    }
+    jobs.clear();
+    pthread_mutex_destroy(&lock);
+}
+
+void OffloadPool::handle_done(void *opaque, Job **p_job)
+{
+    Job *job = *p_job;
+
+    if (job->cancelled) {
+        g_free(job);
+        return;
+    }
+    job->pool->jobs.remove(job);
+    job->done(job->opaque);
+    g_free(job);
+}
+
+void OffloadPool::run_job(void *data, void *pool_data)
+{
+    auto job = static_cast<Job *>(data);
+    auto self = static_cast<OffloadPool *>(pool_data);
+
+    job->work(job->opaque);
+
+    pthread_mutex_lock(&self->lock);
+    job->posted = !self->stopping;
+    pthread_mutex_unlock(&self->lock);
+    if (job->posted) {
+        self->dispatcher->send_message_custom(handle_done, &job, false);
+    }
+}
+
+void OffloadPool::push(JobFunc work, JobFunc done, JobFunc cancel, void *opaque)
+{
+    auto job = g_new0(Job, 1);
+
+    job->work = work;
+    job->done = done;
+    job->cancel = cancel;
+    job->opaque = opaque;
+    job->pool = this;
+    jobs.push_back(job);
+    g_thread_pool_push(pool, job, nullptr);
+}
@@ -0,0 +1,74 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef OFFLOAD_POOL_H_
+#define OFFLOAD_POOL_H_
+
+#include <list>
+#include <pthread.h>
+#include <glib.h>
+
+#include "dispatcher.h"
+#include "safe-list.hpp"
+
+#include "push-visibility.h"
+
+/**
+ * Pool of helper threads running CPU intensive jobs, like TLS
+ * handshakes or SASL steps, out of the thread handling the connections.
+ *
+ * The work function of a job runs in a helper thread, the done
+ * function then runs in the thread of @dispatcher, usually the main
+ * thread. The objects used by a job must not be accessed by the
+ * dispatcher thread until the done function is called.
+ * Jobs are pushed from the thread of the dispatcher.
+ */
+class OffloadPool
+{
+public:
+    SPICE_CXX_GLIB_ALLOCATOR
+
+    typedef void (*JobFunc)(void *opaque);
+
+    OffloadPool(Dispatcher *dispatcher, unsigned max_threads);
+    /* Waits for the running jobs, the jobs not started are dropped.
+     * The cancel function of the jobs whose done function was not
+     * called yet is called instead, to free the objects they use.
+     * Must be called from the thread of the dispatcher */
+    ~OffloadPool();
+
+    void push(JobFunc work, JobFunc done, JobFunc cancel, void *opaque);
+
+private:
+    struct Job;
+
+    static void run_job(void *data, void *pool_data);
+    static void handle_done(void *opaque, Job **job);
+
+    red::shared_ptr<Dispatcher> dispatcher;
+    GThreadPool *pool;
+    pthread_mutex_t lock;
+    /* jobs whose done function was not called yet */
+    std::list<Job *, red::Mallocator<Job *>> jobs;
+    /* the pool is deleted, completions are not posted anymore */
+    bool stopping;
+};
+
+#include "pop-visibility.h"
+
+#endif /* OFFLOAD_POOL_H_ */
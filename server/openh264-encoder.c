@@ -0,0 +1,572 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* H.264 video encoder based on the OpenH264 library, for builds which
+ * cannot depend on GStreamer and its plugins.
+ */
+#include <config.h>
+
+#include <inttypes.h>
+#include <stdbool.h>
+#include <wels/codec_api.h>
+
+#include "red-common.h"
+#include "video-encoder.h"
+#include "video-rate-control.h"
+#include "video-visible-region.h"
+#include "utils.h"
+
+
+/* Don't bother changing the OpenH264 bit rate if close enough. */
+#define OPENH264_VIDEO_BITRATE_MARGIN 0.05
+
+/* Give up encoding after this many consecutive errors, until the video
+ * format changes. */
+#define OPENH264_MAX_ERRORS 3
+
+typedef struct OpenH264Encoder {
+    VideoEncoder base;
+
+    /* ---------- Video characteristics ---------- */
+
+    uint32_t width;
+    uint32_t height;
+    SpiceBitmapFmt format;
+    uint32_t fps;
+
+    /* Number of consecutive frame encoding errors. */
+    uint32_t errors;
+
+    /* ---------- OpenH264 encoder ---------- */
+
+    /* NULL until the first frame, and after the video changed or a key
+     * frame was requested: a new encoder starts with a key frame.
+     */
+    ISVCEncoder *svc;
+
+    /* The I420 planes the bitmaps are converted to, reused for all the
+     * frames of the same size.
+     */
+    uint8_t *planes;
+    uint32_t luma_stride;
+    uint32_t chroma_stride;
+
+    /* Only the visible pixels are converted, the others keep their previous
+     * content so OpenH264 encodes them as skipped macroblocks.
+     */
+    VideoVisibleRegion visible_region;
+
+    /* OpenH264 follows the video bit rate closely but still needs frames
+     * to be dropped when the network bit rate goes down.
+     */
+    VideoRateControl rate_control;
+} OpenH264Encoder;
+
+
+/* Returns the source frame rate which may change at any time so don't store
+ * the result.
+ */
+static uint32_t get_source_fps(const OpenH264Encoder *encoder)
+{
+    return video_rate_control_get_source_fps(&encoder->rate_control);
+}
+
+static void free_svc_encoder(OpenH264Encoder *encoder)
+{
+    if (encoder->svc) {
+        (*encoder->svc)->Uninitialize(encoder->svc);
+        WelsDestroySVCEncoder(encoder->svc);
+        encoder->svc = NULL;
+    }
+}
+
+
+/* ---------- OpenH264 encoder ---------- */
+
+static bool create_svc_encoder(OpenH264Encoder *encoder)
+{
+    SEncParamExt param;
+    int format = videoFormatI420;
+    int log_level = WELS_LOG_ERROR;
+
+    if (WelsCreateSVCEncoder(&encoder->svc) != 0 || !encoder->svc) {
+        spice_warning("unable to create an OpenH264 encoder");
+        encoder->svc = NULL;
+        return false;
+    }
+
+    (*encoder->svc)->GetDefaultParams(encoder->svc, &param);
+    param.iUsageType = CAMERA_VIDEO_REAL_TIME;
+    param.iPicWidth = encoder->width;
+    param.iPicHeight = encoder->height;
+    param.iRCMode = RC_BITRATE_MODE;
+    param.iTargetBitrate = MIN(encoder->rate_control.video_bit_rate, INT32_MAX);
+    param.iMaxBitrate = UNSPECIFIED_BIT_RATE;
+    param.fMaxFrameRate = encoder->fps;
+    /* Frames are dropped by the bit rate control above */
+    param.bEnableFrameSkip = false;
+    /* Key frames are only sent when a client needs one */
+    param.uiIntraPeriod = 0;
+    param.iMultipleThreadIdc = 0; /* one thread per processor */
+    param.iSpatialLayerNum = 1;
+    param.sSpatialLayers[0].iVideoWidth = encoder->width;
+    param.sSpatialLayers[0].iVideoHeight = encoder->height;
+    param.sSpatialLayers[0].fFrameRate = encoder->fps;
+    param.sSpatialLayers[0].iSpatialBitrate = param.iTargetBitrate;
+    param.sSpatialLayers[0].iMaxSpatialBitrate = UNSPECIFIED_BIT_RATE;
+    param.sSpatialLayers[0].sSliceArgument.uiSliceMode = SM_SINGLE_SLICE;
+
+    (*encoder->svc)->SetOption(encoder->svc, ENCODER_OPTION_TRACE_LEVEL, &log_level);
+    if ((*encoder->svc)->InitializeExt(encoder->svc, &param) != 0 ||
+        (*encoder->svc)->SetOption(encoder->svc, ENCODER_OPTION_DATAFORMAT, &format) != 0) {
+        spice_warning("unable to initialize the OpenH264 encoder for %ux%u frames",
+                      encoder->width, encoder->height);
+        WelsDestroySVCEncoder(encoder->svc);
+        encoder->svc = NULL;
+        return false;
+    }
+    return true;
+}
+
+/* The rate control callback to change the video bit rate */
+static bool set_video_bit_rate(void *opaque, uint64_t bit_rate)
+{
+    OpenH264Encoder *encoder = (OpenH264Encoder*)opaque;
+    uint64_t video_bit_rate = encoder->rate_control.video_bit_rate;
+    SBitrateInfo info;
+
+    if (i64abs((int64_t)(bit_rate - video_bit_rate)) <=
+        video_bit_rate * OPENH264_VIDEO_BITRATE_MARGIN) {
+        return false;
+    }
+    if (!encoder->svc) {
+        /* create_svc_encoder() will pick it up */
+        return true;
+    }
+
+    memset(&info, 0, sizeof(info));
+    info.iLayer = SPATIAL_LAYER_ALL;
+    info.iBitrate = MIN(bit_rate, INT32_MAX);
+    if ((*encoder->svc)->SetOption(encoder->svc, ENCODER_OPTION_BITRATE, &info) != 0) {
+        spice_debug("unable to change the OpenH264 bit rate");
+    }
+    return true;
+}
+
+static void update_frame_rate(OpenH264Encoder *encoder)
+{
+    uint32_t fps = get_source_fps(encoder);
+    float frame_rate = fps;
+
+    if (fps == encoder->fps) {
+        return;
+    }
+    encoder->fps = fps;
+    if (encoder->svc) {
+        (*encoder->svc)->SetOption(encoder->svc, ENCODER_OPTION_FRAME_RATE, &frame_rate);
+    }
+}
+
+static inline uint8_t *get_image_line(SpiceChunks *chunks, size_t *offset,
+                                      int *chunk_nr, int stride)
+{
+    uint8_t *ret;
+    SpiceChunk *chunk;
+
+    chunk = &chunks->chunk[*chunk_nr];
+
+    if (*offset == chunk->len) {
+        if (*chunk_nr == chunks->num_chunks - 1) {
+            return NULL; /* Last chunk */
+        }
+        *offset = 0;
+        (*chunk_nr)++;
+        chunk = &chunks->chunk[*chunk_nr];
+    }
+
+    if (chunk->len - *offset < stride) {
+        spice_warning("bad chunk alignment");
+        return NULL;
+    }
+    ret = chunk->data + *offset;
+    *offset += stride;
+    return ret;
+}
+
+static inline void read_pixel(SpiceBitmapFmt format, const uint8_t *line, uint32_t x,
+                              int *r, int *g, int *b)
+{
+    switch (format) {
+    case SPICE_BITMAP_FMT_32BIT:
+    case SPICE_BITMAP_FMT_RGBA: {
+        uint32_t pixel = GUINT32_FROM_LE(((const uint32_t *)line)[x]);
+        *r = (pixel >> 16) & 0xff;
+        *g = (pixel >> 8) & 0xff;
+        *b = pixel & 0xff;
+        break;
+    }
+    case SPICE_BITMAP_FMT_24BIT:
+        line += x * 3;
+        *r = line[2];
+        *g = line[1];
+        *b = line[0];
+        break;
+    default: {
+        uint16_t pixel = GUINT16_FROM_LE(((const uint16_t *)line)[x]);
+        *r = ((pixel >> 7) & 0xf8) | ((pixel >> 12) & 0x7);
+        *g = ((pixel >> 2) & 0xf8) | ((pixel >> 7) & 0x7);
+        *b = ((pixel << 3) & 0xf8) | ((pixel >> 2) & 0x7);
+        break;
+    }
+    }
+}
+
+/* Converts the [x_start, x_end) pixels of two lines of the bitmap to
+ * BT.601 limited range I420, x_start and x_end being even.
+ */
+static void convert_lines(OpenH264Encoder *encoder, const uint8_t *line0,
+                          const uint8_t *line1, uint32_t left,
+                          uint32_t x_start, uint32_t x_end,
+                          uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v)
+{
+    const uint8_t *lines[2] = { line0, line1 };
+    uint8_t *luma[2] = { y0, y1 };
+    uint32_t x;
+    int i;
+
+    for (x = x_start; x < x_end; x += 2) {
+        int r_sum = 0, g_sum = 0, b_sum = 0;
+
+        for (i = 0; i < 4; i++) {
+            int r, g, b;
+            uint32_t pos = x + (i & 1);
+
+            read_pixel(encoder->format, lines[i >> 1], left + pos, &r, &g, &b);
+            luma[i >> 1][pos] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+            r_sum += r;
+            g_sum += g;
+            b_sum += b;
+        }
+        u[x / 2] = ((-38 * r_sum - 74 * g_sum + 112 * b_sum + 512) >> 10) + 128;
+        v[x / 2] = ((112 * r_sum - 94 * g_sum - 18 * b_sum + 512) >> 10) + 128;
+    }
+}
+
+/* The lines are read straight from the bitmap chunks, without copying
+ * the bitmap first.
+ */
+static bool convert_frame(OpenH264Encoder *encoder, const SpiceBitmap *bitmap,
+                          const SpiceRect *src, int top_down)
+{
+    SpiceChunks *chunks = bitmap->data;
+    size_t offset = 0;
+    int chunk = 0;
+    uint8_t *y_plane = encoder->planes;
+    uint8_t *u_plane = y_plane + encoder->luma_stride * encoder->height;
+    uint8_t *v_plane = u_plane + encoder->chroma_stride * encoder->height / 2;
+    uint32_t i, j;
+
+    const int skip_lines = top_down ? src->top : bitmap->y - src->bottom;
+    for (i = 0; i < skip_lines; i++) {
+        get_image_line(chunks, &offset, &chunk, bitmap->stride);
+    }
+
+    for (i = 0; i < encoder->height; i += 2) {
+        uint8_t *line0 = get_image_line(chunks, &offset, &chunk, bitmap->stride);
+        uint8_t *line1 = get_image_line(chunks, &offset, &chunk, bitmap->stride);
+
+        if (!line0 || !line1) {
+            return false;
+        }
+
+        /* The visible spans of both lines, in picture coordinates, are
+         * extended to the enclosing chroma samples.
+         */
+        uint32_t y = top_down ? i : encoder->height - 2 - i;
+        for (j = 0; j < 2; j++) {
+            uint32_t x = 0, end;
+            while (video_visible_region_next_span(&encoder->visible_region, y + j,
+                                                  encoder->width, &x, &end)) {
+                convert_lines(encoder, line0, line1, src->left,
+                              x & ~1u, SPICE_ALIGN(end, 2),
+                              y_plane + i * encoder->luma_stride,
+                              y_plane + (i + 1) * encoder->luma_stride,
+                              u_plane + i / 2 * encoder->chroma_stride,
+                              v_plane + i / 2 * encoder->chroma_stride);
+                x = end;
+            }
+        }
+    }
+    return true;
+}
+
+static void openh264_video_buffer_free(VideoBuffer *buffer)
+{
+    g_free(buffer->data);
+    g_free(buffer);
+}
+
+static VideoEncodeResults encode_frame(OpenH264Encoder *encoder, uint32_t frame_mm_time,
+                                       VideoBuffer **outbuf)
+{
+    SSourcePicture picture;
+    SFrameBSInfo info;
+    VideoBuffer *buffer;
+    uint32_t size = 0;
+    int layer, nal;
+
+    memset(&picture, 0, sizeof(picture));
+    picture.iColorFormat = videoFormatI420;
+    picture.iPicWidth = encoder->width;
+    picture.iPicHeight = encoder->height;
+    picture.iStride[0] = encoder->luma_stride;
+    picture.iStride[1] = picture.iStride[2] = encoder->chroma_stride;
+    picture.pData[0] = encoder->planes;
+    picture.pData[1] = picture.pData[0] + encoder->luma_stride * encoder->height;
+    picture.pData[2] = picture.pData[1] + encoder->chroma_stride * encoder->height / 2;
+    picture.uiTimeStamp = frame_mm_time;
+
+    memset(&info, 0, sizeof(info));
+    if ((*encoder->svc)->EncodeFrame(encoder->svc, &picture, &info) != cmResultSuccess) {
+        return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+    }
+    if (info.eFrameType == videoFrameTypeSkip || info.eFrameType == videoFrameTypeInvalid) {
+        return VIDEO_ENCODER_FRAME_DROP;
+    }
+
+    /* The NAL units of all the layers make the frame */
+    for (layer = 0; layer < info.iLayerNum; layer++) {
+        for (nal = 0; nal < info.sLayerInfo[layer].iNalCount; nal++) {
+            size += info.sLayerInfo[layer].pNalLengthInByte[nal];
+        }
+    }
+
+    buffer = g_new0(VideoBuffer, 1);
+    buffer->free = openh264_video_buffer_free;
+    buffer->data = g_malloc(size);
+    for (layer = 0; layer < info.iLayerNum; layer++) {
+        const SLayerBSInfo *layer_info = &info.sLayerInfo[layer];
+        uint32_t layer_size = 0;
+
+        for (nal = 0; nal < layer_info->iNalCount; nal++) {
+            layer_size += layer_info->pNalLengthInByte[nal];
+        }
+        memcpy(buffer->data + buffer->size, layer_info->pBsBuf, layer_size);
+        buffer->size += layer_size;
+    }
+    *outbuf = buffer;
+    return VIDEO_ENCODER_FRAME_ENCODE_DONE;
+}
+
+/* Prepares the encoder for frames of a new size or format */
+static bool set_video_format(OpenH264Encoder *encoder, uint32_t width, uint32_t height,
+                             SpiceBitmapFmt format)
+{
+    spice_debug("video format change: width %d -> %d, height %d -> %d, format %d -> %d",
+                encoder->width, width, encoder->height, height,
+                encoder->format, format);
+    free_svc_encoder(encoder);
+    g_free(encoder->planes);
+    encoder->planes = NULL;
+    encoder->width = width;
+    encoder->height = height;
+    encoder->format = format;
+    encoder->errors = 0;
+
+    switch (format) {
+    case SPICE_BITMAP_FMT_16BIT:
+    case SPICE_BITMAP_FMT_24BIT:
+    case SPICE_BITMAP_FMT_32BIT:
+    case SPICE_BITMAP_FMT_RGBA:
+        break;
+    default:
+        spice_warning("unable to map format type %d", format);
+        return false;
+    }
+    /* The chroma is subsampled, only even sizes can be encoded */
+    if (width < 16 || height < 16 || (width & 1) || (height & 1)) {
+        spice_debug("cannot compress %ux%u frames", width, height);
+        return false;
+    }
+
+    encoder->luma_stride = SPICE_ALIGN(width, 16);
+    encoder->chroma_stride = encoder->luma_stride / 2;
+    encoder->planes = g_malloc(encoder->luma_stride * height * 3 / 2);
+    /* The hidden pixels are never converted, start with a black frame */
+    memset(encoder->planes, 16, encoder->luma_stride * height);
+    memset(encoder->planes + encoder->luma_stride * height, 128,
+           encoder->luma_stride * height / 2);
+    return true;
+}
+
+static VideoEncodeResults
+openh264_encoder_encode_frame(VideoEncoder *video_encoder,
+                              uint32_t frame_mm_time,
+                              const SpiceBitmap *bitmap,
+                              const SpiceRect *src, int top_down,
+                              gpointer bitmap_opaque,
+                              VideoBuffer **outbuf)
+{
+    OpenH264Encoder *encoder = SPICE_CONTAINEROF(video_encoder, OpenH264Encoder, base);
+    g_return_val_if_fail(outbuf != NULL, VIDEO_ENCODER_FRAME_UNSUPPORTED);
+    *outbuf = NULL;
+
+    uint32_t width = src->right - src->left;
+    uint32_t height = src->bottom - src->top;
+    if (width != encoder->width || height != encoder->height ||
+        encoder->format != bitmap->format) {
+        if (!set_video_format(encoder, width, height, (SpiceBitmapFmt) bitmap->format)) {
+            encoder->errors = OPENH264_MAX_ERRORS;
+            return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+        }
+        video_rate_control_set_video_format(&encoder->rate_control, width, height,
+                                            24, frame_mm_time);
+    } else if (encoder->errors >= OPENH264_MAX_ERRORS) {
+        /* OpenH264 keeps failing to handle these frames, give up until
+         * something changes.
+         */
+        return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+    }
+
+    if (video_rate_control_drop_frame(&encoder->rate_control, frame_mm_time)) {
+        /* Drop the frame to limit the outgoing bit rate. */
+        return VIDEO_ENCODER_FRAME_DROP;
+    }
+
+    update_frame_rate(encoder);
+    if (!encoder->svc && !create_svc_encoder(encoder)) {
+        encoder->errors++;
+        return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+    }
+
+    uint64_t start = spice_get_monotonic_time_ns();
+    if (!convert_frame(encoder, bitmap, src, top_down)) {
+        return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+    }
+    VideoEncodeResults rc = encode_frame(encoder, frame_mm_time, outbuf);
+    if (rc == VIDEO_ENCODER_FRAME_UNSUPPORTED) {
+        /* Something went wrong, it may be safer to start from scratch */
+        free_svc_encoder(encoder);
+        encoder->errors++;
+    }
+    if (rc != VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+        return rc;
+    }
+    encoder->errors = 0;
+
+    video_rate_control_add_frame(&encoder->rate_control, frame_mm_time,
+                                 spice_get_monotonic_time_ns() - start, (*outbuf)->size);
+
+    return rc;
+}
+
+static void openh264_encoder_client_stream_report(VideoEncoder *video_encoder,
+                                                  uint32_t num_frames,
+                                                  uint32_t num_drops,
+                                                  uint32_t start_frame_mm_time,
+                                                  uint32_t end_frame_mm_time,
+                                                  int32_t video_margin,
+                                                  uint32_t audio_margin)
+{
+    OpenH264Encoder *encoder = SPICE_CONTAINEROF(video_encoder, OpenH264Encoder, base);
+    video_rate_control_client_stream_report(&encoder->rate_control, num_frames, num_drops,
+                                            start_frame_mm_time, end_frame_mm_time,
+                                            video_margin, audio_margin);
+}
+
+static void openh264_encoder_notify_server_frame_drop(VideoEncoder *video_encoder)
+{
+    OpenH264Encoder *encoder = SPICE_CONTAINEROF(video_encoder, OpenH264Encoder, base);
+    video_rate_control_server_frame_drop(&encoder->rate_control);
+}
+
+static uint64_t openh264_encoder_get_bit_rate(VideoEncoder *video_encoder)
+{
+    OpenH264Encoder *encoder = SPICE_CONTAINEROF(video_encoder, OpenH264Encoder, base);
+    return video_rate_control_get_effective_bit_rate(&encoder->rate_control);
+}
+
+static void openh264_encoder_get_stats(VideoEncoder *video_encoder,
+                                       VideoEncoderStats *stats)
+{
+    OpenH264Encoder *encoder = SPICE_CONTAINEROF(video_encoder, OpenH264Encoder, base);
+    uint64_t raw_bit_rate = (uint64_t)encoder->width * encoder->height * 24 *
+                            get_source_fps(encoder);
+
+    spice_return_if_fail(stats != NULL);
+    stats->starting_bit_rate = encoder->rate_control.starting_bit_rate;
+    stats->cur_bit_rate = video_rate_control_get_effective_bit_rate(&encoder->rate_control);
+
+    /* Use the compression level as a proxy for the quality */
+    stats->avg_quality = stats->cur_bit_rate ? 100.0 - raw_bit_rate / stats->cur_bit_rate : 0;
+    if (stats->avg_quality < 0) {
+        stats->avg_quality = 0;
+    }
+}
+
+static void openh264_encoder_request_key_frame(VideoEncoder *video_encoder)
+{
+    OpenH264Encoder *encoder = SPICE_CONTAINEROF(video_encoder, OpenH264Encoder, base);
+    /* The next frame is encoded by a new encoder, the ForceIntraFrame()
+     * signature changed between OpenH264 versions.
+     */
+    free_svc_encoder(encoder);
+}
+
+static void openh264_encoder_set_visible_region(VideoEncoder *video_encoder,
+                                                const SpiceClipRects *visible)
+{
+    OpenH264Encoder *encoder = SPICE_CONTAINEROF(video_encoder, OpenH264Encoder, base);
+    video_visible_region_set(&encoder->visible_region, visible);
+}
+
+static void openh264_encoder_destroy(VideoEncoder *video_encoder)
+{
+    OpenH264Encoder *encoder = SPICE_CONTAINEROF(video_encoder, OpenH264Encoder, base);
+
+    free_svc_encoder(encoder);
+    g_free(encoder->planes);
+    video_visible_region_clear(&encoder->visible_region);
+    g_free(encoder);
+}
+
+VideoEncoder *openh264_encoder_new(SpiceVideoCodecType codec_type,
+                                   uint64_t starting_bit_rate,
+                                   VideoEncoderRateControlCbs *cbs,
+                                   bitmap_ref_t bitmap_ref,
+                                   bitmap_unref_t bitmap_unref)
+{
+    spice_return_val_if_fail(codec_type == SPICE_VIDEO_CODEC_TYPE_H264, NULL);
+
+    OpenH264Encoder *encoder = g_new0(OpenH264Encoder, 1);
+    encoder->base.destroy = openh264_encoder_destroy;
+    encoder->base.encode_frame = openh264_encoder_encode_frame;
+    encoder->base.client_stream_report = openh264_encoder_client_stream_report;
+    encoder->base.notify_server_frame_drop = openh264_encoder_notify_server_frame_drop;
+    encoder->base.get_bit_rate = openh264_encoder_get_bit_rate;
+    encoder->base.get_stats = openh264_encoder_get_stats;
+    encoder->base.request_key_frame = openh264_encoder_request_key_frame;
+    encoder->base.set_visible_region = openh264_encoder_set_visible_region;
+    encoder->base.codec_type = codec_type;
+
+    video_rate_control_init(&encoder->rate_control, cbs, starting_bit_rate, true,
+                            set_video_bit_rate, encoder);
+    encoder->format = SPICE_BITMAP_FMT_INVALID;
+
+    /* All the other fields are initialized to zero by g_new0(). */
+    return &encoder->base;
+}
@@ -16,41 +16,177 @@
 */
 #include <config.h>
 
+#include <spice/stats.h>
+
 #include "pixmap-cache.h"
 
-int pixmap_cache_unlocked_set_lossy(PixmapCache *cache, uint64_t id, int lossy)
+#define PIXMAP_CACHE_MIN_TABLE_BITS 6
+#define PIXMAP_CACHE_SLAB_ENTRIES 256
+
+/* Pixmaps taking more than this part of the cache are only cached the second
+ * time they are sent, so that the large images shown once do not evict the
+ * pixmaps which are used over and over.
+ */
+#define PIXMAP_CACHE_LARGE_SHARE 8
+
+struct PixmapCacheSlab {
+    PixmapCacheSlab *next;
+    PixmapCacheEntry entries[PIXMAP_CACHE_SLAB_ENTRIES];
+};
+
+static inline uint32_t pixmap_cache_slot(const PixmapCache *cache, uint64_t id)
+{
+    /* the ids are often sequential, spread them with a multiplicative hash */
+    return (id * UINT64_C(0x9e3779b97f4a7c15)) >> (64 - cache->table_bits);
+}
+
+static inline uint32_t pixmap_cache_mask(const PixmapCache *cache)
 {
-    NewCacheItem *item;
+    return (1u << cache->table_bits) - 1;
+}
 
-    item = cache->hash_table[BITS_CACHE_HASH_KEY(id)];
+PixmapCacheEntry *pixmap_cache_unlocked_lookup(PixmapCache *cache, uint64_t id)
+{
+    const uint32_t mask = pixmap_cache_mask(cache);
+    PixmapCacheEntry *entry;
 
-    while (item) {
-        if (item->id == id) {
-            item->lossy = lossy;
-            break;
+    for (uint32_t i = pixmap_cache_slot(cache, id); (entry = cache->table[i]); i = (i + 1) & mask) {
+        if (entry->id == id) {
+            return entry;
         }
-        item = item->next;
     }
-    return !!item;
+    return nullptr;
 }
 
-void pixmap_cache_clear(PixmapCache *cache)
+static void pixmap_cache_table_add(PixmapCache *cache, PixmapCacheEntry *entry)
 {
-    NewCacheItem *item;
+    const uint32_t mask = pixmap_cache_mask(cache);
+    uint32_t i = pixmap_cache_slot(cache, entry->id);
 
-    if (cache->frozen) {
-        cache->lru.next = cache->frozen_head;
-        cache->lru.prev = cache->frozen_tail;
-        cache->frozen = FALSE;
+    while (cache->table[i]) {
+        i = (i + 1) & mask;
+    }
+    cache->table[i] = entry;
+}
+
+static void pixmap_cache_grow(PixmapCache *cache)
+{
+    PixmapCacheEntry **old_table = cache->table;
+    uint32_t old_size = 1u << cache->table_bits;
+
+    cache->table_bits++;
+    cache->table = g_new0(PixmapCacheEntry *, 1u << cache->table_bits);
+    for (uint32_t i = 0; i < old_size; i++) {
+        if (old_table[i]) {
+            pixmap_cache_table_add(cache, old_table[i]);
+        }
+    }
+    g_free(old_table);
+}
+
+static PixmapCacheEntry *pixmap_cache_alloc_entry(PixmapCache *cache)
+{
+    if (ring_is_empty(&cache->free_entries)) {
+        auto slab = g_new(PixmapCacheSlab, 1);
+        slab->next = cache->slabs;
+        cache->slabs = slab;
+        for (auto &entry : slab->entries) {
+            ring_item_init(&entry.lru_link);
+            ring_add(&cache->free_entries, &entry.lru_link);
+        }
+    }
+
+    SPICE_VERIFY(SPICE_OFFSETOF(PixmapCacheEntry, lru_link) == 0);
+    auto entry = SPICE_CONTAINEROF(ring_get_head(&cache->free_entries), PixmapCacheEntry, lru_link);
+    ring_remove(&entry->lru_link);
+    return entry;
+}
+
+PixmapCacheEntry *pixmap_cache_unlocked_insert(PixmapCache *cache, uint64_t id)
+{
+    /* keep the table at most 3/4 full so the probe sequences stay short */
+    if ((cache->num_entries + 1) * 4 > (3u << cache->table_bits)) {
+        pixmap_cache_grow(cache);
+    }
+
+    PixmapCacheEntry *entry = pixmap_cache_alloc_entry(cache);
+    entry->id = id;
+    pixmap_cache_table_add(cache, entry);
+    cache->num_entries++;
+    ring_add(&cache->lru, &entry->lru_link);
+    return entry;
+}
+
+void pixmap_cache_unlocked_remove(PixmapCache *cache, PixmapCacheEntry *entry)
+{
+    const uint32_t mask = pixmap_cache_mask(cache);
+    uint32_t hole = pixmap_cache_slot(cache, entry->id);
+
+    while (cache->table[hole] != entry) {
+        spice_assert(cache->table[hole]);
+        hole = (hole + 1) & mask;
+    }
+
+    /* Move back the following entries of the cluster which would not be
+     * found anymore past the hole, so the table needs no tombstones.
+     */
+    for (uint32_t i = (hole + 1) & mask; cache->table[i]; i = (i + 1) & mask) {
+        uint32_t slot = pixmap_cache_slot(cache, cache->table[i]->id);
+        if (((i - slot) & mask) >= ((i - hole) & mask)) {
+            cache->table[hole] = cache->table[i];
+            hole = i;
+        }
+    }
+    cache->table[hole] = nullptr;
+    cache->num_entries--;
+
+    ring_remove(&entry->lru_link);
+    ring_add(&cache->free_entries, &entry->lru_link);
+}
+
+bool pixmap_cache_unlocked_admit(PixmapCache *cache, uint64_t id, uint64_t size)
+{
+    if (cache->size <= 0 || size <= static_cast<uint64_t>(cache->size) / PIXMAP_CACHE_LARGE_SHARE) {
+        return true;
+    }
+
+    uint32_t num_seen = MIN(cache->num_seen_large, PIXMAP_CACHE_SEEN_LARGE);
+    for (uint32_t i = 0; i < num_seen; i++) {
+        if (cache->seen_large[i] == id) {
+            return true;
+        }
+    }
+    cache->seen_large[cache->num_seen_large++ % PIXMAP_CACHE_SEEN_LARGE] = id;
+    return false;
+}
+
+int pixmap_cache_unlocked_set_lossy(PixmapCache *cache, uint64_t id, int lossy)
+{
+    PixmapCacheEntry *entry = pixmap_cache_unlocked_lookup(cache, id);
+
+    if (entry) {
+        entry->lossy = lossy;
     }
+    return !!entry;
+}
+
+static void pixmap_cache_remove_all(PixmapCache *cache)
+{
+    PixmapCacheEntry *entry;
 
-    SPICE_VERIFY(SPICE_OFFSETOF(NewCacheItem, lru_link) == 0);
-    while ((item = SPICE_CONTAINEROF(ring_get_head(&cache->lru), NewCacheItem, lru_link))) {
-        ring_remove(&item->lru_link);
-        g_free(item);
+    SPICE_VERIFY(SPICE_OFFSETOF(PixmapCacheEntry, lru_link) == 0);
+    while ((entry = SPICE_CONTAINEROF(ring_get_head(&cache->lru), PixmapCacheEntry, lru_link))) {
+        ring_remove(&entry->lru_link);
+        ring_add(&cache->free_entries, &entry->lru_link);
     }
-    memset(cache->hash_table, 0, sizeof(*cache->hash_table) * BITS_CACHE_HASH_SIZE);
+    memset(cache->table, 0, sizeof(*cache->table) << cache->table_bits);
+    cache->num_entries = 0;
+}
 
+void pixmap_cache_clear(PixmapCache *cache)
+{
+    pixmap_cache_remove_all(cache);
+    cache->frozen = FALSE;
     cache->available = cache->size;
 }
 
@@ -63,10 +199,8 @@ bool pixmap_cache_freeze(PixmapCache *cache)
         return FALSE;
     }
 
-    cache->frozen_head = cache->lru.next;
-    cache->frozen_tail = cache->lru.prev;
-    ring_init(&cache->lru);
-    memset(cache->hash_table, 0, sizeof(*cache->hash_table) * BITS_CACHE_HASH_SIZE);
+    /* the pixmaps can no longer be referenced, nor new ones added */
+    pixmap_cache_remove_all(cache);
     cache->available = -1;
     cache->frozen = TRUE;
 
@@ -81,11 +215,28 @@ static void pixmap_cache_destroy(PixmapCache *cache)
     pthread_mutex_lock(&cache->lock);
     pixmap_cache_clear(cache);
     pthread_mutex_unlock(&cache->lock);
+
+    while (cache->slabs) {
+        PixmapCacheSlab *slab = cache->slabs;
+        cache->slabs = slab->next;
+        g_free(slab);
+    }
+    g_free(cache->table);
+
+    RedsState *reds = cache->client->get_server();
+    stat_remove_counter(reds, &cache->hits);
+    stat_remove_counter(reds, &cache->misses);
+    stat_remove_counter(reds, &cache->evictions);
+    stat_remove_counter(reds, &cache->not_admitted);
+    stat_remove_counter(reds, &cache->saved_bytes);
+    stat_remove_node(reds, &cache->stat);
 }
 
 
 static pthread_mutex_t cache_lock = PTHREAD_MUTEX_INITIALIZER;
 static Ring pixmap_cache_list = {&pixmap_cache_list, &pixmap_cache_list};
+/* tells apart the stat nodes of the caches with the same id */
+static uint32_t pixmap_cache_serial;
 
 static PixmapCache *pixmap_cache_new(RedClient *client, uint8_t id, int64_t size)
 {
@@ -95,11 +246,30 @@ static PixmapCache *pixmap_cache_new(RedClient *client, uint8_t id, int64_t size
     pthread_mutex_init(&cache->lock, nullptr);
     cache->id = id;
     cache->refs = 1;
+    cache->table_bits = PIXMAP_CACHE_MIN_TABLE_BITS;
+    cache->table = g_new0(PixmapCacheEntry *, 1u << cache->table_bits);
+    ring_init(&cache->free_entries);
     ring_init(&cache->lru);
     cache->available = size;
     cache->size = size;
     cache->client = client;
 
+    RedsState *reds = client->get_server();
+    char name[SPICE_STAT_NODE_NAME_MAX];
+    snprintf(name, sizeof(name), "pixmaps[%u:%u]", id, pixmap_cache_serial++ % 1000);
+    stat_init_node(&cache->stat, reds, nullptr, name, TRUE);
+#ifdef RED_STATISTICS
+    if (cache->stat.ref == INVALID_STAT_REF) {
+        /* the stat file is full, don't add the counters at the top level */
+        return cache;
+    }
+#endif
+    stat_init_counter(&cache->hits, reds, &cache->stat, "hits", TRUE);
+    stat_init_counter(&cache->misses, reds, &cache->stat, "misses", TRUE);
+    stat_init_counter(&cache->evictions, reds, &cache->stat, "evictions", TRUE);
+    stat_init_counter(&cache->not_admitted, reds, &cache->stat, "not_admitted", TRUE);
+    stat_init_counter(&cache->saved_bytes, reds, &cache->stat, "saved_bytes", TRUE);
+
     return cache;
 }
 
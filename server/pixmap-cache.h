@@ -22,38 +22,49 @@
 #include <common/ring.h>
 
 #include "red-channel.h"
+#include "stat.h"
 
 #include "push-visibility.h"
 
 #define MAX_CACHE_CLIENTS 4
 
-#define BITS_CACHE_HASH_SHIFT 10
-#define BITS_CACHE_HASH_SIZE (1 << BITS_CACHE_HASH_SHIFT)
-#define BITS_CACHE_HASH_MASK (BITS_CACHE_HASH_SIZE - 1)
-#define BITS_CACHE_HASH_KEY(id) ((id) & BITS_CACHE_HASH_MASK)
-
-struct NewCacheItem {
+struct PixmapCacheEntry {
     RingItem lru_link;
-    NewCacheItem *next;
     uint64_t id;
     uint64_t sync[MAX_CACHE_CLIENTS];
-    size_t size;
+    /* in pixels, like the size of the cache */
+    uint64_t size;
     int lossy;
 };
 
+struct PixmapCacheSlab;
+
+/* Number of recently seen large pixmaps remembered by the admission policy */
+#define PIXMAP_CACHE_SEEN_LARGE 32
+
 struct PixmapCache {
     RingItem base;
     pthread_mutex_t lock;
     uint8_t id;
     uint32_t refs;
-    NewCacheItem *hash_table[BITS_CACHE_HASH_SIZE];
+    /* Open addressing hash table of the entries with linear probing.
+     * The number of slots is a power of 2 and grows with the entries. */
+    PixmapCacheEntry **table;
+    uint8_t table_bits;
+    uint32_t num_entries;
+    /* The entries are allocated by slabs, the unused ones wait in
+     * free_entries to be reused */
+    PixmapCacheSlab *slabs;
+    Ring free_entries;
     Ring lru;
     int64_t available;
     int64_t size;
 
     int frozen;
-    RingItem *frozen_head;
-    RingItem *frozen_tail;
+
+    /* The ids of the last pixmaps refused by pixmap_cache_unlocked_admit() */
+    uint64_t seen_large[PIXMAP_CACHE_SEEN_LARGE];
+    uint32_t num_seen_large;
 
     uint32_t generation;
     struct {
@@ -63,6 +74,14 @@ struct PixmapCache {
     uint64_t sync[MAX_CACHE_CLIENTS]; // here CLIENTS refer to different channel
                                       // clients of the same client
     RedClient *client;
+
+    RedStatNode stat;
+    RedStatCounter hits;
+    RedStatCounter misses;
+    RedStatCounter evictions;
+    RedStatCounter not_admitted;
+    /* estimated size of the pixmaps the client took from its cache */
+    RedStatCounter saved_bytes;
 };
 
 PixmapCache *pixmap_cache_get(RedClient *client, uint8_t id, int64_t size);
@@ -71,6 +90,15 @@ void         pixmap_cache_clear(PixmapCache *cache);
 int          pixmap_cache_unlocked_set_lossy(PixmapCache *cache, uint64_t id, int lossy);
 bool         pixmap_cache_freeze(PixmapCache *cache);
 
+/* The following functions must be called with the cache lock held */
+PixmapCacheEntry *pixmap_cache_unlocked_lookup(PixmapCache *cache, uint64_t id);
+/* Adds a new entry for @id at the head of the LRU list, the caller fills
+ * the other fields */
+PixmapCacheEntry *pixmap_cache_unlocked_insert(PixmapCache *cache, uint64_t id);
+void              pixmap_cache_unlocked_remove(PixmapCache *cache, PixmapCacheEntry *entry);
+/* Returns false if a pixmap of @size pixels should not be cached yet */
+bool              pixmap_cache_unlocked_admit(PixmapCache *cache, uint64_t id, uint64_t size);
+
 #include "pop-visibility.h"
 
 #endif /* PIXMAP_CACHE_H_ */
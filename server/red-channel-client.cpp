@@ -20,6 +20,7 @@
 #include <cerrno>
 #include <cstdint>
 #include <cstdio>
+#include <cstring>
 
 #include <fcntl.h>
 #include <glib.h>
@@ -29,15 +30,39 @@
 #include <netinet/tcp.h>
 #include <sys/ioctl.h>
 #endif
-#ifdef HAVE_LINUX_SOCKIOS_H
-#include <linux/sockios.h> /* SIOCOUTQ */
-#endif
 #include <common/generated_server_marshallers.h>
 
 #include "red-channel-client.h"
 #include "red-client.h"
+#include "reds.h"
+#include "net-utils.h"
 
 #define CLIENT_ACK_WINDOW 20
+/* limits of the ack window adapted to the network */
+#define MIN_CLIENT_ACK_WINDOW 10
+/* data in flight allowed in addition to the bandwidth-delay product,
+ * so short links do not get starved */
+#define MIN_BYTES_IN_FLIGHT (64 * 1024)
+/* minimum time between two changes of the ack window */
+#define ACK_WINDOW_UPDATE_INTERVAL (NSEC_PER_SEC)
+/* the size of the kernel send queue is sampled at most this often */
+#define SEND_QUEUE_SAMPLE_INTERVAL (NSEC_PER_MILLISEC * 5)
+/* limits of the socket send buffer sized to the network */
+#define MIN_SEND_BUFFER_SIZE (64 * 1024)
+/* the socket send buffer is capped once it queues data longer than this */
+#define MAX_SEND_BUFFER_DELAY (NSEC_PER_MILLISEC * 200)
+#define MAX_SEND_BUFFER_SIZE (4 * 1024 * 1024)
+/* number of sent messages remembered to compute delivery rates,
+ * must be more than the messages sent without acks */
+#define NET_SAMPLE_MESSAGES 256
+/* a channel throttled by more urgent channels of the client still
+ * sends a message at least this often so it is not starved */
+#define MAX_TX_THROTTLE_TIME (NSEC_PER_MILLISEC * 20)
+/* delay before a throttled channel checks again whether it can send */
+#define TX_THROTTLE_RETRY_MS 2
+/* the channels holding their items when congested stop sending while the
+ * data queued in the kernel take longer than this to be sent */
+#define MAX_SEND_QUEUE_DELAY (NSEC_PER_MILLISEC * 200)
 
 #define MAX_HEADER_SIZE sizeof(SpiceDataHeader)
 
@@ -101,6 +126,53 @@ struct RedChannelClientConnectivityMonitor {
     SpiceTimer *timer;
 };
 
+/* Delivery rate sampling, the client acknowledges every
+ * ack_data.client_window messages received so the bytes sent
+ * between two acks were delivered in the time between them */
+struct RedChannelClientNetSampler {
+    /* messages started in the current ack generation */
+    uint32_t messages;
+    /* messages acknowledged in the current ack generation */
+    uint32_t acked_messages;
+    /* total bytes written to the stream */
+    uint64_t sent_bytes;
+    /* sent_bytes when each message was completely written */
+    struct {
+        uint32_t message;
+        uint64_t sent_bytes;
+    } sent[NET_SAMPLE_MESSAGES];
+    /* time the last ack was received, 0 if it can't be used for samples */
+    uint64_t last_ack_time;
+    /* sent_bytes when the last acknowledged message was written */
+    uint64_t last_ack_bytes;
+    /* sending was limited by the network (blocked socket or
+     * waiting for acks) since the last ack */
+    bool network_limited;
+};
+
+/* Transmit scheduling among the channels of a client */
+struct RedChannelClientTxScheduler {
+    RedClientTxPriority priority;
+    /* counted by the client as having messages to send */
+    bool pending;
+    /* last pipe_item_get() did not return an item to let more
+     * urgent channels send */
+    bool throttled;
+    /* start of the current throttling, 0 if not throttled */
+    uint64_t throttle_start;
+    SpiceTimer *timer;
+};
+
+/* Data written to the socket and not yet sent or acknowledged */
+struct RedChannelClientSendQueue {
+    uint64_t sample_time;
+    int size;
+    /* time needed to send the queued data at the estimated bandwidth */
+    uint64_t delay_ns;
+    /* size set with SO_SNDBUF, 0 if left to the kernel */
+    int buffer_size;
+};
+
 struct OutgoingMessageBuffer {
     int pos;
     int size;
@@ -135,6 +207,15 @@ struct RedChannelClientPrivate
         uint32_t client_generation;
         uint32_t messages_window;
         uint32_t client_window;
+        /* limit of the bytes sent and not acknowledged, 0 if not limited */
+        uint64_t max_bytes_in_flight;
+        /* average size of the messages sent */
+        uint32_t avg_message_size;
+        /* last time the window was adapted to the network */
+        uint64_t window_update_time;
+        /* window to use once SET_ACK is sent, 0 if none. Acks of the
+         * current generation count messages using the current window */
+        uint32_t next_window;
     } ack_data;
 
     struct {
@@ -153,8 +234,25 @@ struct RedChannelClientPrivate
         struct {
             SpiceMarshaller *marshaller;
         } urgent;
+
+        /* zero-copy identifier of the stream when the message started */
+        uint32_t zerocopy_id;
+
+        /* file descriptor of a message whose data are written but
+         * which could not be sent yet as the socket was full */
+        bool has_pending_fd;
+        int pending_fd;
     } send_data;
 
+    /* marshallers of sent messages whose data are still referenced
+     * by zero-copy writes, ordered by end_id */
+    struct ZeroCopyMarshaller {
+        SpiceMarshaller *marshaller;
+        /* zero-copy identifier following the last write of the message */
+        uint32_t end_id;
+    };
+    std::list<ZeroCopyMarshaller, red::Mallocator<ZeroCopyMarshaller>> zerocopy_marshallers;
+
     bool block_read;
     bool during_send;
     RedChannelClient::Pipe pipe;
@@ -167,16 +265,32 @@ struct RedChannelClientPrivate
 
     RedChannelClientLatencyMonitor latency_monitor;
     RedChannelClientConnectivityMonitor connectivity_monitor;
+    RedChannelClientNetSampler net_sampler;
+    RedChannelClientSendQueue send_queue;
+    RedChannelClientTxScheduler tx;
 
     IncomingMessageBuffer incoming;
     OutgoingMessageBuffer outgoing;
 
     RedStatCounter out_messages;
     RedStatCounter out_bytes;
-
-    inline RedPipeItemPtr pipe_item_get();
+    RedStatCounter tls_connections;
+    RedStatCounter ktls_connections;
+    RedStatNode client_stat;
+    RedStatCounter queued_bytes;
+    RedStatCounter queue_delay_ms;
+
+    inline RedPipeItemPtr pipe_item_get(bool bulk);
+    inline bool has_writable_messages();
     inline void pipe_remove(RedPipeItem *item);
     void handle_pong(SpiceMsgPing *ping);
+    void handle_ack();
+    void add_tcp_rtt_sample();
+    void init_client_stat();
+    void update_send_queue(uint64_t now);
+    void tune_send_buffer(uint64_t bdp, uint64_t now);
+    void set_tx_pending(bool pending);
+    bool tx_throttle(RedClientTxPriority priority);
     inline void set_message_serial(uint64_t serial);
     void pipe_clear();
     void data_sent(int n);
@@ -187,6 +301,8 @@ struct RedChannelClientPrivate
     void reset_send_data();
     void seamless_migration_done();
     void clear_sent_item();
+    bool zerocopy_hold_marshaller();
+    void zerocopy_release_marshallers();
     void restart_ping_timer();
     void start_ping_timer(uint32_t timeout);
     void cancel_ping_timer();
@@ -326,10 +442,36 @@ RedChannelClientPrivate::RedChannelClientPrivate(RedChannel *init_channel,
     }
     incoming.header.data = incoming.header_buf;
 
+    tx.priority = red_client_get_tx_priority(channel->type());
+
     RedsState* reds = channel->get_server();
     const RedStatNode *node = channel->get_stat_node();
     stat_init_counter(&out_messages, reds, node, "out_messages", TRUE);
     stat_init_counter(&out_bytes, reds, node, "out_bytes", TRUE);
+    stat_init_counter(&tls_connections, reds, node, "tls_connections", TRUE);
+    stat_init_counter(&ktls_connections, reds, node, "ktls_connections", TRUE);
+    init_client_stat();
+}
+
+/* the send queue is specific to each client, its counters go
+ * in a node of the client */
+void RedChannelClientPrivate::init_client_stat()
+{
+    static gint client_stat_serial;
+    RedsState* reds = channel->get_server();
+    char name[SPICE_STAT_NODE_NAME_MAX];
+
+    snprintf(name, sizeof(name), "client[%u]",
+             (guint) g_atomic_int_add(&client_stat_serial, 1) % 100000000);
+    stat_init_node(&client_stat, reds, channel->get_stat_node(), name, TRUE);
+#ifdef RED_STATISTICS
+    if (client_stat.ref == INVALID_STAT_REF) {
+        /* the stat file is full, don't add the counters at the top level */
+        return;
+    }
+#endif
+    stat_init_counter(&queued_bytes, reds, &client_stat, "queued_bytes", TRUE);
+    stat_init_counter(&queue_delay_ms, reds, &client_stat, "queue_delay_ms", TRUE);
 }
 
 RedChannelClientPrivate::~RedChannelClientPrivate()
@@ -340,8 +482,16 @@ RedChannelClientPrivate::~RedChannelClientPrivate()
     red_timer_remove(connectivity_monitor.timer);
     connectivity_monitor.timer = nullptr;
 
+    red_timer_remove(tx.timer);
+    tx.timer = nullptr;
+
     red_stream_free(stream);
 
+    RedsState* reds = channel->get_server();
+    stat_remove_counter(reds, &queued_bytes);
+    stat_remove_counter(reds, &queue_delay_ms);
+    stat_remove_node(reds, &client_stat);
+
     if (send_data.main.marshaller) {
         spice_marshaller_destroy(send_data.main.marshaller);
     }
@@ -350,6 +500,17 @@ RedChannelClientPrivate::~RedChannelClientPrivate()
         spice_marshaller_destroy(send_data.urgent.marshaller);
     }
 
+#ifndef _WIN32
+    if (send_data.has_pending_fd && send_data.pending_fd != -1) {
+        close(send_data.pending_fd);
+    }
+#endif
+
+    /* the socket is closed, the kernel doesn't reference the data anymore */
+    for (const auto& zc : zerocopy_marshallers) {
+        spice_marshaller_destroy(zc.marshaller);
+    }
+
     red_channel_capabilities_reset(&remote_caps);
 }
 
@@ -377,6 +538,7 @@ void RedChannelClientPrivate::data_sent(int n)
     if (connectivity_monitor.timer) {
         connectivity_monitor.sent_bytes = true;
     }
+    net_sampler.sent_bytes += n;
     stat_inc_counter(out_bytes, n);
 }
 
@@ -401,6 +563,7 @@ inline int RedChannelClientPrivate::prepare_out_msg(struct iovec *vec, int vec_s
 inline void RedChannelClientPrivate::set_blocked()
 {
     send_data.blocked = true;
+    net_sampler.network_limited = true;
 }
 
 inline int RedChannelClientPrivate::urgent_marshaller_is_active()
@@ -429,8 +592,17 @@ void RedChannelClient::send_set_ack()
 
     init_send_data(SPICE_MSG_SET_ACK);
     ack.generation = ++priv->ack_data.generation;
+    if (priv->ack_data.next_window) {
+        priv->ack_data.client_window = priv->ack_data.next_window;
+        priv->ack_data.next_window = 0;
+    }
     ack.window = priv->ack_data.client_window;
     priv->ack_data.messages_window = 0;
+    priv->net_sampler.messages = 0;
+    priv->net_sampler.acked_messages = 0;
+    priv->net_sampler.last_ack_time = 0;
+    priv->net_sampler.last_ack_bytes = priv->net_sampler.sent_bytes;
+    memset(priv->net_sampler.sent, 0, sizeof(priv->net_sampler.sent));
 
     spice_marshall_msg_set_ack(priv->send_data.marshaller, &ack);
 
@@ -524,21 +696,36 @@ inline void RedChannelClientPrivate::restore_main_sender()
 void RedChannelClient::msg_sent()
 {
 #ifndef _WIN32
-    int fd;
+    if (!priv->send_data.has_pending_fd) {
+        priv->send_data.has_pending_fd =
+            spice_marshaller_get_fd(priv->send_data.marshaller, &priv->send_data.pending_fd);
+    }
+    if (priv->send_data.has_pending_fd) {
+        int fd = priv->send_data.pending_fd;
 
-    if (spice_marshaller_get_fd(priv->send_data.marshaller, &fd)) {
         if (red_stream_send_msgfd(priv->stream, fd) < 0) {
+            if (errno == EAGAIN) {
+                /* handle_outgoing() retries once the socket is writable */
+                priv->set_blocked();
+                return;
+            }
             perror("sendfd");
+            priv->send_data.has_pending_fd = false;
             disconnect();
             if (fd != -1)
                 close(fd);
             return;
         }
+        priv->send_data.has_pending_fd = false;
         if (fd != -1)
             close(fd);
     }
 #endif
 
+    auto sent = &priv->net_sampler.sent[priv->net_sampler.messages % NET_SAMPLE_MESSAGES];
+    sent->message = priv->net_sampler.messages;
+    sent->sent_bytes = priv->net_sampler.sent_bytes;
+
     priv->clear_sent_item();
 
     if (priv->urgent_marshaller_is_active()) {
@@ -610,21 +797,13 @@ void RedChannelClient::ping_timer(RedChannelClient *rcc)
     spice_assert(rcc->priv->latency_monitor.state == PING_STATE_TIMER);
     rcc->priv->cancel_ping_timer();
 
-#ifdef HAVE_LINUX_SOCKIOS_H /* SIOCOUTQ is a Linux only ioctl on sockets. */
-    int so_unsent_size = 0;
-
-    /* retrieving the occupied size of the socket's tcp send buffer (unacked + unsent) */
-    if (ioctl(rcc->priv->stream->socket, SIOCOUTQ, &so_unsent_size) == -1) {
-        red_channel_warning(rcc->get_channel(),
-                            "ioctl(SIOCOUTQ) failed, %s", strerror(errno));
-    }
-    if (so_unsent_size > 0) {
+    /* retrieving the occupied size of the socket's tcp send buffer (unacked + unsent),
+     * not available on all systems */
+    if (red_socket_get_send_queue_size(rcc->priv->stream->socket) > 0) {
         /* tcp send buffer is still occupied. rescheduling ping */
         rcc->priv->start_ping_timer(PING_TEST_IDLE_NET_TIMEOUT_MS);
         return;
     }
-#endif /* ifdef HAVE_LINUX_SOCKIOS_H */
-    /* More portable alternative code path (less accurate but avoids bogus ioctls)*/
     rcc->push_ping();
 }
 
@@ -632,8 +811,17 @@ inline int RedChannelClientPrivate::waiting_for_ack()
 {
     gboolean handle_acks = channel->handle_acks();
 
-    return (handle_acks && (ack_data.messages_window >
-                            ack_data.client_window * 2));
+    if (!handle_acks) {
+        return false;
+    }
+    if (ack_data.messages_window > ack_data.client_window * 2) {
+        return true;
+    }
+    /* wait only if an ack is expected, that is once the client
+     * received a whole window */
+    return ack_data.max_bytes_in_flight &&
+           ack_data.messages_window > ack_data.client_window &&
+           net_sampler.sent_bytes - net_sampler.last_ack_bytes > ack_data.max_bytes_in_flight;
 }
 
 /*
@@ -711,7 +899,7 @@ void RedChannelClient::start_connectivity_monitoring(uint32_t timeout_ms)
      */
     if (priv->latency_monitor.timer == nullptr) {
         priv->latency_monitor.timer =
-            core->timer_new(ping_timer, this);
+            core->coarse_timer_new(ping_timer, this);
         priv->latency_monitor.roundtrip = -1;
     } else {
         priv->cancel_ping_timer();
@@ -723,7 +911,7 @@ void RedChannelClient::start_connectivity_monitoring(uint32_t timeout_ms)
     if (priv->connectivity_monitor.timer == nullptr) {
         priv->connectivity_monitor.state = CONNECTIVITY_STATE_CONNECTED;
         priv->connectivity_monitor.timer =
-            core->timer_new(connectivity_timer, this);
+            core->coarse_timer_new(connectivity_timer, this);
         priv->connectivity_monitor.timeout = timeout_ms;
         if (!priv->client->during_migrate_at_target()) {
             red_timer_start(priv->connectivity_monitor.timer,
@@ -735,7 +923,9 @@ void RedChannelClient::start_connectivity_monitoring(uint32_t timeout_ms)
 static void red_channel_client_event(int fd, int event, RedChannelClient *rcc)
 {
     red::shared_ptr<RedChannelClient> hold_rcc(rcc);
-    if (event & SPICE_WATCH_EVENT_READ) {
+    /* no event is reported for socket errors, including the
+     * zero-copy completions, reading handles them */
+    if ((event & SPICE_WATCH_EVENT_READ) || event == 0) {
         rcc->receive();
     }
     if (event & SPICE_WATCH_EVENT_WRITE) {
@@ -807,6 +997,7 @@ bool RedChannelClient::init()
 {
     char *local_error = nullptr;
     SpiceCoreInterfaceInternal *core;
+    size_t zerocopy_threshold;
 
     if (!priv->stream) {
         local_error =
@@ -820,6 +1011,23 @@ bool RedChannelClient::init()
         goto cleanup;
     }
 
+    if (red_stream_is_ssl(priv->stream)) {
+        stat_inc_counter(priv->tls_connections, 1);
+        if (red_stream_is_ktls(priv->stream)) {
+            stat_inc_counter(priv->ktls_connections, 1);
+        }
+        red_channel_debug(priv->channel, "TLS connection, kernel offload %s",
+                          red_stream_is_ktls(priv->stream) ? "enabled" : "disabled");
+    }
+
+    /* messages are queued and written together at the end of push() */
+    red_stream_set_write_batching(priv->stream, true);
+
+    zerocopy_threshold = reds_get_zerocopy_threshold(priv->channel->get_server());
+    if (zerocopy_threshold && red_stream_enable_zerocopy(priv->stream, zerocopy_threshold)) {
+        priv->send_data.zerocopy_id = red_stream_zerocopy_get_next_id(priv->stream);
+    }
+
     core = priv->channel->get_core_interface();
     red_stream_set_core_interface(priv->stream, core);
     priv->stream->watch =
@@ -827,10 +1035,11 @@ bool RedChannelClient::init()
                         SPICE_WATCH_EVENT_READ,
                         red_channel_client_event,
                         this);
+    priv->tx.timer = core->timer_new(tx_throttle_timer, this);
 
     if (red_stream_get_family(priv->stream) != AF_UNIX) {
         priv->latency_monitor.timer =
-            core->timer_new(ping_timer, this);
+            core->coarse_timer_new(ping_timer, this);
 
         if (!priv->client->during_migrate_at_target()) {
             priv->start_ping_timer(PING_TEST_IDLE_NET_TIMEOUT_MS);
@@ -940,6 +1149,15 @@ void RedChannelClient::handle_outgoing()
         return;
     }
 
+#ifndef _WIN32
+    if (priv->send_data.has_pending_fd) {
+        /* the data of the message are written, only the file
+         * descriptor is left */
+        msg_sent();
+        return;
+    }
+#endif
+
     if (buffer->size == 0) {
         buffer->size = priv->get_out_msg_size();
         if (!buffer->size) {  // nothing to be sent
@@ -1121,6 +1339,7 @@ void RedChannelClient::handle_incoming()
 void RedChannelClient::receive()
 {
     red::shared_ptr<RedChannelClient> hold_rcc(this);
+    priv->zerocopy_release_marshallers();
     handle_incoming();
 }
 
@@ -1130,11 +1349,63 @@ void RedChannelClient::send()
     handle_outgoing();
 }
 
-inline RedPipeItemPtr RedChannelClientPrivate::pipe_item_get()
+void RedChannelClientPrivate::set_tx_pending(bool pending)
+{
+    if (tx.pending == pending) {
+        return;
+    }
+    tx.pending = pending;
+    client->set_tx_pending(tx.priority, pending);
+}
+
+/* Whether to hold the next message so more urgent channels of the
+ * client get the bandwidth of the shared network path.
+ * A message is sent anyway every MAX_TX_THROTTLE_TIME */
+bool RedChannelClientPrivate::tx_throttle(RedClientTxPriority priority)
+{
+    if (!client->is_tx_pending_above(priority)) {
+        tx.throttle_start = 0;
+        return false;
+    }
+
+    uint64_t now = spice_get_monotonic_time_ns();
+    if (tx.throttle_start == 0) {
+        tx.throttle_start = now;
+    } else if (now - tx.throttle_start >= MAX_TX_THROTTLE_TIME) {
+        tx.throttle_start = now;
+        return false;
+    }
+    return true;
+}
+
+void RedChannelClient::tx_throttle_timer(RedChannelClient *rcc)
+{
+    red::shared_ptr<RedChannelClient> hold_rcc(rcc);
+    rcc->priv->watch_update_mask(SPICE_WATCH_EVENT_READ|SPICE_WATCH_EVENT_WRITE);
+    rcc->push();
+}
+
+/* Whether less urgent channels of the client should be held back.
+ * Messages waiting for the socket to be writable or for acks don't
+ * use the network */
+inline bool RedChannelClientPrivate::has_writable_messages()
+{
+    return !send_data.blocked && !pipe.empty() && !waiting_for_ack();
+}
+
+inline RedPipeItemPtr RedChannelClientPrivate::pipe_item_get(bool bulk)
 {
     RedPipeItemPtr ret;
 
-    if (send_data.blocked || waiting_for_ack() || pipe.empty()) {
+    if (send_data.blocked || pipe.empty()) {
+        return ret;
+    }
+    if (waiting_for_ack()) {
+        net_sampler.network_limited = true;
+        return ret;
+    }
+    if (tx_throttle(bulk ? RED_CLIENT_TX_PRIORITY_BULK : tx.priority)) {
+        tx.throttled = true;
         return ret;
     }
     ret = std::move(pipe.back());
@@ -1149,7 +1420,9 @@ void RedChannelClient::push()
     }
 
     priv->during_send = TRUE;
+    priv->tx.throttled = false;
     red::shared_ptr<RedChannelClient> hold_rcc(this);
+    priv->zerocopy_release_marshallers();
     if (is_blocked()) {
         send();
     }
@@ -1160,8 +1433,15 @@ void RedChannelClient::push()
                             "ERROR: an item waiting to be sent and not blocked");
     }
 
-    while (auto pipe_item = priv->pipe_item_get()) {
-        send_any_item(pipe_item.get());
+    /* only this client waits, the items held in its pipe can be replaced
+     * by newer ones, the timer checks the kernel queue again shortly */
+    if (hold_when_congested() && !priv->pipe.empty() &&
+        get_send_queue_delay() > MAX_SEND_QUEUE_DELAY) {
+        priv->tx.throttled = true;
+    } else {
+        while (auto pipe_item = priv->pipe_item_get(next_item_is_bulk())) {
+            send_any_item(pipe_item.get());
+        }
     }
     /* prepare_pipe_add() will reenable WRITE events when the priv->pipe is empty
      * ack_zero_messages_window() will reenable WRITE events
@@ -1172,20 +1452,37 @@ void RedChannelClient::push()
      */
     if ((no_item_being_sent() && priv->pipe.empty()) ||
         priv->waiting_for_ack()) {
-        priv->watch_update_mask(SPICE_WATCH_EVENT_READ);
-
         /* channel has no pending data to send so now we can flush data in
          * order to avoid data stall into buffers in case of manual
          * flushing
          * We need to flush also in case of ack as it is possible
          * that for a long train of small messages the message that would
          * cause the client to send the ack is still in the queue
+         * If the socket cannot take all the batched data keep WRITE
+         * events enabled to flush the rest later
          */
-        red_stream_flush(priv->stream);
+        if (red_stream_flush(priv->stream)) {
+            priv->watch_update_mask(SPICE_WATCH_EVENT_READ);
+        } else {
+            priv->watch_update_mask(SPICE_WATCH_EVENT_READ|SPICE_WATCH_EVENT_WRITE);
+        }
+    } else if (priv->tx.throttled) {
+        /* more urgent channels are sending, do not spin on WRITE
+         * events, the timer checks again shortly */
+        if (red_stream_flush(priv->stream)) {
+            priv->watch_update_mask(SPICE_WATCH_EVENT_READ);
+        }
+        red_timer_start(priv->tx.timer, TX_THROTTLE_RETRY_MS);
     }
+    priv->set_tx_pending(priv->has_writable_messages() && !next_item_is_bulk());
     priv->during_send = FALSE;
 }
 
+bool RedChannelClient::next_item_is_bulk()
+{
+    return !priv->pipe.empty() && is_bulk_item(priv->pipe.back().get());
+}
+
 int RedChannelClient::get_roundtrip_ms() const
 {
     if (priv->latency_monitor.roundtrip < 0) {
@@ -1239,12 +1536,166 @@ void RedChannelClientPrivate::handle_pong(SpiceMsgPing *ping)
         latency_monitor.roundtrip = now - ping->timestamp;
         spice_debug("update roundtrip %.2f(ms)", ((double)latency_monitor.roundtrip)/NSEC_PER_MILLISEC);
     }
+    client->add_net_rtt_sample(now - ping->timestamp);
+    add_tcp_rtt_sample();
 
     latency_monitor.last_pong_time = now;
     latency_monitor.state = PING_STATE_NONE;
     start_ping_timer(latency_monitor.timeout);
 }
 
+void RedChannelClientPrivate::add_tcp_rtt_sample()
+{
+    uint32_t rtt_us;
+
+    if (red_socket_get_rtt(stream->socket, &rtt_us)) {
+        client->add_net_rtt_sample(uint64_t{rtt_us} * NSEC_PER_MICROSEC);
+    }
+}
+
+void RedChannelClientPrivate::handle_ack()
+{
+    uint64_t now = spice_get_monotonic_time_ns();
+
+    net_sampler.acked_messages += ack_data.client_window;
+
+    /* find how many bytes were sent up to the last acknowledged message */
+    auto sent = &net_sampler.sent[net_sampler.acked_messages % NET_SAMPLE_MESSAGES];
+    if (sent->message != net_sampler.acked_messages ||
+        net_sampler.messages - net_sampler.acked_messages >= NET_SAMPLE_MESSAGES) {
+        /* lost track, consider everything acknowledged */
+        net_sampler.last_ack_time = 0;
+        net_sampler.last_ack_bytes = net_sampler.sent_bytes;
+        return;
+    }
+
+    if (net_sampler.last_ack_time) {
+        uint64_t bytes = sent->sent_bytes - net_sampler.last_ack_bytes;
+        uint32_t message_size = bytes / ack_data.client_window;
+
+        client->add_net_delivery_sample(bytes, now - net_sampler.last_ack_time,
+                                        !net_sampler.network_limited);
+        add_tcp_rtt_sample();
+        if (ack_data.avg_message_size == 0) {
+            ack_data.avg_message_size = message_size;
+        } else {
+            ack_data.avg_message_size += ((int64_t) message_size - ack_data.avg_message_size) / 4;
+        }
+    }
+    net_sampler.last_ack_time = now;
+    net_sampler.last_ack_bytes = sent->sent_bytes;
+    net_sampler.network_limited = send_data.blocked;
+}
+
+/* Size the data in flight to the bandwidth-delay product of the client
+ * network: the bytes not acknowledged are limited to twice the product,
+ * and the ack window, counted in messages, is changed so that a window
+ * of average messages holds the product. */
+void RedChannelClient::update_ack_window()
+{
+    NetEstimator estimate = priv->client->get_net_estimate();
+    uint64_t now = spice_get_monotonic_time_ns();
+    uint64_t bdp;
+    uint32_t window;
+
+    if (!estimate.has_bit_rate() || !estimate.has_rtt() || priv->ack_data.avg_message_size == 0) {
+        return;
+    }
+
+    bdp = estimate.get_bit_rate() / 8 * estimate.get_min_rtt_ns() / NSEC_PER_SEC;
+    priv->ack_data.max_bytes_in_flight = 2 * bdp + MIN_BYTES_IN_FLIGHT;
+    priv->tune_send_buffer(bdp, now);
+
+    if (now - priv->ack_data.window_update_time < ACK_WINDOW_UPDATE_INTERVAL ||
+        priv->ack_data.next_window) {
+        return;
+    }
+    window = CLAMP(bdp / priv->ack_data.avg_message_size,
+                   MIN_CLIENT_ACK_WINDOW, MAX_CLIENT_ACK_WINDOW);
+    /* ignore small changes, each change costs a SET_ACK exchange */
+    if (window * 4 > priv->ack_data.client_window * 3 &&
+        window * 4 < priv->ack_data.client_window * 5) {
+        return;
+    }
+    red_channel_debug(priv->channel, "ack window %u -> %u, bdp %" G_GUINT64_FORMAT
+                      " bytes, average message %u bytes", priv->ack_data.client_window,
+                      window, bdp, priv->ack_data.avg_message_size);
+    priv->ack_data.window_update_time = now;
+    priv->ack_data.next_window = window;
+    push_set_ack();
+}
+
+void RedChannelClientPrivate::update_send_queue(uint64_t now)
+{
+    NetEstimator estimate = client->get_net_estimate();
+    bool has_bit_rate = estimate.has_bit_rate() && estimate.get_bit_rate() > 0;
+    int size = red_socket_get_unsent_size(stream->socket);
+
+    if (size < 0) {
+        /* only the total is available, the data in flight, about a
+         * bandwidth-delay product on a busy connection, are not queued */
+        size = red_socket_get_send_queue_size(stream->socket);
+        if (size > 0 && has_bit_rate && estimate.has_rtt()) {
+            uint64_t bdp = estimate.get_bit_rate() / 8 * estimate.get_min_rtt_ns() / NSEC_PER_SEC;
+            size = static_cast<uint64_t>(size) > bdp ? size - static_cast<int>(bdp) : 0;
+        }
+    }
+
+    send_queue.sample_time = now;
+    send_queue.size = MAX(size, 0);
+    send_queue.delay_ns = 0;
+    if (has_bit_rate) {
+        send_queue.delay_ns = uint64_t{8} * send_queue.size * NSEC_PER_SEC / estimate.get_bit_rate();
+    }
+    stat_set_counter(queued_bytes, send_queue.size);
+    stat_set_counter(queue_delay_ms, send_queue.delay_ns / NSEC_PER_MILLISEC);
+}
+
+/* The kernel auto tuning of the socket send buffer can queue seconds of
+ * data on slow networks. Setting SO_SNDBUF disables the auto tuning for
+ * good, so the buffer is only capped, to twice the bandwidth-delay
+ * product, once the data queued in the socket take longer than
+ * MAX_SEND_BUFFER_DELAY to send. The bandwidth measured through a capped
+ * buffer is limited by it, so the cap follows the product when it grows
+ * but is only lowered while the queue is still too long. */
+void RedChannelClientPrivate::tune_send_buffer(uint64_t bdp, uint64_t now)
+{
+    int family = red_stream_get_family(stream);
+    int size;
+
+    if (family != AF_INET && family != AF_INET6) {
+        return;
+    }
+
+    if (now - send_queue.sample_time >= SEND_QUEUE_SAMPLE_INTERVAL) {
+        update_send_queue(now);
+    }
+    size = CLAMP(2 * bdp, MIN_SEND_BUFFER_SIZE, MAX_SEND_BUFFER_SIZE);
+    if (send_queue.delay_ns <= MAX_SEND_BUFFER_DELAY &&
+        (send_queue.buffer_size == 0 || size < send_queue.buffer_size)) {
+        return;
+    }
+    /* ignore small changes */
+    if (send_queue.buffer_size &&
+        size * 4 > send_queue.buffer_size * 3 && size * 4 < send_queue.buffer_size * 5) {
+        return;
+    }
+    if (red_socket_set_send_buffer_size(stream->socket, size)) {
+        red_channel_debug(channel, "send buffer size %d", size);
+        send_queue.buffer_size = size;
+    }
+}
+
+uint64_t RedChannelClient::get_send_queue_delay()
+{
+    uint64_t now = spice_get_monotonic_time_ns();
+
+    if (now - priv->send_queue.sample_time >= SEND_QUEUE_SAMPLE_INTERVAL) {
+        priv->update_send_queue(now);
+    }
+    return priv->send_queue.delay_ns;
+}
+
 void RedChannelClient::handle_migrate_flush_mark()
 {
 }
@@ -1288,6 +1739,9 @@ bool RedChannelClient::handle_message(uint16_t type, uint32_t size, void *messag
     case SPICE_MSGC_ACK:
         if (priv->ack_data.client_generation == priv->ack_data.generation) {
             priv->ack_data.messages_window -= priv->ack_data.client_window;
+            priv->handle_ack();
+            on_net_estimate_update();
+            update_ack_window();
             priv->watch_update_mask(SPICE_WATCH_EVENT_READ|SPICE_WATCH_EVENT_WRITE);
             push();
         }
@@ -1346,7 +1800,9 @@ void RedChannelClient::begin_send_message()
     priv->send_data.header.set_msg_serial(&priv->send_data.header,
                                                ++priv->send_data.last_sent_serial);
     priv->ack_data.messages_window++;
+    priv->net_sampler.messages++;
     priv->send_data.header.data = nullptr; /* avoid writing to this until we have a new message */
+    priv->send_data.zerocopy_id = red_stream_zerocopy_get_next_id(priv->stream);
     send();
 }
 
@@ -1381,6 +1837,9 @@ inline bool RedChannelClient::prepare_pipe_add(RedPipeItem *item)
     if (priv->pipe.empty()) {
         priv->watch_update_mask(SPICE_WATCH_EVENT_READ | SPICE_WATCH_EVENT_WRITE);
     }
+    if (!priv->send_data.blocked && !priv->waiting_for_ack() && !is_bulk_item(item)) {
+        priv->set_tx_pending(true);
+    }
     return true;
 }
 
@@ -1492,7 +1951,50 @@ void RedChannelClientPrivate::clear_sent_item()
 {
     send_data.blocked = FALSE;
     send_data.size = 0;
-    spice_marshaller_reset(send_data.marshaller);
+    if (!zerocopy_hold_marshaller()) {
+        spice_marshaller_reset(send_data.marshaller);
+    }
+}
+
+/* If the message was sent with zero-copy writes the kernel still
+ * references its data, so the marshaller, and the references it
+ * holds to the items, cannot be reset. Keep it aside and replace
+ * it with a new one.
+ * Returns true if the marshaller was kept. */
+bool RedChannelClientPrivate::zerocopy_hold_marshaller()
+{
+    uint32_t next_id = red_stream_zerocopy_get_next_id(stream);
+
+    if (next_id == send_data.zerocopy_id) {
+        return false;
+    }
+    send_data.zerocopy_id = next_id;
+
+    zerocopy_marshallers.push_back({send_data.marshaller, next_id});
+    if (urgent_marshaller_is_active()) {
+        send_data.urgent.marshaller = spice_marshaller_new();
+        send_data.marshaller = send_data.urgent.marshaller;
+    } else {
+        send_data.main.marshaller = spice_marshaller_new();
+        send_data.marshaller = send_data.main.marshaller;
+    }
+    return true;
+}
+
+void RedChannelClientPrivate::zerocopy_release_marshallers()
+{
+    /* poll even if no marshaller is kept, notifications left in the
+     * error queue would wake up the main loop again and again */
+    uint32_t completed = red_stream_zerocopy_poll(stream);
+    while (!zerocopy_marshallers.empty()) {
+        auto& zc = zerocopy_marshallers.front();
+        /* identifiers wrap around */
+        if (static_cast<int32_t>(completed - zc.end_id) < 0) {
+            break;
+        }
+        spice_marshaller_destroy(zc.marshaller);
+        zerocopy_marshallers.pop_front();
+    }
 }
 
 // TODO: again - what is the context exactly? this happens in channel disconnect. but our
@@ -1537,6 +2039,10 @@ void RedChannelClient::disconnect()
     red_timer_remove(priv->connectivity_monitor.timer);
     priv->connectivity_monitor.timer = nullptr;
 
+    red_timer_remove(priv->tx.timer);
+    priv->tx.timer = nullptr;
+    priv->set_tx_pending(false);
+
     channel->remove_client(this);
     on_disconnect();
     // remove client from RedClient
@@ -1565,7 +2071,7 @@ RedStream *RedChannelClient::get_stream()
     return priv->stream;
 }
 
-RedClient *RedChannelClient::get_client()
+RedClient *RedChannelClient::get_client() const
 {
     return priv->client;
 }
@@ -1615,7 +2121,7 @@ bool RedChannelClient::wait_outgoing_item(int64_t timeout)
     uint64_t end_time;
     int blocked;
 
-    if (!is_blocked()) {
+    if (!is_blocked() && red_stream_flush(priv->stream)) {
         return TRUE;
     }
     if (timeout != -1) {
@@ -1629,7 +2135,7 @@ bool RedChannelClient::wait_outgoing_item(int64_t timeout)
         usleep(CHANNEL_BLOCKED_SLEEP_DURATION);
         receive();
         send();
-    } while ((blocked = is_blocked()) &&
+    } while ((blocked = is_blocked() || !red_stream_flush(priv->stream)) &&
              (timeout == -1 || spice_get_monotonic_time_ns() < end_time));
 
     if (blocked) {
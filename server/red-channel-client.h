@@ -29,6 +29,9 @@
 
 #include "push-visibility.h"
 
+/* maximum number of messages between acks, see RedChannelClient::update_ack_window */
+#define MAX_CLIENT_ACK_WINDOW 48
+
 struct RedChannelClientPrivate;
 
 class RedChannelClient: public red::shared_ptr_counted
@@ -108,6 +111,11 @@ public:
 
     bool is_blocked() const;
 
+    /* estimated time to send the data queued in the kernel and not sent
+     * yet, in nanoseconds. The data waiting for an acknowledgement are
+     * not counted, they do not delay new data */
+    uint64_t get_send_queue_delay();
+
     /* helper for channels that have complex logic that can possibly ready a send */
     int send_message_pending();
 
@@ -120,7 +128,7 @@ public:
     /* Note: the valid times to call red_channel_get_marshaller are just during send_item callback. */
     SpiceMarshaller *get_marshaller();
     RedStream *get_stream();
-    RedClient *get_client();
+    RedClient *get_client() const;
 
     /* Note that the header is valid only between reset_send_data and
      * begin_send_message.*/
@@ -164,6 +172,9 @@ protected:
 
     virtual void on_disconnect() {};
 
+    /* called when the channel updated the network estimate of the client */
+    virtual void on_net_estimate_update() {};
+
     // TODO: add ASSERTS for thread_id  in client and channel calls
     /*
      * callbacks that are triggered from channel client stream events.
@@ -171,6 +182,14 @@ protected:
      */
     virtual void send_item(RedPipeItem *item) {};
 
+    /* whether the item carries bulk data, sent with the lowest
+     * priority among the channels of the client */
+    virtual bool is_bulk_item(const RedPipeItem *item) const { return false; }
+
+    /* whether the items stay in the pipe while the data queued in the
+     * kernel take too long to be sent, so newer items can replace them */
+    virtual bool hold_when_congested() const { return false; }
+
     virtual bool handle_migrate_data(uint32_t size, void *message) { return false; }
     virtual bool handle_migrate_data_get_serial(uint32_t size, void *message, uint64_t &serial)
     {
@@ -185,6 +204,7 @@ private:
     virtual void handle_migrate_flush_mark();
     void handle_migrate_data_early(uint32_t size, void *message);
     inline bool prepare_pipe_add(RedPipeItem *item);
+    bool next_item_is_bulk();
     void pipe_add_before_pos(RedPipeItemPtr&& item, RedChannelClient::Pipe::iterator pipe_item_pos);
     void send_set_ack();
     void send_migrate();
@@ -192,8 +212,10 @@ private:
     void msg_sent();
     static void ping_timer(RedChannelClient *rcc);
     static void connectivity_timer(RedChannelClient *rcc);
+    static void tx_throttle_timer(RedChannelClient *rcc);
     void send_ping();
     void push_ping();
+    void update_ack_window();
 
     /* Private data */
 private:
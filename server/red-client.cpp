@@ -25,6 +25,7 @@ RedClient::~RedClient()
 {
     spice_debug("release client=%p", this);
     pthread_mutex_destroy(&lock);
+    pthread_mutex_destroy(&net_estimate_lock);
 }
 
 RedClient::RedClient(RedsState *init_reds, bool migrated):
@@ -32,6 +33,7 @@ RedClient::RedClient(RedsState *init_reds, bool migrated):
     during_target_migrate(migrated)
 {
     pthread_mutex_init(&lock, nullptr);
+    pthread_mutex_init(&net_estimate_lock, nullptr);
     thread_id = pthread_self();
 }
 
@@ -262,3 +264,69 @@ RedsState *RedClient::get_server()
 {
     return reds;
 }
+
+void RedClient::add_net_rtt_sample(uint64_t rtt_ns)
+{
+    pthread_mutex_lock(&net_estimate_lock);
+    net_estimate.add_rtt_sample(rtt_ns, spice_get_monotonic_time_ns());
+    pthread_mutex_unlock(&net_estimate_lock);
+}
+
+void RedClient::add_net_delivery_sample(uint64_t bytes, uint64_t interval_ns, bool app_limited)
+{
+    pthread_mutex_lock(&net_estimate_lock);
+    net_estimate.add_delivery_sample(bytes, interval_ns, app_limited);
+    pthread_mutex_unlock(&net_estimate_lock);
+}
+
+void RedClient::add_net_bit_rate_sample(uint64_t bit_rate, bool app_limited)
+{
+    pthread_mutex_lock(&net_estimate_lock);
+    net_estimate.add_bit_rate_sample(bit_rate, app_limited);
+    pthread_mutex_unlock(&net_estimate_lock);
+}
+
+NetEstimator RedClient::get_net_estimate()
+{
+    pthread_mutex_lock(&net_estimate_lock);
+    NetEstimator estimate = net_estimate;
+    pthread_mutex_unlock(&net_estimate_lock);
+    return estimate;
+}
+
+RedClientTxPriority red_client_get_tx_priority(uint32_t channel_type)
+{
+    switch (channel_type) {
+    case SPICE_CHANNEL_INPUTS:
+    case SPICE_CHANNEL_CURSOR:
+        return RED_CLIENT_TX_PRIORITY_INTERACTIVE;
+    case SPICE_CHANNEL_MAIN:
+        return RED_CLIENT_TX_PRIORITY_MAIN;
+    case SPICE_CHANNEL_DISPLAY:
+        return RED_CLIENT_TX_PRIORITY_DISPLAY;
+    case SPICE_CHANNEL_PLAYBACK:
+    case SPICE_CHANNEL_RECORD:
+        return RED_CLIENT_TX_PRIORITY_MEDIA;
+    default:
+        return RED_CLIENT_TX_PRIORITY_BULK;
+    }
+}
+
+void RedClient::set_tx_pending(RedClientTxPriority priority, bool pending)
+{
+    if (pending) {
+        g_atomic_int_inc(&tx_pending[priority]);
+    } else {
+        g_atomic_int_add(&tx_pending[priority], -1);
+    }
+}
+
+bool RedClient::is_tx_pending_above(RedClientTxPriority priority)
+{
+    for (int i = 0; i < priority; i++) {
+        if (g_atomic_int_get(&tx_pending[i]) > 0) {
+            return true;
+        }
+    }
+    return false;
+}
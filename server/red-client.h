@@ -20,12 +20,29 @@
 #define RED_CLIENT_H_
 
 #include "main-channel-client.h"
+#include "net-estimator.h"
 #include "safe-list.hpp"
 
 #include "push-visibility.h"
 
 RedClient *red_client_new(RedsState *reds, int migrated);
 
+/* Priorities of the channels of a client when sending, lower values
+ * are more urgent. Channels of a client share the same network path,
+ * a channel does not start new messages while a channel with an
+ * higher priority has messages it can write, see RedChannelClient::push */
+enum RedClientTxPriority {
+    RED_CLIENT_TX_PRIORITY_INTERACTIVE, /* inputs, cursor */
+    RED_CLIENT_TX_PRIORITY_MAIN,
+    RED_CLIENT_TX_PRIORITY_DISPLAY,
+    RED_CLIENT_TX_PRIORITY_MEDIA, /* playback, record */
+    RED_CLIENT_TX_PRIORITY_BULK, /* usbredir, smartcard, ports */
+
+    RED_CLIENT_TX_PRIORITY_NUM
+};
+
+RedClientTxPriority red_client_get_tx_priority(uint32_t channel_type);
+
 class RedClient final
 {
 public:
@@ -66,6 +83,19 @@ public:
     void set_disconnecting();
     RedsState* get_server();
 
+    /* network estimate of the client, fed by all its channels,
+     * can be called from any thread */
+    void add_net_rtt_sample(uint64_t rtt_ns);
+    void add_net_delivery_sample(uint64_t bytes, uint64_t interval_ns, bool app_limited);
+    void add_net_bit_rate_sample(uint64_t bit_rate, bool app_limited);
+    NetEstimator get_net_estimate();
+
+    /* transmit scheduling, a channel client with @priority has
+     * (or no longer has) messages to send, can be called from any thread */
+    void set_tx_pending(RedClientTxPriority priority, bool pending);
+    /* whether channel clients more urgent than @priority have messages to send */
+    bool is_tx_pending_above(RedClientTxPriority priority);
+
 private:
     RedChannelClient *get_channel(int type, int id);
 
@@ -88,6 +118,12 @@ private:
     int seamless_migrate;
     int num_migrated_channels; /* for seamless - number of channels that wait for migrate data*/
 
+    NetEstimator net_estimate;
+    pthread_mutex_t net_estimate_lock;
+
+    /* number of channel clients with messages to send, per priority */
+    gint tx_pending[RED_CLIENT_TX_PRIORITY_NUM] = {};
+
     gint _ref = 1;
 };
 
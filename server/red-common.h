@@ -52,6 +52,45 @@ typedef struct SpiceCoreInterfaceInternal SpiceCoreInterfaceInternal;
 extern const SpiceCoreInterfaceInternal event_loop_core;
 extern const SpiceCoreInterfaceInternal core_interface_adapter;
 
+/* Timers with a resolution of a few milliseconds, for timeouts like
+ * the pings. The coarse timers of a loop share a timer wheel driven by
+ * a single timer of the loop, the loop must not be destroyed before */
+typedef struct TimerWheel TimerWheel;
+
+TimerWheel *timer_wheel_new(const SpiceCoreInterfaceInternal *iface);
+/* all the timers of the wheel must be removed before */
+void timer_wheel_free(TimerWheel *wheel);
+/* timers of iface->coarse_timers, or normal ones if not set */
+SpiceTimer *red_coarse_timer_add(const SpiceCoreInterfaceInternal *iface,
+                                 SpiceTimerFunc func, void *opaque);
+
+#ifdef HAVE_SYS_EPOLL_H
+/* Event loop based on epoll, for the loops of the threads we own.
+ * Watches are edge triggered: a callback must handle the file
+ * descriptor until it would block or change the event mask, which
+ * reports again the events already pending. */
+typedef struct EventLoopEpoll EventLoopEpoll;
+
+/* Called at each iteration of event_loop_epoll_run(), like the
+ * functions of a GSource. prepare() can reduce the timeout (in
+ * milliseconds, -1 for infinite) and returns true to dispatch
+ * without waiting, check() is called after waiting */
+typedef struct EventLoopEpollHooks {
+    bool (*prepare)(void *opaque, int *timeout);
+    bool (*check)(void *opaque);
+    void (*dispatch)(void *opaque);
+} EventLoopEpollHooks;
+
+/* returns NULL if epoll is not available, @core is initialized
+ * to add timers and watches to the new loop */
+EventLoopEpoll *event_loop_epoll_new(SpiceCoreInterfaceInternal *core);
+/* timers and watches must be removed before */
+void event_loop_epoll_free(EventLoopEpoll *loop);
+void event_loop_epoll_run(EventLoopEpoll *loop, const EventLoopEpollHooks *hooks, void *opaque);
+/* must be called from the loop thread */
+void event_loop_epoll_quit(EventLoopEpoll *loop);
+#endif
+
 SPICE_END_DECLS
 
 struct SpiceCoreInterfaceInternal {
@@ -61,11 +100,17 @@ struct SpiceCoreInterfaceInternal {
 
     void (*channel_event)(const SpiceCoreInterfaceInternal *iface, int event, SpiceChannelEventInfo *info);
 
+    TimerWheel *coarse_timers;
+
 #ifdef __cplusplus
     template <typename T>
     inline SpiceTimer *timer_new(void (*func)(T*), T *opaque) const
     { return this->timer_add(this, (SpiceTimerFunc) func, opaque); }
 
+    template <typename T>
+    inline SpiceTimer *coarse_timer_new(void (*func)(T*), T *opaque) const
+    { return red_coarse_timer_add(this, (SpiceTimerFunc) func, opaque); }
+
     template <typename T>
     inline SpiceWatch *watch_new(int fd, int event_mask, void (*func)(int,int,T*), T* opaque) const
     { return this->watch_add(this, fd, event_mask, (SpiceWatchFunc) func, opaque); }
@@ -76,7 +121,8 @@ struct SpiceCoreInterfaceInternal {
      * implement the core interface in a couple different ways. The first
      * method is to use a public SpiceCoreInterface provided to us by the
      * library user (for example, qemu). The second method is to implement the
-     * core interface functions using the glib event loop. In order to avoid
+     * core interface functions using the glib event loop, or epoll for the
+     * threads we own (see EventLoopEpoll). In order to avoid
      * global variables, each method needs to store additional data in this
      * adapter structure. Instead of using a generic void* data parameter, we
      * provide a bit more type-safety by using a union to store the type of
@@ -85,6 +131,7 @@ struct SpiceCoreInterfaceInternal {
     union {
         GMainContext *main_context;
         SpiceCoreInterface *public_interface;
+        struct EventLoopEpoll *epoll_loop;
     };
 };
 
@@ -319,26 +319,16 @@ StreamDevice::handle_msg_data()
     spice_extra_assert(hdr_pos >= sizeof(StreamDevHeader));
     spice_extra_assert(hdr.type == STREAM_TYPE_DATA);
 
-    /* make sure we have a large enough buffer for the whole frame */
-    /* ---
-     * TODO: Now that we copy partial data into the buffer, for each frame
-     * the buffer is allocated and freed (look for g_realloc in
-     * partial_read).
-     * Probably better to just keep the larger buffer.
-     */
+    /* the frame is read straight into the buffer it is sent from */
     if (msg_pos == 0) {
         frame_mmtime = reds_get_mm_time();
         record(stream_device_data, "Stream data packet size %u mm_time %u",
                hdr.size, frame_mmtime);
-        if (msg_len < hdr.size) {
-            g_free(msg);
-            msg = static_cast<StreamDevice::AllMessages *>(g_malloc(hdr.size));
-            msg_len = hdr.size;
-        }
+        frame = stream_channel->get_frame(hdr.size);
     }
 
     /* read from device */
-    n = read(msg->buf + msg_pos, hdr.size - msg_pos);
+    n = read(frame->data + msg_pos, hdr.size - msg_pos);
     if (n <= 0) {
         return msg_pos == hdr.size;
     }
@@ -349,7 +339,8 @@ StreamDevice::handle_msg_data()
     }
 
     /* The whole frame was read from the device, send it */
-    stream_channel->send_data(msg->buf, hdr.size, frame_mmtime);
+    stream_channel->send_frame(frame, frame_mmtime);
+    frame.reset();
 
     return true;
 }
@@ -655,6 +646,7 @@ StreamDevice::port_event(uint8_t event)
     }
     hdr_pos = 0;
     msg_pos = 0;
+    frame.reset();
     has_error = false;
     flow_stopped = false;
     reset();
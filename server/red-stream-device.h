@@ -33,6 +33,7 @@ struct StreamDevice;
 
 // forward declarations
 struct StreamChannel;
+struct StreamFrame;
 struct CursorChannel;
 struct StreamQueueStat;
 
@@ -85,6 +86,8 @@ private:
     uint8_t guest_capabilities[MAX_GUEST_CAPABILITIES_BYTES];
     red::shared_ptr<StreamChannel> stream_channel;
     red::shared_ptr<CursorChannel> cursor_channel;
+    /* the frame being read, released before the channel */
+    red::shared_ptr<StreamFrame> frame;
     SpiceTimer *close_timer;
     uint32_t frame_mmtime;
     StreamDeviceDisplayInfo device_display_info;
@@ -29,6 +29,9 @@
 #else
 #include <ws2tcpip.h>
 #endif
+#ifdef HAVE_LINUX_ERRQUEUE_H
+#include <linux/errqueue.h> /* sock_extended_err */
+#endif
 
 #include <glib.h>
 
@@ -48,6 +51,28 @@
 #define TCP_CORK TCP_NOPUSH
 #endif
 
+/* size of the transmit buffer used when write batching is enabled */
+#define RED_STREAM_BATCH_BUF_SIZE (64 * 1024)
+/* writes bigger than this are not copied in the transmit buffer */
+#define RED_STREAM_BATCH_MAX_WRITE 4096
+
+/* MSG_ZEROCOPY is a Linux only feature, completions are reported
+ * in the socket error queue */
+#if defined(HAVE_LINUX_ERRQUEUE_H) && defined(SO_ZEROCOPY) && \
+    defined(MSG_ZEROCOPY) && defined(SO_EE_ORIGIN_ZEROCOPY)
+#define RED_STREAM_ZEROCOPY 1
+#endif
+
+/* kernel TLS offload, requires OpenSSL 3.0 */
+#if defined(SSL_OP_ENABLE_KTLS) && !defined(OPENSSL_NO_KTLS) && defined(BIO_get_ktls_send)
+#define RED_STREAM_KTLS 1
+#endif
+
+struct ZeroCopyRange {
+    uint32_t lo;
+    uint32_t hi;
+};
+
 struct AsyncRead {
     void *opaque;
     uint8_t *now;
@@ -81,6 +106,8 @@ struct RedSASL {
 
 struct RedStreamPrivate {
     SSL *ssl;
+    /* the kernel encrypts the data written to the socket */
+    bool ktls_send;
 
 #if HAVE_SASL
     RedSASL sasl;
@@ -98,6 +125,30 @@ struct RedStreamPrivate {
     bool use_cork;
     bool corked;
 
+    /* transmit buffer used for write batching,
+     * buf is NULL if batching is disabled */
+    struct {
+        uint8_t *buf;
+        size_t pos;
+        size_t len;
+        /* last attempt to write queued data would block */
+        bool blocked;
+        /* queued data are being written */
+        bool draining;
+    } tx_batch;
+
+    /* zero-copy transmission state, threshold is 0 if disabled */
+    struct {
+        size_t threshold;
+        /* identifier of the next zero-copy write */
+        uint32_t next_id;
+        /* all writes before this identifier are completed */
+        uint32_t completed;
+        /* ranges of writes completed out of order */
+        GArray *pending;
+        bool copied_reported;
+    } zerocopy;
+
     ssize_t (*read)(RedStream *s, void *buf, size_t nbyte);
     ssize_t (*write)(RedStream *s, const void *buf, size_t nbyte);
     ssize_t (*writev)(RedStream *s, const struct iovec *iov, int iovcnt);
@@ -157,6 +208,46 @@ static ssize_t stream_writev_cb(RedStream *s, const struct iovec *iov, int iovcn
     return ret;
 }
 
+#ifdef RED_STREAM_ZEROCOPY
+static ssize_t stream_writev_zerocopy_cb(RedStream *s, const struct iovec *iov, int iovcnt)
+{
+    auto zc = &s->priv->zerocopy;
+    size_t largest = 0;
+    int i;
+
+#ifdef IOV_MAX
+    if (iovcnt > IOV_MAX) {
+        return stream_writev_cb(s, iov, iovcnt);
+    }
+#endif
+    for (i = 0; i < iovcnt; i++) {
+        largest = MAX(largest, iov[i].iov_len);
+    }
+    /* pinning pages and handling the completion costs more
+     * than copying small buffers */
+    if (largest < zc->threshold) {
+        return stream_writev_cb(s, iov, iovcnt);
+    }
+
+    struct msghdr msgh = { nullptr, };
+    msgh.msg_iov = const_cast<struct iovec *>(iov);
+    msgh.msg_iovlen = iovcnt;
+
+    ssize_t n = sendmsg(s->socket, &msgh, MSG_ZEROCOPY | MSG_NOSIGNAL);
+    if (n < 0 && errno == ENOBUFS) {
+        /* too many pages pinned or completions not read yet,
+         * fall back to a normal copy */
+        return stream_writev_cb(s, iov, iovcnt);
+    }
+    /* the kernel assigns an identifier only to writes
+     * which sent some data */
+    if (n > 0) {
+        zc->next_id++;
+    }
+    return n;
+}
+#endif
+
 static ssize_t stream_read_cb(RedStream *s, void *buf, size_t size)
 {
     return socket_read(s->socket, buf, size);
@@ -198,6 +289,22 @@ static ssize_t stream_ssl_write_cb(RedStream *s, const void *buf, size_t size)
     return return_code;
 }
 
+#ifdef RED_STREAM_KTLS
+/* Once the handshake is done, with kernel TLS the socket encrypts
+ * the data itself, so plain data can be written directly avoiding
+ * the copy to OpenSSL buffers and allowing writev. */
+static void red_stream_ssl_enable_ktls(RedStream *s)
+{
+    if (!BIO_get_ktls_send(SSL_get_wbio(s->priv->ssl))) {
+        return;
+    }
+
+    s->priv->ktls_send = true;
+    s->priv->write = stream_write_cb;
+    s->priv->writev = stream_writev_cb;
+}
+#endif
+
 static ssize_t stream_ssl_read_cb(RedStream *s, void *buf, size_t size)
 {
     int return_code;
@@ -235,6 +342,66 @@ ssize_t red_stream_read(RedStream *s, void *buf, size_t nbyte)
     return ret;
 }
 
+#if HAVE_SASL
+static ssize_t red_stream_sasl_write(RedStream *s, const void *buf, size_t nbyte);
+#endif
+
+static ssize_t red_stream_write_unbatched(RedStream *s, const void *buf, size_t nbyte)
+{
+    ssize_t ret;
+
+#if HAVE_SASL
+    if (s->priv->sasl.conn && s->priv->sasl.runSSF) {
+        ret = red_stream_sasl_write(s, buf, nbyte);
+    } else
+#endif
+        ret = s->priv->write(s, buf, nbyte);
+
+    return ret;
+}
+
+/**
+ * Write the data queued in the transmit buffer.
+ *
+ * Returns true if no more data are queued, false otherwise
+ * with errno set.
+ */
+static bool red_stream_batch_drain(RedStream *s)
+{
+    auto batch = &s->priv->tx_batch;
+
+    while (batch->pos < batch->len) {
+        batch->draining = true;
+        ssize_t n = red_stream_write_unbatched(s, batch->buf + batch->pos,
+                                               batch->len - batch->pos);
+        batch->draining = false;
+        if (n <= 0) {
+            if (n == 0) {
+                errno = EPIPE;
+            } else if (errno == EINTR) {
+                continue;
+            }
+            batch->blocked = (errno == EAGAIN);
+            return false;
+        }
+        batch->pos += n;
+    }
+    batch->pos = 0;
+    batch->len = 0;
+    batch->blocked = false;
+    return true;
+}
+
+ssize_t red_stream_write(RedStream *s, const void *buf, size_t nbyte)
+{
+    /* queued data must be sent before */
+    if (!red_stream_batch_drain(s)) {
+        return -1;
+    }
+
+    return red_stream_write_unbatched(s, buf, nbyte);
+}
+
 bool red_stream_write_all(RedStream *stream, const void *in_buf, size_t n)
 {
     const uint8_t *buf = (uint8_t *)in_buf;
@@ -273,30 +440,169 @@ bool red_stream_set_auto_flush(RedStream *s, bool auto_flush)
     return true;
 }
 
-void red_stream_flush(RedStream *s)
+bool red_stream_set_write_batching(RedStream *s, bool batching)
+{
+    auto batch = &s->priv->tx_batch;
+
+    if (batching == (batch->buf != nullptr)) {
+        return true;
+    }
+
+    if (batching) {
+        batch->buf = static_cast<uint8_t *>(g_malloc(RED_STREAM_BATCH_BUF_SIZE));
+        return true;
+    }
+
+    if (!red_stream_batch_drain(s)) {
+        return false;
+    }
+    g_free(batch->buf);
+    batch->buf = nullptr;
+    return true;
+}
+
+bool red_stream_flush(RedStream *s)
 {
+    bool flushed = red_stream_batch_drain(s);
+
+    if (!flushed && errno != EAGAIN) {
+        /* the connection is broken, the error will be
+         * reported by the next read or write */
+        s->priv->tx_batch.pos = 0;
+        s->priv->tx_batch.len = 0;
+        flushed = true;
+    }
+
     if (s->priv->corked) {
         socket_set_cork(s->socket, 0);
         socket_set_cork(s->socket, 1);
     }
+    return flushed;
 }
 
+bool red_stream_enable_zerocopy(RedStream *s, size_t threshold)
+{
+#ifdef RED_STREAM_ZEROCOPY
+    auto zc = &s->priv->zerocopy;
+    int family = red_stream_get_family(s);
+    int enable = 1;
+
+    spice_return_val_if_fail(threshold > 0, false);
+
+    if (zc->threshold) {
+        zc->threshold = threshold;
+        return true;
+    }
+
+    /* the data must be sent as is, encrypted or encoded
+     * streams copy them anyway */
+    if ((family != AF_INET && family != AF_INET6) ||
+        s->priv->writev != stream_writev_cb || s->priv->ssl || s->priv->ws) {
+        return false;
+    }
 #if HAVE_SASL
-static ssize_t red_stream_sasl_write(RedStream *s, const void *buf, size_t nbyte);
+    if (s->priv->sasl.conn) {
+        return false;
+    }
 #endif
 
-ssize_t red_stream_write(RedStream *s, const void *buf, size_t nbyte)
+    if (setsockopt(s->socket, SOL_SOCKET, SO_ZEROCOPY, &enable, sizeof(enable)) != 0) {
+        spice_debug("SO_ZEROCOPY not supported: %s", strerror(errno));
+        return false;
+    }
+
+    zc->threshold = threshold;
+    if (!zc->pending) {
+        zc->pending = g_array_new(FALSE, FALSE, sizeof(ZeroCopyRange));
+    }
+    s->priv->writev = stream_writev_zerocopy_cb;
+    return true;
+#else
+    return false;
+#endif
+}
+
+uint32_t red_stream_zerocopy_get_next_id(RedStream *s)
 {
-    ssize_t ret;
+    return s->priv->zerocopy.next_id;
+}
 
-#if HAVE_SASL
-    if (s->priv->sasl.conn && s->priv->sasl.runSSF) {
-        ret = red_stream_sasl_write(s, buf, nbyte);
-    } else
+#ifdef RED_STREAM_ZEROCOPY
+static void red_stream_zerocopy_complete(RedStream *s, uint32_t lo, uint32_t hi)
+{
+    auto zc = &s->priv->zerocopy;
+
+    if (lo != zc->completed) {
+        ZeroCopyRange range = { lo, hi };
+        g_array_append_val(zc->pending, range);
+        return;
+    }
+
+    zc->completed = hi + 1;
+    /* merge the ranges completed out of order */
+    for (guint i = 0; i < zc->pending->len; ) {
+        auto range = &g_array_index(zc->pending, ZeroCopyRange, i);
+        if (range->lo == zc->completed) {
+            zc->completed = range->hi + 1;
+            g_array_remove_index_fast(zc->pending, i);
+            i = 0;
+        } else {
+            i++;
+        }
+    }
+}
 #endif
-        ret = s->priv->write(s, buf, nbyte);
 
-    return ret;
+uint32_t red_stream_zerocopy_poll(RedStream *s)
+{
+    auto zc = &s->priv->zerocopy;
+
+#ifdef RED_STREAM_ZEROCOPY
+    if (!zc->threshold) {
+        return zc->completed;
+    }
+
+    /* read the error queue even if all the writes are known to be
+     * completed, while not empty the socket reports an error */
+    for (;;) {
+        struct msghdr msgh = { nullptr, };
+        union {
+            struct cmsghdr hdr;
+            char data[CMSG_SPACE(sizeof(struct sock_extended_err) +
+                                 sizeof(struct sockaddr_in6))];
+        } control;
+        struct cmsghdr *cmsg;
+
+        msgh.msg_control = control.data;
+        msgh.msg_controllen = sizeof(control.data);
+        if (recvmsg(s->socket, &msgh, MSG_ERRQUEUE) < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            /* EAGAIN, no more notifications */
+            break;
+        }
+
+        for (cmsg = CMSG_FIRSTHDR(&msgh); cmsg; cmsg = CMSG_NXTHDR(&msgh, cmsg)) {
+            if (!(cmsg->cmsg_level == SOL_IP && cmsg->cmsg_type == IP_RECVERR) &&
+                !(cmsg->cmsg_level == SOL_IPV6 && cmsg->cmsg_type == IPV6_RECVERR)) {
+                continue;
+            }
+            auto serr = reinterpret_cast<struct sock_extended_err *>(CMSG_DATA(cmsg));
+            if (serr->ee_errno != 0 || serr->ee_origin != SO_EE_ORIGIN_ZEROCOPY) {
+                continue;
+            }
+            if ((serr->ee_code & SO_EE_CODE_ZEROCOPY_COPIED) && !zc->copied_reported) {
+                /* happens for instance on loopback or with devices
+                 * not supporting scatter-gather */
+                spice_debug("zero-copy write was copied by the kernel");
+                zc->copied_reported = true;
+            }
+            red_stream_zerocopy_complete(s, serr->ee_info, serr->ee_data);
+        }
+    }
+#endif
+    return zc->completed;
 }
 
 int red_stream_get_family(const RedStream *s)
@@ -363,6 +669,13 @@ int red_stream_send_msgfd(RedStream *stream, int fd)
 
     spice_return_val_if_fail(red_stream_is_plain_unix(stream), -1);
 
+    /* queued data must be received before the file descriptor, if the
+     * socket cannot take them fail with EAGAIN so the caller retries
+     * once the socket is writable */
+    if (!red_stream_batch_drain(stream)) {
+        return -1;
+    }
+
     /* set the payload */
     iov.iov_base = const_cast<char *>("@");
     iov.iov_len = 1;
@@ -386,24 +699,25 @@ int red_stream_send_msgfd(RedStream *stream, int fd)
 
     do {
         r = sendmsg(stream->socket, &msgh, MSG_NOSIGNAL);
-    } while (r < 0 && (errno == EINTR || errno == EAGAIN));
+    } while (r < 0 && errno == EINTR);
 
     return r;
 }
 #endif
 
-ssize_t red_stream_writev(RedStream *s, const struct iovec *iov, int iovcnt)
+static ssize_t red_stream_writev_unbatched(RedStream *s, const struct iovec *iov, int iovcnt)
 {
     int i;
     int n;
     ssize_t ret = 0;
 
-    if (s->priv->writev != nullptr && iovcnt > 1) {
+    /* zero-copy writes are done only by the writev callback */
+    if (s->priv->writev != nullptr && (iovcnt > 1 || s->priv->zerocopy.threshold)) {
         return s->priv->writev(s, iov, iovcnt);
     }
 
     for (i = 0; i < iovcnt; ++i) {
-        n = red_stream_write(s, iov[i].iov_base, iov[i].iov_len);
+        n = red_stream_write_unbatched(s, iov[i].iov_base, iov[i].iov_len);
         if (n <= 0)
             return ret == 0 ? n : ret;
         ret += n;
@@ -412,6 +726,40 @@ ssize_t red_stream_writev(RedStream *s, const struct iovec *iov, int iovcnt)
     return ret;
 }
 
+ssize_t red_stream_writev(RedStream *s, const struct iovec *iov, int iovcnt)
+{
+    auto batch = &s->priv->tx_batch;
+    size_t size = 0;
+    int i;
+
+    if (batch->buf == nullptr) {
+        return red_stream_writev_unbatched(s, iov, iovcnt);
+    }
+
+    for (i = 0; i < iovcnt; ++i) {
+        size += iov[i].iov_len;
+    }
+
+    /* make room for the new data or, if the data are too big
+     * to be queued, preserve the ordering with queued data */
+    if (batch->blocked || size > RED_STREAM_BATCH_MAX_WRITE ||
+        batch->len + size > RED_STREAM_BATCH_BUF_SIZE) {
+        if (!red_stream_batch_drain(s)) {
+            return -1;
+        }
+    }
+
+    if (size > RED_STREAM_BATCH_MAX_WRITE) {
+        return red_stream_writev_unbatched(s, iov, iovcnt);
+    }
+
+    for (i = 0; i < iovcnt; ++i) {
+        memcpy(batch->buf + batch->len, iov[i].iov_base, iov[i].iov_len);
+        batch->len += iov[i].iov_len;
+    }
+    return size;
+}
+
 void red_stream_free(RedStream *s)
 {
     if (!s) {
@@ -435,6 +783,10 @@ void red_stream_free(RedStream *s)
     }
 
     websocket_free(s->priv->ws);
+    g_free(s->priv->tx_batch.buf);
+    if (s->priv->zerocopy.pending) {
+        g_array_unref(s->priv->zerocopy.pending);
+    }
 
     red_stream_remove_watch(s);
     socket_close(s->socket);
@@ -508,6 +860,16 @@ bool red_stream_is_ssl(RedStream *stream)
     return (stream->priv->ssl != nullptr);
 }
 
+bool red_stream_is_ktls(RedStream *stream)
+{
+    return stream->priv->ktls_send;
+}
+
+bool red_stream_is_ssl_resumed(RedStream *stream)
+{
+    return stream->priv->ssl && SSL_session_reused(stream->priv->ssl);
+}
+
 static void red_stream_disable_writev(RedStream *stream)
 {
     stream->priv->writev = nullptr;
@@ -520,6 +882,9 @@ RedStreamSslStatus red_stream_ssl_accept(RedStream *stream)
 
     return_code = SSL_accept(stream->priv->ssl);
     if (return_code == 1) {
+#ifdef RED_STREAM_KTLS
+        red_stream_ssl_enable_ktls(stream);
+#endif
         return RED_STREAM_SSL_STATUS_OK;
     }
 
@@ -545,21 +910,21 @@ RedStreamSslStatus red_stream_ssl_accept(RedStream *stream)
     return RED_STREAM_SSL_STATUS_ERROR;
 }
 
-RedStreamSslStatus red_stream_enable_ssl(RedStream *stream, SSL_CTX *ctx)
+bool red_stream_setup_ssl(RedStream *stream, SSL_CTX *ctx)
 {
     BIO *sbio;
 
     // Handle SSL handshaking
     if (!(sbio = BIO_new_socket(stream->socket, BIO_NOCLOSE))) {
         spice_warning("could not allocate ssl bio socket");
-        return RED_STREAM_SSL_STATUS_ERROR;
+        return false;
     }
 
     stream->priv->ssl = SSL_new(ctx);
     if (!stream->priv->ssl) {
         spice_warning("could not allocate ssl context");
         BIO_free(sbio);
-        return RED_STREAM_SSL_STATUS_ERROR;
+        return false;
     }
 
     SSL_set_bio(stream->priv->ssl, sbio, sbio);
@@ -568,6 +933,14 @@ RedStreamSslStatus red_stream_enable_ssl(RedStream *stream, SSL_CTX *ctx)
     stream->priv->read = stream_ssl_read_cb;
     red_stream_disable_writev(stream);
 
+    return true;
+}
+
+RedStreamSslStatus red_stream_enable_ssl(RedStream *stream, SSL_CTX *ctx)
+{
+    if (!red_stream_setup_ssl(stream, ctx)) {
+        return RED_STREAM_SSL_STATUS_ERROR;
+    }
     return red_stream_ssl_accept(stream);
 }
 
@@ -825,6 +1198,10 @@ struct RedSASLAuth {
     // saved Async callback, we need to call if failed as
     // we need to chain it in order to use a different opaque data
     AsyncReadError saved_error_cb;
+    // result of the step computed in the offload pool
+    int step_err;
+    const char *serverout;
+    unsigned int serveroutlen;
 };
 
 static void red_sasl_auth_free(RedSASLAuth *auth)
@@ -889,15 +1266,13 @@ static void red_sasl_handle_auth_steplen(void *opaque);
  * u8 continue
  */
 
-static void red_sasl_handle_auth_step(void *opaque)
+/* Computing a step can be expensive (GSSAPI for instance) so it runs
+ * in the offload pool, the stream is not used meanwhile */
+static void red_sasl_auth_step_work(void *opaque)
 {
     RedSASLAuth *auth = (RedSASLAuth*) opaque;
-    RedStream *stream = auth->stream;
-    const char *serverout;
-    unsigned int serveroutlen;
-    int err;
     char *clientdata = NULL;
-    RedSASL *sasl = &stream->priv->sasl;
+    RedSASL *sasl = &auth->stream->priv->sasl;
     uint32_t datalen = auth->len;
 
     /* NB, distinction of NULL vs "" is *critical* in SASL */
@@ -910,22 +1285,33 @@ static void red_sasl_handle_auth_step(void *opaque)
     if (auth->mechname != NULL) {
         spice_debug("Start SASL auth with mechanism %s. Data %p (%d bytes)",
                     auth->mechname, clientdata, datalen);
-        err = sasl_server_start(sasl->conn,
-                                auth->mechname,
-                                clientdata,
-                                datalen,
-                                &serverout,
-                                &serveroutlen);
+        auth->step_err = sasl_server_start(sasl->conn,
+                                           auth->mechname,
+                                           clientdata,
+                                           datalen,
+                                           &auth->serverout,
+                                           &auth->serveroutlen);
         g_free(auth->mechname);
         auth->mechname = NULL;
     } else {
         spice_debug("Step using SASL Data %p (%d bytes)", clientdata, datalen);
-        err = sasl_server_step(sasl->conn,
-                               clientdata,
-                               datalen,
-                               &serverout,
-                               &serveroutlen);
+        auth->step_err = sasl_server_step(sasl->conn,
+                                          clientdata,
+                                          datalen,
+                                          &auth->serverout,
+                                          &auth->serveroutlen);
     }
+}
+
+static void red_sasl_auth_step_done(void *opaque)
+{
+    RedSASLAuth *auth = (RedSASLAuth*) opaque;
+    RedStream *stream = auth->stream;
+    const char *serverout = auth->serverout;
+    unsigned int serveroutlen = auth->serveroutlen;
+    int err = auth->step_err;
+    RedSASL *sasl = &stream->priv->sasl;
+
     if (err != SASL_OK &&
         err != SASL_CONTINUE) {
         spice_warning("sasl step failed %d (%s)",
@@ -986,6 +1372,23 @@ authreject:
     red_sasl_async_result(auth, RED_SASL_ERROR_AUTH_FAILED);
 }
 
+/* the server is being destroyed, close the connection */
+static void red_sasl_auth_step_cancel(void *opaque)
+{
+    RedSASLAuth *auth = (RedSASLAuth*) opaque;
+
+    red_sasl_async_result(auth, RED_SASL_ERROR_GENERIC);
+}
+
+static void red_sasl_handle_auth_step(void *opaque)
+{
+    RedSASLAuth *auth = (RedSASLAuth*) opaque;
+
+    reds_offload(auth->stream->priv->reds,
+                 red_sasl_auth_step_work, red_sasl_auth_step_done,
+                 red_sasl_auth_step_cancel, auth);
+}
+
 static void red_sasl_handle_auth_steplen(void *opaque)
 {
     RedSASLAuth *auth = (RedSASLAuth*) opaque;
@@ -1178,14 +1581,49 @@ static ssize_t stream_websocket_read(RedStream *s, void *buf, size_t size)
     return len;
 }
 
+/* Messages smaller than this are not worth compressing */
+#define WEBSOCKET_COMPRESS_MIN_SIZE 64
+
+/* Choose the flags of the frame to write.
+ * Control channels carry small and very repetitive messages, always
+ * compress them. Display channels carry mostly images and video that
+ * are already compressed, compress only the trains of small drawing
+ * commands collected in the transmit buffer. */
+static unsigned stream_websocket_flags(RedStream *s, size_t size)
+{
+    if (!websocket_is_deflate_enabled(s->priv->ws) || size < WEBSOCKET_COMPRESS_MIN_SIZE) {
+        return WEBSOCKET_BINARY_FINAL;
+    }
+
+    switch (s->priv->info->type) {
+    case SPICE_CHANNEL_MAIN:
+    case SPICE_CHANNEL_INPUTS:
+    case SPICE_CHANNEL_CURSOR:
+        return WEBSOCKET_BINARY_FINAL | WEBSOCKET_COMPRESS;
+    case SPICE_CHANNEL_DISPLAY:
+        if (s->priv->tx_batch.draining) {
+            return WEBSOCKET_BINARY_FINAL | WEBSOCKET_COMPRESS;
+        }
+        break;
+    default:
+        break;
+    }
+    return WEBSOCKET_BINARY_FINAL;
+}
+
 static ssize_t stream_websocket_write(RedStream *s, const void *buf, size_t size)
 {
-    return websocket_write(s->priv->ws, buf, size, WEBSOCKET_BINARY_FINAL);
+    return websocket_write(s->priv->ws, buf, size, stream_websocket_flags(s, size));
 }
 
 static ssize_t stream_websocket_writev(RedStream *s, const struct iovec *iov, int iovcnt)
 {
-    return websocket_writev(s->priv->ws, iov, iovcnt, WEBSOCKET_BINARY_FINAL);
+    size_t size = 0;
+
+    for (int i = 0; i < iovcnt; i++) {
+        size += iov[i].iov_len;
+    }
+    return websocket_writev(s->priv->ws, iov, iovcnt, stream_websocket_flags(s, size));
 }
 
 /*
@@ -1203,7 +1641,8 @@ bool red_stream_is_websocket(RedStream *stream, const void *buf, size_t len)
     stream->priv->ws =
         websocket_new(buf, len, stream, reinterpret_cast<websocket_read_cb_t>(stream->priv->read),
                       reinterpret_cast<websocket_write_cb_t>(stream->priv->write),
-                      reinterpret_cast<websocket_writev_cb_t>(stream->priv->writev));
+                      reinterpret_cast<websocket_writev_cb_t>(stream->priv->writev),
+                      reds_get_websocket_deflate_config(stream->priv->reds));
     if (stream->priv->ws) {
         stream->priv->read = stream_websocket_read;
         stream->priv->write = stream_websocket_write;
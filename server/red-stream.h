@@ -63,13 +63,21 @@ void red_stream_set_channel(RedStream *stream, int connection_id,
 RedStream *red_stream_new(RedsState *reds, int socket);
 void red_stream_set_core_interface(RedStream *stream, SpiceCoreInterfaceInternal *core);
 bool red_stream_is_ssl(RedStream *stream);
+/* true if encryption of the sent data is offloaded to the kernel */
+bool red_stream_is_ktls(RedStream *stream);
+/* true if the TLS handshake resumed a previous session */
+bool red_stream_is_ssl_resumed(RedStream *stream);
 RedStreamSslStatus red_stream_ssl_accept(RedStream *stream);
+/* prepare the stream for TLS, the handshake is done by red_stream_ssl_accept() */
+bool red_stream_setup_ssl(RedStream *stream, SSL_CTX *ctx);
 RedStreamSslStatus red_stream_enable_ssl(RedStream *stream, SSL_CTX *ctx);
 int red_stream_get_family(const RedStream *stream);
 bool red_stream_is_plain_unix(const RedStream *stream);
 bool red_stream_set_no_delay(RedStream *stream, bool no_delay);
 int red_stream_get_no_delay(RedStream *stream);
 #ifndef _WIN32
+/* send a file descriptor after the queued data, fails with EAGAIN
+ * if the socket cannot take them yet */
 int red_stream_send_msgfd(RedStream *stream, int fd);
 #endif
 
@@ -86,12 +94,59 @@ int red_stream_send_msgfd(RedStream *stream, int fd);
  */
 bool red_stream_set_auto_flush(RedStream *stream, bool auto_flush);
 
+/**
+ * Set write batching flag.
+ * If set, small buffers passed to red_stream_writev are queued
+ * in a per-stream transmit buffer instead of being written to
+ * the socket immediately, so that a train of small messages
+ * is sent with a single system call. Queued data are written
+ * when the transmit buffer fills up, before any larger write
+ * and when red_stream_flush is called.
+ * Disabling batching fails if queued data could not be written.
+ *
+ * Returns true on success or false on failure.
+ */
+bool red_stream_set_write_batching(RedStream *stream, bool batching);
+
 /**
  * Flush data to the underlying socket.
- * Calling this function on a stream with auto flush set has
- * no result.
+ * Calling this function on a stream with auto flush set and
+ * write batching disabled has no result.
+ *
+ * Returns false if some queued data could not be written
+ * as the socket would block, true otherwise.
+ */
+bool red_stream_flush(RedStream *stream);
+
+/**
+ * Enable zero-copy transmission.
+ * Writes containing a buffer of at least @threshold bytes are
+ * sent with MSG_ZEROCOPY: the kernel sends the data directly
+ * from the buffers passed to red_stream_writev so these must
+ * not be modified or freed until the write is reported as
+ * completed by red_stream_zerocopy_poll.
+ * Only plain TCP streams on Linux support zero-copy.
+ *
+ * Returns true on success or false if not supported.
+ */
+bool red_stream_enable_zerocopy(RedStream *stream, size_t threshold);
+
+/**
+ * Returns the identifier the next zero-copy write will get.
+ * Identifiers are incremented only by zero-copy writes.
+ */
+uint32_t red_stream_zerocopy_get_next_id(RedStream *stream);
+
+/**
+ * Process the zero-copy completions reported by the kernel.
+ * All the notifications queued on the socket are read, so it
+ * must be called when the socket reports an error even if all
+ * the writes are known to be completed.
+ *
+ * Returns the identifier of the oldest write not completed,
+ * all previous writes are completed.
  */
-void red_stream_flush(RedStream *stream);
+uint32_t red_stream_zerocopy_poll(RedStream *stream);
 
 bool red_stream_is_websocket(RedStream *stream, const void *buf, size_t len);
 
@@ -86,6 +86,8 @@ struct RedWorker {
     bool driver_cap_monitors_config;
 
     RedRecord *record;
+    /* the loop is based on epoll if available, on glib otherwise */
+    struct EventLoopEpoll *epoll_loop;
     GMainLoop *loop;
 };
 
@@ -715,6 +717,12 @@ handle_dev_gl_draw_async(RedWorker* worker, RedWorkerMessageGlDraw* draw)
 static void
 handle_dev_close(RedWorker* worker, RedWorkerMessageClose*)
 {
+#ifdef HAVE_SYS_EPOLL_H
+    if (worker->epoll_loop) {
+        event_loop_epoll_quit(worker->epoll_loop);
+        return;
+    }
+#endif
     g_main_loop_quit(worker->loop);
 }
 
@@ -868,15 +876,8 @@ static void register_callbacks(Dispatcher *dispatcher)
 
 
 
-struct RedWorkerSource {
-    GSource source;
-    RedWorker *worker;
-};
-
-static gboolean worker_source_prepare(GSource *source, gint *p_timeout)
+static bool worker_prepare(RedWorker *worker, int *p_timeout)
 {
-    RedWorkerSource *wsource = SPICE_CONTAINEROF(source, RedWorkerSource, source);
-    RedWorker *worker = wsource->worker;
     unsigned int timeout;
 
     timeout = MIN(worker->event_timeout,
@@ -893,19 +894,13 @@ static gboolean worker_source_prepare(GSource *source, gint *p_timeout)
     return FALSE;
 }
 
-static gboolean worker_source_check(GSource *source)
+static bool worker_check(RedWorker *worker)
 {
-    RedWorkerSource *wsource = SPICE_CONTAINEROF(source, RedWorkerSource, source);
-    RedWorker *worker = wsource->worker;
-
     return red_qxl_is_running(worker->qxl) /* TODO && worker->pending_process */;
 }
 
-static gboolean worker_source_dispatch(GSource *source, GSourceFunc callback,
-                                       gpointer user_data)
+static void worker_dispatch(RedWorker *worker)
 {
-    RedWorkerSource *wsource = SPICE_CONTAINEROF(source, RedWorkerSource, source);
-    RedWorker *worker = wsource->worker;
     DisplayChannel *display = worker->display_channel;
     int ring_is_empty;
 
@@ -917,11 +912,39 @@ static gboolean worker_source_dispatch(GSource *source, GSourceFunc callback,
 
     /* TODO: could use its own source */
     video_stream_timeout(display);
+    display_channel_video_region_timeout(display);
 
     worker->event_timeout = INF_EVENT_WAIT;
     worker->was_blocked = FALSE;
     red_process_cursor(worker, &ring_is_empty);
     red_process_display(worker, &ring_is_empty);
+}
+
+struct RedWorkerSource {
+    GSource source;
+    RedWorker *worker;
+};
+
+static gboolean worker_source_prepare(GSource *source, gint *p_timeout)
+{
+    RedWorkerSource *wsource = SPICE_CONTAINEROF(source, RedWorkerSource, source);
+
+    return worker_prepare(wsource->worker, p_timeout);
+}
+
+static gboolean worker_source_check(GSource *source)
+{
+    RedWorkerSource *wsource = SPICE_CONTAINEROF(source, RedWorkerSource, source);
+
+    return worker_check(wsource->worker);
+}
+
+static gboolean worker_source_dispatch(GSource *source, GSourceFunc callback,
+                                       gpointer user_data)
+{
+    RedWorkerSource *wsource = SPICE_CONTAINEROF(source, RedWorkerSource, source);
+
+    worker_dispatch(wsource->worker);
 
     return TRUE;
 }
@@ -933,6 +956,29 @@ static GSourceFuncs worker_source_funcs = {
     .dispatch = worker_source_dispatch,
 };
 
+#ifdef HAVE_SYS_EPOLL_H
+static bool worker_epoll_prepare(void *opaque, int *p_timeout)
+{
+    return worker_prepare(static_cast<RedWorker *>(opaque), p_timeout);
+}
+
+static bool worker_epoll_check(void *opaque)
+{
+    return worker_check(static_cast<RedWorker *>(opaque));
+}
+
+static void worker_epoll_dispatch(void *opaque)
+{
+    worker_dispatch(static_cast<RedWorker *>(opaque));
+}
+
+static const EventLoopEpollHooks worker_epoll_hooks = {
+    .prepare = worker_epoll_prepare,
+    .check = worker_epoll_check,
+    .dispatch = worker_epoll_dispatch,
+};
+#endif
+
 RedWorker* red_worker_new(QXLInstance *qxl)
 {
     QXLDevInitInfo init_info;
@@ -944,8 +990,14 @@ RedWorker* red_worker_new(QXLInstance *qxl)
     red_qxl_get_init_info(qxl, &init_info);
 
     worker = g_new0(RedWorker, 1);
-    worker->core = event_loop_core;
-    worker->core.main_context = g_main_context_new();
+#ifdef HAVE_SYS_EPOLL_H
+    worker->epoll_loop = event_loop_epoll_new(&worker->core);
+#endif
+    if (!worker->epoll_loop) {
+        worker->core = event_loop_core;
+        worker->core.main_context = g_main_context_new();
+        worker->core.coarse_timers = timer_wheel_new(&worker->core);
+    }
 
     worker->record = reds_get_record(reds);
     dispatcher = red_qxl_get_dispatcher(qxl);
@@ -969,10 +1021,12 @@ RedWorker* red_worker_new(QXLInstance *qxl)
     worker->dispatch_watch = dispatcher->create_watch(&worker->core);
     spice_assert(worker->dispatch_watch != nullptr);
 
-    GSource *source = g_source_new(&worker_source_funcs, sizeof(RedWorkerSource));
-    SPICE_CONTAINEROF(source, RedWorkerSource, source)->worker = worker;
-    g_source_attach(source, worker->core.main_context);
-    g_source_unref(source);
+    if (!worker->epoll_loop) {
+        GSource *source = g_source_new(&worker_source_funcs, sizeof(RedWorkerSource));
+        SPICE_CONTAINEROF(source, RedWorkerSource, source)->worker = worker;
+        g_source_attach(source, worker->core.main_context);
+        g_source_unref(source);
+    }
 
     memslot_info_init(&worker->mem_slots,
                       init_info.num_memslots_groups,
@@ -1011,11 +1065,19 @@ static void *red_worker_main(void *arg)
     pthread_setname_np("SPICE Worker");
 #endif
     SPICE_VERIFY(MAX_PIPE_SIZE > WIDE_CLIENT_ACK_WINDOW &&
-           MAX_PIPE_SIZE > NARROW_CLIENT_ACK_WINDOW); //ensure wakeup by ack message
+           MAX_PIPE_SIZE > NARROW_CLIENT_ACK_WINDOW &&
+           MAX_PIPE_SIZE > MAX_CLIENT_ACK_WINDOW); //ensure wakeup by ack message
 
     worker->cursor_channel->reset_thread_id();
     worker->display_channel->reset_thread_id();
 
+#ifdef HAVE_SYS_EPOLL_H
+    if (worker->epoll_loop) {
+        event_loop_epoll_run(worker->epoll_loop, &worker_epoll_hooks, worker);
+        return nullptr;
+    }
+#endif
+
     GMainLoop *loop = g_main_loop_new(worker->core.main_context, FALSE);
     worker->loop = loop;
     g_main_loop_run(loop);
@@ -1080,7 +1142,14 @@ void red_worker_free(RedWorker *worker)
         red_watch_remove(worker->dispatch_watch);
     }
 
-    g_main_context_unref(worker->core.main_context);
+    if (worker->epoll_loop) {
+#ifdef HAVE_SYS_EPOLL_H
+        event_loop_epoll_free(worker->epoll_loop);
+#endif
+    } else {
+        timer_wheel_free(worker->core.coarse_timers);
+        g_main_context_unref(worker->core.main_context);
+    }
 
     if (worker->record) {
         red_record_unref(worker->record);
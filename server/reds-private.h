@@ -23,11 +23,13 @@
 #include <spice/stats.h>
 
 #include "main-dispatcher.h"
+#include "offload-pool.h"
 #include "main-channel.h"
 #include "inputs-channel.h"
 #include "stat-file.h"
 #include "red-record-qxl.h"
 #include "safe-list.hpp"
+#include "websocket.h"
 
 #define MIGRATE_TIMEOUT (MSEC_PER_SEC * 10)
 #define MM_TIME_DELTA 400 /*ms*/
@@ -116,11 +118,19 @@ struct RedsState {
     int seamless_migration_enabled; /* command line arg */
 
     SSL_CTX *ctx;
+    RedStatNode tls_stat;
+    RedStatCounter tls_full_handshakes;
+    RedStatCounter tls_resumed_handshakes;
 
 #ifdef RED_STATISTICS
     RedStatFile *stat_file;
 #endif
     int allow_multiple_clients;
+    /* minimum size of the buffers sent with zero-copy writes, 0 to disable */
+    size_t zerocopy_threshold;
+    /* permessage-deflate parameters for WebSocket connections */
+    bool websocket_deflate_enabled;
+    WebSocketDeflateConfig websocket_deflate;
     bool late_initialization_done;
 
     /* Intermediate state for on going monitors config message from a single
@@ -136,6 +146,8 @@ struct RedsState {
     SpiceCoreInterfaceInternal core;
     red::safe_list<QXLInstance*> qxl_instances; // XXX owning
     red::shared_ptr<MainDispatcher> main_dispatcher;
+    /* runs TLS handshakes and SASL steps out of the main thread */
+    OffloadPool *offload_pool;
     RedRecord *record;
 };
 
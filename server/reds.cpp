@@ -81,8 +81,10 @@
 #include "red-client.h"
 #include "net-utils.h"
 #include "red-stream-device.h"
+#include "display-limits.h"
 
-#define REDS_MAX_STAT_NODES 100
+/* the nodes of the server and its channels, plus all the streams of a client */
+#define REDS_MAX_STAT_NODES (100 + NUM_STREAMS * NUM_STREAM_STAT_NODES)
 
 static void reds_client_monitors_config(RedsState *reds, VDAgentMonitorsConfig *monitors_config);
 static gboolean reds_use_client_monitors_config(RedsState *reds);
@@ -91,9 +93,17 @@ static void reds_set_video_codecs(RedsState *reds, GArray *video_codecs);
 /* Debugging only variable: allow multiple client connections to the spice
  * server */
 #define SPICE_DEBUG_ALLOW_MC_ENV "SPICE_DEBUG_ALLOW_MC"
+#define SPICE_ZEROCOPY_THRESHOLD_ENV "SPICE_ZEROCOPY_THRESHOLD"
+#define SPICE_WEBSOCKET_DEFLATE_ENV "SPICE_WEBSOCKET_DEFLATE"
 
 #define REDS_TOKENS_TO_SEND 5
 #define REDS_VDI_PORT_NUM_RECEIVE_BUFFS 5
+/* helper threads for TLS handshakes and SASL steps */
+#define MAX_OFFLOAD_THREADS 4
+/* TLS sessions which can be resumed by the next channels of a client */
+#define TLS_SESSION_CACHE_SIZE 1024
+#define TLS_SESSION_TIMEOUT 300
+#define TLS_SESSION_TICKETS 1
 
 /* TODO while we can technically create more than one server in a process,
  * the intended use is to support a single server per process */
@@ -150,6 +160,8 @@ struct RedLinkInfo {
     TicketInfo tiTicketing;
     SpiceLinkAuthMechanism auth_mechanism;
     int skip_auth;
+    /* result of the last handshake step run in the offload pool */
+    RedStreamSslStatus ssl_status;
 };
 
 struct ChannelSecurityOptions {
@@ -2351,27 +2363,61 @@ static void reds_handle_new_link(RedLinkInfo *link)
                           sizeof(link->link_header.magic), reds_handle_read_magic_done, link);
 }
 
-static void reds_handle_ssl_accept(int fd, int event, void *data)
+/* The handshake steps computing keys and signatures are expensive,
+ * they run in the offload pool so the main thread keeps serving the
+ * other connections. The link is not touched by the main thread
+ * while a step is running */
+static void reds_ssl_accept_work(void *opaque)
 {
-    auto link = static_cast<RedLinkInfo *>(data);
-    RedStreamSslStatus return_code = red_stream_ssl_accept(link->stream);
+    auto link = static_cast<RedLinkInfo *>(opaque);
+    link->ssl_status = red_stream_ssl_accept(link->stream);
+}
+
+static void reds_handle_ssl_accept(int fd, int event, void *data);
+
+static void reds_ssl_accept_cancel(void *opaque)
+{
+    reds_link_free(static_cast<RedLinkInfo *>(opaque));
+}
 
-    switch (return_code) {
+static void reds_ssl_accept_done(void *opaque)
+{
+    auto link = static_cast<RedLinkInfo *>(opaque);
+    RedsState *reds = link->reds;
+
+    switch (link->ssl_status) {
         case RED_STREAM_SSL_STATUS_ERROR:
             reds_link_free(link);
             return;
         case RED_STREAM_SSL_STATUS_WAIT_FOR_READ:
-            red_watch_update_mask(link->stream->watch, SPICE_WATCH_EVENT_READ);
+            link->stream->watch = reds_core_watch_add(reds, link->stream->socket,
+                                                      SPICE_WATCH_EVENT_READ,
+                                                      reds_handle_ssl_accept, link);
             return;
         case RED_STREAM_SSL_STATUS_WAIT_FOR_WRITE:
-            red_watch_update_mask(link->stream->watch, SPICE_WATCH_EVENT_WRITE);
+            link->stream->watch = reds_core_watch_add(reds, link->stream->socket,
+                                                      SPICE_WATCH_EVENT_WRITE,
+                                                      reds_handle_ssl_accept, link);
             return;
         case RED_STREAM_SSL_STATUS_OK:
-            red_stream_remove_watch(link->stream);
+            if (red_stream_is_ssl_resumed(link->stream)) {
+                stat_inc_counter(reds->tls_resumed_handshakes, 1);
+            } else {
+                stat_inc_counter(reds->tls_full_handshakes, 1);
+            }
             reds_handle_new_link(link);
     }
 }
 
+static void reds_handle_ssl_accept(int fd, int event, void *data)
+{
+    auto link = static_cast<RedLinkInfo *>(data);
+
+    red_stream_remove_watch(link->stream);
+    reds_offload(link->reds, reds_ssl_accept_work, reds_ssl_accept_done,
+                 reds_ssl_accept_cancel, link);
+}
+
 #define KEEPALIVE_TIMEOUT (10*60)
 
 static RedLinkInfo *reds_init_client_connection(RedsState *reds, int socket)
@@ -2406,31 +2452,19 @@ static RedLinkInfo *reds_init_client_connection(RedsState *reds, int socket)
 static RedLinkInfo *reds_init_client_ssl_connection(RedsState *reds, int socket)
 {
     RedLinkInfo *link;
-    RedStreamSslStatus ssl_status;
 
     link = reds_init_client_connection(reds, socket);
     if (link == nullptr) {
         return nullptr;
     }
 
-    ssl_status = red_stream_enable_ssl(link->stream, reds->ctx);
-    switch (ssl_status) {
-        case RED_STREAM_SSL_STATUS_OK:
-            reds_handle_new_link(link);
-            return link;
-        case RED_STREAM_SSL_STATUS_ERROR:
-            goto error;
-        case RED_STREAM_SSL_STATUS_WAIT_FOR_READ:
-            link->stream->watch = reds_core_watch_add(reds, link->stream->socket,
-                                                      SPICE_WATCH_EVENT_READ,
-                                                      reds_handle_ssl_accept, link);
-            break;
-        case RED_STREAM_SSL_STATUS_WAIT_FOR_WRITE:
-            link->stream->watch = reds_core_watch_add(reds, link->stream->socket,
-                                                      SPICE_WATCH_EVENT_WRITE,
-                                                      reds_handle_ssl_accept, link);
-            break;
+    if (!red_stream_setup_ssl(link->stream, reds->ctx)) {
+        goto error;
     }
+    /* the client hello is usually already received, the first
+     * step of the handshake is expensive */
+    reds_offload(reds, reds_ssl_accept_work, reds_ssl_accept_done,
+                 reds_ssl_accept_cancel, link);
     return link;
 
 error:
@@ -2812,6 +2846,11 @@ static int reds_init_ssl(RedsState *reds)
     // With OpenSSL 1.1: Disable all renegotiation in TLSv1.2 and earlier
     ssl_options |= SSL_OP_NO_RENEGOTIATION;
 #endif
+#ifdef SSL_OP_ENABLE_KTLS
+    // With OpenSSL 3.0: let the kernel encrypt the data if supported,
+    // see red_stream_ssl_accept
+    ssl_options |= SSL_OP_ENABLE_KTLS;
+#endif
 
     /* Global system initialization*/
     openssl_global_init();
@@ -2869,6 +2908,26 @@ static int reds_init_ssl(RedsState *reds)
     }
 
     SSL_CTX_set_session_id_context(reds->ctx, reinterpret_cast<const unsigned char *>("SPICE"), 5);
+
+    /* A client opens several channels at once, the channels after the
+     * first one resume its TLS session instead of doing a full handshake.
+     * TLS 1.3 uses session tickets, previous versions the session cache
+     * or tickets depending on the client */
+    SSL_CTX_set_session_cache_mode(reds->ctx, SSL_SESS_CACHE_SERVER);
+    SSL_CTX_sess_set_cache_size(reds->ctx, TLS_SESSION_CACHE_SIZE);
+    SSL_CTX_set_timeout(reds->ctx, TLS_SESSION_TIMEOUT);
+    SSL_CTX_clear_options(reds->ctx, SSL_OP_NO_TICKET);
+#if OPENSSL_VERSION_NUMBER >= 0x10101000L
+    /* a ticket is enough, the channels connect in parallel */
+    SSL_CTX_set_num_tickets(reds->ctx, TLS_SESSION_TICKETS);
+#endif
+
+    stat_init_node(&reds->tls_stat, reds, nullptr, "tls", TRUE);
+    stat_init_counter(&reds->tls_full_handshakes, reds, &reds->tls_stat,
+                      "full_handshakes", TRUE);
+    stat_init_counter(&reds->tls_resumed_handshakes, reds, &reds->tls_stat,
+                      "resumed_handshakes", TRUE);
+
     if (strlen(reds->config->ssl_parameters.ciphersuite) > 0) {
         if (!SSL_CTX_set_cipher_list(reds->ctx, reds->config->ssl_parameters.ciphersuite)) {
             return -1;
@@ -3422,9 +3481,12 @@ static int do_spice_init(RedsState *reds, SpiceCoreInterface *core_interface)
     }
     reds->core = core_interface_adapter;
     reds->core.public_interface = core_interface;
+    reds->core.coarse_timers = timer_wheel_new(&reds->core);
     reds->agent_dev = red::make_shared<RedCharDeviceVDIPort>(reds);
     reds_update_agent_properties(reds);
     reds->main_dispatcher = red::make_shared<MainDispatcher>(reds);
+    reds->offload_pool = new OffloadPool(reds->main_dispatcher.get(),
+                                         CLAMP(g_get_num_processors(), 1, MAX_OFFLOAD_THREADS));
     reds->mig_target_clients = nullptr;
     reds->vm_running = TRUE; /* for backward compatibility */
 
@@ -3467,6 +3529,28 @@ static int do_spice_init(RedsState *reds, SpiceCoreInterface *core_interface)
     if (reds->allow_multiple_clients) {
         spice_warning("spice: allowing multiple client connections");
     }
+
+    const char *zerocopy_threshold = getenv(SPICE_ZEROCOPY_THRESHOLD_ENV);
+    if (zerocopy_threshold) {
+        reds->zerocopy_threshold = strtoul(zerocopy_threshold, nullptr, 10);
+        spice_debug("zero-copy threshold %zu", reds->zerocopy_threshold);
+    }
+
+    /* compression is disabled unless requested, "1" enables it with
+     * the default options, otherwise options like
+     * "window_bits=12,no_context_takeover" */
+    const char *websocket_deflate = getenv(SPICE_WEBSOCKET_DEFLATE_ENV);
+    if (!websocket_deflate || strcmp(websocket_deflate, "0") == 0) {
+        reds->websocket_deflate_enabled = false;
+    } else if (!websocket_deflate_config_parse(&reds->websocket_deflate,
+                                               strcmp(websocket_deflate, "1") == 0 ?
+                                               "" : websocket_deflate)) {
+        spice_warning("invalid %s value \"%s\", WebSocket compression disabled",
+                      SPICE_WEBSOCKET_DEFLATE_ENV, websocket_deflate);
+        reds->websocket_deflate_enabled = false;
+    } else {
+        reds->websocket_deflate_enabled = true;
+    }
     pthread_mutex_lock(&global_reds_lock);
     servers = g_list_prepend(servers, reds);
     pthread_mutex_unlock(&global_reds_lock);
@@ -3483,7 +3567,12 @@ static const char default_renderer[] = "sw";
 #else
 #define GSTREAMER_CODECS ""
 #endif
-static const char default_video_codecs[] = "spice:mjpeg;" GSTREAMER_CODECS;
+#ifdef HAVE_OPENH264
+#define OPENH264_CODECS "openh264:h264;"
+#else
+#define OPENH264_CODECS ""
+#endif
+static const char default_video_codecs[] = "spice:mjpeg;" GSTREAMER_CODECS OPENH264_CODECS;
 
 /* new interface */
 SPICE_GNUC_VISIBLE SpiceServer *spice_server_new(void)
@@ -3584,6 +3673,7 @@ static gboolean reds_add_renderer(RedsState *reds, const char *name)
 static const EnumNames video_encoder_names[] = {
     {0, "spice"},
     {1, "gstreamer"},
+    {2, "openh264"},
     {0, nullptr},
 };
 
@@ -3594,6 +3684,11 @@ static const new_video_encoder_t video_encoder_procs[] = {
 #else
     nullptr,
 #endif
+#ifdef HAVE_OPENH264
+    &openh264_encoder_new,
+#else
+    nullptr,
+#endif
 };
 
 static const EnumNames video_codec_names[] = {
@@ -3791,6 +3886,10 @@ SPICE_GNUC_VISIBLE void spice_server_destroy(SpiceServer *reds)
     }
     red_timer_remove(reds->mig_timer);
 
+    /* handshakes still running use the SSL context */
+    delete reds->offload_pool;
+    reds->offload_pool = nullptr;
+
     if (reds->ctx) {
         SSL_CTX_free(reds->ctx);
     }
@@ -3808,6 +3907,7 @@ SPICE_GNUC_VISIBLE void spice_server_destroy(SpiceServer *reds)
 #ifdef RED_STATISTICS
     stat_file_free(reds->stat_file);
 #endif
+    timer_wheel_free(reds->core.coarse_timers);
 
     reds_config_free(reds->config);
     delete reds;
@@ -4335,6 +4435,23 @@ spice_wan_compression_t reds_get_zlib_glz_state(const RedsState *reds)
     return reds->config->zlib_glz_state;
 }
 
+void reds_offload(RedsState *reds, void (*work)(void *opaque),
+                  void (*done)(void *opaque), void (*cancel)(void *opaque),
+                  void *opaque)
+{
+    reds->offload_pool->push(work, done, cancel, opaque);
+}
+
+size_t reds_get_zerocopy_threshold(const RedsState *reds)
+{
+    return reds->zerocopy_threshold;
+}
+
+const WebSocketDeflateConfig *reds_get_websocket_deflate_config(const RedsState *reds)
+{
+    return reds->websocket_deflate_enabled ? &reds->websocket_deflate : nullptr;
+}
+
 SpiceCoreInterfaceInternal* reds_get_core_interface(RedsState *reds)
 {
     return &reds->core;
@@ -30,6 +30,7 @@
 #include "video-encoder.h"
 #include "main-dispatcher.h"
 #include "migration-protocol.h"
+#include "websocket.h"
 
 SPICE_BEGIN_DECLS
 
@@ -100,9 +101,17 @@ uint32_t reds_get_streaming_video(const RedsState *reds);
 GArray* reds_get_video_codecs(const RedsState *reds);
 spice_wan_compression_t reds_get_jpeg_state(const RedsState *reds);
 spice_wan_compression_t reds_get_zlib_glz_state(const RedsState *reds);
+size_t reds_get_zerocopy_threshold(const RedsState *reds);
+const WebSocketDeflateConfig *reds_get_websocket_deflate_config(const RedsState *reds);
 SpiceCoreInterfaceInternal* reds_get_core_interface(RedsState *reds);
 void reds_update_client_mouse_allowed(RedsState *reds);
 MainDispatcher* reds_get_main_dispatcher(RedsState *reds);
+/* run @work in a helper thread, then @done in the main thread.
+ * If the server is destroyed before @done is called @cancel is
+ * called instead, to free @opaque */
+void reds_offload(RedsState *reds, void (*work)(void *opaque),
+                  void (*done)(void *opaque), void (*cancel)(void *opaque),
+                  void *opaque);
 
 /* Marshal VDAgentGraphicsDeviceInfo structure */
 void reds_marshall_device_display_info(RedsState *reds, SpiceMarshaller *m);
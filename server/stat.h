@@ -83,6 +83,16 @@ stat_inc_counter(RedStatCounter counter, uint64_t value)
 #endif
 }
 
+static inline void
+stat_set_counter(RedStatCounter counter, uint64_t value)
+{
+#ifdef RED_STATISTICS
+    if (counter.counter) {
+        *(counter.counter) = value;
+    }
+#endif
+}
+
 typedef uint64_t stat_time_t;
 
 static inline stat_time_t stat_now(clockid_t clock_id)
@@ -75,6 +75,8 @@ struct StreamDataItem: public RedPipeItemNum<RED_PIPE_ITEM_TYPE_STREAM_DATA> {
     ~StreamDataItem() override;
 
     StreamChannel *channel;
+    // the data is sent from the frame buffer, not from data.data
+    StreamFramePtr frame;
     // NOTE: this must be the last field in the structure
     SpiceMsgDisplayStreamData data;
 };
@@ -234,7 +236,7 @@ void StreamChannelClient::send_item(RedPipeItem *pipe_item)
         auto item = static_cast<StreamDataItem*>(pipe_item);
         init_send_data(SPICE_MSG_DISPLAY_STREAM_DATA);
         spice_marshall_msg_display_stream_data(m, &item->data);
-        pipe_item->add_to_marshaller(m, item->data.data, item->data.data_size);
+        pipe_item->add_to_marshaller(m, item->frame->data, item->data.data_size);
         record(stream_channel_data, "Stream data packet size %u mm_time %u",
                item->data.data_size, item->data.base.multi_media_time);
         break;
@@ -389,6 +391,24 @@ void StreamChannel::on_connect(RedClient *red_client, RedStream *stream,
     rcc->pipe_add_type(RED_PIPE_ITEM_TYPE_FILL_SURFACE);
     // TODO monitor configs ??
     rcc->pipe_add_empty_msg(SPICE_MSG_DISPLAY_MARK);
+
+    // join the current stream rather than wait for the guest to start
+    // a new one
+    if (can_join_stream()) {
+        rcc->pipe_add(create_stream_item());
+        rcc->pipe_add_type(RED_PIPE_ITEM_TYPE_STREAM_ACTIVATE_REPORT);
+    }
+}
+
+/* Whether a client can be sent the current stream from its next frame.
+ * Only MJPEG frames can be decoded without the previous ones, and every
+ * client supports MJPEG. For the other codecs the guest would have to be
+ * asked for a key frame, which the stream device protocol cannot do, so
+ * the client waits for the guest to start a new stream.
+ */
+bool StreamChannel::can_join_stream() const
+{
+    return stream_id >= 0 && codec == SPICE_VIDEO_CODEC_TYPE_MJPEG;
 }
 
 StreamChannel::StreamChannel(RedsState *reds, uint32_t id):
@@ -401,6 +421,13 @@ StreamChannel::StreamChannel(RedsState *reds, uint32_t id):
     reds_register_channel(reds, this);
 }
 
+StreamChannel::~StreamChannel()
+{
+    for (int i = 0; i < num_pooled_frames; i++) {
+        g_free(frame_pool[i].data);
+    }
+}
+
 void
 StreamChannel::change_format(const StreamMsgFormat *fmt)
 {
@@ -422,22 +449,30 @@ StreamChannel::change_format(const StreamMsgFormat *fmt)
 
     // allocate a new stream id
     stream_id = (stream_id + 1) % NUM_STREAMS;
+    codec = fmt->codec;
 
     // send create stream
+    pipes_add(create_stream_item());
+
+    // activate stream report if possible
+    pipes_add_type(RED_PIPE_ITEM_TYPE_STREAM_ACTIVATE_REPORT);
+}
+
+red::shared_ptr<StreamCreateItem>
+StreamChannel::create_stream_item()
+{
     auto item = red::make_shared<StreamCreateItem>();
     item->stream_create.id = stream_id;
     item->stream_create.flags = SPICE_STREAM_FLAGS_TOP_DOWN;
-    item->stream_create.codec_type = fmt->codec;
-    item->stream_create.stream_width = fmt->width;
-    item->stream_create.stream_height = fmt->height;
-    item->stream_create.src_width = fmt->width;
-    item->stream_create.src_height = fmt->height;
-    item->stream_create.dest = (SpiceRect) { 0, 0, fmt->width, fmt->height };
+    item->stream_create.codec_type = codec;
+    item->stream_create.stream_width = width;
+    item->stream_create.stream_height = height;
+    item->stream_create.src_width = width;
+    item->stream_create.src_height = height;
+    item->stream_create.dest = (SpiceRect) { 0, 0, static_cast<int32_t>(width),
+                                             static_cast<int32_t>(height) };
     item->stream_create.clip = (SpiceClip) { SPICE_CLIP_TYPE_NONE, nullptr };
-    pipes_add(item);
-
-    // activate stream report if possible
-    pipes_add_type(RED_PIPE_ITEM_TYPE_STREAM_ACTIVATE_REPORT);
+    return item;
 }
 
 inline void
@@ -455,8 +490,70 @@ StreamDataItem::~StreamDataItem()
     channel->update_queue_stat(-1, -data.data_size);
 }
 
+StreamFrame::~StreamFrame()
+{
+    channel->release_frame_buffer(data, buffer_size);
+}
+
 void
-StreamChannel::send_data(const void *data, size_t size, uint32_t mm_time)
+StreamChannel::release_frame_buffer(uint8_t *data, uint32_t size)
+{
+    if (num_pooled_frames == STREAM_FRAME_POOL_SIZE) {
+        g_free(data);
+        return;
+    }
+    frame_pool[num_pooled_frames].data = data;
+    frame_pool[num_pooled_frames].size = size;
+    num_pooled_frames++;
+}
+
+/* The best buffer for a frame is the smallest one large enough for it, or
+ * else the largest one which has to grow the least.
+ */
+static bool
+is_better_frame_buffer(uint32_t buffer_size, uint32_t other_size, uint32_t frame_size)
+{
+    bool fits = buffer_size >= frame_size;
+
+    if (fits != (other_size >= frame_size)) {
+        return fits;
+    }
+    return fits ? buffer_size < other_size : buffer_size > other_size;
+}
+
+StreamFramePtr
+StreamChannel::get_frame(uint32_t size)
+{
+    auto frame = red::make_shared<StreamFrame>();
+    int best = -1;
+
+    frame->channel = this;
+    frame->size = size;
+
+    for (int i = 0; i < num_pooled_frames; i++) {
+        if (best < 0 || is_better_frame_buffer(frame_pool[i].size, frame_pool[best].size, size)) {
+            best = i;
+        }
+    }
+    if (best < 0) {
+        frame->data = static_cast<uint8_t *>(g_malloc(size));
+        frame->buffer_size = size;
+        return frame;
+    }
+
+    frame->data = frame_pool[best].data;
+    frame->buffer_size = frame_pool[best].size;
+    frame_pool[best] = frame_pool[--num_pooled_frames];
+    if (frame->buffer_size < size) {
+        g_free(frame->data);
+        frame->data = static_cast<uint8_t *>(g_malloc(size));
+        frame->buffer_size = size;
+    }
+    return frame;
+}
+
+void
+StreamChannel::send_frame(const StreamFramePtr &frame, uint32_t mm_time)
 {
     if (stream_id < 0) {
         // this condition can happen if the guest didn't handle
@@ -465,15 +562,14 @@ StreamChannel::send_data(const void *data, size_t size, uint32_t mm_time)
         return;
     }
 
-    auto item = new (size) StreamDataItem();
+    auto item = red::make_shared<StreamDataItem>();
     item->data.base.id = stream_id;
     item->data.base.multi_media_time = mm_time;
-    item->data.data_size = size;
+    item->data.data_size = frame->size;
     item->channel = this;
-    update_queue_stat(1, size);
-    // TODO try to optimize avoiding the copy
-    memcpy(item->data.data, data, size);
-    pipes_add(red::shared_ptr<StreamDataItem>(item));
+    item->frame = frame;
+    update_queue_stat(1, frame->size);
+    pipes_add(item);
 }
 
 void
@@ -50,13 +50,36 @@ struct StreamQueueStat {
 typedef void (*stream_channel_queue_stat_proc)(void *opaque, const StreamQueueStat *stats,
                                                StreamChannel *channel);
 
+struct StreamChannel;
+
+/**
+ * A frame encoded by the guest.
+ * The StreamDevice reads the frame straight into the buffer and the clients
+ * are sent the data from there, without copying it. Once the clients are
+ * done with the frame the buffer goes back to the channel for the next one.
+ */
+struct StreamFrame final: public red::simple_ptr_counted<StreamFrame> {
+    ~StreamFrame();
+
+    StreamChannel *channel;
+    uint8_t *data;
+    uint32_t size;
+    /* allocated size of data */
+    uint32_t buffer_size;
+};
+
+typedef red::shared_ptr<StreamFrame> StreamFramePtr;
+
+struct StreamCreateItem;
 struct StreamDataItem;
 class StreamChannelClient;
 struct StreamChannel final: public RedChannel
 {
     friend struct StreamChannelClient;
     friend struct StreamDataItem;
+    friend struct StreamFrame;
     StreamChannel(RedsState *reds, uint32_t id);
+    ~StreamChannel() override;
 
     /**
      * Reset channel at initial state
@@ -64,7 +87,13 @@ struct StreamChannel final: public RedChannel
     void reset();
 
     void change_format(const struct StreamMsgFormat *fmt);
-    void send_data(const void *data, size_t size, uint32_t mm_time);
+
+    /**
+     * Returns a frame with a buffer for @size bytes of data, to be filled
+     * and passed to send_frame().
+     */
+    StreamFramePtr get_frame(uint32_t size);
+    void send_frame(const StreamFramePtr &frame, uint32_t mm_time);
 
     void register_start_cb(stream_channel_start_proc cb, void *opaque);
     void register_queue_stat_cb(stream_channel_queue_stat_proc cb, void *opaque);
@@ -74,16 +103,31 @@ private:
                     int migration, RedChannelCapabilities *caps) override;
 
     inline void update_queue_stat(int32_t num_diff, int32_t size_diff);
+    void release_frame_buffer(uint8_t *data, uint32_t size);
     void request_new_stream(StreamMsgStartStop *start);
+    bool can_join_stream() const;
+    red::shared_ptr<StreamCreateItem> create_stream_item();
 
     /* current video stream id, <0 if not initialized or
      * we are not sending a stream */
     int stream_id = -1;
     /* size of the current video stream */
     unsigned width = 0, height = 0;
+    /* codec of the current video stream */
+    uint8_t codec = 0;
 
     StreamQueueStat queue_stat;
 
+    /* The device stops reading frames while one is queued so a frame is
+     * being sent while the next one is read, keep their buffers.
+     */
+#define STREAM_FRAME_POOL_SIZE 2
+    struct {
+        uint8_t *data;
+        uint32_t size;
+    } frame_pool[STREAM_FRAME_POOL_SIZE];
+    int num_pooled_frames;
+
     /* callback to notify when a stream should be started or stopped */
     stream_channel_start_proc start_cb;
     void *start_opaque;
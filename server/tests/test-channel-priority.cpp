@@ -0,0 +1,379 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Test of the transmit scheduling among the channels of a client.
+ * A display channel keeps sending large messages while a cursor channel
+ * sends cursor shapes at regular intervals.
+ * A local client emulates a network link shared by the channels, with
+ * a limited bit rate and a small bottleneck queue filled from both
+ * sockets in turn, and reports the latency of the cursor messages:
+ * the time from the message being queued by the server to its last
+ * byte being delivered by the link.
+ * The latency depends on the load of the machine, so this is a
+ * benchmark rather than a check test. It fails if the 95th percentile
+ * of the latency is above --max-latency, when given.
+ * With --no-priority the cursor messages are sent by a second display
+ * channel, which has the same priority as the load, for comparison.
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <vector>
+#include <algorithm>
+#include <spice.h>
+
+#include "basic-event-loop.h"
+#include "reds.h"
+#include "red-client.h"
+#include "net-utils.h"
+#include "utils.h"
+
+#define LOAD_MSG_SIZE (64 * 1024)
+/* size of the server socket buffers, as tuned for a slow network */
+#define SOCKET_BUFFER_SIZE (16 * 1024)
+/* bytes moved at once from a socket to the emulated link */
+#define LINK_CHUNK_SIZE 1500
+#define MINI_HEADER_SIZE 6
+
+static gint link_mbps = 20;
+static gint queue_kb = 32;
+static gint cursor_size = 16 * 1024;
+static gint cursor_interval = 30;
+static gint num_cursors = 100;
+static gint max_latency_ms = 0;
+static gboolean no_priority = FALSE;
+
+static GOptionEntry cmd_entries[] = {
+    {"rate", 'r', 0, G_OPTION_ARG_INT, &link_mbps,
+     "Bit rate of the emulated link in Mbps (default 20)", nullptr},
+    {"queue", 'q', 0, G_OPTION_ARG_INT, &queue_kb,
+     "Size of the bottleneck queue of the link in kilobytes (default 32)", nullptr},
+    {"cursor-size", 's', 0, G_OPTION_ARG_INT, &cursor_size,
+     "Size of the cursor messages in bytes (default 16384)", nullptr},
+    {"interval", 'i', 0, G_OPTION_ARG_INT, &cursor_interval,
+     "Milliseconds between cursor messages (default 30)", nullptr},
+    {"count", 'c', 0, G_OPTION_ARG_INT, &num_cursors,
+     "Number of cursor messages (default 100)", nullptr},
+    {"max-latency", 'm', 0, G_OPTION_ARG_INT, &max_latency_ms,
+     "Maximum 95th percentile of the latency in milliseconds, 0 to not check (default 0)",
+     nullptr},
+    {"no-priority", 'n', 0, G_OPTION_ARG_NONE, &no_priority,
+     "Send the cursor messages with the priority of the display", nullptr},
+    {nullptr}
+};
+
+/*
+ * Server side
+ */
+struct TestPipeItem: public RedPipeItemNum<RED_PIPE_ITEM_TYPE_CHANNEL_BASE> {
+    uint64_t time;
+};
+
+struct RedTestChannel final: public RedChannel
+{
+    using RedChannel::RedChannel;
+    void on_connect(RedClient *client, RedStream *stream,
+                    int migration, RedChannelCapabilities *caps) override;
+
+    red::shared_ptr<RedChannelClient> rcc;
+    uint32_t msg_size;
+};
+
+class RedTestChannelClient final: public RedChannelClient
+{
+    using RedChannelClient::RedChannelClient;
+    uint8_t *alloc_recv_buf(uint16_t type, uint32_t size) override;
+    void release_recv_buf(uint16_t type, uint32_t size, uint8_t *msg) override;
+    void send_item(RedPipeItem *item) override;
+};
+
+void RedTestChannel::on_connect(RedClient *client, RedStream *stream,
+                                int migration, RedChannelCapabilities *caps)
+{
+    rcc = red::make_shared<RedTestChannelClient>(this, client, stream, caps);
+    g_assert_true(rcc->init());
+}
+
+uint8_t *RedTestChannelClient::alloc_recv_buf(uint16_t type, uint32_t size)
+{
+    return static_cast<uint8_t *>(g_malloc(size));
+}
+
+void RedTestChannelClient::release_recv_buf(uint16_t type, uint32_t size, uint8_t *msg)
+{
+    g_free(msg);
+}
+
+/* messages start with the time they were queued, the rest is padding */
+void RedTestChannelClient::send_item(RedPipeItem *base)
+{
+    static uint8_t padding[LOAD_MSG_SIZE];
+    auto item = static_cast<TestPipeItem *>(base);
+    auto channel = static_cast<RedTestChannel *>(get_channel());
+    SpiceMarshaller *m = get_marshaller();
+
+    init_send_data(channel->type() == SPICE_CHANNEL_CURSOR ?
+                   SPICE_MSG_CURSOR_SET : SPICE_MSG_DISPLAY_DRAW_COPY);
+    spice_marshaller_add_uint64(m, item->time);
+    spice_marshaller_add_by_ref(m, padding, channel->msg_size - sizeof(uint64_t));
+    begin_send_message();
+}
+
+static void queue_message(RedChannelClient *rcc)
+{
+    auto item = red::make_shared<TestPipeItem>();
+    item->time = spice_get_monotonic_time_ns();
+    rcc->pipe_add_push(std::move(item));
+}
+
+static red::shared_ptr<RedTestChannel> load_channel;
+static red::shared_ptr<RedTestChannel> cursor_channel;
+static SpiceCoreInterface *core;
+static SpiceTimer *load_timer;
+static SpiceTimer *cursor_timer;
+static SpiceTimer *exit_timer;
+static pid_t client_pid;
+static int client_status;
+static int cursors_sent;
+
+/* keep the display pipe full so the link is saturated */
+static void load_timer_func(void *opaque)
+{
+    RedChannelClient *rcc = load_channel->rcc.get();
+
+    while (rcc->is_connected() && rcc->get_pipe_size() < 8) {
+        queue_message(rcc);
+    }
+    core->timer_start(load_timer, 5);
+}
+
+static void cursor_timer_func(void *opaque)
+{
+    queue_message(cursor_channel->rcc.get());
+    if (++cursors_sent < num_cursors) {
+        core->timer_start(cursor_timer, cursor_interval);
+    }
+}
+
+static void exit_timer_func(void *opaque)
+{
+    if (waitpid(client_pid, &client_status, WNOHANG) == client_pid) {
+        basic_event_loop_quit();
+        return;
+    }
+    core->timer_start(exit_timer, 100);
+}
+
+/*
+ * Client side, emulating the link
+ */
+static void run_client(int load_sock, int cursor_sock)
+{
+    const uint64_t ns_per_byte = NSEC_PER_SEC * 8 / ((uint64_t) link_mbps * 1000 * 1000);
+    const uint64_t queue_ns = (uint64_t) queue_kb * 1024 * ns_per_byte;
+    static uint8_t buf[LINK_CHUNK_SIZE];
+    std::vector<uint64_t> latencies;
+    /* time the link finishes delivering the accepted data */
+    uint64_t link_time = 0;
+    /* parsing of the cursor messages */
+    uint8_t header[MINI_HEADER_SIZE + sizeof(uint64_t)];
+    uint32_t header_pos = 0, msg_left = 0;
+    uint64_t msg_time = 0;
+    int turn = 0;
+
+    red_socket_set_non_blocking(load_sock, true);
+    red_socket_set_non_blocking(cursor_sock, true);
+
+    while (latencies.size() < (size_t) num_cursors) {
+        struct pollfd fds[2] = {
+            { load_sock, POLLIN, 0 },
+            { cursor_sock, POLLIN, 0 },
+        };
+        uint64_t now = spice_get_monotonic_time_ns();
+
+        /* the bottleneck queue is full, wait for the link */
+        if (link_time > now + queue_ns) {
+            g_usleep((link_time - now - queue_ns) / NSEC_PER_MICROSEC + 1);
+            continue;
+        }
+        if (poll(fds, 2, 1000) <= 0) {
+            continue;
+        }
+
+        /* the link takes data from the sockets in turn */
+        for (int i = 0; i < 2; i++) {
+            int idx = (turn + i) % 2;
+            if (!(fds[idx].revents & POLLIN)) {
+                continue;
+            }
+            turn = idx + 1;
+
+            if (idx == 0) {
+                ssize_t n = read(load_sock, buf, sizeof(buf));
+                spice_assert(n > 0 || (n < 0 && errno == EAGAIN));
+                if (n > 0) {
+                    link_time = MAX(link_time, now) + n * ns_per_byte;
+                }
+                break;
+            }
+
+            /* read the cursor messages header by header so the
+             * delivery time of their last byte is known */
+            size_t len = header_pos < sizeof(header) ?
+                         sizeof(header) - header_pos : MIN(msg_left, sizeof(buf));
+            uint8_t *dest = header_pos < sizeof(header) ? header + header_pos : buf;
+            ssize_t n = read(cursor_sock, dest, len);
+            spice_assert(n > 0 || (n < 0 && errno == EAGAIN));
+            if (n <= 0) {
+                break;
+            }
+            link_time = MAX(link_time, now) + n * ns_per_byte;
+            if (header_pos < sizeof(header)) {
+                header_pos += n;
+                if (header_pos == sizeof(header)) {
+                    uint32_t size;
+                    memcpy(&size, header + 2, sizeof(size));
+                    memcpy(&msg_time, header + MINI_HEADER_SIZE, sizeof(msg_time));
+                    msg_left = GUINT32_FROM_LE(size) - sizeof(uint64_t);
+                }
+            } else {
+                msg_left -= n;
+            }
+            if (header_pos == sizeof(header) && msg_left == 0) {
+                latencies.push_back(link_time - msg_time);
+                header_pos = 0;
+            }
+            break;
+        }
+    }
+
+    std::sort(latencies.begin(), latencies.end());
+    uint64_t total = 0;
+    for (auto latency: latencies) {
+        total += latency;
+    }
+    printf("cursor latency over %zu messages: average %.1f ms, median %.1f ms, "
+           "95th percentile %.1f ms, max %.1f ms\n",
+           latencies.size(),
+           (double) total / latencies.size() / NSEC_PER_MILLISEC,
+           (double) latencies[latencies.size() / 2] / NSEC_PER_MILLISEC,
+           (double) latencies[latencies.size() * 95 / 100] / NSEC_PER_MILLISEC,
+           (double) latencies.back() / NSEC_PER_MILLISEC);
+    if (max_latency_ms > 0 &&
+        latencies[latencies.size() * 95 / 100] > (uint64_t) max_latency_ms * NSEC_PER_MILLISEC) {
+        printf("cursor latency above %d ms\n", max_latency_ms);
+        _exit(1);
+    }
+    _exit(0);
+}
+
+static RedStream *create_stream(SpiceServer *server, int *p_socket)
+{
+    int sv[2];
+
+    spice_assert(socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) == 0);
+    red_socket_set_non_blocking(sv[0], true);
+    red_socket_set_send_buffer_size(sv[0], SOCKET_BUFFER_SIZE);
+    if (p_socket) {
+        *p_socket = sv[1];
+    } else {
+        close(sv[1]);
+    }
+    return red_stream_new(server, sv[0]);
+}
+
+int main(int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = nullptr;
+    int load_sock, cursor_sock;
+
+    context = g_option_context_new("- test cursor latency under display load");
+    g_option_context_add_main_entries(context, cmd_entries, nullptr);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        printf("Option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    g_option_context_free(context);
+    spice_assert(link_mbps > 0 && num_cursors > 0);
+    spice_assert(cursor_size >= (gint) sizeof(uint64_t) && cursor_size <= LOAD_MSG_SIZE);
+
+    SpiceServer *server = spice_server_new();
+    core = basic_event_loop_init();
+    spice_assert(spice_server_init(server, core) == 0);
+
+    RedChannelCapabilities caps;
+    memset(&caps, 0, sizeof(caps));
+    uint32_t common_caps = 1 << SPICE_COMMON_CAP_MINI_HEADER;
+    caps.num_common_caps = 1;
+    caps.common_caps = static_cast<uint32_t *>(spice_memdup(&common_caps, sizeof(common_caps)));
+
+    RedClient *client = red_client_new(server, FALSE);
+    red::shared_ptr<MainChannel> main_channel(main_channel_new(server));
+    spice_assert(main_channel_link(main_channel.get(), client, create_stream(server, nullptr),
+                                   0, FALSE, &caps));
+
+    load_channel = red::make_shared<RedTestChannel>(server, SPICE_CHANNEL_DISPLAY, 0);
+    load_channel->msg_size = LOAD_MSG_SIZE;
+    cursor_channel = no_priority ?
+        red::make_shared<RedTestChannel>(server, SPICE_CHANNEL_DISPLAY, 1) :
+        red::make_shared<RedTestChannel>(server, SPICE_CHANNEL_CURSOR, 0);
+    cursor_channel->msg_size = cursor_size;
+
+    load_channel->connect(client, create_stream(server, &load_sock), FALSE, &caps);
+    cursor_channel->connect(client, create_stream(server, &cursor_sock), FALSE, &caps);
+    red_channel_capabilities_reset(&caps);
+
+    client_pid = fork();
+    spice_assert(client_pid >= 0);
+    if (client_pid == 0) {
+        run_client(load_sock, cursor_sock);
+    }
+    close(load_sock);
+    close(cursor_sock);
+
+    load_timer = core->timer_add(load_timer_func, nullptr);
+    cursor_timer = core->timer_add(cursor_timer_func, nullptr);
+    exit_timer = core->timer_add(exit_timer_func, nullptr);
+    core->timer_start(load_timer, 0);
+    /* let the load fill the link first */
+    core->timer_start(cursor_timer, 500);
+    core->timer_start(exit_timer, 100);
+
+    basic_event_loop_mainloop();
+
+    core->timer_remove(load_timer);
+    core->timer_remove(cursor_timer);
+    core->timer_remove(exit_timer);
+    load_channel->rcc.reset();
+    cursor_channel->rcc.reset();
+    client->destroy();
+    main_channel.reset();
+    load_channel.reset();
+    cursor_channel.reset();
+    spice_server_destroy(server);
+    basic_event_loop_destroy();
+
+    return WIFEXITED(client_status) ? WEXITSTATUS(client_status) : 1;
+}
@@ -0,0 +1,161 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test the detection of the video region from the surface damage
+ */
+#include <config.h>
+
+#include <glib.h>
+
+#include "test-glib-compat.h"
+#include "damage-tracker.h"
+
+#define FRAME_INTERVAL (NSEC_PER_SEC / 25)
+
+/* draws a frame of a 400x300 video at 100,50 with 10x10 drawables,
+ * like a player filling the window one block at a time */
+static void draw_video_frame(DamageTracker &tracker, red_time_t now)
+{
+    for (int y = 50; y < 350; y += 10) {
+        for (int x = 100; x < 500; x += 10) {
+            SpiceRect rect = { x, y, x + 10, y + 10 };
+            tracker.add_damage(rect, now);
+        }
+    }
+}
+
+/* plays the video for @frames frames, returns the time after them */
+static red_time_t play_video(DamageTracker &tracker, red_time_t now, int frames)
+{
+    for (int i = 0; i < frames; i++) {
+        draw_video_frame(tracker, now);
+        tracker.update(now);
+        now += FRAME_INTERVAL;
+    }
+    return now;
+}
+
+static void test_damage_tracker_video(void)
+{
+    DamageTracker tracker;
+    SpiceRect region;
+    red_time_t now = NSEC_PER_SEC;
+
+    tracker.resize(1024, 768);
+    g_assert_false(tracker.get_region(&region));
+
+    // a video needs some frames to be detected
+    now = play_video(tracker, now, DAMAGE_HOT_FRAMES / 2);
+    g_assert_false(tracker.get_region(&region));
+
+    // the region is exactly the area drawn, not made of whole tiles
+    now = play_video(tracker, now, 2 * DAMAGE_HOT_FRAMES);
+    g_assert_true(tracker.get_region(&region));
+    g_assert_cmpint(region.left, ==, 100);
+    g_assert_cmpint(region.top, ==, 50);
+    g_assert_cmpint(region.right, ==, 500);
+    g_assert_cmpint(region.bottom, ==, 350);
+
+    // the video stopped
+    now += DAMAGE_MAX_FRAME_INTERVAL * 2;
+    tracker.update(now);
+    g_assert_false(tracker.get_region(&region));
+}
+
+static void test_damage_tracker_same_frame(void)
+{
+    DamageTracker tracker;
+    SpiceRect region;
+    red_time_t now = NSEC_PER_SEC;
+
+    tracker.resize(1024, 768);
+
+    // many updates of the same frame are counted once
+    for (int i = 0; i < 4 * DAMAGE_HOT_FRAMES; i++) {
+        draw_video_frame(tracker, now);
+        tracker.update(now);
+        now += NSEC_PER_MICROSEC;
+    }
+    g_assert_false(tracker.get_region(&region));
+}
+
+static void test_damage_tracker_scattered(void)
+{
+    DamageTracker tracker;
+    SpiceRect region;
+    red_time_t now = NSEC_PER_SEC;
+
+    tracker.resize(1024, 768);
+
+    // two small areas updated often far from each other
+    for (int i = 0; i < 4 * DAMAGE_HOT_FRAMES; i++) {
+        SpiceRect top_left = { 0, 0, 20, 20 };
+        SpiceRect bottom_right = { 1000, 700, 1020, 720 };
+
+        tracker.add_damage(top_left, now);
+        tracker.add_damage(bottom_right, now);
+        tracker.update(now);
+        now += FRAME_INTERVAL;
+    }
+    g_assert_false(tracker.get_region(&region));
+
+    // a single small area is not a video either
+    for (int i = 0; i < 4 * DAMAGE_HOT_FRAMES; i++) {
+        SpiceRect cursor = { 200, 200, 210, 220 };
+
+        tracker.add_damage(cursor, now);
+        tracker.update(now);
+        now += FRAME_INTERVAL;
+    }
+    g_assert_false(tracker.get_region(&region));
+}
+
+static void test_damage_tracker_resize(void)
+{
+    DamageTracker tracker;
+    SpiceRect region;
+    red_time_t now = NSEC_PER_SEC;
+
+    tracker.resize(1024, 768);
+    now = play_video(tracker, now, 3 * DAMAGE_HOT_FRAMES);
+    g_assert_true(tracker.get_region(&region));
+
+    // same size, nothing changes
+    tracker.resize(1024, 768);
+    g_assert_true(tracker.get_region(&region));
+
+    // the surface changed, the updates are forgotten
+    tracker.resize(800, 600);
+    g_assert_false(tracker.get_region(&region));
+
+    // damage outside of the surface is ignored
+    SpiceRect outside = { 900, 700, 1000, 768 };
+    tracker.add_damage(outside, now);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, nullptr);
+
+    g_test_add_func("/server/damage-tracker/video", test_damage_tracker_video);
+    g_test_add_func("/server/damage-tracker/same-frame", test_damage_tracker_same_frame);
+    g_test_add_func("/server/damage-tracker/scattered", test_damage_tracker_scattered);
+    g_test_add_func("/server/damage-tracker/resize", test_damage_tracker_resize);
+
+    return g_test_run();
+}
@@ -0,0 +1,110 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test that the display channel drops the drawables inside the video
+ * region only while the region is streamed
+ */
+#include <config.h>
+
+#include <glib.h>
+
+#include "test-glib-compat.h"
+#include "display-channel-private.h"
+
+static const SpiceRect region = { 100, 50, 500, 350 };
+static const SpiceRect inside = { 200, 100, 210, 110 };
+static const SpiceRect partly_inside = { 490, 100, 510, 110 };
+static const SpiceRect outside = { 600, 100, 610, 110 };
+
+static void stream_init(VideoStream *stream, const SpiceRect *dest_area)
+{
+    *stream = {};
+    stream->dest_area = *dest_area;
+    ring_item_init(&stream->link);
+}
+
+static void test_display_video_region_no_stream(void)
+{
+    Ring streams;
+
+    ring_init(&streams);
+
+    /* the frames of the region are not a stream yet, the clients
+     * get the drawables */
+    g_assert_false(video_region_hides_drawable(&streams, &region, &inside));
+    g_assert_false(video_region_hides_drawable(&streams, &region, &partly_inside));
+    g_assert_false(video_region_hides_drawable(&streams, &region, &outside));
+}
+
+static void test_display_video_region_streamed(void)
+{
+    Ring streams;
+    VideoStream stream;
+
+    ring_init(&streams);
+    stream_init(&stream, &region);
+    ring_add(&streams, &stream.link);
+
+    g_assert_true(video_region_hides_drawable(&streams, &region, &inside));
+    g_assert_true(video_region_hides_drawable(&streams, &region, &region));
+    /* the next frame would not cover it all */
+    g_assert_false(video_region_hides_drawable(&streams, &region, &partly_inside));
+    g_assert_false(video_region_hides_drawable(&streams, &region, &outside));
+
+    /* the stream ends, the drawables are sent again */
+    ring_remove(&stream.link);
+    g_assert_false(video_region_hides_drawable(&streams, &region, &inside));
+}
+
+static void test_display_video_region_other_stream(void)
+{
+    Ring streams;
+    VideoStream other, stream;
+    const SpiceRect other_area = { 0, 0, 320, 240 };
+    const SpiceRect old_region = { 100, 50, 500, 300 };
+
+    ring_init(&streams);
+    stream_init(&other, &other_area);
+    ring_add(&streams, &other.link);
+
+    /* a stream of another part of the screen, even overlapping the
+     * region, does not replace the drawables */
+    g_assert_false(video_region_hides_drawable(&streams, &region, &inside));
+
+    /* nor does the stream of the region before it grew */
+    stream_init(&stream, &old_region);
+    ring_add(&streams, &stream.link);
+    g_assert_false(video_region_hides_drawable(&streams, &region, &inside));
+
+    stream.dest_area = region;
+    g_assert_true(video_region_hides_drawable(&streams, &region, &inside));
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/display-video-region/no-stream",
+                    test_display_video_region_no_stream);
+    g_test_add_func("/server/display-video-region/streamed",
+                    test_display_video_region_streamed);
+    g_test_add_func("/server/display-video-region/other-stream",
+                    test_display_video_region_other_stream);
+
+    return g_test_run();
+}
@@ -314,6 +314,14 @@ static const EncoderInfo encoder_infos[] = {
       "", "h264parse ! ffdec_h264" },
 #else
       "", "h264parse ! avdec_h264" },
+#endif
+#ifdef HAVE_OPENH264
+    { "openh264",        openh264_encoder_new, SPICE_VIDEO_CODEC_TYPE_H264,
+#ifdef HAVE_GSTREAMER_0_10
+      "", "h264parse ! ffdec_h264" },
+#else
+      "", "h264parse ! avdec_h264" },
+#endif
 #endif
     { NULL, NULL, SPICE_VIDEO_CODEC_TYPE_ENUM_END, NULL, NULL }
 };
@@ -325,6 +333,7 @@ int main(int argc, char *argv[])
     gchar *encoder_name = NULL;
     gchar *file_report_name = NULL;
     gboolean use_hw_encoder = FALSE; // TODO use
+    gboolean list_encoders = FALSE;
     gchar *clipping = NULL;
 
     // - input pipeline
@@ -344,6 +353,8 @@ int main(int argc, char *argv[])
           "Image format (16BIT/24BIT/32BIT/RGBA)", "FMT" },
         { "encoder", 'e', 0, G_OPTION_ARG_STRING, &encoder_name,
           "Encoder to use", "ENC" },
+        { "list-encoders", 0, 0, G_OPTION_ARG_NONE, &list_encoders,
+          "List the encoders built in and exit", NULL },
         { "use-hw-encoder", 0, 0, G_OPTION_ARG_NONE, &use_hw_encoder,
           "Use H/W encoders if possible", NULL },
         { "clipping", 0, 0, G_OPTION_ARG_STRING, &clipping,
@@ -370,6 +381,13 @@ int main(int argc, char *argv[])
         exit(1);
     }
 
+    if (list_encoders) {
+        for (const EncoderInfo *info = encoder_infos; info->name; ++info) {
+            printf("%s\n", info->name);
+        }
+        exit(0);
+    }
+
     if (!input_pipeline_desc) {
         g_printerr("Input pipeline option missing\n");
         exit(1);
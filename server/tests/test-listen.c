@@ -40,6 +40,11 @@
 
 #define PKI_DIR SPICE_TOP_SRCDIR "/server/tests/pki/"
 
+/* concurrent clients of the connect storm benchmark */
+#define STORM_CLIENTS 64
+/* period of the timer measuring how long the main loop stalls */
+#define STORM_TICK_MS 5
+
 static bool error_is_set(GError **error)
 {
     return ((error != NULL) && (*error != NULL));
@@ -205,6 +210,46 @@ static gpointer check_no_connect_thread(gpointer data)
     return NULL;
 }
 
+/* connect storm, the last client to complete stops the main loop */
+static gint storm_clients_left;
+static SpiceTimer *storm_tick_timer;
+static gint64 storm_last_tick;
+static gint64 storm_max_stall;
+
+static gpointer check_magic_storm_thread(gpointer data)
+{
+    GError *error = NULL;
+    ThreadData *thread_data = (ThreadData*) data;
+    GSocketConnectable *connectable = G_SOCKET_CONNECTABLE(thread_data->connectable);
+    GIOStream *stream;
+
+    stream = fake_client_connect_tls(connectable, &error);
+    g_assert_no_error(error);
+    check_magic(stream, &error);
+    g_assert_no_error(error);
+
+    g_object_unref(stream);
+    g_object_unref(connectable);
+
+    if (g_atomic_int_dec_and_test(&storm_clients_left)) {
+        test_event_loop_quit(thread_data->event_loop);
+    }
+    g_free(thread_data);
+
+    return NULL;
+}
+
+/* the handshakes must not prevent the main loop from running */
+static void storm_tick_cb(void *opaque)
+{
+    TestEventLoop *event_loop = (TestEventLoop *) opaque;
+    gint64 now = g_get_monotonic_time();
+
+    storm_max_stall = MAX(storm_max_stall, now - storm_last_tick);
+    storm_last_tick = now;
+    event_loop->core->timer_start(storm_tick_timer, STORM_TICK_MS);
+}
+
 static GThread *fake_client_new(GThreadFunc thread_func,
                                 const char *hostname, int port,
                                 bool use_tls,
@@ -323,6 +368,59 @@ static void test_connect_plain_and_tls(void)
     spice_server_destroy(server);
 }
 
+static void test_connect_tls_storm(void)
+{
+    GThread *threads[STORM_CLIENTS];
+    gint64 start_time, elapsed;
+    int result, i;
+
+    TestEventLoop event_loop = { 0, };
+
+    test_event_loop_init(&event_loop);
+
+    /* server */
+    SpiceServer *server = spice_server_new();
+    spice_server_set_name(server, "SPICE listen test");
+    spice_server_set_noauth(server);
+    result = spice_server_set_tls(server, BASE_PORT,
+                                  PKI_DIR "ca-cert.pem",
+                                  PKI_DIR "server-cert.pem",
+                                  PKI_DIR "server-key.pem",
+                                  NULL, NULL, NULL);
+    g_assert_cmpint(result, ==, 0);
+    result = spice_server_init(server, event_loop.core);
+    g_assert_cmpint(result, ==, 0);
+
+    storm_tick_timer = event_loop.core->timer_add(storm_tick_cb, &event_loop);
+    storm_last_tick = g_get_monotonic_time();
+    storm_max_stall = 0;
+    event_loop.core->timer_start(storm_tick_timer, STORM_TICK_MS);
+
+    /* fake clients, all connecting at once */
+    storm_clients_left = STORM_CLIENTS;
+    start_time = g_get_monotonic_time();
+    for (i = 0; i < STORM_CLIENTS; i++) {
+        threads[i] = fake_client_new(check_magic_storm_thread, "localhost", BASE_PORT,
+                                     true, &event_loop);
+    }
+    test_event_loop_run(&event_loop);
+    elapsed = g_get_monotonic_time() - start_time;
+    for (i = 0; i < STORM_CLIENTS; i++) {
+        g_assert_null(g_thread_join(threads[i]));
+    }
+
+    g_test_maximized_result(STORM_CLIENTS * 1000000.0 / elapsed,
+                            "accepted %d TLS connections in %.3f s",
+                            STORM_CLIENTS, elapsed / 1000000.0);
+    g_test_minimized_result(storm_max_stall / 1000.0,
+                            "main loop stalled at most %.1f ms", storm_max_stall / 1000.0);
+
+    event_loop.core->timer_remove(storm_tick_timer);
+    storm_tick_timer = NULL;
+    test_event_loop_destroy(&event_loop);
+    spice_server_destroy(server);
+}
+
 #ifndef _WIN32
 static void test_connect_unix(void)
 {
@@ -373,6 +471,10 @@ int main(int argc, char **argv)
     g_test_add_func("/server/listen/connect_plain", test_connect_plain);
     g_test_add_func("/server/listen/connect_tls", test_connect_tls);
     g_test_add_func("/server/listen/connect_both", test_connect_plain_and_tls);
+    /* a benchmark, only run with -m perf */
+    if (g_test_perf()) {
+        g_test_add_func("/server/listen/connect_tls_storm", test_connect_tls_storm);
+    }
 #ifndef _WIN32
     g_test_add_func("/server/listen/connect_unix", test_connect_unix);
 #endif
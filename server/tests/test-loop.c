@@ -17,6 +17,10 @@
 */
 
 /* Test event loop
+ * Test the coarse timers sharing a timer wheel.
+ * Then compare the glib and epoll loops of the threads we own:
+ * events per second between two pipes and wakeup latency of
+ * timers and of another thread.
  */
 
 #include <config.h>
@@ -27,9 +31,13 @@
 #include <unistd.h>
 #include <pthread.h>
 #include <glib.h>
+#ifndef _WIN32
+#include <fcntl.h>
+#endif
 
 #include <spice/macros.h>
 #include <common/log.h>
+#include "red-common.h"
 #include "basic-event-loop.h"
 #include "win-alarm.h"
 
@@ -100,6 +108,303 @@ static void timer_not_twice(void *opaque)
 }
 
 
+#define COARSE_TIMERS 500
+
+typedef struct CoarseTimer {
+    SpiceTimer *timer;
+    uint64_t start;
+    uint32_t ms;
+    int called;
+} CoarseTimer;
+
+static GMainLoop *coarse_loop = NULL;
+static unsigned coarse_pending = 0;
+
+static void coarse_timer_func(void *opaque)
+{
+    CoarseTimer *timer = (CoarseTimer *) opaque;
+
+    /* called once and never early */
+    spice_assert(++timer->called == 1);
+    spice_assert(spice_get_monotonic_time_ns() - timer->start >= timer->ms * NSEC_PER_MILLISEC);
+
+    if (--coarse_pending == 0) {
+        g_main_loop_quit(coarse_loop);
+    }
+}
+
+static void test_coarse_timers(void)
+{
+    SpiceCoreInterfaceInternal iface = event_loop_core;
+    CoarseTimer *timers = g_new0(CoarseTimer, COARSE_TIMERS);
+    int i;
+
+    iface.main_context = g_main_context_new();
+    iface.coarse_timers = timer_wheel_new(&iface);
+    spice_assert(iface.coarse_timers != NULL);
+
+    for (i = 0; i < COARSE_TIMERS; i++) {
+        timers[i].timer = red_coarse_timer_add(&iface, coarse_timer_func, &timers[i]);
+        timers[i].ms = i % 100;
+        timers[i].start = spice_get_monotonic_time_ns();
+        red_timer_start(timers[i].timer, timers[i].ms);
+    }
+    /* cancel some of the timers, restart others */
+    for (i = 0; i < COARSE_TIMERS; i++) {
+        if (i % 3 == 0) {
+            red_timer_cancel(timers[i].timer);
+            continue;
+        }
+        if (i % 3 == 1) {
+            timers[i].ms = 150 - timers[i].ms;
+            timers[i].start = spice_get_monotonic_time_ns();
+            red_timer_start(timers[i].timer, timers[i].ms);
+        }
+        coarse_pending++;
+    }
+
+    coarse_loop = g_main_loop_new(iface.main_context, FALSE);
+    g_main_loop_run(coarse_loop);
+    g_main_loop_unref(coarse_loop);
+    coarse_loop = NULL;
+
+    for (i = 0; i < COARSE_TIMERS; i++) {
+        spice_assert(timers[i].called == (i % 3 == 0 ? 0 : 1));
+        red_timer_remove(timers[i].timer);
+    }
+    timer_wheel_free(iface.coarse_timers);
+    g_main_context_unref(iface.main_context);
+    g_free(timers);
+}
+
+#ifndef _WIN32
+#define BENCH_EVENTS 100000
+#define BENCH_WAKEUPS 200
+
+typedef struct BenchLoop {
+    const char *name;
+    SpiceCoreInterfaceInternal core;
+    GMainLoop *glib_loop;
+#ifdef HAVE_SYS_EPOLL_H
+    EventLoopEpoll *epoll_loop;
+#endif
+} BenchLoop;
+
+static void bench_loop_run(BenchLoop *loop)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (loop->epoll_loop) {
+        event_loop_epoll_run(loop->epoll_loop, NULL, NULL);
+        return;
+    }
+#endif
+    g_main_loop_run(loop->glib_loop);
+}
+
+static void bench_loop_quit(BenchLoop *loop)
+{
+#ifdef HAVE_SYS_EPOLL_H
+    if (loop->epoll_loop) {
+        event_loop_epoll_quit(loop->epoll_loop);
+        return;
+    }
+#endif
+    g_main_loop_quit(loop->glib_loop);
+}
+
+static void open_nonblocking_pipe(int fds[2])
+{
+    spice_assert(pipe(fds) == 0);
+    spice_assert(fcntl(fds[0], F_SETFL, O_NONBLOCK) == 0);
+}
+
+/* a byte goes back and forth between two pipes, each read is an event */
+typedef struct PingPong {
+    BenchLoop *loop;
+    int pipes[2][2];
+    unsigned events;
+} PingPong;
+
+static void ping_pong_read(int fd, int event, void *opaque)
+{
+    PingPong *ping_pong = (PingPong *) opaque;
+    int side = fd == ping_pong->pipes[0][0] ? 0 : 1;
+    char c;
+
+    /* read until the pipe is empty, watches can be edge triggered */
+    while (read(fd, &c, 1) == 1) {
+        if (++ping_pong->events == BENCH_EVENTS) {
+            bench_loop_quit(ping_pong->loop);
+            return;
+        }
+        spice_assert(write(ping_pong->pipes[!side][1], &c, 1) == 1);
+    }
+}
+
+static void bench_events(BenchLoop *loop)
+{
+    PingPong ping_pong = { .loop = loop };
+    SpiceWatch *watches[2];
+    uint64_t start, elapsed;
+    int i;
+
+    for (i = 0; i < 2; i++) {
+        open_nonblocking_pipe(ping_pong.pipes[i]);
+        watches[i] = loop->core.watch_add(&loop->core, ping_pong.pipes[i][0],
+                                          SPICE_WATCH_EVENT_READ, ping_pong_read, &ping_pong);
+        spice_assert(watches[i] != NULL);
+    }
+
+    start = spice_get_monotonic_time_ns();
+    spice_assert(write(ping_pong.pipes[0][1], "x", 1) == 1);
+    bench_loop_run(loop);
+    elapsed = spice_get_monotonic_time_ns() - start;
+    spice_assert(ping_pong.events == BENCH_EVENTS);
+
+    printf("%s: %u events in %.1f ms, %.0f events/s\n", loop->name, ping_pong.events,
+           elapsed / 1000000.0, ping_pong.events * 1000000000.0 / elapsed);
+
+    for (i = 0; i < 2; i++) {
+        red_watch_remove(watches[i]);
+        close(ping_pong.pipes[i][0]);
+        close(ping_pong.pipes[i][1]);
+    }
+}
+
+typedef struct Wakeups {
+    BenchLoop *loop;
+    SpiceTimer *timer;
+    int pipe[2];
+    uint64_t start;
+    unsigned count;
+    uint64_t total_latency;
+    uint64_t max_latency;
+} Wakeups;
+
+static bool wakeups_add(Wakeups *wakeups, uint64_t latency)
+{
+    wakeups->total_latency += latency;
+    wakeups->max_latency = MAX(wakeups->max_latency, latency);
+    if (++wakeups->count == BENCH_WAKEUPS) {
+        bench_loop_quit(wakeups->loop);
+        return false;
+    }
+    return true;
+}
+
+static void wakeups_print(Wakeups *wakeups, const char *what)
+{
+    printf("%s: %s wakeup latency average %.1f us, max %.1f us\n", wakeups->loop->name, what,
+           wakeups->total_latency / 1000.0 / wakeups->count, wakeups->max_latency / 1000.0);
+}
+
+/* the timer is started again as soon as it expires */
+static void timer_wakeup(void *opaque)
+{
+    Wakeups *wakeups = (Wakeups *) opaque;
+    uint64_t now = spice_get_monotonic_time_ns();
+    uint64_t expected = wakeups->start + NSEC_PER_MILLISEC;
+
+    if (wakeups_add(wakeups, now > expected ? now - expected : 0)) {
+        wakeups->start = spice_get_monotonic_time_ns();
+        red_timer_start(wakeups->timer, 1);
+    }
+}
+
+static void bench_timer_wakeups(BenchLoop *loop)
+{
+    Wakeups wakeups = { .loop = loop };
+
+    wakeups.timer = loop->core.timer_add(&loop->core, timer_wakeup, &wakeups);
+    wakeups.start = spice_get_monotonic_time_ns();
+    red_timer_start(wakeups.timer, 1);
+    bench_loop_run(loop);
+    red_timer_remove(wakeups.timer);
+
+    wakeups_print(&wakeups, "timer");
+}
+
+/* another thread writes the time in a pipe every millisecond */
+static void *thread_wakeup_writer(void *opaque)
+{
+    Wakeups *wakeups = (Wakeups *) opaque;
+    int i;
+
+    for (i = 0; i < BENCH_WAKEUPS; i++) {
+        uint64_t now;
+
+        g_usleep(1000);
+        now = spice_get_monotonic_time_ns();
+        spice_assert(write(wakeups->pipe[1], &now, sizeof(now)) == sizeof(now));
+    }
+    return NULL;
+}
+
+static void thread_wakeup(int fd, int event, void *opaque)
+{
+    Wakeups *wakeups = (Wakeups *) opaque;
+    uint64_t sent;
+
+    while (read(fd, &sent, sizeof(sent)) == sizeof(sent)) {
+        if (!wakeups_add(wakeups, spice_get_monotonic_time_ns() - sent)) {
+            return;
+        }
+    }
+}
+
+static void bench_thread_wakeups(BenchLoop *loop)
+{
+    Wakeups wakeups = { .loop = loop };
+    SpiceWatch *watch;
+    pthread_t thread;
+
+    open_nonblocking_pipe(wakeups.pipe);
+    watch = loop->core.watch_add(&loop->core, wakeups.pipe[0],
+                                 SPICE_WATCH_EVENT_READ, thread_wakeup, &wakeups);
+    spice_assert(watch != NULL);
+
+    spice_assert(pthread_create(&thread, NULL, thread_wakeup_writer, &wakeups) == 0);
+    bench_loop_run(loop);
+    spice_assert(pthread_join(thread, NULL) == 0);
+
+    red_watch_remove(watch);
+    close(wakeups.pipe[0]);
+    close(wakeups.pipe[1]);
+
+    wakeups_print(&wakeups, "thread");
+}
+
+static void bench_loop(BenchLoop *loop)
+{
+    bench_events(loop);
+    bench_timer_wakeups(loop);
+    bench_thread_wakeups(loop);
+}
+
+static void bench_loops(void)
+{
+    BenchLoop loop;
+
+    memset(&loop, 0, sizeof(loop));
+    loop.name = "glib";
+    loop.core = event_loop_core;
+    loop.core.main_context = g_main_context_new();
+    loop.glib_loop = g_main_loop_new(loop.core.main_context, FALSE);
+    bench_loop(&loop);
+    g_main_loop_unref(loop.glib_loop);
+    g_main_context_unref(loop.core.main_context);
+
+#ifdef HAVE_SYS_EPOLL_H
+    memset(&loop, 0, sizeof(loop));
+    loop.name = "epoll";
+    loop.epoll_loop = event_loop_epoll_new(&loop.core);
+    spice_assert(loop.epoll_loop != NULL);
+    bench_loop(&loop);
+    event_loop_epoll_free(loop.epoll_loop);
+#endif
+}
+#endif
+
 int main(int argc, char **argv)
 {
     SpiceTimer *timer, *timers[10];
@@ -172,5 +477,15 @@ int main(int argc, char **argv)
 
     basic_event_loop_destroy();
 
+    alarm(2);
+    test_coarse_timers();
+    alarm(0);
+
+#ifndef _WIN32
+    alarm(10);
+    bench_loops();
+    alarm(0);
+#endif
+
     return 0;
 }
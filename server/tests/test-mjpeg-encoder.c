@@ -0,0 +1,201 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Benchmark of the MJPEG encoder.
+ * 1080p and 4K frames are encoded as a single slice, then split in
+ * slices compressed in parallel (see SPICE_MJPEG_SLICES). The frame
+ * rates of both are reported and the images they produce are checked
+ * to be the same.
+ */
+#include <config.h>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <glib.h>
+#include <jpeglib.h>
+
+#include <common/log.h>
+#include <common/mem.h>
+#include "video-encoder.h"
+
+static gint num_frames = 50;
+static gint num_slices = 0;
+
+static GOptionEntry cmd_entries[] = {
+    {"frames", 'f', 0, G_OPTION_ARG_INT, &num_frames,
+     "Number of frames encoded for each test (default 50)", NULL},
+    {"slices", 's', 0, G_OPTION_ARG_INT, &num_slices,
+     "Maximum number of slices (default one per processor)", NULL},
+    {NULL}
+};
+
+static SpiceBitmap *create_frame(uint32_t width, uint32_t height)
+{
+    SpiceBitmap *bitmap = g_new0(SpiceBitmap, 1);
+    uint32_t stride = width * 4;
+    uint8_t *data = g_malloc(stride * height);
+    uint32_t x, y;
+
+    /* gradients with some details, compressing them is not trivial */
+    for (y = 0; y < height; y++) {
+        uint8_t *line = data + y * stride;
+        for (x = 0; x < width; x++) {
+            line[x * 4 + 0] = x * 255 / width;
+            line[x * 4 + 1] = y * 255 / height;
+            line[x * 4 + 2] = ((x ^ y) & 0x1f) * 8;
+            line[x * 4 + 3] = 0;
+        }
+    }
+
+    bitmap->format = SPICE_BITMAP_FMT_32BIT;
+    bitmap->flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
+    bitmap->x = width;
+    bitmap->y = height;
+    bitmap->stride = stride;
+    bitmap->data = spice_chunks_new_linear(data, stride * height);
+    return bitmap;
+}
+
+static void free_frame(SpiceBitmap *bitmap)
+{
+    g_free(bitmap->data->chunk[0].data);
+    spice_chunks_destroy(bitmap->data);
+    g_free(bitmap);
+}
+
+/* returns the decoded RGB image */
+static uint8_t *decode_frame(VideoBuffer *buffer, uint32_t width, uint32_t height)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    uint8_t *image;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, buffer->data, buffer->size);
+    spice_assert(jpeg_read_header(&cinfo, TRUE) == JPEG_HEADER_OK);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    spice_assert(cinfo.output_width == width && cinfo.output_height == height);
+
+    image = g_malloc(width * height * 3);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        uint8_t *row = image + cinfo.output_scanline * width * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    /* a badly joined slice shows as a corrupt data warning */
+    spice_assert(jerr.num_warnings == 0);
+    jpeg_destroy_decompress(&cinfo);
+    return image;
+}
+
+/* Encodes the frames with at most max_slices slices and returns the
+ * frame rate, the first encoded frame is returned in first_frame */
+static double bench_encoder(SpiceBitmap *bitmap, const char *max_slices,
+                            VideoBuffer **first_frame)
+{
+    VideoEncoderRateControlCbs cbs;
+    VideoEncoder *encoder;
+    SpiceRect src = { 0, 0, bitmap->x, bitmap->y };
+    gint64 encode_time = 0;
+    int frames = 0;
+
+    /* read by the encoder when it is created */
+    g_setenv("SPICE_MJPEG_SLICES", max_slices, TRUE);
+    memset(&cbs, 0, sizeof(cbs));
+    encoder = mjpeg_encoder_new(SPICE_VIDEO_CODEC_TYPE_MJPEG, UINT64_C(10) * 1024 * 1024 * 1024,
+                                &cbs, NULL, NULL);
+    spice_assert(encoder);
+
+    *first_frame = NULL;
+    while (frames < num_frames) {
+        VideoBuffer *buffer;
+        gint64 start = g_get_monotonic_time();
+        VideoEncodeResults ret = encoder->encode_frame(encoder, start / 1000, bitmap, &src,
+                                                       TRUE, NULL, &buffer);
+
+        if (ret == VIDEO_ENCODER_FRAME_DROP) {
+            /* the rate control limits the frame rate based on the frame
+             * mm_time, only the encoding time is measured */
+            g_usleep(1000);
+            continue;
+        }
+        spice_assert(ret == VIDEO_ENCODER_FRAME_ENCODE_DONE);
+        encode_time += g_get_monotonic_time() - start;
+        if (*first_frame == NULL) {
+            *first_frame = buffer;
+        } else {
+            buffer->free(buffer);
+        }
+        frames++;
+    }
+    encoder->destroy(encoder);
+
+    return frames * 1000000.0 / encode_time;
+}
+
+static void bench_size(uint32_t width, uint32_t height)
+{
+    SpiceBitmap *bitmap = create_frame(width, height);
+    char slices[16];
+    VideoBuffer *single_frame, *sliced_frame;
+    uint8_t *single_image, *sliced_image;
+    double single_fps, sliced_fps;
+
+    snprintf(slices, sizeof(slices), "%d", num_slices);
+    single_fps = bench_encoder(bitmap, "1", &single_frame);
+    sliced_fps = bench_encoder(bitmap, slices, &sliced_frame);
+    printf("%ux%u: single slice %.1f fps (%u bytes), %d slices %.1f fps (%u bytes), x%.2f\n",
+           width, height, single_fps, single_frame->size, num_slices, sliced_fps,
+           sliced_frame->size, sliced_fps / single_fps);
+
+    /* the slices are made of whole MCUs, the images are the same */
+    single_image = decode_frame(single_frame, width, height);
+    sliced_image = decode_frame(sliced_frame, width, height);
+    spice_assert(memcmp(single_image, sliced_image, width * height * 3) == 0);
+
+    g_free(single_image);
+    g_free(sliced_image);
+    single_frame->free(single_frame);
+    sliced_frame->free(sliced_frame);
+    free_frame(bitmap);
+}
+
+int main(int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+
+    context = g_option_context_new("- benchmark the MJPEG encoder");
+    g_option_context_add_main_entries(context, cmd_entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        printf("Option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    g_option_context_free(context);
+    spice_assert(num_frames > 0);
+    if (num_slices <= 0) {
+        num_slices = g_get_num_processors();
+    }
+
+    bench_size(1920, 1080);
+    bench_size(3840, 2160);
+
+    return 0;
+}
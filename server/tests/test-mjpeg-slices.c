@@ -0,0 +1,180 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test that a frame compressed in slices by the MJPEG encoder, whose
+ * slices are joined in a single JPEG image, decodes to the same image
+ * as the frame compressed at once.
+ */
+#include <config.h>
+
+#include <string.h>
+#include <glib.h>
+#include <jpeglib.h>
+
+#include <common/mem.h>
+#include "test-glib-compat.h"
+#include "video-encoder.h"
+
+static SpiceBitmap *create_frame(uint32_t width, uint32_t height)
+{
+    SpiceBitmap *bitmap = g_new0(SpiceBitmap, 1);
+    uint32_t stride = width * 4;
+    uint8_t *data = g_malloc(stride * height);
+    uint32_t x, y;
+
+    for (y = 0; y < height; y++) {
+        uint8_t *line = data + y * stride;
+        for (x = 0; x < width; x++) {
+            line[x * 4 + 0] = x * 255 / width;
+            line[x * 4 + 1] = y * 255 / height;
+            line[x * 4 + 2] = ((x ^ y) & 0x1f) * 8;
+            line[x * 4 + 3] = 0;
+        }
+    }
+
+    bitmap->format = SPICE_BITMAP_FMT_32BIT;
+    bitmap->flags = SPICE_BITMAP_FLAGS_TOP_DOWN;
+    bitmap->x = width;
+    bitmap->y = height;
+    bitmap->stride = stride;
+    bitmap->data = spice_chunks_new_linear(data, stride * height);
+    return bitmap;
+}
+
+static void free_frame(SpiceBitmap *bitmap)
+{
+    g_free(bitmap->data->chunk[0].data);
+    spice_chunks_destroy(bitmap->data);
+    g_free(bitmap);
+}
+
+/* Encodes @bitmap with at most @max_slices slices */
+static VideoBuffer *encode_frame(SpiceBitmap *bitmap, const char *max_slices)
+{
+    VideoEncoderRateControlCbs cbs;
+    VideoEncoder *encoder;
+    VideoBuffer *buffer = NULL;
+    SpiceRect src = { 0, 0, bitmap->x, bitmap->y };
+    VideoEncodeResults ret;
+
+    /* read by the encoder when it is created */
+    g_setenv("SPICE_MJPEG_SLICES", max_slices, TRUE);
+    memset(&cbs, 0, sizeof(cbs));
+    encoder = mjpeg_encoder_new(SPICE_VIDEO_CODEC_TYPE_MJPEG, UINT64_C(10) * 1024 * 1024 * 1024,
+                                &cbs, NULL, NULL);
+    g_assert_nonnull(encoder);
+    g_unsetenv("SPICE_MJPEG_SLICES");
+
+    ret = encoder->encode_frame(encoder, 0, bitmap, &src, TRUE, NULL, &buffer);
+    g_assert_cmpint(ret, ==, VIDEO_ENCODER_FRAME_ENCODE_DONE);
+    g_assert_nonnull(buffer);
+    encoder->destroy(encoder);
+
+    return buffer;
+}
+
+/* Whether the JPEG image has a restart interval, the slices are made of
+ * restart intervals */
+static gboolean has_restart_interval(const VideoBuffer *buffer)
+{
+    uint32_t i;
+
+    for (i = 0; i + 1 < buffer->size; i++) {
+        /* the DRI marker, before the scan data where 0xff is escaped */
+        if (buffer->data[i] == 0xff && buffer->data[i + 1] == 0xdd) {
+            return TRUE;
+        }
+        if (buffer->data[i] == 0xff && buffer->data[i + 1] == 0xda) {
+            return FALSE;
+        }
+    }
+    return FALSE;
+}
+
+/* returns the decoded RGB image */
+static uint8_t *decode_frame(const VideoBuffer *buffer, uint32_t width, uint32_t height)
+{
+    struct jpeg_decompress_struct cinfo;
+    struct jpeg_error_mgr jerr;
+    uint8_t *image;
+
+    cinfo.err = jpeg_std_error(&jerr);
+    jpeg_create_decompress(&cinfo);
+    jpeg_mem_src(&cinfo, buffer->data, buffer->size);
+    g_assert_cmpint(jpeg_read_header(&cinfo, TRUE), ==, JPEG_HEADER_OK);
+    cinfo.out_color_space = JCS_RGB;
+    jpeg_start_decompress(&cinfo);
+    g_assert_cmpuint(cinfo.output_width, ==, width);
+    g_assert_cmpuint(cinfo.output_height, ==, height);
+
+    image = g_malloc(width * height * 3);
+    while (cinfo.output_scanline < cinfo.output_height) {
+        uint8_t *row = image + cinfo.output_scanline * width * 3;
+        jpeg_read_scanlines(&cinfo, &row, 1);
+    }
+    jpeg_finish_decompress(&cinfo);
+    /* a badly joined slice shows as a corrupt data warning */
+    g_assert_cmpint(jerr.num_warnings, ==, 0);
+    jpeg_destroy_decompress(&cinfo);
+    return image;
+}
+
+static void check_slices(uint32_t width, uint32_t height, const char *max_slices)
+{
+    SpiceBitmap *bitmap = create_frame(width, height);
+    VideoBuffer *single_frame, *sliced_frame;
+    uint8_t *single_image, *sliced_image;
+
+    single_frame = encode_frame(bitmap, "1");
+    sliced_frame = encode_frame(bitmap, max_slices);
+    g_assert_false(has_restart_interval(single_frame));
+    g_assert_true(has_restart_interval(sliced_frame));
+
+    /* the slices are made of whole MCUs, the images are the same */
+    single_image = decode_frame(single_frame, width, height);
+    sliced_image = decode_frame(sliced_frame, width, height);
+    g_assert_true(memcmp(single_image, sliced_image, width * height * 3) == 0);
+
+    g_free(single_image);
+    g_free(sliced_image);
+    single_frame->free(single_frame);
+    sliced_frame->free(sliced_frame);
+    free_frame(bitmap);
+}
+
+/* the smallest frames split in slices */
+static void test_mjpeg_slices_even(void)
+{
+    check_slices(1280, 720, "4");
+}
+
+/* partial MCUs on the right and at the bottom, a shorter last slice */
+static void test_mjpeg_slices_uneven(void)
+{
+    check_slices(1288, 730, "3");
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/mjpeg-slices/even", test_mjpeg_slices_even);
+    g_test_add_func("/server/mjpeg-slices/uneven", test_mjpeg_slices_uneven);
+
+    return g_test_run();
+}
@@ -0,0 +1,116 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test the continuous network estimator
+ */
+#include <config.h>
+
+#include <glib.h>
+
+#include "test-glib-compat.h"
+#include "utils.h"
+#include "net-estimator.h"
+
+#define MBPS (UINT64_C(1024) * 1024)
+
+static void test_net_estimator_empty(void)
+{
+    NetEstimator estimator;
+
+    g_assert_false(estimator.has_bit_rate());
+    g_assert_false(estimator.has_rtt());
+    g_assert_cmpuint(estimator.get_bit_rate(), ==, ~UINT64_C(0));
+    g_assert_cmpuint(estimator.get_min_rtt_ns(), ==, 0);
+}
+
+static void test_net_estimator_rtt(void)
+{
+    NetEstimator estimator;
+    uint64_t now = NSEC_PER_SEC;
+
+    estimator.add_rtt_sample(20 * NSEC_PER_MILLISEC, now);
+    g_assert_true(estimator.has_rtt());
+    g_assert_cmpuint(estimator.get_min_rtt_ns(), ==, 20 * NSEC_PER_MILLISEC);
+
+    // bigger samples are caused by queues, the minimum is kept
+    now += NSEC_PER_SEC;
+    estimator.add_rtt_sample(50 * NSEC_PER_MILLISEC, now);
+    g_assert_cmpuint(estimator.get_min_rtt_ns(), ==, 20 * NSEC_PER_MILLISEC);
+    estimator.add_rtt_sample(10 * NSEC_PER_MILLISEC, now);
+    g_assert_cmpuint(estimator.get_min_rtt_ns(), ==, 10 * NSEC_PER_MILLISEC);
+
+    // the path changed, the old minimum expires
+    now += NSEC_PER_SEC * 11;
+    estimator.add_rtt_sample(80 * NSEC_PER_MILLISEC, now);
+    g_assert_cmpuint(estimator.get_min_rtt_ns(), ==, 80 * NSEC_PER_MILLISEC);
+}
+
+static void test_net_estimator_bit_rate(void)
+{
+    NetEstimator estimator;
+    int i;
+
+    // 4 MiB in a second
+    estimator.add_delivery_sample(4 * 1024 * 1024, NSEC_PER_SEC, false);
+    g_assert_true(estimator.has_bit_rate());
+    g_assert_cmpuint(estimator.get_bit_rate(), ==, 32 * MBPS);
+
+    // intervals too short are ignored
+    estimator.add_delivery_sample(1024, 1000, false);
+    g_assert_cmpuint(estimator.get_bit_rate(), ==, 32 * MBPS);
+
+    // the network got slower, the estimate follows
+    for (i = 0; i < 30; i++) {
+        estimator.add_bit_rate_sample(4 * MBPS, false);
+    }
+    g_assert_cmpuint(estimator.get_bit_rate(), <, NET_LOW_BANDWIDTH_BIT_RATE);
+    g_assert_cmpuint(estimator.get_bit_rate(), >=, 4 * MBPS);
+}
+
+static void test_net_estimator_app_limited(void)
+{
+    NetEstimator estimator;
+    uint64_t bit_rate;
+    int i;
+
+    estimator.add_bit_rate_sample(20 * MBPS, false);
+
+    // the sender was idle, slow samples do not mean a slow network
+    for (i = 0; i < 30; i++) {
+        estimator.add_bit_rate_sample(MBPS, true);
+    }
+    g_assert_cmpuint(estimator.get_bit_rate(), ==, 20 * MBPS);
+
+    // but faster samples do
+    estimator.add_bit_rate_sample(40 * MBPS, true);
+    bit_rate = estimator.get_bit_rate();
+    g_assert_cmpuint(bit_rate, >, 20 * MBPS);
+    g_assert_cmpuint(bit_rate, <=, 40 * MBPS);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, nullptr);
+
+    g_test_add_func("/server/net-estimator/empty", test_net_estimator_empty);
+    g_test_add_func("/server/net-estimator/rtt", test_net_estimator_rtt);
+    g_test_add_func("/server/net-estimator/bit-rate", test_net_estimator_bit_rate);
+    g_test_add_func("/server/net-estimator/app-limited", test_net_estimator_app_limited);
+
+    return g_test_run();
+}
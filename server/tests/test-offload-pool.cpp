@@ -0,0 +1,182 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test OffloadPool class, in particular that every job gets either
+ * its done or its cancel function called when the pool is deleted
+ */
+
+#include <config.h>
+
+#include "basic-event-loop.h"
+#include "test-glib-compat.h"
+#include "reds.h"
+#include "offload-pool.h"
+#include "win-alarm.h"
+
+#define NUM_JOBS 20
+
+static SpiceCoreInterface *core;
+static SpiceCoreInterfaceInternal core_int;
+static red::shared_ptr<Dispatcher> dispatcher;
+static SpiceWatch *watch;
+static gint num_worked;
+static unsigned num_done;
+static unsigned num_cancelled;
+using TestFixture = int;
+
+static void test_offload_pool_setup(TestFixture *fixture, gconstpointer user_data)
+{
+    num_worked = 0;
+    num_done = 0;
+    num_cancelled = 0;
+    g_assert_null(core);
+    core = basic_event_loop_init();
+    g_assert_nonnull(core);
+    core_int = core_interface_adapter;
+    core_int.public_interface = core;
+    dispatcher = red::make_shared<Dispatcher>(1);
+    watch = dispatcher->create_watch(&core_int);
+}
+
+static void test_offload_pool_teardown(TestFixture *fixture, gconstpointer user_data)
+{
+    g_assert_nonnull(core);
+
+    red_watch_remove(watch);
+    watch = nullptr;
+    dispatcher.reset();
+    basic_event_loop_destroy();
+    core = nullptr;
+}
+
+/* the opaque of the jobs is allocated, a leak shows a job
+ * whose done or cancel function was not called */
+static void job_work(void *opaque)
+{
+    g_usleep(GPOINTER_TO_UINT(*static_cast<gpointer *>(opaque)));
+    g_atomic_int_inc(&num_worked);
+}
+
+static void job_done(void *opaque)
+{
+    g_free(opaque);
+    if (++num_done == NUM_JOBS) {
+        basic_event_loop_quit();
+    }
+}
+
+static void job_cancel(void *opaque)
+{
+    g_free(opaque);
+    num_cancelled++;
+}
+
+static void push_job(OffloadPool *pool, unsigned sleep_us)
+{
+    auto opaque = g_new(gpointer, 1);
+    *opaque = GUINT_TO_POINTER(sleep_us);
+    pool->push(job_work, job_done, job_cancel, opaque);
+}
+
+static void quit_timer(void *opaque)
+{
+    basic_event_loop_quit();
+}
+
+/* run the main loop for a while to handle the completions */
+static void run_loop(unsigned ms)
+{
+    SpiceTimer *timer = core->timer_add(quit_timer, nullptr);
+    core->timer_start(timer, ms);
+    basic_event_loop_mainloop();
+    core->timer_remove(timer);
+}
+
+static void test_offload_pool_done(TestFixture *fixture, gconstpointer user_data)
+{
+    auto pool = new OffloadPool(dispatcher.get(), 4);
+
+    for (int i = 0; i < NUM_JOBS; i++) {
+        push_job(pool, 1000);
+    }
+    alarm(20);
+    basic_event_loop_mainloop();
+    alarm(0);
+    delete pool;
+
+    g_assert_cmpint(num_done, ==, NUM_JOBS);
+    g_assert_cmpint(num_cancelled, ==, 0);
+}
+
+/* jobs still queued or running when the pool is deleted */
+static void test_offload_pool_delete_pending(TestFixture *fixture, gconstpointer user_data)
+{
+    auto pool = new OffloadPool(dispatcher.get(), 1);
+
+    for (int i = 0; i < NUM_JOBS; i++) {
+        push_job(pool, 50 * 1000);
+    }
+    /* let the first job start */
+    g_usleep(10 * 1000);
+    delete pool;
+
+    g_assert_cmpint(g_atomic_int_get(&num_worked), >=, 1);
+    g_assert_cmpint(g_atomic_int_get(&num_worked), <, NUM_JOBS);
+    g_assert_cmpint(num_cancelled, ==, NUM_JOBS);
+
+    /* nothing was posted to the dispatcher */
+    run_loop(100);
+    g_assert_cmpint(num_done, ==, 0);
+}
+
+/* jobs whose completion is posted but not handled when the pool is deleted */
+static void test_offload_pool_delete_posted(TestFixture *fixture, gconstpointer user_data)
+{
+    auto pool = new OffloadPool(dispatcher.get(), 4);
+
+    for (int i = 0; i < NUM_JOBS; i++) {
+        push_job(pool, 0);
+    }
+    while (g_atomic_int_get(&num_worked) < NUM_JOBS) {
+        g_usleep(1000);
+    }
+    /* wait for the completions to be posted */
+    g_usleep(50 * 1000);
+    delete pool;
+    g_assert_cmpint(num_cancelled, ==, NUM_JOBS);
+
+    /* the completions are ignored */
+    run_loop(100);
+    g_assert_cmpint(num_done, ==, 0);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add("/server/offload-pool/done", TestFixture, nullptr, test_offload_pool_setup,
+               test_offload_pool_done, test_offload_pool_teardown);
+    g_test_add("/server/offload-pool/delete-pending", TestFixture, nullptr,
+               test_offload_pool_setup, test_offload_pool_delete_pending,
+               test_offload_pool_teardown);
+    g_test_add("/server/offload-pool/delete-posted", TestFixture, nullptr,
+               test_offload_pool_setup, test_offload_pool_delete_posted,
+               test_offload_pool_teardown);
+
+    return g_test_run();
+}
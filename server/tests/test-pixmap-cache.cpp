@@ -0,0 +1,267 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test the hash table and the admission policy of the pixmap cache
+ */
+#include <config.h>
+
+#include "basic-event-loop.h"
+#include "test-glib-compat.h"
+#include "reds.h"
+#include "red-client.h"
+#include "pixmap-cache.h"
+
+#define CACHE_SIZE 800
+
+struct TestFixture {
+    SpiceCoreInterface *core;
+    SpiceServer *server;
+    RedClient *client;
+    PixmapCache *cache;
+};
+
+static void test_pixmap_cache_setup(TestFixture *fixture, gconstpointer user_data)
+{
+    fixture->core = basic_event_loop_init();
+    g_assert_nonnull(fixture->core);
+    fixture->server = spice_server_new();
+    g_assert_nonnull(fixture->server);
+    g_assert_cmpint(spice_server_init(fixture->server, fixture->core), ==, 0);
+    fixture->client = red_client_new(fixture->server, FALSE);
+    g_assert_nonnull(fixture->client);
+    fixture->cache = pixmap_cache_get(fixture->client, 0, CACHE_SIZE);
+    g_assert_nonnull(fixture->cache);
+    pthread_mutex_lock(&fixture->cache->lock);
+}
+
+static void test_pixmap_cache_teardown(TestFixture *fixture, gconstpointer user_data)
+{
+    pthread_mutex_unlock(&fixture->cache->lock);
+    pixmap_cache_unref(fixture->cache);
+    fixture->client->destroy();
+    spice_server_destroy(fixture->server);
+    basic_event_loop_destroy();
+}
+
+static uint32_t table_size(const PixmapCache *cache)
+{
+    return 1u << cache->table_bits;
+}
+
+/* Returns the slot of the table holding @id, or -1 */
+static int find_slot(const PixmapCache *cache, uint64_t id)
+{
+    for (uint32_t i = 0; i < table_size(cache); i++) {
+        if (cache->table[i] && cache->table[i]->id == id) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/* Returns the slot @id is stored at when there is no collision */
+static uint32_t home_slot(PixmapCache *cache, uint64_t id)
+{
+    g_assert_cmpuint(cache->num_entries, ==, 0);
+
+    PixmapCacheEntry *entry = pixmap_cache_unlocked_insert(cache, id);
+    int slot = find_slot(cache, id);
+    pixmap_cache_unlocked_remove(cache, entry);
+
+    g_assert_cmpint(slot, >=, 0);
+    return slot;
+}
+
+/* Fills @ids with @num_ids ids whose home slot is @slot */
+static void get_ids(PixmapCache *cache, uint32_t slot, uint64_t *ids, int num_ids)
+{
+    uint64_t id = 1;
+
+    for (int i = 0; i < num_ids; id++) {
+        if (home_slot(cache, id) == slot) {
+            ids[i++] = id;
+        }
+    }
+}
+
+static void insert_all(PixmapCache *cache, const uint64_t *ids, int num_ids)
+{
+    for (int i = 0; i < num_ids; i++) {
+        g_assert_null(pixmap_cache_unlocked_lookup(cache, ids[i]));
+        pixmap_cache_unlocked_insert(cache, ids[i]);
+    }
+}
+
+static void check_found(PixmapCache *cache, const uint64_t *ids, int num_ids)
+{
+    for (int i = 0; i < num_ids; i++) {
+        PixmapCacheEntry *entry = pixmap_cache_unlocked_lookup(cache, ids[i]);
+        g_assert_nonnull(entry);
+        g_assert_cmpuint(entry->id, ==, ids[i]);
+    }
+}
+
+static void remove_id(PixmapCache *cache, uint64_t id)
+{
+    PixmapCacheEntry *entry = pixmap_cache_unlocked_lookup(cache, id);
+
+    g_assert_nonnull(entry);
+    pixmap_cache_unlocked_remove(cache, entry);
+    g_assert_null(pixmap_cache_unlocked_lookup(cache, id));
+}
+
+/* a cluster starting at the last slot continues at the first one */
+static void test_pixmap_cache_wrap_around(TestFixture *fixture, gconstpointer user_data)
+{
+    PixmapCache *cache = fixture->cache;
+    const uint32_t last = table_size(cache) - 1;
+    uint64_t ids[4];
+
+    get_ids(cache, last, ids, 3);
+    get_ids(cache, 0, &ids[3], 1);
+    insert_all(cache, ids, 4);
+
+    g_assert_cmpint(find_slot(cache, ids[0]), ==, last);
+    g_assert_cmpint(find_slot(cache, ids[1]), ==, 0);
+    g_assert_cmpint(find_slot(cache, ids[2]), ==, 1);
+    g_assert_cmpint(find_slot(cache, ids[3]), ==, 2);
+    check_found(cache, ids, 4);
+
+    /* the rest of the cluster moves back across the end of the table */
+    remove_id(cache, ids[0]);
+    g_assert_cmpint(find_slot(cache, ids[1]), ==, last);
+    g_assert_cmpint(find_slot(cache, ids[2]), ==, 0);
+    g_assert_cmpint(find_slot(cache, ids[3]), ==, 1);
+    g_assert_null(cache->table[2]);
+    check_found(cache, &ids[1], 3);
+    g_assert_cmpuint(cache->num_entries, ==, 3);
+}
+
+/* the entries following a removed one are still found */
+static void test_pixmap_cache_remove_middle(TestFixture *fixture, gconstpointer user_data)
+{
+    PixmapCache *cache = fixture->cache;
+    uint64_t ids[5];
+
+    get_ids(cache, 10, ids, 3);
+    get_ids(cache, 12, &ids[3], 1);
+    get_ids(cache, 14, &ids[4], 1);
+    insert_all(cache, ids, 5);
+
+    g_assert_cmpint(find_slot(cache, ids[0]), ==, 10);
+    g_assert_cmpint(find_slot(cache, ids[1]), ==, 11);
+    g_assert_cmpint(find_slot(cache, ids[2]), ==, 12);
+    g_assert_cmpint(find_slot(cache, ids[3]), ==, 13);
+    g_assert_cmpint(find_slot(cache, ids[4]), ==, 14);
+
+    remove_id(cache, ids[1]);
+    g_assert_cmpint(find_slot(cache, ids[0]), ==, 10);
+    g_assert_cmpint(find_slot(cache, ids[2]), ==, 11);
+    g_assert_cmpint(find_slot(cache, ids[3]), ==, 12);
+    /* an entry is never moved before its home slot */
+    g_assert_cmpint(find_slot(cache, ids[4]), ==, 14);
+    g_assert_null(cache->table[13]);
+
+    const uint64_t left[] = { ids[0], ids[2], ids[3], ids[4] };
+    check_found(cache, left, G_N_ELEMENTS(left));
+    g_assert_cmpuint(cache->num_entries, ==, 4);
+}
+
+/* growing the table moves the entries, not what they hold */
+static void test_pixmap_cache_grow(TestFixture *fixture, gconstpointer user_data)
+{
+    PixmapCache *cache = fixture->cache;
+    const uint8_t table_bits = cache->table_bits;
+    const uint64_t num_ids = 1000;
+    PixmapCacheEntry *entries[num_ids];
+
+    for (uint64_t id = 0; id < num_ids; id++) {
+        entries[id] = pixmap_cache_unlocked_insert(cache, id);
+        entries[id]->size = id * 10;
+        entries[id]->lossy = id % 2;
+    }
+    g_assert_cmpuint(cache->table_bits, >, table_bits);
+    g_assert_cmpuint(cache->num_entries, ==, num_ids);
+    g_assert_cmpuint(cache->num_entries * 4, <=, 3 * table_size(cache));
+
+    for (uint64_t id = 0; id < num_ids; id++) {
+        PixmapCacheEntry *entry = pixmap_cache_unlocked_lookup(cache, id);
+        g_assert_true(entry == entries[id]);
+        g_assert_cmpuint(entry->id, ==, id);
+        g_assert_cmpuint(entry->size, ==, id * 10);
+        g_assert_cmpint(entry->lossy, ==, id % 2);
+    }
+
+    /* the LRU order is kept, the last inserted entry is the most recent */
+    SPICE_VERIFY(SPICE_OFFSETOF(PixmapCacheEntry, lru_link) == 0);
+    auto head = SPICE_CONTAINEROF(ring_get_head(&cache->lru), PixmapCacheEntry, lru_link);
+    auto tail = SPICE_CONTAINEROF(ring_get_tail(&cache->lru), PixmapCacheEntry, lru_link);
+    g_assert_true(head == entries[num_ids - 1]);
+    g_assert_true(tail == entries[0]);
+
+    for (uint64_t id = 0; id < num_ids; id += 2) {
+        remove_id(cache, id);
+    }
+    for (uint64_t id = 1; id < num_ids; id += 2) {
+        g_assert_true(pixmap_cache_unlocked_lookup(cache, id) == entries[id]);
+    }
+    g_assert_cmpuint(cache->num_entries, ==, num_ids / 2);
+}
+
+static void test_pixmap_cache_admit(TestFixture *fixture, gconstpointer user_data)
+{
+    PixmapCache *cache = fixture->cache;
+    const uint64_t large = CACHE_SIZE / 8 + 1;
+
+    /* the pixmaps up to 1/8 of the cache are cached the first time */
+    g_assert_true(pixmap_cache_unlocked_admit(cache, 1, CACHE_SIZE / 8));
+
+    /* a larger one only the second time */
+    g_assert_false(pixmap_cache_unlocked_admit(cache, 2, large));
+    g_assert_false(pixmap_cache_unlocked_admit(cache, 3, CACHE_SIZE));
+    g_assert_true(pixmap_cache_unlocked_admit(cache, 2, large));
+    g_assert_true(pixmap_cache_unlocked_admit(cache, 3, CACHE_SIZE));
+
+    /* it is forgotten after PIXMAP_CACHE_SEEN_LARGE other large pixmaps */
+    g_assert_false(pixmap_cache_unlocked_admit(cache, 4, large));
+    for (uint64_t id = 100; id < 100 + PIXMAP_CACHE_SEEN_LARGE; id++) {
+        g_assert_false(pixmap_cache_unlocked_admit(cache, id, large));
+    }
+    g_assert_false(pixmap_cache_unlocked_admit(cache, 4, large));
+    g_assert_true(pixmap_cache_unlocked_admit(cache, 4, large));
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add("/server/pixmap-cache/wrap-around", TestFixture, nullptr,
+               test_pixmap_cache_setup, test_pixmap_cache_wrap_around,
+               test_pixmap_cache_teardown);
+    g_test_add("/server/pixmap-cache/remove-middle", TestFixture, nullptr,
+               test_pixmap_cache_setup, test_pixmap_cache_remove_middle,
+               test_pixmap_cache_teardown);
+    g_test_add("/server/pixmap-cache/grow", TestFixture, nullptr,
+               test_pixmap_cache_setup, test_pixmap_cache_grow,
+               test_pixmap_cache_teardown);
+    g_test_add("/server/pixmap-cache/admit", TestFixture, nullptr,
+               test_pixmap_cache_setup, test_pixmap_cache_admit,
+               test_pixmap_cache_teardown);
+
+    return g_test_run();
+}
@@ -105,6 +105,7 @@ check_vmc_error_message()
 
 static int num_send_data_calls = 0;
 static size_t send_data_bytes = 0;
+static uint8_t *send_data_last;
 
 StreamChannel::StreamChannel(RedsState *reds, uint32_t id):
     RedChannel(reds, SPICE_CHANNEL_DISPLAY, id, RedChannel::HandleAcks)
@@ -112,16 +113,39 @@ StreamChannel::StreamChannel(RedsState *reds, uint32_t id):
     reds_register_channel(reds, this);
 }
 
+StreamChannel::~StreamChannel()
+{
+}
+
 void
 StreamChannel::change_format(const StreamMsgFormat *fmt)
 {
 }
 
+StreamFrame::~StreamFrame()
+{
+    g_free(data);
+}
+
+StreamFramePtr
+StreamChannel::get_frame(uint32_t size)
+{
+    auto frame = red::make_shared<StreamFrame>();
+    frame->channel = this;
+    frame->data = static_cast<uint8_t *>(g_malloc(size));
+    frame->size = size;
+    frame->buffer_size = size;
+    return frame;
+}
+
 void
-StreamChannel::send_data(const void *data, size_t size, uint32_t mm_time)
+StreamChannel::send_frame(const StreamFramePtr &frame, uint32_t mm_time)
 {
     ++num_send_data_calls;
-    send_data_bytes += size;
+    send_data_bytes += frame->size;
+    g_free(send_data_last);
+    send_data_last = static_cast<uint8_t *>(g_malloc(frame->size));
+    memcpy(send_data_last, frame->data, frame->size);
 }
 
 void
@@ -167,6 +191,7 @@ static void test_stream_device_setup(TestFixture *fixture, gconstpointer user_da
 
     num_send_data_calls = 0;
     send_data_bytes = 0;
+    g_clear_pointer(&send_data_last, g_free);
 }
 
 static void test_stream_device_teardown(TestFixture *fixture, gconstpointer user_data)
@@ -360,6 +385,7 @@ static void test_stream_device_data_message(TestFixture *fixture, gconstpointer
     // add some messages into device buffer
     p = add_format(p, 640, 480, SPICE_VIDEO_CODEC_TYPE_MJPEG);
     p = add_stream_hdr(p, STREAM_TYPE_DATA, 1017);
+    const uint8_t *data = p;
     for (int i = 0; i < 1017; ++i, ++p) {
         *p = static_cast<uint8_t>(i * 123 + 57);
     }
@@ -380,6 +406,8 @@ static void test_stream_device_data_message(TestFixture *fixture, gconstpointer
     // make sure data were collapsed in a single message
     g_assert_cmpint(num_send_data_calls, ==, 1);
     g_assert_cmpint(send_data_bytes, ==, 1017);
+    g_assert_nonnull(send_data_last);
+    g_assert_cmpint(memcmp(send_data_last, data, 1017), ==, 0);
 }
 
 static void test_display_info(TestFixture *fixture, gconstpointer user_data)
@@ -0,0 +1,232 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Benchmark comparing the throughput of a TLS RedStream with and
+ * without kernel TLS offload, sending to a local TLS client.
+ * Kernel TLS requires OpenSSL 3.0 built with KTLS support and the
+ * "tls" kernel module loaded.
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <glib.h>
+#include <openssl/err.h>
+
+#include <common/log.h>
+#include "red-stream.h"
+#include "basic-event-loop.h"
+
+#define PKI_DIR SPICE_TOP_SRCDIR "/server/tests/pki/"
+
+static gint total_mb = 2048;
+static gint chunk_kb = 64;
+static gboolean no_ktls = FALSE;
+
+static GOptionEntry cmd_entries[] = {
+    {"size", 's', 0, G_OPTION_ARG_INT, &total_mb,
+     "Megabytes to send (default 2048)", NULL},
+    {"chunk", 'c', 0, G_OPTION_ARG_INT, &chunk_kb,
+     "Size of each message in kilobytes (default 64)", NULL},
+    {"no-ktls", 'n', 0, G_OPTION_ARG_NONE, &no_ktls,
+     "Do not use kernel TLS offload", NULL},
+    {NULL}
+};
+
+/* TLS client discarding everything received */
+static void run_client(int sock)
+{
+    static char buf[256 * 1024];
+    SSL_CTX *ctx = SSL_CTX_new(TLS_client_method());
+    SSL *ssl;
+
+    spice_assert(ctx);
+    SSL_CTX_set_verify(ctx, SSL_VERIFY_NONE, NULL);
+    ssl = SSL_new(ctx);
+    spice_assert(ssl);
+    SSL_set_fd(ssl, sock);
+    if (SSL_connect(ssl) != 1) {
+        ERR_print_errors_fp(stderr);
+        _exit(1);
+    }
+    while (SSL_read(ssl, buf, sizeof(buf)) > 0) {
+        continue;
+    }
+    SSL_free(ssl);
+    SSL_CTX_free(ctx);
+    _exit(0);
+}
+
+static SSL_CTX *create_server_ctx(void)
+{
+    SSL_CTX *ctx = SSL_CTX_new(TLS_server_method());
+
+    spice_assert(ctx);
+#ifdef SSL_OP_ENABLE_KTLS
+    if (!no_ktls) {
+        SSL_CTX_set_options(ctx, SSL_OP_ENABLE_KTLS);
+    }
+#endif
+    spice_assert(SSL_CTX_use_certificate_chain_file(ctx, PKI_DIR "server-cert.pem") == 1);
+    spice_assert(SSL_CTX_use_PrivateKey_file(ctx, PKI_DIR "server-key.pem",
+                                             SSL_FILETYPE_PEM) == 1);
+    return ctx;
+}
+
+static void writev_all(RedStream *stream, struct iovec *iov, int iovcnt)
+{
+    while (iovcnt > 0) {
+        ssize_t n = red_stream_writev(stream, iov, iovcnt);
+        if (n <= 0) {
+            if (n < 0 && (errno == EINTR || errno == EAGAIN)) {
+                continue;
+            }
+            spice_error("write failed: %s", strerror(errno));
+        }
+        while (iovcnt > 0 && (size_t) n >= iov->iov_len) {
+            n -= iov->iov_len;
+            iov++;
+            iovcnt--;
+        }
+        if (iovcnt > 0) {
+            iov->iov_base = (uint8_t *) iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+}
+
+static double timeval_to_sec(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    SpiceServer *server;
+    RedStream *stream;
+    RedStreamSslStatus status;
+    SSL_CTX *ctx;
+    struct rusage start_usage, end_usage;
+    gint64 start_time, elapsed;
+    uint64_t total, sent = 0;
+    uint8_t header[16];
+    size_t chunk;
+    uint8_t *buf;
+    pid_t pid;
+    int sv[2];
+
+    context = g_option_context_new("- benchmark kernel TLS offload");
+    g_option_context_add_main_entries(context, cmd_entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        printf("Option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    g_option_context_free(context);
+
+    total = (uint64_t) total_mb * 1024 * 1024;
+    chunk = (size_t) chunk_kb * 1024;
+    spice_assert(total > 0 && chunk > 0);
+
+    server = spice_server_new();
+    spice_assert(spice_server_init(server, basic_event_loop_init()) == 0);
+
+    /* kernel TLS works only on TCP sockets */
+    {
+        struct sockaddr_in addr;
+        socklen_t len = sizeof(addr);
+        int listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+
+        spice_assert(listen_sock >= 0);
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        spice_assert(bind(listen_sock, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+        spice_assert(listen(listen_sock, 1) == 0);
+        spice_assert(getsockname(listen_sock, (struct sockaddr *) &addr, &len) == 0);
+
+        sv[1] = socket(AF_INET, SOCK_STREAM, 0);
+        spice_assert(sv[1] >= 0);
+        spice_assert(connect(sv[1], (struct sockaddr *) &addr, sizeof(addr)) == 0);
+        sv[0] = accept(listen_sock, NULL, NULL);
+        spice_assert(sv[0] >= 0);
+        close(listen_sock);
+    }
+
+    pid = fork();
+    spice_assert(pid >= 0);
+    if (pid == 0) {
+        close(sv[0]);
+        run_client(sv[1]);
+    }
+    close(sv[1]);
+
+    ctx = create_server_ctx();
+    stream = red_stream_new(server, sv[0]);
+    status = red_stream_enable_ssl(stream, ctx);
+    while (status == RED_STREAM_SSL_STATUS_WAIT_FOR_READ ||
+           status == RED_STREAM_SSL_STATUS_WAIT_FOR_WRITE) {
+        status = red_stream_ssl_accept(stream);
+    }
+    spice_assert(status == RED_STREAM_SSL_STATUS_OK);
+
+    buf = g_malloc(chunk);
+    memset(buf, 0x5a, chunk);
+    memset(header, 0, sizeof(header));
+
+    getrusage(RUSAGE_SELF, &start_usage);
+    start_time = g_get_monotonic_time();
+
+    /* send messages as channels do, a small header followed
+     * by the payload */
+    while (sent < total) {
+        struct iovec iov[2];
+
+        iov[0].iov_base = header;
+        iov[0].iov_len = sizeof(header);
+        iov[1].iov_base = buf;
+        iov[1].iov_len = MIN(chunk, total - sent);
+        sent += iov[1].iov_len;
+        writev_all(stream, iov, 2);
+    }
+
+    elapsed = g_get_monotonic_time() - start_time;
+    getrusage(RUSAGE_SELF, &end_usage);
+
+    double cpu = timeval_to_sec(&end_usage.ru_utime) - timeval_to_sec(&start_usage.ru_utime) +
+                 timeval_to_sec(&end_usage.ru_stime) - timeval_to_sec(&start_usage.ru_stime);
+    double mb = total / (1024.0 * 1024.0);
+    printf("kernel TLS offload: %s\n", red_stream_is_ktls(stream) ? "yes" : "no");
+    printf("sent %.0f MiB in %.3f s (%.1f MiB/s)\n",
+           mb, elapsed / 1000000.0, mb * 1000000.0 / elapsed);
+    printf("CPU time: %.3f s, %.3f s per GiB\n", cpu, cpu * 1024 / mb);
+
+    red_stream_free(stream);
+    waitpid(pid, NULL, 0);
+    SSL_CTX_free(ctx);
+    g_free(buf);
+
+    return 0;
+}
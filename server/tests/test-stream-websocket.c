@@ -0,0 +1,289 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Benchmark of a WebSocket RedStream.
+ * A local client sends masked frames, small ones like the inputs
+ * channel and large ones, then receives display like traffic:
+ * trains of small messages followed by a flush.
+ * The client reports the number of frames received, which shows
+ * the effect of write batching (see --no-batching).
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <glib.h>
+
+#include <common/log.h>
+#include "red-stream.h"
+#include "basic-event-loop.h"
+
+#define INPUT_MSG_SIZE 8
+#define BIG_FRAME_SIZE (64 * 1024)
+
+static gint num_inputs = 100000;
+static gint big_mb = 512;
+static gint num_messages = 200000;
+static gint flush_interval = 16;
+static gboolean no_batching = FALSE;
+
+static GOptionEntry cmd_entries[] = {
+    {"inputs", 'i', 0, G_OPTION_ARG_INT, &num_inputs,
+     "Number of small input messages sent by the client (default 100000)", NULL},
+    {"big", 'b', 0, G_OPTION_ARG_INT, &big_mb,
+     "Megabytes sent by the client in large frames (default 512)", NULL},
+    {"messages", 'm', 0, G_OPTION_ARG_INT, &num_messages,
+     "Number of display messages sent by the server (default 200000)", NULL},
+    {"flush", 'f', 0, G_OPTION_ARG_INT, &flush_interval,
+     "Number of display messages between flushes (default 16)", NULL},
+    {"no-batching", 'n', 0, G_OPTION_ARG_NONE, &no_batching,
+     "Write each message with a separate frame", NULL},
+    {NULL}
+};
+
+static const uint8_t mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+
+static void write_all(int fd, const void *buf, size_t len)
+{
+    const uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        spice_assert(n > 0);
+        p += n;
+        len -= n;
+    }
+}
+
+static void read_all(int fd, void *buf, size_t len)
+{
+    uint8_t *p = buf;
+
+    while (len > 0) {
+        ssize_t n = read(fd, p, len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        spice_assert(n > 0);
+        p += n;
+        len -= n;
+    }
+}
+
+/* build a masked binary frame, the payload contains its offset */
+static size_t build_frame(uint8_t *frame, size_t len)
+{
+    size_t used = 0, i;
+
+    frame[used++] = 0x82;
+    if (len < 126) {
+        frame[used++] = 0x80 | len;
+    } else if (len < 65536) {
+        frame[used++] = 0x80 | 126;
+        frame[used++] = len >> 8;
+        frame[used++] = len & 0xff;
+    } else {
+        frame[used++] = 0x80 | 127;
+        for (i = 0; i < 8; i++) {
+            frame[used++] = ((uint64_t) len >> (56 - i * 8)) & 0xff;
+        }
+    }
+    memcpy(frame + used, mask, sizeof(mask));
+    used += sizeof(mask);
+    for (i = 0; i < len; i++) {
+        frame[used + i] = (uint8_t) i ^ mask[i % 4];
+    }
+    return used + len;
+}
+
+static void run_client(int sock)
+{
+    static const char request[] =
+        "GET / HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Protocol: binary\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "\r\n";
+    char reply[1024];
+    size_t reply_len = 0;
+    uint8_t *frame = g_malloc(BIG_FRAME_SIZE + 14);
+    size_t frame_len;
+    uint64_t frames = 0, bytes = 0;
+    int i;
+
+    write_all(sock, request, strlen(request));
+    while (reply_len < 4 || memcmp(reply + reply_len - 4, "\r\n\r\n", 4) != 0) {
+        spice_assert(reply_len < sizeof(reply));
+        read_all(sock, reply + reply_len, 1);
+        reply_len++;
+    }
+
+    frame_len = build_frame(frame, INPUT_MSG_SIZE);
+    for (i = 0; i < num_inputs; i++) {
+        write_all(sock, frame, frame_len);
+    }
+    frame_len = build_frame(frame, BIG_FRAME_SIZE);
+    for (i = 0; i < big_mb * (1024 * 1024 / BIG_FRAME_SIZE); i++) {
+        write_all(sock, frame, frame_len);
+    }
+
+    /* count the frames of display traffic */
+    for (;;) {
+        uint8_t header[10];
+        uint64_t len;
+        ssize_t n;
+
+        n = read(sock, header, 2);
+        if (n == 0) {
+            break;
+        }
+        spice_assert(n > 0);
+        if (n == 1) {
+            read_all(sock, header + 1, 1);
+        }
+        len = header[1] & 0x7f;
+        if (len == 126) {
+            read_all(sock, header + 2, 2);
+            len = (header[2] << 8) | header[3];
+        } else if (len == 127) {
+            read_all(sock, header + 2, 8);
+            len = 0;
+            for (i = 2; i < 10; i++) {
+                len = (len << 8) | header[i];
+            }
+        }
+        while (len > 0) {
+            size_t chunk = MIN(len, BIG_FRAME_SIZE);
+            read_all(sock, frame, chunk);
+            len -= chunk;
+            bytes += chunk;
+        }
+        frames++;
+    }
+
+    printf("client received %" G_GUINT64_FORMAT " frames, %" G_GUINT64_FORMAT " bytes\n",
+           frames, bytes);
+    g_free(frame);
+    _exit(0);
+}
+
+int main(int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    SpiceServer *server;
+    RedStream *stream;
+    gint64 start_time, elapsed;
+    uint64_t expected, received = 0;
+    uint8_t *buf;
+    uint8_t start[4];
+    pid_t pid;
+    int sv[2];
+    int i;
+
+    context = g_option_context_new("- benchmark WebSocket streams");
+    g_option_context_add_main_entries(context, cmd_entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        printf("Option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    g_option_context_free(context);
+    spice_assert(flush_interval > 0);
+
+    server = spice_server_new();
+    spice_assert(spice_server_init(server, basic_event_loop_init()) == 0);
+
+    spice_assert(socketpair(AF_LOCAL, SOCK_STREAM, 0, sv) == 0);
+    pid = fork();
+    spice_assert(pid >= 0);
+    if (pid == 0) {
+        close(sv[0]);
+        run_client(sv[1]);
+    }
+    close(sv[1]);
+
+    stream = red_stream_new(server, sv[0]);
+    read_all(sv[0], start, sizeof(start));
+    spice_assert(red_stream_is_websocket(stream, start, sizeof(start)));
+
+    /* receive and check the client data */
+    buf = g_malloc(BIG_FRAME_SIZE);
+    expected = (uint64_t) num_inputs * INPUT_MSG_SIZE +
+               (uint64_t) big_mb * (1024 * 1024 / BIG_FRAME_SIZE) * BIG_FRAME_SIZE;
+    start_time = g_get_monotonic_time();
+    while (received < expected) {
+        ssize_t n = red_stream_read(stream, buf, BIG_FRAME_SIZE);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        spice_assert(n > 0);
+        /* frames contain their offset, reads do not cross frames */
+        spice_assert(buf[0] == 0 || buf[0] == (uint8_t) (received - (uint64_t) num_inputs * INPUT_MSG_SIZE));
+        spice_assert(buf[n - 1] == (uint8_t) (buf[0] + n - 1));
+        received += n;
+    }
+    elapsed = g_get_monotonic_time() - start_time;
+    printf("received %.1f MiB from client in %.3f s (%.1f MiB/s)\n",
+           received / (1024.0 * 1024.0), elapsed / 1000000.0,
+           received / (1024.0 * 1024.0) * 1000000.0 / elapsed);
+
+    /* send display like traffic */
+    if (!no_batching) {
+        spice_assert(red_stream_set_write_batching(stream, true));
+    }
+    memset(buf, 0x5a, BIG_FRAME_SIZE);
+    start_time = g_get_monotonic_time();
+    for (i = 0; i < num_messages; i++) {
+        struct iovec iov[2];
+
+        /* mini header followed by a small drawing command */
+        iov[0].iov_base = buf;
+        iov[0].iov_len = 6;
+        iov[1].iov_base = buf + 6;
+        iov[1].iov_len = (i % 4) == 0 ? 200 : 40;
+        while (red_stream_writev(stream, iov, 2) < 0) {
+            spice_assert(errno == EINTR || errno == EAGAIN);
+        }
+        if ((i + 1) % flush_interval == 0) {
+            while (!red_stream_flush(stream)) {
+                continue;
+            }
+        }
+    }
+    while (!red_stream_flush(stream)) {
+        continue;
+    }
+    elapsed = g_get_monotonic_time() - start_time;
+    printf("sent %d messages in %.3f s\n", num_messages, elapsed / 1000000.0);
+
+    red_stream_free(stream);
+    waitpid(pid, NULL, 0);
+    g_free(buf);
+
+    return 0;
+}
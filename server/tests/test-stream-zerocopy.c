@@ -0,0 +1,232 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Benchmark measuring the CPU time needed to send data through
+ * a RedStream with and without zero-copy writes.
+ * Note that on loopback the kernel copies the data anyway, use
+ * --connect with a sink on another machine (like "nc -l PORT >/dev/null")
+ * to measure the real benefit.
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <netdb.h>
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <netinet/in.h>
+#include <glib.h>
+
+#include <common/log.h>
+#include "red-stream.h"
+#include "basic-event-loop.h"
+
+static gint total_mb = 4096;
+static gint chunk_kb = 256;
+static gint threshold = 16 * 1024;
+static gboolean no_zerocopy = FALSE;
+static gchar *connect_addr = NULL;
+
+static GOptionEntry cmd_entries[] = {
+    {"size", 's', 0, G_OPTION_ARG_INT, &total_mb,
+     "Megabytes to send (default 4096)", NULL},
+    {"chunk", 'c', 0, G_OPTION_ARG_INT, &chunk_kb,
+     "Size of each write in kilobytes (default 256)", NULL},
+    {"threshold", 't', 0, G_OPTION_ARG_INT, &threshold,
+     "Zero-copy threshold in bytes (default 16384)", NULL},
+    {"no-zerocopy", 'n', 0, G_OPTION_ARG_NONE, &no_zerocopy,
+     "Use normal copying writes", NULL},
+    {"connect", 0, 0, G_OPTION_ARG_STRING, &connect_addr,
+     "Send to HOST:PORT instead of a local sink", "HOST:PORT"},
+    {NULL}
+};
+
+static int connect_to(const char *addr)
+{
+    struct addrinfo hints, *res, *ai;
+    char *host = g_strdup(addr);
+    char *port = strrchr(host, ':');
+    int sock = -1;
+
+    if (!port) {
+        spice_error("invalid address %s", addr);
+    }
+    *port++ = 0;
+
+    memset(&hints, 0, sizeof(hints));
+    hints.ai_socktype = SOCK_STREAM;
+    if (getaddrinfo(host, port, &hints, &res) != 0) {
+        spice_error("cannot resolve %s", addr);
+    }
+    for (ai = res; ai != NULL; ai = ai->ai_next) {
+        sock = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+        if (sock < 0) {
+            continue;
+        }
+        if (connect(sock, ai->ai_addr, ai->ai_addrlen) == 0) {
+            break;
+        }
+        close(sock);
+        sock = -1;
+    }
+    freeaddrinfo(res);
+    g_free(host);
+
+    if (sock < 0) {
+        spice_error("cannot connect to %s", addr);
+    }
+    return sock;
+}
+
+/* start a process discarding everything received,
+ * return a socket connected to it */
+static int start_sink(pid_t *pid)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    int listen_sock, sock;
+
+    listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    spice_assert(listen_sock >= 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    spice_assert(bind(listen_sock, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    spice_assert(listen(listen_sock, 1) == 0);
+    spice_assert(getsockname(listen_sock, (struct sockaddr *) &addr, &len) == 0);
+
+    *pid = fork();
+    spice_assert(*pid >= 0);
+    if (*pid == 0) {
+        static char buf[256 * 1024];
+        int peer = accept(listen_sock, NULL, NULL);
+        while (read(peer, buf, sizeof(buf)) > 0) {
+            continue;
+        }
+        _exit(0);
+    }
+    close(listen_sock);
+
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    spice_assert(sock >= 0);
+    spice_assert(connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    return sock;
+}
+
+static double timeval_to_sec(const struct timeval *tv)
+{
+    return tv->tv_sec + tv->tv_usec / 1000000.0;
+}
+
+int main(int argc, char *argv[])
+{
+    GOptionContext *context;
+    GError *error = NULL;
+    SpiceServer *server;
+    RedStream *stream;
+    struct rusage start_usage, end_usage;
+    gint64 start_time, elapsed;
+    pid_t sink_pid = -1;
+    uint64_t total, sent = 0;
+    size_t chunk;
+    uint8_t *buf;
+    bool zerocopy = false;
+    int sock;
+
+    context = g_option_context_new("- benchmark zero-copy writes");
+    g_option_context_add_main_entries(context, cmd_entries, NULL);
+    if (!g_option_context_parse(context, &argc, &argv, &error)) {
+        printf("Option parsing failed: %s\n", error->message);
+        exit(1);
+    }
+    g_option_context_free(context);
+
+    total = (uint64_t) total_mb * 1024 * 1024;
+    chunk = (size_t) chunk_kb * 1024;
+    spice_assert(total > 0 && chunk > 0 && threshold > 0);
+
+    server = spice_server_new();
+    spice_assert(spice_server_init(server, basic_event_loop_init()) == 0);
+
+    sock = connect_addr ? connect_to(connect_addr) : start_sink(&sink_pid);
+    stream = red_stream_new(server, sock);
+    if (!no_zerocopy) {
+        zerocopy = red_stream_enable_zerocopy(stream, threshold);
+        if (!zerocopy) {
+            printf("zero-copy not supported, using normal writes\n");
+        }
+    }
+
+    /* the buffer is never changed so it can be referenced
+     * by the kernel while writes are pending */
+    buf = g_malloc(chunk);
+    memset(buf, 0x5a, chunk);
+
+    getrusage(RUSAGE_SELF, &start_usage);
+    start_time = g_get_monotonic_time();
+
+    while (sent < total) {
+        struct iovec iov;
+        size_t pos = sent % chunk;
+        ssize_t n;
+
+        iov.iov_base = buf + pos;
+        iov.iov_len = MIN(chunk - pos, total - sent);
+        n = red_stream_writev(stream, &iov, 1);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            spice_error("write failed: %s", strerror(errno));
+        }
+        sent += n;
+        red_stream_zerocopy_poll(stream);
+    }
+
+    /* wait for all the data to be released by the kernel */
+    while (red_stream_zerocopy_poll(stream) != red_stream_zerocopy_get_next_id(stream)) {
+        struct pollfd pfd = { sock, 0, 0 };
+        poll(&pfd, 1, -1);
+    }
+
+    elapsed = g_get_monotonic_time() - start_time;
+    getrusage(RUSAGE_SELF, &end_usage);
+
+    double cpu = timeval_to_sec(&end_usage.ru_utime) - timeval_to_sec(&start_usage.ru_utime) +
+                 timeval_to_sec(&end_usage.ru_stime) - timeval_to_sec(&start_usage.ru_stime);
+    double gb = total / (1024.0 * 1024.0 * 1024.0);
+    printf("%s writes of %zu bytes, %u zero-copy writes\n",
+           zerocopy ? "zero-copy" : "normal", chunk,
+           red_stream_zerocopy_get_next_id(stream));
+    printf("sent %.2f GiB in %.3f s (%.1f MiB/s)\n",
+           gb, elapsed / 1000000.0, gb * 1024 * 1000000.0 / elapsed);
+    printf("CPU time: %.3f s, %.3f s per GiB\n", cpu, cpu / gb);
+
+    red_stream_free(stream);
+    if (sink_pid > 0) {
+        waitpid(sink_pid, NULL, 0);
+    }
+    g_free(buf);
+    g_free(connect_addr);
+
+    return 0;
+}
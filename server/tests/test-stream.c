@@ -20,7 +20,11 @@
 #include <sys/types.h>
 #include <sys/socket.h>
 #include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <netinet/in.h>
 
 #include <common/log.h>
 #include "red-stream.h"
@@ -97,6 +101,147 @@ sock_fd_read(int sock, void *buf, ssize_t bufsize, int *fd)
     return size;
 }
 
+static void read_all(int sock, void *buf, size_t size)
+{
+    uint8_t *p = (uint8_t *) buf;
+
+    while (size > 0) {
+        ssize_t ret = sock_fd_read(sock, p, size, NULL);
+        spice_assert(ret > 0);
+        p += ret;
+        size -= ret;
+    }
+}
+
+static void test_write_batching(RedStream *stream, int peer)
+{
+    static const char small[] = "small";
+    char buf[sizeof(small) * 2];
+    struct iovec iov[2];
+    ssize_t ret;
+    int fd = -1;
+    char c;
+
+    iov[0].iov_base = (void *) small;
+    iov[0].iov_len = 2;
+    iov[1].iov_base = (void *) (small + 2);
+    iov[1].iov_len = sizeof(small) - 2;
+
+    /* small writes are queued */
+    ret = red_stream_writev(stream, iov, 2);
+    spice_assert(ret == (ssize_t) sizeof(small));
+    ret = recv(peer, buf, sizeof(buf), MSG_DONTWAIT);
+    spice_assert(ret == -1 && errno == EAGAIN);
+
+    /* and sent on flush */
+    spice_assert(red_stream_flush(stream));
+    read_all(peer, buf, sizeof(small));
+    spice_assert(memcmp(buf, small, sizeof(small)) == 0);
+
+    /* file descriptors are sent after queued data */
+    ret = red_stream_writev(stream, iov, 2);
+    spice_assert(ret == (ssize_t) sizeof(small));
+    ret = red_stream_send_msgfd(stream, 0);
+    spice_assert(ret == 1);
+    read_all(peer, buf, sizeof(small));
+    spice_assert(memcmp(buf, small, sizeof(small)) == 0);
+    ret = sock_fd_read(peer, &c, 1, &fd);
+    spice_assert(c == '@');
+    spice_assert(ret == 1);
+    spice_assert(fd != -1);
+    close(fd);
+
+    /* big writes are not queued but keep the ordering */
+    size_t big_size = 64 * 1024 - 1;
+    uint8_t *big = g_malloc(big_size);
+    uint8_t *big_read = g_malloc(big_size);
+    memset(big, 'x', big_size);
+    ret = red_stream_writev(stream, iov, 2);
+    spice_assert(ret == (ssize_t) sizeof(small));
+    iov[0].iov_base = big;
+    iov[0].iov_len = big_size;
+    ret = red_stream_writev(stream, iov, 1);
+    spice_assert(ret == (ssize_t) big_size);
+    read_all(peer, buf, sizeof(small));
+    spice_assert(memcmp(buf, small, sizeof(small)) == 0);
+    read_all(peer, big_read, big_size);
+    spice_assert(memcmp(big, big_read, big_size) == 0);
+    g_free(big);
+    g_free(big_read);
+}
+
+/* a zero-copy write completing when no write is tracked anymore
+ * must be consumed, otherwise the socket keeps reporting an error
+ * and the main loop spins */
+static void test_zerocopy_late_completion(void)
+{
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    struct pollfd pfd;
+    struct iovec iov;
+    RedStream *stream;
+    int listen_sock, sock, peer;
+
+    listen_sock = socket(AF_INET, SOCK_STREAM, 0);
+    spice_assert(listen_sock >= 0);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    spice_assert(bind(listen_sock, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    spice_assert(listen(listen_sock, 1) == 0);
+    spice_assert(getsockname(listen_sock, (struct sockaddr *) &addr, &len) == 0);
+    sock = socket(AF_INET, SOCK_STREAM, 0);
+    spice_assert(sock >= 0);
+    spice_assert(connect(sock, (struct sockaddr *) &addr, sizeof(addr)) == 0);
+    peer = accept(listen_sock, NULL, NULL);
+    spice_assert(peer >= 0);
+    close(listen_sock);
+
+    stream = red_stream_new(server, sock);
+    if (!red_stream_enable_zerocopy(stream, 1024)) {
+        printf("zero-copy not supported, skipping test\n");
+        red_stream_free(stream);
+        close(peer);
+        return;
+    }
+
+    /* nothing written, nothing to process */
+    spice_assert(red_stream_zerocopy_poll(stream) == 0);
+
+    size_t size = 32 * 1024;
+    uint8_t *data = g_malloc(size);
+    uint8_t *data_read = g_malloc(size);
+    memset(data, 'z', size);
+    iov.iov_base = data;
+    iov.iov_len = size;
+    spice_assert(red_stream_writev(stream, &iov, 1) == (ssize_t) size);
+    spice_assert(red_stream_zerocopy_get_next_id(stream) == 1);
+    read_all(peer, data_read, size);
+    spice_assert(memcmp(data, data_read, size) == 0);
+
+    /* wait for the kernel to report the completion */
+    pfd.fd = sock;
+    pfd.events = 0;
+    pfd.revents = 0;
+    spice_assert(poll(&pfd, 1, 5000) == 1);
+    spice_assert(pfd.revents & POLLERR);
+
+    /* the completion is consumed and the error cleared */
+    spice_assert(red_stream_zerocopy_poll(stream) == 1);
+    pfd.revents = 0;
+    spice_assert(poll(&pfd, 1, 0) == 0);
+
+    /* polling again with everything completed is harmless */
+    spice_assert(red_stream_zerocopy_poll(stream) == 1);
+    pfd.revents = 0;
+    spice_assert(poll(&pfd, 1, 0) == 0);
+
+    g_free(data);
+    g_free(data_read);
+    red_stream_free(stream);
+    close(peer);
+}
+
 int main(int argc, char *argv[])
 {
     RedStream *st[2];
@@ -149,6 +294,13 @@ int main(int argc, char *argv[])
     spice_assert(fd != -1);
     close(fd);
 
+    /* write batching test */
+    spice_assert(red_stream_set_write_batching(st[0], true));
+    test_write_batching(st[0], sv[1]);
+    spice_assert(red_stream_set_write_batching(st[0], false));
+
+    test_zerocopy_late_completion();
+
     red_stream_free(st[0]);
     red_stream_free(st[1]);
 
@@ -0,0 +1,118 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test the detection of the frames a client can start decoding a stream from.
+ */
+#include <config.h>
+
+#include <glib.h>
+
+#include "test-glib-compat.h"
+#include "video-key-frame.h"
+
+#define is_key_frame(codec, frame) \
+    video_is_key_frame(SPICE_VIDEO_CODEC_TYPE_ ## codec, frame, sizeof(frame))
+
+static void test_video_key_frame_mjpeg(void)
+{
+    static const uint8_t frame[] = { 0xff, 0xd8, 0xff, 0xe0 };
+
+    g_assert_true(is_key_frame(MJPEG, frame));
+}
+
+static void test_video_key_frame_vp8(void)
+{
+    static const uint8_t key[] = { 0x50, 0x42, 0x00, 0x9d, 0x01, 0x2a };
+    static const uint8_t inter[] = { 0x31, 0x05, 0x00 };
+
+    g_assert_true(is_key_frame(VP8, key));
+    g_assert_false(is_key_frame(VP8, inter));
+    g_assert_false(video_is_key_frame(SPICE_VIDEO_CODEC_TYPE_VP8, key, 0));
+}
+
+static void test_video_key_frame_vp9(void)
+{
+    /* frame marker, profile 0, show_existing_frame 0, frame_type 0 */
+    static const uint8_t key[] = { 0x82, 0x49, 0x83, 0x42 };
+    /* same with frame_type 1 */
+    static const uint8_t inter[] = { 0x86, 0x00, 0x40 };
+    /* profile 3 has an extra reserved bit */
+    static const uint8_t key_profile3[] = { 0xb0, 0x49, 0x83, 0x42 };
+    static const uint8_t inter_profile3[] = { 0xb2, 0x00 };
+    static const uint8_t show_existing[] = { 0x88 };
+
+    g_assert_true(is_key_frame(VP9, key));
+    g_assert_false(is_key_frame(VP9, inter));
+    g_assert_true(is_key_frame(VP9, key_profile3));
+    g_assert_false(is_key_frame(VP9, inter_profile3));
+    g_assert_false(is_key_frame(VP9, show_existing));
+}
+
+static void test_video_key_frame_h264(void)
+{
+    /* access unit delimiter, SPS, PPS then an IDR slice */
+    static const uint8_t idr[] = {
+        0, 0, 0, 1, 0x09, 0x10,
+        0, 0, 0, 1, 0x67, 0x42, 0x00, 0x1f,
+        0, 0, 1, 0x68, 0xce, 0x38, 0x80,
+        0, 0, 1, 0x65, 0x88, 0x84,
+    };
+    /* a slice referencing the previous frames */
+    static const uint8_t inter[] = {
+        0, 0, 0, 1, 0x09, 0x30,
+        0, 0, 1, 0x41, 0x9a, 0x00, 0x00, 0x00, 0x01,
+    };
+    /* parameter sets alone */
+    static const uint8_t no_slice[] = { 0, 0, 0, 1, 0x67, 0x42, 0, 0, 1, 0x68 };
+
+    g_assert_true(is_key_frame(H264, idr));
+    g_assert_false(is_key_frame(H264, inter));
+    g_assert_false(is_key_frame(H264, no_slice));
+}
+
+static void test_video_key_frame_h265(void)
+{
+    /* VPS, SPS, PPS then an IDR_W_RADL slice */
+    static const uint8_t idr[] = {
+        0, 0, 0, 1, 0x40, 0x01, 0x0c,
+        0, 0, 0, 1, 0x42, 0x01, 0x01,
+        0, 0, 0, 1, 0x44, 0x01, 0xc1,
+        0, 0, 0, 1, 0x26, 0x01, 0xaf,
+    };
+    /* a CRA picture */
+    static const uint8_t cra[] = { 0, 0, 1, 0x2a, 0x01, 0xaf };
+    /* a TRAIL_R picture */
+    static const uint8_t inter[] = { 0, 0, 0, 1, 0x02, 0x01, 0xd0 };
+
+    g_assert_true(is_key_frame(H265, idr));
+    g_assert_true(is_key_frame(H265, cra));
+    g_assert_false(is_key_frame(H265, inter));
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/video-key-frame/mjpeg", test_video_key_frame_mjpeg);
+    g_test_add_func("/server/video-key-frame/vp8", test_video_key_frame_vp8);
+    g_test_add_func("/server/video-key-frame/vp9", test_video_key_frame_vp9);
+    g_test_add_func("/server/video-key-frame/h264", test_video_key_frame_h264);
+    g_test_add_func("/server/video-key-frame/h265", test_video_key_frame_h265);
+
+    return g_test_run();
+}
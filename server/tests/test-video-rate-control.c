@@ -0,0 +1,335 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test the video rate control by replaying synthetic network traces.
+ *
+ * A fake encoder produces frames of the size matching the requested video
+ * bit rate, with periodic larger key frames. They go through a simulated
+ * link whose capacity follows the trace, and a simulated client sends the
+ * stream reports back. Everything is driven by the simulated time so the
+ * results are deterministic.
+ */
+#include <config.h>
+
+#include <glib.h>
+
+#include "test-glib-compat.h"
+#include "utils.h"
+#include "video-rate-control.h"
+
+#define MBPS (UINT64_C(1024) * 1024)
+
+#define WIDTH 1280
+#define HEIGHT 720
+#define SOURCE_FPS 25
+#define KEY_FRAME_INTERVAL 50
+/* one way network latency (ms) */
+#define LATENCY 20
+/* the server drops frames when it has more than this to send (ms) */
+#define MAX_BACKLOG 500
+#define REPORT_FRAMES 25
+#define MAX_REPORTS 16
+/* the measurements cover the end of each trace step (ms) */
+#define MEASURE_TIME 30000
+
+typedef struct LinkStep {
+    /* the capacity applies until this time (ms) */
+    uint32_t until;
+    uint64_t bit_rate;
+} LinkStep;
+
+typedef struct ClientReport {
+    uint32_t time;
+    uint32_t num_frames;
+    uint32_t num_drops;
+    uint32_t start_frame_mm_time;
+    uint32_t end_frame_mm_time;
+    int32_t end_frame_delay;
+} ClientReport;
+
+typedef struct StepStats {
+    uint64_t sent_bytes;
+    uint32_t max_latency;
+    uint32_t client_drops;
+} StepStats;
+
+typedef struct Simulation {
+    VideoRateControl rate_control;
+    const LinkStep *trace;
+    bool client_reports;
+    /* the link bit rate reported to the rate control, 0 if unknown */
+    uint64_t link_bit_rate;
+
+    uint32_t frame_count;
+    /* when the link is done sending the queued frames (ms) */
+    double link_free_time;
+
+    /* the client state */
+    uint32_t playback_delay;
+    ClientReport report;
+    ClientReport pending[MAX_REPORTS];
+    uint32_t pending_first;
+    uint32_t pending_count;
+
+    StepStats stats;
+} Simulation;
+
+static uint32_t sim_get_roundtrip_ms(void *opaque)
+{
+    return LATENCY * 2;
+}
+
+static uint32_t sim_get_source_fps(void *opaque)
+{
+    return SOURCE_FPS;
+}
+
+static void sim_update_client_playback_delay(void *opaque, uint32_t delay_ms)
+{
+    Simulation *sim = (Simulation*)opaque;
+    /* like the mm_time latency, the delay only grows while streaming */
+    sim->playback_delay = MAX(sim->playback_delay, delay_ms);
+}
+
+static uint64_t sim_get_link_bit_rate(void *opaque)
+{
+    Simulation *sim = (Simulation*)opaque;
+    return sim->link_bit_rate;
+}
+
+static bool sim_set_video_bit_rate(void *opaque, uint64_t bit_rate)
+{
+    return true;
+}
+
+static uint64_t sim_get_capacity(const Simulation *sim, uint32_t now)
+{
+    const LinkStep *step = sim->trace;
+    while (step[1].until && step->until <= now) {
+        step++;
+    }
+    return step->bit_rate;
+}
+
+/* The size of the next frame as produced by an encoder following the video
+ * bit rate, key frames being four times larger.
+ */
+static uint32_t sim_get_frame_size(Simulation *sim)
+{
+    uint64_t size = sim->rate_control.video_bit_rate / 8 / SOURCE_FPS;
+    if (sim->frame_count++ % KEY_FRAME_INTERVAL == 0) {
+        size *= 4;
+    }
+    return size;
+}
+
+static void sim_deliver_reports(Simulation *sim, uint32_t now)
+{
+    while (sim->pending_count && sim->pending[sim->pending_first].time <= now) {
+        const ClientReport *report = &sim->pending[sim->pending_first];
+        video_rate_control_client_stream_report(&sim->rate_control,
+                                                report->num_frames, report->num_drops,
+                                                report->start_frame_mm_time,
+                                                report->end_frame_mm_time,
+                                                report->end_frame_delay, UINT32_MAX);
+        sim->pending_first = (sim->pending_first + 1) % MAX_REPORTS;
+        sim->pending_count--;
+    }
+}
+
+/* The client receives the frame, plays it or drops it if it is late, and
+ * periodically reports how the playback goes.
+ */
+static void sim_client_receive(Simulation *sim, uint32_t mm_time, uint32_t arrival)
+{
+    ClientReport *report = &sim->report;
+    int32_t margin = (int32_t)(mm_time + sim->playback_delay - arrival);
+
+    if (report->num_frames == 0) {
+        report->start_frame_mm_time = mm_time;
+    }
+    report->num_frames++;
+    if (margin < 0) {
+        report->num_drops++;
+        sim->stats.client_drops++;
+    }
+    if (report->num_frames < REPORT_FRAMES || !sim->client_reports) {
+        return;
+    }
+    report->end_frame_mm_time = mm_time;
+    report->end_frame_delay = margin;
+    report->time = arrival + LATENCY;
+    g_assert_cmpuint(sim->pending_count, <, MAX_REPORTS);
+    sim->pending[(sim->pending_first + sim->pending_count) % MAX_REPORTS] = *report;
+    sim->pending_count++;
+    memset(report, 0, sizeof(*report));
+}
+
+static void sim_tick(Simulation *sim, uint32_t now)
+{
+    sim_deliver_reports(sim, now);
+
+    if (sim->link_free_time - now > MAX_BACKLOG) {
+        /* the pipe to the client is full */
+        video_rate_control_server_frame_drop(&sim->rate_control);
+        return;
+    }
+    video_rate_control_set_video_format(&sim->rate_control, WIDTH, HEIGHT, 32, now);
+    if (video_rate_control_drop_frame(&sim->rate_control, now)) {
+        return;
+    }
+
+    uint32_t size = sim_get_frame_size(sim);
+    video_rate_control_add_frame(&sim->rate_control, now, 2 * NSEC_PER_MILLISEC, size);
+
+    double start = MAX(sim->link_free_time, now);
+    sim->link_free_time = start + (double)size * 8 * MSEC_PER_SEC / sim_get_capacity(sim, now);
+    uint32_t arrival = sim->link_free_time + LATENCY;
+
+    sim->stats.sent_bytes += size;
+    sim->stats.max_latency = MAX(sim->stats.max_latency, arrival - now);
+    sim_client_receive(sim, now, arrival);
+}
+
+static void sim_init(Simulation *sim, const LinkStep *trace, uint64_t starting_bit_rate,
+                     bool exact_encoder, bool client_reports)
+{
+    VideoEncoderRateControlCbs cbs;
+
+    memset(sim, 0, sizeof(*sim));
+    sim->trace = trace;
+    sim->client_reports = client_reports;
+    sim->playback_delay = 400;
+
+    memset(&cbs, 0, sizeof(cbs));
+    cbs.opaque = sim;
+    cbs.get_roundtrip_ms = sim_get_roundtrip_ms;
+    cbs.get_source_fps = sim_get_source_fps;
+    cbs.update_client_playback_delay = sim_update_client_playback_delay;
+    cbs.get_link_bit_rate = sim_get_link_bit_rate;
+    video_rate_control_init(&sim->rate_control, &cbs, starting_bit_rate, exact_encoder,
+                            sim_set_video_bit_rate, sim);
+}
+
+/* Runs the simulation from @start to @end (ms) and returns the statistics
+ * of the frames sent in that period.
+ */
+static StepStats sim_run(Simulation *sim, uint32_t start, uint32_t end)
+{
+    memset(&sim->stats, 0, sizeof(sim->stats));
+    /* 1 is the first mm_time since 0 means no frame */
+    for (uint32_t now = start + 1; now < end + 1; now += MSEC_PER_SEC / SOURCE_FPS) {
+        sim_tick(sim, now);
+    }
+    return sim->stats;
+}
+
+/* Checks that the stream bit rate converges towards the capacity of each
+ * step of the trace, with frames spending at most max_latency
+ * milliseconds in the network.
+ */
+static void check_trace(const LinkStep *trace, bool exact_encoder, bool client_reports,
+                        uint32_t max_latency)
+{
+    Simulation sim;
+    uint32_t start = 0;
+
+    sim_init(&sim, trace, 10 * MBPS, exact_encoder, client_reports);
+    for (const LinkStep *step = trace; step->until; step++) {
+        sim_run(&sim, start, step->until - MEASURE_TIME);
+        StepStats stats = sim_run(&sim, step->until - MEASURE_TIME, step->until);
+        uint64_t bit_rate = stats.sent_bytes * 8 * MSEC_PER_SEC / MEASURE_TIME;
+
+        g_test_message("capacity %.2fMbps: sent %.2fMbps, latency %ums, %u client drops",
+                       (double)step->bit_rate / MBPS, (double)bit_rate / MBPS,
+                       stats.max_latency, stats.client_drops);
+        g_assert_cmpuint(bit_rate, <=, step->bit_rate);
+        g_assert_cmpuint(bit_rate, >=, step->bit_rate / 2);
+        g_assert_cmpuint(stats.max_latency, <=, max_latency);
+        start = step->until;
+    }
+}
+
+/* Probing for more bandwidth is slow once the bit rate is stable so
+ * leave enough time to recover after the capacity drop.
+ */
+static const LinkStep steps_trace[] = {
+    { 60000, 8 * MBPS },
+    { 150000, 2 * MBPS },
+    { 450000, 6 * MBPS },
+    { 0, 0 }
+};
+
+static void test_video_rate_control_client_reports(void)
+{
+    check_trace(steps_trace, false, true, MAX_BACKLOG);
+}
+
+static void test_video_rate_control_exact_encoder(void)
+{
+    check_trace(steps_trace, true, true, MAX_BACKLOG);
+}
+
+static void test_video_rate_control_server_drops(void)
+{
+    /* Without client reports a stable bit rate is only probed again after
+     * hours so only check that it follows the capacity drop.
+     */
+    static const LinkStep trace[] = {
+        { 60000, 8 * MBPS },
+        { 150000, 2 * MBPS },
+        { 0, 0 }
+    };
+
+    /* the queue grows until the server drops frames, plus a key frame */
+    check_trace(trace, false, false, MAX_BACKLOG * 3 / 2);
+}
+
+static void test_video_rate_control_link_bit_rate(void)
+{
+    static const LinkStep trace[] = {
+        { 60000, 20 * MBPS },
+        { 0, 0 }
+    };
+    Simulation sim;
+
+    /* the bit rate never exceeds the measured link bit rate */
+    sim_init(&sim, trace, 10 * MBPS, false, true);
+    sim.link_bit_rate = 4 * MBPS;
+    for (uint32_t now = 1; now < trace[0].until; now += MSEC_PER_SEC / SOURCE_FPS) {
+        sim_tick(&sim, now);
+        g_assert_cmpuint(sim.rate_control.bit_rate, <=, sim.link_bit_rate);
+    }
+    g_assert_cmpuint(sim.rate_control.bit_rate, >=, sim.link_bit_rate / 2);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/video-rate-control/client-reports",
+                    test_video_rate_control_client_reports);
+    g_test_add_func("/server/video-rate-control/exact-encoder",
+                    test_video_rate_control_exact_encoder);
+    g_test_add_func("/server/video-rate-control/server-drops",
+                    test_video_rate_control_server_drops);
+    g_test_add_func("/server/video-rate-control/link-bit-rate",
+                    test_video_rate_control_link_bit_rate);
+
+    return g_test_run();
+}
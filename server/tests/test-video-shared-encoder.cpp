@@ -0,0 +1,405 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test the encoder shared by the clients of a stream with fake encoders
+ * producing VP8 like frames, or MJPEG ones for the intra only codecs.
+ */
+#include <config.h>
+
+#include <glib.h>
+
+#include "test-glib-compat.h"
+#include "video-shared-encoder.h"
+
+#define NUM_FRAMES 10
+
+struct FakeEncoder {
+    VideoEncoder base;
+    /* the number of frames encoded */
+    int encoded;
+    int key_frame_requests;
+    /* the frame which will be a key frame, -1 if none was requested */
+    int next_key_frame;
+    /* how many frames the encoder takes to honor a key frame request */
+    int key_frame_delay;
+};
+
+struct FakeBuffer {
+    VideoBuffer base;
+    uint8_t data[2];
+};
+
+struct FakeClient {
+    SpiceVideoCodecType codec_type;
+    bool supports_codec;
+    /* the number of encoders created by the client */
+    int created;
+    FakeEncoder *encoder;
+    VideoEncoder *video_encoder;
+};
+
+/* the frames of the stream, only referenced by the shared encoder */
+static int frame_refs[NUM_FRAMES];
+static int num_buffers;
+static int num_encoders;
+
+static void fake_buffer_free(VideoBuffer *video_buffer)
+{
+    num_buffers--;
+    g_free(video_buffer);
+}
+
+static VideoEncodeResults fake_encoder_encode_frame(VideoEncoder *video_encoder,
+                                                    uint32_t frame_mm_time,
+                                                    const SpiceBitmap *bitmap,
+                                                    const SpiceRect *src, int top_down,
+                                                    gpointer bitmap_opaque,
+                                                    VideoBuffer **outbuf)
+{
+    auto encoder = SPICE_CONTAINEROF(video_encoder, FakeEncoder, base);
+    auto buffer = g_new0(FakeBuffer, 1);
+    bool key_frame = encoder->encoded == 0 || encoder->encoded == encoder->next_key_frame;
+
+    if (key_frame) {
+        encoder->next_key_frame = -1;
+    }
+    encoder->encoded++;
+
+    /* the first bit of the VP8 frame tag is 0 for the key frames */
+    buffer->data[0] = key_frame ? 0 : 1;
+    buffer->data[1] = static_cast<int *>(bitmap_opaque) - frame_refs;
+    buffer->base.data = buffer->data;
+    buffer->base.size = sizeof(buffer->data);
+    buffer->base.free = fake_buffer_free;
+    num_buffers++;
+    *outbuf = &buffer->base;
+    return VIDEO_ENCODER_FRAME_ENCODE_DONE;
+}
+
+static void fake_encoder_request_key_frame(VideoEncoder *video_encoder)
+{
+    auto encoder = SPICE_CONTAINEROF(video_encoder, FakeEncoder, base);
+
+    encoder->key_frame_requests++;
+    encoder->next_key_frame = encoder->encoded + encoder->key_frame_delay;
+}
+
+static uint64_t fake_encoder_get_bit_rate(VideoEncoder *video_encoder)
+{
+    return 0;
+}
+
+static void fake_encoder_destroy(VideoEncoder *video_encoder)
+{
+    num_encoders--;
+    g_free(video_encoder);
+}
+
+static VideoEncoder *fake_client_create_encoder(void *opaque, SpiceVideoCodecType codec_type,
+                                                uint64_t starting_bit_rate,
+                                                VideoEncoderRateControlCbs *cbs)
+{
+    auto client = static_cast<FakeClient *>(opaque);
+    auto encoder = g_new0(FakeEncoder, 1);
+
+    encoder->base.destroy = fake_encoder_destroy;
+    encoder->base.encode_frame = fake_encoder_encode_frame;
+    encoder->base.get_bit_rate = fake_encoder_get_bit_rate;
+    encoder->base.codec_type = codec_type ? codec_type : client->codec_type;
+    if (encoder->base.codec_type != SPICE_VIDEO_CODEC_TYPE_MJPEG) {
+        encoder->base.request_key_frame = fake_encoder_request_key_frame;
+    }
+    encoder->next_key_frame = -1;
+    client->created++;
+    client->encoder = encoder;
+    num_encoders++;
+    return &encoder->base;
+}
+
+static bool fake_client_supports_codec(void *opaque, SpiceVideoCodecType codec_type)
+{
+    return static_cast<FakeClient *>(opaque)->supports_codec;
+}
+
+static uint32_t get_roundtrip_ms(void *opaque)
+{
+    return 10;
+}
+
+static uint32_t get_source_fps(void *opaque)
+{
+    return 25;
+}
+
+static void update_client_playback_delay(void *opaque, uint32_t delay_ms)
+{
+}
+
+static uint64_t get_link_bit_rate(void *opaque)
+{
+    return 0;
+}
+
+static void bitmap_ref(gpointer data)
+{
+    (*static_cast<int *>(data))++;
+}
+
+static void bitmap_unref(gpointer data)
+{
+    g_assert_cmpint(*static_cast<int *>(data), >, 0);
+    (*static_cast<int *>(data))--;
+}
+
+static void subscribe(VideoSharedEncoder **shared, FakeClient *client,
+                      SpiceVideoCodecType codec_type = SPICE_VIDEO_CODEC_TYPE_VP8,
+                      bool supports_codec = true)
+{
+    VideoSharedEncoderClient shared_client;
+
+    client->codec_type = codec_type;
+    client->supports_codec = supports_codec;
+    shared_client.opaque = client;
+    shared_client.create_encoder = fake_client_create_encoder;
+    shared_client.supports_codec = fake_client_supports_codec;
+    shared_client.cbs.opaque = client;
+    shared_client.cbs.get_roundtrip_ms = get_roundtrip_ms;
+    shared_client.cbs.get_source_fps = get_source_fps;
+    shared_client.cbs.update_client_playback_delay = update_client_playback_delay;
+    shared_client.cbs.get_link_bit_rate = get_link_bit_rate;
+    client->video_encoder = video_shared_encoder_subscribe(shared, &shared_client,
+                                                           1024 * 1024, bitmap_ref,
+                                                           bitmap_unref);
+    g_assert_nonnull(client->video_encoder);
+}
+
+/* Sends a frame to the client, returns the number of the encoded frame
+ * or -1 if the frame was dropped, and whether it is a key frame. */
+static int send_frame(FakeClient *client, int frame, bool *key_frame = nullptr)
+{
+    VideoEncoder *encoder = client->video_encoder;
+    SpiceRect src = { 0, 0, 64, 64 };
+    SpiceBitmap bitmap = {};
+    VideoBuffer *buffer = nullptr;
+
+    VideoEncodeResults ret = encoder->encode_frame(encoder, frame * 40, &bitmap, &src, TRUE,
+                                                   &frame_refs[frame], &buffer);
+    if (ret == VIDEO_ENCODER_FRAME_DROP) {
+        g_assert_null(buffer);
+        return -1;
+    }
+    g_assert_cmpint(ret, ==, VIDEO_ENCODER_FRAME_ENCODE_DONE);
+    g_assert_nonnull(buffer);
+    g_assert_cmpint(buffer->size, ==, 2);
+
+    auto data = static_cast<const uint8_t *>(buffer->data);
+    int encoded = data[1];
+    if (key_frame) {
+        *key_frame = data[0] == 0;
+    }
+    buffer->free(buffer);
+    return encoded;
+}
+
+static void check_all_freed()
+{
+    for (auto refs : frame_refs) {
+        g_assert_cmpint(refs, ==, 0);
+    }
+    g_assert_cmpint(num_buffers, ==, 0);
+    g_assert_cmpint(num_encoders, ==, 0);
+}
+
+/* clients joining a running stream wait for a key frame, which is only
+ * requested once for all of them */
+static void test_shared_encoder_join(void)
+{
+    VideoSharedEncoder *shared = nullptr;
+    FakeClient a = {}, b = {}, c = {}, d = {};
+    bool key_frame;
+
+    subscribe(&shared, &a);
+    g_assert_nonnull(shared);
+    FakeEncoder *encoder = a.encoder;
+    encoder->key_frame_delay = 1;
+    for (int i = 0; i < 3; i++) {
+        g_assert_cmpint(send_frame(&a, i), ==, i);
+    }
+
+    subscribe(&shared, &b);
+    subscribe(&shared, &c);
+    g_assert_cmpint(b.created + c.created, ==, 0);
+    g_assert_cmpint(encoder->key_frame_requests, ==, 1);
+
+    // the next frame is not a key frame yet, the new clients skip it
+    g_assert_cmpint(send_frame(&b, 3, &key_frame), ==, -1);
+    g_assert_cmpint(send_frame(&a, 3, &key_frame), ==, 3);
+    g_assert_false(key_frame);
+    g_assert_cmpint(send_frame(&c, 3), ==, -1);
+
+    // they all get the key frame
+    g_assert_cmpint(send_frame(&a, 4, &key_frame), ==, 4);
+    g_assert_true(key_frame);
+    g_assert_cmpint(send_frame(&b, 4, &key_frame), ==, 4);
+    g_assert_true(key_frame);
+    g_assert_cmpint(send_frame(&c, 4, &key_frame), ==, 4);
+    g_assert_true(key_frame);
+
+    // and the following frames
+    g_assert_cmpint(send_frame(&c, 5, &key_frame), ==, 5);
+    g_assert_false(key_frame);
+    g_assert_cmpint(send_frame(&a, 5), ==, 5);
+    g_assert_cmpint(send_frame(&b, 5), ==, 5);
+    g_assert_cmpint(encoder->encoded, ==, 6);
+    g_assert_cmpint(encoder->key_frame_requests, ==, 1);
+
+    // a client joining after the key frame asks for a new one
+    subscribe(&shared, &d);
+    g_assert_cmpint(encoder->key_frame_requests, ==, 2);
+    g_assert_cmpint(d.created, ==, 0);
+
+    a.video_encoder->destroy(a.video_encoder);
+    b.video_encoder->destroy(b.video_encoder);
+    c.video_encoder->destroy(c.video_encoder);
+    d.video_encoder->destroy(d.video_encoder);
+    g_assert_null(shared);
+    check_all_freed();
+}
+
+/* a client which misses a frame gets its own encoder */
+static void test_shared_encoder_cache_miss(void)
+{
+    VideoSharedEncoder *shared = nullptr;
+    FakeClient a = {}, b = {};
+    bool key_frame;
+
+    subscribe(&shared, &a);
+    subscribe(&shared, &b);
+    FakeEncoder *encoder = a.encoder;
+    g_assert_cmpint(b.created, ==, 0);
+
+    // the frames are encoded once
+    g_assert_cmpint(send_frame(&a, 0), ==, 0);
+    g_assert_cmpint(send_frame(&b, 0), ==, 0);
+    g_assert_cmpint(send_frame(&b, 1), ==, 1);
+    g_assert_cmpint(send_frame(&a, 1), ==, 1);
+    g_assert_cmpint(encoder->encoded, ==, 2);
+
+    // the frames b did not send yet drop out of the cache
+    for (int i = 2; i < 6; i++) {
+        g_assert_cmpint(send_frame(&a, i), ==, i);
+    }
+    g_assert_cmpint(encoder->encoded, ==, 6);
+
+    // b encodes the frame again with its own encoder, from a key frame
+    g_assert_cmpint(send_frame(&b, 2, &key_frame), ==, 2);
+    g_assert_true(key_frame);
+    g_assert_cmpint(b.created, ==, 1);
+    g_assert_true(b.encoder != encoder);
+    g_assert_cmpint(b.encoder->encoded, ==, 1);
+    g_assert_cmpint(send_frame(&b, 3, &key_frame), ==, 3);
+    g_assert_false(key_frame);
+    g_assert_cmpint(b.encoder->encoded, ==, 2);
+
+    // a is alone on the shared encoder
+    g_assert_cmpint(send_frame(&a, 6), ==, 6);
+    g_assert_cmpint(encoder->encoded, ==, 7);
+
+    b.video_encoder->destroy(b.video_encoder);
+    g_assert_nonnull(shared);
+    a.video_encoder->destroy(a.video_encoder);
+    g_assert_null(shared);
+    check_all_freed();
+}
+
+/* all the frames of intra only codecs can be decoded on their own */
+static void test_shared_encoder_intra_only(void)
+{
+    VideoSharedEncoder *shared = nullptr;
+    FakeClient a = {}, b = {};
+
+    subscribe(&shared, &a, SPICE_VIDEO_CODEC_TYPE_MJPEG);
+    FakeEncoder *encoder = a.encoder;
+    g_assert_null(a.video_encoder->request_key_frame);
+    for (int i = 0; i < 3; i++) {
+        g_assert_cmpint(send_frame(&a, i), ==, i);
+    }
+
+    // no key frame to wait for
+    subscribe(&shared, &b, SPICE_VIDEO_CODEC_TYPE_MJPEG);
+    g_assert_null(b.video_encoder->request_key_frame);
+    g_assert_cmpint(send_frame(&a, 3), ==, 3);
+    g_assert_cmpint(send_frame(&b, 3), ==, 3);
+    g_assert_cmpint(encoder->encoded, ==, 4);
+
+    // a frame missing from the cache is encoded again by the shared encoder
+    for (int i = 4; i < 8; i++) {
+        g_assert_cmpint(send_frame(&a, i), ==, i);
+    }
+    g_assert_cmpint(send_frame(&b, 4), ==, 4);
+    g_assert_cmpint(encoder->encoded, ==, 9);
+    g_assert_cmpint(send_frame(&b, 7), ==, 7);
+    g_assert_cmpint(encoder->encoded, ==, 9);
+    g_assert_cmpint(b.created, ==, 0);
+
+    a.video_encoder->destroy(a.video_encoder);
+    b.video_encoder->destroy(b.video_encoder);
+    g_assert_null(shared);
+    check_all_freed();
+}
+
+/* the last subscriber leaving frees the shared encoder and its frames */
+static void test_shared_encoder_unsubscribe(void)
+{
+    VideoSharedEncoder *shared = nullptr;
+    FakeClient a = {}, b = {}, c = {};
+
+    subscribe(&shared, &a);
+    subscribe(&shared, &b);
+    g_assert_cmpint(num_encoders, ==, 1);
+
+    // a client not supporting the codec gets its own encoder
+    subscribe(&shared, &c, SPICE_VIDEO_CODEC_TYPE_H264, false);
+    g_assert_cmpint(c.created, ==, 1);
+    g_assert_cmpint(num_encoders, ==, 2);
+
+    // frames are cached for b
+    g_assert_cmpint(send_frame(&a, 0), ==, 0);
+    g_assert_cmpint(send_frame(&a, 1), ==, 1);
+    g_assert_cmpint(frame_refs[0], ==, 1);
+    g_assert_cmpint(frame_refs[1], ==, 1);
+
+    a.video_encoder->destroy(a.video_encoder);
+    g_assert_nonnull(shared);
+    b.video_encoder->destroy(b.video_encoder);
+    g_assert_null(shared);
+    c.video_encoder->destroy(c.video_encoder);
+    check_all_freed();
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/video-shared-encoder/join", test_shared_encoder_join);
+    g_test_add_func("/server/video-shared-encoder/cache-miss", test_shared_encoder_cache_miss);
+    g_test_add_func("/server/video-shared-encoder/intra-only", test_shared_encoder_intra_only);
+    g_test_add_func("/server/video-shared-encoder/unsubscribe", test_shared_encoder_unsubscribe);
+
+    return g_test_run();
+}
@@ -0,0 +1,140 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/**
+ * Test the visible spans computed from the visible rectangles of a stream.
+ */
+#include <config.h>
+
+#include <glib.h>
+
+#include "test-glib-compat.h"
+#include "video-visible-region.h"
+
+#define WIDTH 100
+
+/* Returns the visible spans of line @y as a "start-end ..." string */
+static gchar *get_spans(const VideoVisibleRegion *region, uint32_t y)
+{
+    GString *spans = g_string_new(NULL);
+    uint32_t x = 0, end;
+
+    while (video_visible_region_next_span(region, y, WIDTH, &x, &end)) {
+        g_assert_cmpuint(x, <, end);
+        g_string_append_printf(spans, "%s%u-%u", spans->len ? " " : "", x, end);
+        x = end;
+    }
+    return g_string_free(spans, FALSE);
+}
+
+static void check_spans(const VideoVisibleRegion *region, uint32_t y, const char *expected)
+{
+    gchar *spans = get_spans(region, y);
+    g_assert_cmpstr(spans, ==, expected);
+    g_free(spans);
+}
+
+static void set_rects(VideoVisibleRegion *region, const SpiceRect *rects, uint32_t num_rects)
+{
+    SpiceClipRects *visible = (SpiceClipRects *)
+        g_malloc(sizeof(SpiceClipRects) + num_rects * sizeof(SpiceRect));
+
+    visible->num_rects = num_rects;
+    memcpy(visible->rects, rects, num_rects * sizeof(SpiceRect));
+    video_visible_region_set(region, visible);
+    /* the region keeps its own copy */
+    memset(visible->rects, 0, num_rects * sizeof(SpiceRect));
+    g_free(visible);
+}
+
+static void test_video_visible_region_unclipped(void)
+{
+    VideoVisibleRegion region = { 0 };
+
+    check_spans(&region, 0, "0-100");
+    video_visible_region_set(&region, NULL);
+    check_spans(&region, 50, "0-100");
+    video_visible_region_clear(&region);
+}
+
+static void test_video_visible_region_hidden(void)
+{
+    VideoVisibleRegion region = { 0 };
+
+    set_rects(&region, NULL, 0);
+    check_spans(&region, 0, "");
+    video_visible_region_clear(&region);
+    check_spans(&region, 0, "0-100");
+}
+
+static void test_video_visible_region_spans(void)
+{
+    /* a window covering the middle of the stream, not in any order */
+    static const SpiceRect rects[] = {
+        { 60, 0, 100, 80 },
+        { 30, 60, 60, 80 },
+        { 0, 0, 30, 80 },
+        { 30, 0, 60, 20 },
+    };
+    VideoVisibleRegion region = { 0 };
+
+    set_rects(&region, rects, G_N_ELEMENTS(rects));
+    check_spans(&region, 0, "0-100");
+    check_spans(&region, 19, "0-100");
+    check_spans(&region, 20, "0-30 60-100");
+    check_spans(&region, 59, "0-30 60-100");
+    check_spans(&region, 60, "0-100");
+    check_spans(&region, 79, "0-100");
+    check_spans(&region, 80, "");
+    video_visible_region_clear(&region);
+}
+
+static void test_video_visible_region_overlaps(void)
+{
+    /* overlapping rectangles, and some outside of the frame */
+    static const SpiceRect rects[] = {
+        { 40, 0, 60, 10 },
+        { 10, 0, 50, 10 },
+        { 90, 0, 150, 10 },
+        { -20, 0, 5, 10 },
+        { 70, 0, 75, 10 },
+        { 0, 10, 100, 20 },
+    };
+    VideoVisibleRegion region = { 0 };
+
+    set_rects(&region, rects, G_N_ELEMENTS(rects));
+    check_spans(&region, 0, "0-5 10-60 70-75 90-100");
+    check_spans(&region, 10, "0-100");
+    check_spans(&region, 20, "");
+    video_visible_region_clear(&region);
+}
+
+int main(int argc, char *argv[])
+{
+    g_test_init(&argc, &argv, NULL);
+
+    g_test_add_func("/server/video-visible-region/unclipped",
+                    test_video_visible_region_unclipped);
+    g_test_add_func("/server/video-visible-region/hidden",
+                    test_video_visible_region_hidden);
+    g_test_add_func("/server/video-visible-region/spans",
+                    test_video_visible_region_spans);
+    g_test_add_func("/server/video-visible-region/overlaps",
+                    test_video_visible_region_overlaps);
+
+    return g_test_run();
+}
@@ -0,0 +1,195 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+/* Test reading messages compressed with the permessage-deflate
+ * extension, in particular messages decompressing to exactly the
+ * size of the buffer passed to websocket_read.
+ */
+#include <config.h>
+
+#include <errno.h>
+#include <string.h>
+#include <zlib.h>
+#include <glib.h>
+
+#include <common/log.h>
+#include "websocket.h"
+
+/* in memory connection with the client */
+typedef struct {
+    GByteArray *in;
+    size_t in_pos;
+    GByteArray *out;
+} Peer;
+
+static const uint8_t mask[4] = { 0x12, 0x34, 0x56, 0x78 };
+
+static ssize_t peer_read(void *opaque, void *buf, size_t nbyte)
+{
+    Peer *peer = opaque;
+    size_t avail = peer->in->len - peer->in_pos;
+
+    if (avail == 0) {
+        errno = EAGAIN;
+        return -1;
+    }
+    nbyte = MIN(nbyte, avail);
+    memcpy(buf, peer->in->data + peer->in_pos, nbyte);
+    peer->in_pos += nbyte;
+    return nbyte;
+}
+
+static ssize_t peer_write(void *opaque, const void *buf, size_t nbyte)
+{
+    Peer *peer = opaque;
+
+    g_byte_array_append(peer->out, buf, nbyte);
+    return nbyte;
+}
+
+static ssize_t peer_writev(void *opaque, struct iovec *iov, int iovcnt)
+{
+    ssize_t ret = 0;
+    int i;
+
+    for (i = 0; i < iovcnt; i++) {
+        ret += peer_write(opaque, iov[i].iov_base, iov[i].iov_len);
+    }
+    return ret;
+}
+
+/* queue a compressed message sent by the client */
+static void peer_send_compressed(Peer *peer, z_stream *strm, const uint8_t *data, size_t len)
+{
+    uint8_t *compressed = g_malloc(len + 1024);
+    uint8_t header[14];
+    size_t header_len = 0, compressed_len, i;
+
+    strm->next_in = (Bytef *) data;
+    strm->avail_in = len;
+    strm->next_out = compressed;
+    strm->avail_out = len + 1024;
+    spice_assert(deflate(strm, Z_SYNC_FLUSH) == Z_OK);
+    spice_assert(strm->avail_in == 0 && strm->avail_out > 0);
+    compressed_len = strm->next_out - compressed;
+
+    /* the tail of the last block is removed, see RFC 7692 */
+    spice_assert(compressed_len >= 4);
+    spice_assert(memcmp(compressed + compressed_len - 4, "\x00\x00\xff\xff", 4) == 0);
+    compressed_len -= 4;
+
+    /* binary, final and compressed frame */
+    header[header_len++] = 0xc2;
+    if (compressed_len < 126) {
+        header[header_len++] = 0x80 | compressed_len;
+    } else {
+        spice_assert(compressed_len < 65536);
+        header[header_len++] = 0x80 | 126;
+        header[header_len++] = compressed_len >> 8;
+        header[header_len++] = compressed_len & 0xff;
+    }
+    memcpy(header + header_len, mask, sizeof(mask));
+    header_len += sizeof(mask);
+    for (i = 0; i < compressed_len; i++) {
+        compressed[i] ^= mask[i % 4];
+    }
+
+    g_byte_array_append(peer->in, header, header_len);
+    g_byte_array_append(peer->in, compressed, compressed_len);
+    g_free(compressed);
+}
+
+/* read a whole message using reads of at most chunk bytes */
+static void check_message(RedsWebSocket *ws, const uint8_t *expected, size_t len, size_t chunk)
+{
+    uint8_t *buf = g_malloc(len + 1);
+    size_t pos = 0;
+    unsigned flags;
+
+    do {
+        int rc = websocket_read(ws, buf + pos, MIN(chunk, len + 1 - pos), &flags);
+        spice_assert(rc >= 0);
+        spice_assert(rc > 0 || flags != 0);
+        spice_assert((flags & ~WEBSOCKET_FINAL) == WEBSOCKET_BINARY);
+        pos += rc;
+        spice_assert(pos <= len);
+    } while (!(flags & WEBSOCKET_FINAL));
+
+    spice_assert(pos == len);
+    spice_assert(memcmp(buf, expected, len) == 0);
+    g_free(buf);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char request[] =
+        "GET / HTTP/1.1\r\n"
+        "Host: localhost\r\n"
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Key: dGhlIHNhbXBsZSBub25jZQ==\r\n"
+        "Sec-WebSocket-Version: 13\r\n"
+        "Sec-WebSocket-Extensions: permessage-deflate\r\n"
+        "\r\n";
+    WebSocketDeflateConfig config;
+    Peer peer = { g_byte_array_new(), 0, g_byte_array_new() };
+    z_stream strm;
+    size_t i, len;
+
+    spice_assert(websocket_deflate_config_parse(&config, ""));
+    g_byte_array_append(peer.in, (const uint8_t *) request, strlen(request));
+    RedsWebSocket *ws = websocket_new("", 0, &peer, peer_read, peer_write, peer_writev, &config);
+    spice_assert(ws != NULL);
+    spice_assert(websocket_is_deflate_enabled(ws));
+
+    memset(&strm, 0, sizeof(strm));
+    spice_assert(deflateInit2(&strm, Z_BEST_COMPRESSION, Z_DEFLATED, -15, 8,
+                              Z_DEFAULT_STRATEGY) == Z_OK);
+
+    /* very compressible data, all the input is consumed by the first
+     * read while the decompressor still has output */
+    len = 64 * 1024;
+    uint8_t *zeroes = g_malloc0(len);
+    peer_send_compressed(&peer, &strm, zeroes, len);
+    peer_send_compressed(&peer, &strm, zeroes, len);
+
+    /* decompress to exactly the size of the buffer */
+    check_message(ws, zeroes, len, len);
+    /* same with smaller reads */
+    check_message(ws, zeroes, len, 1000);
+
+    /* less compressible data spanning multiple raw reads */
+    len = 32 * 1024;
+    uint8_t *data = g_malloc(len);
+    for (i = 0; i < len; i++) {
+        data[i] = g_random_int_range(0, 16);
+    }
+    peer_send_compressed(&peer, &strm, data, len);
+    peer_send_compressed(&peer, &strm, data, 1);
+    check_message(ws, data, len, len);
+    check_message(ws, data, 1, 1);
+    spice_assert(peer.in_pos == peer.in->len);
+
+    deflateEnd(&strm);
+    g_free(zeroes);
+    g_free(data);
+    websocket_free(ws);
+    g_byte_array_free(peer.in, TRUE);
+    g_byte_array_free(peer.out, TRUE);
+
+    return 0;
+}
@@ -59,6 +59,7 @@ if data size == 0 when we receive we must send it
 static int port = 7777;
 static gboolean non_blocking = false;
 static gboolean debug = false;
+static gboolean deflate = false;
 static volatile bool got_term = false;
 static unsigned int num_connections = 0;
 
@@ -69,6 +70,8 @@ static GOptionEntry cmd_entries[] = {
    "Enable non-blocking i/o", NULL},
   {"debug", 0, 0, G_OPTION_ARG_NONE, &debug,
    "Enable debug output", NULL},
+  {"deflate", 0, 0, G_OPTION_ARG_NONE, &deflate,
+   "Enable permessage-deflate extension", NULL},
   {NULL}
 };
 
@@ -211,8 +214,11 @@ handle_client(int new_sock)
     // wait header
     wait_for(new_sock, POLLIN);
 
+    WebSocketDeflateConfig deflate_config;
+    websocket_deflate_config_parse(&deflate_config, "");
     RedsWebSocket *ws = websocket_new("", 0, GINT_TO_POINTER(new_sock),
-                                      ws_read, ws_write, ws_writev);
+                                      ws_read, ws_write, ws_writev,
+                                      deflate ? &deflate_config : NULL);
     assert(ws);
 
     char buffer[4096];
@@ -261,7 +267,7 @@ handle_client(int new_sock)
         }
 
         if (events & POLLOUT) {
-            int size = websocket_write(ws, buffer, to_send, ws_flags);
+            int size = websocket_write(ws, buffer, to_send, ws_flags | WEBSOCKET_COMPRESS);
 
             if (size < 0) {
                 switch (errno) {
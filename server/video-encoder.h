@@ -54,6 +54,10 @@ typedef struct VideoEncoderStats {
     uint64_t starting_bit_rate;
     uint64_t cur_bit_rate;
     double avg_quality;
+    /* The average number of bytes copied per frame before encoding it */
+    double avg_copy_size;
+    /* The number of buffers allocated to hold the frame copies */
+    uint64_t num_buffer_allocs;
 } VideoEncoderStats;
 
 typedef struct VideoEncoder VideoEncoder;
@@ -140,6 +144,27 @@ struct VideoEncoder {
      */
     void (*get_stats)(VideoEncoder *encoder, VideoEncoderStats *stats);
 
+    /* Makes the next encoded frame a key frame so that a client starting
+     * to receive the stream can decode it.
+     * This is NULL if all the frames are key frames.
+     *
+     * @encoder:    The video encoder.
+     */
+    void (*request_key_frame)(VideoEncoder *encoder);
+
+    /* Tells the video encoder which part of the frames the client displays
+     * so it can spend fewer bits on the parts that are hidden, for instance
+     * by a window covering the stream. The hidden parts may be encoded with
+     * any content.
+     * This is NULL if the encoder always encodes the whole frames.
+     *
+     * @encoder:    The video encoder.
+     * @visible:    The visible rectangles in frame coordinates, with the
+     *              origin at the top left corner of the picture, or NULL if
+     *              the whole frames are visible. The encoder makes a copy.
+     */
+    void (*set_visible_region)(VideoEncoder *encoder, const SpiceClipRects *visible);
+
     /* The codec being used by the video encoder */
     SpiceVideoCodecType codec_type;
 };
@@ -169,6 +194,11 @@ typedef struct VideoEncoderRateControlCbs {
      *              frames to reach the client.
      */
     void (*update_client_playback_delay)(void *opaque, uint32_t delay_ms);
+
+    /* Returns the bit rate measured on the link to the client in bits per
+     * second, or 0 if unknown. May be NULL.
+     */
+    uint64_t (*get_link_bit_rate)(void *opaque);
 } VideoEncoderRateControlCbs;
 
 typedef void (*bitmap_ref_t)(gpointer data);
@@ -207,6 +237,13 @@ VideoEncoder* gstreamer_encoder_new(SpiceVideoCodecType codec_type,
                                     bitmap_ref_t bitmap_ref,
                                     bitmap_unref_t bitmap_unref);
 #endif
+#ifdef HAVE_OPENH264
+VideoEncoder* openh264_encoder_new(SpiceVideoCodecType codec_type,
+                                   uint64_t starting_bit_rate,
+                                   VideoEncoderRateControlCbs *cbs,
+                                   bitmap_ref_t bitmap_ref,
+                                   bitmap_unref_t bitmap_unref);
+#endif
 
 
 typedef struct RedVideoCodec {
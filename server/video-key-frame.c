@@ -0,0 +1,111 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include "red-common.h"
+#include "video-key-frame.h"
+
+/* Calls nal_kind() on the header of each NAL unit of the frame until it
+ * finds a picture, which decides whether the frame is a key frame.
+ */
+static bool annexb_is_key_frame(const uint8_t *data, uint32_t size,
+                                int (*nal_kind)(uint8_t nal_header))
+{
+    uint32_t zeros = 0;
+
+    for (uint32_t i = 0; i < size; i++) {
+        if (data[i] == 0) {
+            zeros++;
+            continue;
+        }
+        if (data[i] == 1 && zeros >= 2 && i + 1 < size) {
+            int kind = nal_kind(data[i + 1]);
+            if (kind != 0) {
+                return kind > 0;
+            }
+        }
+        zeros = 0;
+    }
+    return false;
+}
+
+/* Returns 1 for a key picture, -1 for another picture and 0 for the NAL
+ * units that hold no picture such as the parameter sets.
+ */
+static int h264_nal_kind(uint8_t nal_header)
+{
+    switch (nal_header & 0x1f) {
+    case 5: /* IDR slice */
+        return 1;
+    case 1: /* non-IDR slice */
+    case 2: /* slice data partitions */
+    case 3:
+    case 4:
+        return -1;
+    default:
+        return 0;
+    }
+}
+
+static int h265_nal_kind(uint8_t nal_header)
+{
+    uint8_t type = (nal_header >> 1) & 0x3f;
+
+    /* 16 to 23 are the intra random access point pictures, BLA, IDR
+     * and CRA, and 0 to 31 the other pictures */
+    if (type >= 16 && type <= 23) {
+        return 1;
+    }
+    return type < 32 ? -1 : 0;
+}
+
+static bool vp9_is_key_frame(const uint8_t *data, uint32_t size)
+{
+    if (size < 1 || (data[0] >> 6) != 2 /* frame marker */) {
+        return false;
+    }
+
+    /* the header bits come most significant first */
+    unsigned profile = ((data[0] >> 5) & 1) | (((data[0] >> 4) & 1) << 1);
+    unsigned bit = profile == 3 ? 5 : 4;
+
+    if ((data[0] >> (7 - bit)) & 1) {
+        /* show_existing_frame, there is no new picture */
+        return false;
+    }
+    bit++;
+    return ((data[0] >> (7 - bit)) & 1) == 0;
+}
+
+bool video_is_key_frame(SpiceVideoCodecType codec_type, const uint8_t *data, uint32_t size)
+{
+    switch (codec_type) {
+    case SPICE_VIDEO_CODEC_TYPE_VP8:
+        /* the frame type is the first bit of the frame tag */
+        return size >= 1 && (data[0] & 1) == 0;
+    case SPICE_VIDEO_CODEC_TYPE_VP9:
+        return vp9_is_key_frame(data, size);
+    case SPICE_VIDEO_CODEC_TYPE_H264:
+        return annexb_is_key_frame(data, size, h264_nal_kind);
+    case SPICE_VIDEO_CODEC_TYPE_H265:
+        return annexb_is_key_frame(data, size, h265_nal_kind);
+    default:
+        /* MJPEG frames are all key frames */
+        return true;
+    }
+}
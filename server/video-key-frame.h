@@ -0,0 +1,39 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VIDEO_KEY_FRAME_H_
+#define VIDEO_KEY_FRAME_H_
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <spice/enums.h>
+#include <spice/macros.h>
+
+SPICE_BEGIN_DECLS
+
+/* Returns true if the client can start decoding the stream from this
+ * encoded frame, without the previous ones.
+ * H.264 and H.265 frames are expected in the Annex B byte stream format.
+ * Frames of codecs the function does not know about are considered key
+ * frames.
+ */
+bool video_is_key_frame(SpiceVideoCodecType codec_type, const uint8_t *data, uint32_t size);
+
+SPICE_END_DECLS
+
+#endif /* VIDEO_KEY_FRAME_H_ */
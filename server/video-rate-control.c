@@ -0,0 +1,685 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <inttypes.h>
+#include <stdlib.h>
+
+#include "red-common.h"
+#include "video-rate-control.h"
+#include "utils.h"
+
+#define RATE_CONTROL_DEFAULT_FPS 30
+
+/* How many frames to take into account when computing the effective
+ * bit rate, average frame size, etc. This should be large enough so the
+ * I and P frames average out, and short enough for it to reflect the
+ * current situation. Must be lower than VIDEO_RATE_CONTROL_HISTORY_SIZE.
+ */
+#define RATE_CONTROL_FRAME_STATISTICS_COUNT 21
+
+
+/* ---------- Encoder bit rate control ---------- */
+
+/* The minimum bit rate / bit rate increment. */
+#define RATE_CONTROL_MIN_BITRATE (128 * 1024)
+
+/* The default bit rate. */
+#define RATE_CONTROL_DEFAULT_BITRATE (8 * 1024 * 1024)
+
+/* The bit rate control is performed using a virtual buffer to allow
+ * short term variations: bursts are allowed until the virtual buffer is
+ * full. Then frames are dropped to limit the bit rate. VBUFFER_SIZE
+ * defines the size of the virtual buffer in milliseconds worth of data
+ * while vbuffer_size holds the limit in bytes for the current bit rate.
+ */
+#define RATE_CONTROL_VBUFFER_SIZE 300
+
+/* Defines the minimum allowed fps. */
+#define RATE_CONTROL_MAX_PERIOD (NSEC_PER_SEC / 3)
+
+/* How big of a margin to take to cover for latency jitter. */
+#define RATE_CONTROL_LATENCY_MARGIN 0.1
+
+
+/* ---------- Network bit rate control ---------- */
+
+/* How much to reduce the bit rate in case of network congestion. */
+#define RATE_CONTROL_BITRATE_CUT 2
+#define RATE_CONTROL_BITRATE_REDUCE (4.0 / 3.0)
+
+/* Never increase the bit rate by more than this amount (bits per second). */
+#define RATE_CONTROL_BITRATE_MAX_STEP (1024 * 1024)
+
+/* Defines when the spread between max_bit_rate and min_bit_rate has been
+ * narrowed down enough. Note that this value should be large enough for
+ * min_bit_rate to allow recovery from network congestion in a reasonable
+ * time frame, and to absorb transient traffic spikes (potentially from
+ * other sources).
+ * This is also used as a multiplier for the video_bit_rate so it does
+ * not have to be changed too often.
+ */
+#define RATE_CONTROL_BITRATE_MARGIN RATE_CONTROL_BITRATE_REDUCE
+
+/* How often to increase the bit rate. */
+#define RATE_CONTROL_BITRATE_UP_INTERVAL (MSEC_PER_SEC * 2)
+#define RATE_CONTROL_BITRATE_UP_CLIENT_STABLE (MSEC_PER_SEC * 60 * 2)
+#define RATE_CONTROL_BITRATE_UP_SERVER_STABLE (MSEC_PER_SEC * 3600 * 4)
+#define RATE_CONTROL_BITRATE_UP_RESET_MAX (MSEC_PER_SEC * 30)
+
+
+/* ---------- Client feedback ---------- */
+
+/* The margin is the amount of time between the reception of a piece of
+ * media data by the client and the time when it should be displayed.
+ * Increasing the bit rate increases the transmission time and thus
+ * reduces the margin.
+ */
+#define RATE_CONTROL_VIDEO_MARGIN_GOOD 0.75
+#define RATE_CONTROL_VIDEO_MARGIN_AVERAGE 0.5
+#define RATE_CONTROL_VIDEO_MARGIN_BAD 0.3
+
+#define RATE_CONTROL_VIDEO_DELTA_BAD 0.2
+#define RATE_CONTROL_VIDEO_DELTA_AVERAGE 0.15
+
+#define RATE_CONTROL_AUDIO_MARGIN_BAD 0.5
+#define RATE_CONTROL_AUDIO_VIDEO_RATIO 1.25
+
+
+/* ---------- Miscellaneous helpers ---------- */
+
+static inline double get_mbps(uint64_t bit_rate)
+{
+    return (double)bit_rate / 1024 / 1024;
+}
+
+uint32_t video_rate_control_get_source_fps(const VideoRateControl *rate_control)
+{
+    uint32_t fps = rate_control->cbs.get_source_fps ?
+        rate_control->cbs.get_source_fps(rate_control->cbs.opaque) : 0;
+    return fps ? fps : RATE_CONTROL_DEFAULT_FPS;
+}
+
+static uint32_t get_network_latency(const VideoRateControl *rate_control)
+{
+    /* Assume that the network latency is symmetric */
+    return rate_control->cbs.get_roundtrip_ms ?
+        rate_control->cbs.get_roundtrip_ms(rate_control->cbs.opaque) / 2 : 0;
+}
+
+static uint64_t get_link_bit_rate(const VideoRateControl *rate_control)
+{
+    return rate_control->cbs.get_link_bit_rate ?
+        rate_control->cbs.get_link_bit_rate(rate_control->cbs.opaque) : 0;
+}
+
+
+/* ---------- Encoded frame statistics ---------- */
+
+static inline uint32_t get_last_frame_mm_time(const VideoRateControl *rate_control)
+{
+    return rate_control->history[rate_control->history_last].mm_time;
+}
+
+static inline uint32_t get_stat_count(const VideoRateControl *rate_control)
+{
+    return rate_control->history_last +
+        (rate_control->history_last < rate_control->stat_first ? VIDEO_RATE_CONTROL_HISTORY_SIZE : 0) -
+        rate_control->stat_first + 1;
+}
+
+/* Returns the current bit rate based on the last
+ * RATE_CONTROL_FRAME_STATISTICS_COUNT frames.
+ */
+uint64_t video_rate_control_get_effective_bit_rate(const VideoRateControl *rate_control)
+{
+    uint32_t next_mm_time = rate_control->next_frame_mm_time ?
+                            rate_control->next_frame_mm_time :
+                            get_last_frame_mm_time(rate_control) +
+                                MSEC_PER_SEC / video_rate_control_get_source_fps(rate_control);
+    uint32_t elapsed = next_mm_time - rate_control->history[rate_control->stat_first].mm_time;
+    return elapsed ? rate_control->stat_size_sum * 8 * MSEC_PER_SEC / elapsed : 0;
+}
+
+static uint64_t get_average_encoding_time(const VideoRateControl *rate_control)
+{
+    return rate_control->stat_duration_sum / get_stat_count(rate_control);
+}
+
+static uint32_t get_average_frame_size(const VideoRateControl *rate_control)
+{
+    return rate_control->stat_size_sum / get_stat_count(rate_control);
+}
+
+/* Look for the largest frame and store it in stat_size_max to reduce how
+ * often we have to scan the history for the largest frame.
+ * Then all we need to keep things consistent is to:
+ * - Update stat_size_max when adding a larger frame to the history.
+ * - Reset stat_size_max to zero when the largest frame falls out of
+ *   the history.
+ */
+static uint32_t get_maximum_frame_size(VideoRateControl *rate_control)
+{
+    if (rate_control->stat_size_max == 0) {
+        uint32_t index = rate_control->history_last;
+        while (1) {
+            rate_control->stat_size_max = MAX(rate_control->stat_size_max,
+                                              rate_control->history[index].size);
+            if (index == rate_control->stat_first) {
+                break;
+            }
+            index = (index ? index : VIDEO_RATE_CONTROL_HISTORY_SIZE) - 1;
+        }
+    }
+    return rate_control->stat_size_max;
+}
+
+/* Returns the bit rate of the specified period. from and to must be the
+ * mm time of the first and last frame to consider.
+ */
+static uint64_t get_period_bit_rate(const VideoRateControl *rate_control,
+                                    uint32_t from, uint32_t to)
+{
+    uint32_t sum = 0;
+    uint32_t last_mm_time = 0;
+    uint32_t index = rate_control->history_last;
+    while (1) {
+        if (rate_control->history[index].mm_time == to) {
+            if (last_mm_time == 0) {
+                /* We don't know how much time elapsed between the period's
+                 * last frame and the next so we cannot include it.
+                 */
+                sum = 1;
+                last_mm_time = to;
+            } else {
+                sum = rate_control->history[index].size + 1;
+            }
+
+        } else if (rate_control->history[index].mm_time == from) {
+            sum += rate_control->history[index].size;
+            return (sum - 1) * 8 * MSEC_PER_SEC / (last_mm_time - from);
+
+        } else if (sum > 0) {
+            sum += rate_control->history[index].size;
+
+        } else {
+            last_mm_time = rate_control->history[index].mm_time;
+        }
+
+        if (index == rate_control->history_first) {
+            /* This period is outside the recorded history */
+            spice_debug("period (%u-%u) outside known history (%u-%u)",
+                        from, to,
+                        rate_control->history[rate_control->history_first].mm_time,
+                        rate_control->history[rate_control->history_last].mm_time);
+           return 0;
+        }
+        index = (index ? index : VIDEO_RATE_CONTROL_HISTORY_SIZE) - 1;
+    }
+}
+
+static void add_frame(VideoRateControl *rate_control, uint32_t frame_mm_time,
+                      uint64_t duration, uint32_t size)
+{
+    /* Update the statistics */
+    if (get_stat_count(rate_control) == RATE_CONTROL_FRAME_STATISTICS_COUNT) {
+        const VideoRateControlFrame *first = &rate_control->history[rate_control->stat_first];
+        rate_control->stat_duration_sum -= first->duration;
+        rate_control->stat_size_sum -= first->size;
+        if (rate_control->stat_size_max == first->size) {
+            rate_control->stat_size_max = 0;
+        }
+        rate_control->stat_first = (rate_control->stat_first + 1) % VIDEO_RATE_CONTROL_HISTORY_SIZE;
+    }
+    rate_control->stat_duration_sum += duration;
+    rate_control->stat_size_sum += size;
+    if (rate_control->stat_size_max > 0 && size > rate_control->stat_size_max) {
+        rate_control->stat_size_max = size;
+    }
+
+    /* Update the frame history */
+    rate_control->history_last = (rate_control->history_last + 1) % VIDEO_RATE_CONTROL_HISTORY_SIZE;
+    if (rate_control->history_last == rate_control->history_first) {
+        rate_control->history_first = (rate_control->history_first + 1) % VIDEO_RATE_CONTROL_HISTORY_SIZE;
+    }
+    rate_control->history[rate_control->history_last].mm_time = frame_mm_time;
+    rate_control->history[rate_control->history_last].duration = duration;
+    rate_control->history[rate_control->history_last].size = size;
+}
+
+
+/* ---------- Encoder bit rate control ---------- */
+
+static void set_video_bit_rate(VideoRateControl *rate_control, uint64_t bit_rate)
+{
+    if (bit_rate != rate_control->video_bit_rate &&
+        rate_control->set_video_bit_rate(rate_control->opaque, bit_rate)) {
+        rate_control->video_bit_rate = bit_rate;
+    }
+}
+
+static uint32_t get_min_playback_delay(VideoRateControl *rate_control)
+{
+    /* Make sure the delay is large enough to send a large frame (typically
+     * an I frame) and an average frame. This also takes into account the
+     * frames dropped by the encoder bit rate control.
+     */
+    uint32_t size = get_maximum_frame_size(rate_control) + get_average_frame_size(rate_control);
+    uint32_t send_time = ((uint64_t)MSEC_PER_SEC * 8) * size / rate_control->bit_rate;
+
+    /* Also factor in the network latency with a margin for jitter. */
+    uint32_t net_latency = get_network_latency(rate_control) * (1.0 + RATE_CONTROL_LATENCY_MARGIN);
+
+    return send_time + net_latency + get_average_encoding_time(rate_control) / NSEC_PER_MILLISEC;
+}
+
+void video_rate_control_update_client_playback_delay(VideoRateControl *rate_control)
+{
+    if (rate_control->cbs.update_client_playback_delay && rate_control->bit_rate) {
+        uint32_t min_delay = get_min_playback_delay(rate_control);
+        rate_control->cbs.update_client_playback_delay(rate_control->cbs.opaque, min_delay);
+    }
+}
+
+static void update_next_frame_mm_time(VideoRateControl *rate_control)
+{
+    uint64_t period_ns = NSEC_PER_SEC / video_rate_control_get_source_fps(rate_control);
+    uint64_t min_delay_ns = get_average_encoding_time(rate_control);
+    if (min_delay_ns > period_ns) {
+        spice_warning("your system seems to be too slow to encode this %dx%d@%d video in real time",
+                      rate_control->width, rate_control->height,
+                      video_rate_control_get_source_fps(rate_control));
+    }
+
+    min_delay_ns = MIN(min_delay_ns, RATE_CONTROL_MAX_PERIOD);
+    if (rate_control->vbuffer_free >= 0) {
+        rate_control->next_frame_mm_time = get_last_frame_mm_time(rate_control) +
+                                           min_delay_ns / NSEC_PER_MILLISEC;
+        return;
+    }
+
+    /* Figure out how many frames to drop to not exceed the current bit rate.
+     * Use nanoseconds to avoid precision loss.
+     */
+    uint64_t delay_ns = -rate_control->vbuffer_free * 8 * NSEC_PER_SEC / rate_control->bit_rate;
+    uint32_t drops = (delay_ns + period_ns - 1) / period_ns; /* round up */
+    spice_debug("drops=%u vbuffer %d/%d", drops, rate_control->vbuffer_free,
+                rate_control->vbuffer_size);
+
+    delay_ns = drops * period_ns + period_ns / 2;
+    if (delay_ns > RATE_CONTROL_MAX_PERIOD) {
+        /* Reduce the video bit rate so we don't have to drop so many frames. */
+        if (rate_control->video_bit_rate > rate_control->bit_rate * RATE_CONTROL_BITRATE_MARGIN) {
+            set_video_bit_rate(rate_control, rate_control->bit_rate * RATE_CONTROL_BITRATE_MARGIN);
+        } else {
+            set_video_bit_rate(rate_control, rate_control->bit_rate);
+        }
+        delay_ns = RATE_CONTROL_MAX_PERIOD;
+    }
+    rate_control->next_frame_mm_time = get_last_frame_mm_time(rate_control) +
+                                       MAX(delay_ns, min_delay_ns) / NSEC_PER_MILLISEC;
+
+    /* Drops mean a higher delay between encoded frames so update the
+     * playback delay.
+     */
+    video_rate_control_update_client_playback_delay(rate_control);
+}
+
+
+/* ---------- Network bit rate control ---------- */
+
+/* The maximum bit rate we will use for the current video.
+ *
+ * This is based on a 10x compression ratio which should be more than enough
+ * for even MJPEG to provide good quality. There is also no point in
+ * exceeding the bit rate measured on the link to the client.
+ */
+static uint64_t get_bit_rate_cap(const VideoRateControl *rate_control)
+{
+    uint64_t raw_frame_bits = (uint64_t)rate_control->width * rate_control->height * rate_control->bpp;
+    uint64_t cap = raw_frame_bits * video_rate_control_get_source_fps(rate_control) / 10;
+    uint64_t link_bit_rate = get_link_bit_rate(rate_control);
+
+    if (link_bit_rate) {
+        cap = MIN(cap, link_bit_rate);
+    }
+    return MAX(cap, RATE_CONTROL_MIN_BITRATE);
+}
+
+static void set_bit_rate(VideoRateControl *rate_control, uint64_t bit_rate)
+{
+    if (bit_rate == 0) {
+        /* Use the default value */
+        bit_rate = RATE_CONTROL_DEFAULT_BITRATE;
+    }
+    if (bit_rate == rate_control->bit_rate) {
+        return;
+    }
+    if (bit_rate < RATE_CONTROL_MIN_BITRATE) {
+        /* Don't let the bit rate go too low... */
+        bit_rate = RATE_CONTROL_MIN_BITRATE;
+    } else if (bit_rate > rate_control->bit_rate) {
+        /* or too high */
+        bit_rate = MIN(bit_rate, get_bit_rate_cap(rate_control));
+    }
+
+    if (bit_rate < rate_control->min_bit_rate) {
+        rate_control->min_bit_rate = bit_rate;
+        rate_control->bit_rate_step = 0;
+    } else if (rate_control->status == VIDEO_RATE_CONTROL_DECREASING &&
+               bit_rate > rate_control->bit_rate) {
+        rate_control->min_bit_rate = rate_control->bit_rate;
+        rate_control->bit_rate_step = 0;
+    } else if (rate_control->status != VIDEO_RATE_CONTROL_DECREASING &&
+               bit_rate < rate_control->bit_rate) {
+        rate_control->max_bit_rate = rate_control->bit_rate - RATE_CONTROL_MIN_BITRATE;
+        rate_control->bit_rate_step = 0;
+    }
+    rate_control->increase_interval = RATE_CONTROL_BITRATE_UP_INTERVAL;
+
+    if (rate_control->bit_rate_step == 0) {
+        rate_control->bit_rate_step = MAX(RATE_CONTROL_MIN_BITRATE,
+                                          MIN(RATE_CONTROL_BITRATE_MAX_STEP,
+                                              (rate_control->max_bit_rate - rate_control->min_bit_rate) / 10));
+        rate_control->status = (bit_rate < rate_control->bit_rate) ?
+            VIDEO_RATE_CONTROL_DECREASING : VIDEO_RATE_CONTROL_INCREASING;
+        if (rate_control->max_bit_rate / RATE_CONTROL_BITRATE_MARGIN < rate_control->min_bit_rate) {
+            /* We have sufficiently narrowed down the optimal bit rate range.
+             * Settle on the lower end to keep a safety margin and stop
+             * rocking the boat.
+             */
+            bit_rate = rate_control->min_bit_rate;
+            rate_control->status = VIDEO_RATE_CONTROL_STABLE;
+            rate_control->increase_interval = rate_control->has_client_reports ?
+                RATE_CONTROL_BITRATE_UP_CLIENT_STABLE : RATE_CONTROL_BITRATE_UP_SERVER_STABLE;
+            set_video_bit_rate(rate_control, bit_rate);
+        }
+    }
+    spice_debug("%u set_bit_rate(%.3fMbps) eff %.3f %.3f-%.3f %d",
+                get_last_frame_mm_time(rate_control) - rate_control->last_change,
+                get_mbps(bit_rate),
+                get_mbps(video_rate_control_get_effective_bit_rate(rate_control)),
+                get_mbps(rate_control->min_bit_rate),
+                get_mbps(rate_control->max_bit_rate), rate_control->status);
+
+    rate_control->last_change = get_last_frame_mm_time(rate_control);
+    rate_control->bit_rate = bit_rate;
+    /* Adjust the vbuffer size without ever increasing vbuffer_free to avoid
+     * sudden bit rate increases.
+     */
+    int32_t new_size = bit_rate * RATE_CONTROL_VBUFFER_SIZE / MSEC_PER_SEC / 8;
+    if (new_size < rate_control->vbuffer_size && rate_control->vbuffer_free > 0) {
+        rate_control->vbuffer_free = MAX(0, rate_control->vbuffer_free + new_size -
+                                            rate_control->vbuffer_size);
+    }
+    rate_control->vbuffer_size = new_size;
+    update_next_frame_mm_time(rate_control);
+
+    /* Frames preceding the bit rate change are not relevant to the current
+     * situation anymore.
+     */
+    rate_control->stat_first = rate_control->history_last;
+    rate_control->stat_duration_sum = rate_control->history[rate_control->history_last].duration;
+    rate_control->stat_size_sum = rate_control->stat_size_max =
+        rate_control->history[rate_control->history_last].size;
+
+    if (rate_control->exact_encoder) {
+        set_video_bit_rate(rate_control, bit_rate);
+    } else if (bit_rate > rate_control->video_bit_rate) {
+        set_video_bit_rate(rate_control, bit_rate * RATE_CONTROL_BITRATE_MARGIN);
+    }
+}
+
+static void reduce_bit_rate(VideoRateControl *rate_control, double factor)
+{
+    uint64_t bit_rate = (rate_control->bit_rate == rate_control->min_bit_rate) ?
+        rate_control->bit_rate / factor :
+        MAX(rate_control->min_bit_rate, rate_control->bit_rate / factor);
+    set_bit_rate(rate_control, bit_rate);
+}
+
+static void increase_bit_rate(VideoRateControl *rate_control)
+{
+    if (video_rate_control_get_effective_bit_rate(rate_control) < rate_control->bit_rate) {
+        /* The encoder currently uses less bandwidth than allowed.
+         * So increasing the limit again makes no sense.
+         */
+        return;
+    }
+
+    if (rate_control->bit_rate == rate_control->max_bit_rate &&
+        get_last_frame_mm_time(rate_control) - rate_control->last_change > RATE_CONTROL_BITRATE_UP_RESET_MAX) {
+        /* The maximum bit rate seems to be sustainable so it was probably
+         * set too low. Probe for the maximum bit rate again.
+         */
+        rate_control->max_bit_rate = get_bit_rate_cap(rate_control);
+        rate_control->status = VIDEO_RATE_CONTROL_INCREASING;
+    }
+
+    uint64_t new_bit_rate = MIN(rate_control->bit_rate + rate_control->bit_rate_step,
+                                rate_control->max_bit_rate);
+    spice_debug("increase bit rate to %.3fMbps %.3f-%.3fMbps %d",
+                get_mbps(new_bit_rate), get_mbps(rate_control->min_bit_rate),
+                get_mbps(rate_control->max_bit_rate), rate_control->status);
+    set_bit_rate(rate_control, new_bit_rate);
+}
+
+
+/* ---------- Server feedback ---------- */
+
+/* Checks how many frames got dropped since the last encoded frame and
+ * adjusts the bit rate accordingly.
+ */
+static bool handle_server_drops(VideoRateControl *rate_control, uint32_t frame_mm_time)
+{
+    if (rate_control->server_drops == 0) {
+        return false;
+    }
+
+    spice_debug("server report: got %u drops in %ums after %ums",
+                rate_control->server_drops,
+                frame_mm_time - get_last_frame_mm_time(rate_control),
+                frame_mm_time - rate_control->last_change);
+
+    /* The server dropped a frame so clearly the buffer is full. */
+    rate_control->vbuffer_free = MIN(rate_control->vbuffer_free, 0);
+    /* Add a 0 byte frame so the time spent dropping frames is not counted as
+     * time during which the buffer was refilling. This implies dropping this
+     * frame.
+     */
+    add_frame(rate_control, frame_mm_time, 0, 0);
+
+    if (rate_control->server_drops >= video_rate_control_get_source_fps(rate_control)) {
+        spice_debug("cut the bit rate");
+        reduce_bit_rate(rate_control, RATE_CONTROL_BITRATE_CUT);
+    } else {
+        spice_debug("reduce the bit rate");
+        reduce_bit_rate(rate_control, RATE_CONTROL_BITRATE_REDUCE);
+    }
+    rate_control->server_drops = 0;
+    return true;
+}
+
+void video_rate_control_server_frame_drop(VideoRateControl *rate_control)
+{
+    if (rate_control->server_drops == 0) {
+        spice_debug("server report: getting frame drops...");
+    }
+    rate_control->server_drops++;
+}
+
+
+/* ---------- Public interface ---------- */
+
+void video_rate_control_init(VideoRateControl *rate_control,
+                             const VideoEncoderRateControlCbs *cbs,
+                             uint64_t starting_bit_rate,
+                             bool exact_encoder,
+                             video_rate_control_set_video_bit_rate_t set_video_bit_rate,
+                             void *opaque)
+{
+    memset(rate_control, 0, sizeof(*rate_control));
+    rate_control->cbs = *cbs;
+    rate_control->starting_bit_rate = starting_bit_rate;
+    rate_control->exact_encoder = exact_encoder;
+    rate_control->set_video_bit_rate = set_video_bit_rate;
+    rate_control->opaque = opaque;
+}
+
+void video_rate_control_set_video_format(VideoRateControl *rate_control,
+                                         uint32_t width, uint32_t height,
+                                         uint32_t bpp, uint32_t frame_mm_time)
+{
+    rate_control->width = width;
+    rate_control->height = height;
+    rate_control->bpp = bpp;
+    if (rate_control->bit_rate == 0) {
+        rate_control->history[0].mm_time = frame_mm_time;
+        rate_control->max_bit_rate = get_bit_rate_cap(rate_control);
+        rate_control->min_bit_rate = RATE_CONTROL_MIN_BITRATE;
+        rate_control->status = VIDEO_RATE_CONTROL_DECREASING;
+        set_bit_rate(rate_control, rate_control->starting_bit_rate);
+        rate_control->vbuffer_free = 0; /* Slow start */
+    }
+}
+
+bool video_rate_control_drop_frame(VideoRateControl *rate_control, uint32_t frame_mm_time)
+{
+    return handle_server_drops(rate_control, frame_mm_time) ||
+           frame_mm_time < rate_control->next_frame_mm_time;
+}
+
+void video_rate_control_add_frame(VideoRateControl *rate_control, uint32_t frame_mm_time,
+                                  uint64_t duration, uint32_t size)
+{
+    uint32_t last_mm_time = get_last_frame_mm_time(rate_control);
+    add_frame(rate_control, frame_mm_time, duration, size);
+
+    int32_t refill = rate_control->bit_rate * (frame_mm_time - last_mm_time) / MSEC_PER_SEC / 8;
+    rate_control->vbuffer_free = MIN(rate_control->vbuffer_free + refill,
+                                     rate_control->vbuffer_size) - size;
+
+    /* Let video_rate_control_client_stream_report() deal with bit rate
+     * increases if we receive client reports.
+     */
+    if (!rate_control->has_client_reports && rate_control->server_drops == 0 &&
+        frame_mm_time - rate_control->last_change >= rate_control->increase_interval) {
+        increase_bit_rate(rate_control);
+    }
+    update_next_frame_mm_time(rate_control);
+}
+
+void video_rate_control_client_stream_report(VideoRateControl *rate_control,
+                                             uint32_t num_frames, uint32_t num_drops,
+                                             uint32_t start_frame_mm_time,
+                                             uint32_t end_frame_mm_time,
+                                             int32_t video_margin, uint32_t audio_margin)
+{
+    rate_control->has_client_reports = true;
+
+    rate_control->max_video_margin = MAX(rate_control->max_video_margin, video_margin);
+    rate_control->max_audio_margin = MAX(rate_control->max_audio_margin, audio_margin);
+    int32_t margin_delta = video_margin - rate_control->last_video_margin;
+    rate_control->last_video_margin = video_margin;
+
+    uint64_t period_bit_rate = get_period_bit_rate(rate_control, start_frame_mm_time,
+                                                   end_frame_mm_time);
+    spice_debug("client report: %u/%u drops in %ums margins video %3d/%3d audio %3u/%3u bw %.3f/%.3fMbps%s",
+                num_drops, num_frames, end_frame_mm_time - start_frame_mm_time,
+                video_margin, rate_control->max_video_margin,
+                audio_margin, rate_control->max_audio_margin,
+                get_mbps(period_bit_rate),
+                get_mbps(video_rate_control_get_effective_bit_rate(rate_control)),
+                start_frame_mm_time < rate_control->last_change ? " obsolete" : "");
+    if (rate_control->status == VIDEO_RATE_CONTROL_DECREASING &&
+        start_frame_mm_time < rate_control->last_change) {
+        /* Some of this data predates the last bit rate reduction
+         * so it is obsolete.
+         */
+        return;
+    }
+
+    /* We normally arrange for even the largest frames to arrive a bit over
+     * one period before they should be displayed.
+     */
+    int32_t min_margin = MSEC_PER_SEC / video_rate_control_get_source_fps(rate_control) +
+        get_network_latency(rate_control) * RATE_CONTROL_LATENCY_MARGIN;
+
+    /* A low video margin indicates that the bit rate is too high. */
+    uint32_t score;
+    if (num_drops) {
+        score = 4;
+    } else if (margin_delta >= 0) {
+        /* The situation was bad but seems to be improving */
+        score = 0;
+    } else if (video_margin < min_margin * RATE_CONTROL_VIDEO_MARGIN_BAD ||
+               video_margin < rate_control->max_video_margin * RATE_CONTROL_VIDEO_MARGIN_BAD) {
+        score = 3;
+    } else if (video_margin < min_margin ||
+               video_margin < rate_control->max_video_margin * RATE_CONTROL_VIDEO_MARGIN_AVERAGE) {
+        score = 2;
+    } else if (video_margin < rate_control->max_video_margin * RATE_CONTROL_VIDEO_MARGIN_GOOD) {
+        score = 1;
+    } else {
+        score = 0;
+    }
+    /* A fast dropping video margin is a compounding factor. */
+    if (margin_delta < -abs(rate_control->max_video_margin) * RATE_CONTROL_VIDEO_DELTA_BAD) {
+        score += 2;
+    } else if (margin_delta < -abs(rate_control->max_video_margin) * RATE_CONTROL_VIDEO_DELTA_AVERAGE) {
+        score += 1;
+    }
+
+    if (score > 3) {
+        spice_debug("score %u, cut the bit rate", score);
+        reduce_bit_rate(rate_control, RATE_CONTROL_BITRATE_CUT);
+
+    } else if (score == 3) {
+        spice_debug("score %u, reduce the bit rate", score);
+        reduce_bit_rate(rate_control, RATE_CONTROL_BITRATE_REDUCE);
+
+    } else if (score == 2) {
+        spice_debug("score %u, decrement the bit rate", score);
+        set_bit_rate(rate_control, rate_control->bit_rate - rate_control->bit_rate_step);
+
+    } else if (audio_margin < rate_control->max_audio_margin * RATE_CONTROL_AUDIO_MARGIN_BAD &&
+               audio_margin * RATE_CONTROL_AUDIO_VIDEO_RATIO < video_margin) {
+        /* The audio margin has decreased a lot while the video_margin
+         * remained higher. It may be that the video stream is starving the
+         * audio one of bandwidth. So reduce the bit rate.
+         */
+        spice_debug("free some bandwidth for the audio stream");
+        set_bit_rate(rate_control, rate_control->bit_rate - rate_control->bit_rate_step);
+
+    } else if (score == 1 && period_bit_rate <= rate_control->bit_rate &&
+               rate_control->status == VIDEO_RATE_CONTROL_INCREASING) {
+        /* We only increase the bit rate when score == 0 so things got worse
+         * since the last increase, and not because of a transient bit rate
+         * peak.
+         */
+        spice_debug("degraded margin, decrement bit rate %.3f <= %.3fMbps",
+                    get_mbps(period_bit_rate), get_mbps(rate_control->bit_rate));
+        set_bit_rate(rate_control, rate_control->bit_rate - rate_control->bit_rate_step);
+
+    } else if (score == 0 &&
+               get_last_frame_mm_time(rate_control) - rate_control->last_change >=
+               rate_control->increase_interval) {
+        /* The video margin is consistently high so increase the bit rate. */
+        increase_bit_rate(rate_control);
+    }
+}
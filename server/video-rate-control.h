@@ -0,0 +1,172 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VIDEO_RATE_CONTROL_H_
+#define VIDEO_RATE_CONTROL_H_
+
+#include <stdbool.h>
+
+#include "video-encoder.h"
+
+SPICE_BEGIN_DECLS
+
+/* The bit rate control shared by the video encoders.
+ *
+ * It figures out the bit rate the network can sustain from the client
+ * stream reports, the frames dropped by the server, the roundtrip time
+ * and the measured link bit rate, then drops frames to not exceed it.
+ * The encoders only have to compress the frames at the video bit rate
+ * it asks for, and to report the size of the frames they produced.
+ */
+
+/* Asks the encoder to target @bit_rate bits per second.
+ * Returns false if the encoder ignored the change, for instance because
+ * applying it is costly and the new bit rate is close to the current one.
+ */
+typedef bool (*video_rate_control_set_video_bit_rate_t)(void *opaque, uint64_t bit_rate);
+
+#define VIDEO_RATE_CONTROL_HISTORY_SIZE 60
+
+typedef struct VideoRateControlFrame {
+    uint32_t mm_time;
+    uint32_t size;
+    uint64_t duration;
+} VideoRateControlFrame;
+
+typedef enum VideoRateControlStatus {
+    VIDEO_RATE_CONTROL_DECREASING,
+    VIDEO_RATE_CONTROL_INCREASING,
+    VIDEO_RATE_CONTROL_STABLE,
+} VideoRateControlStatus;
+
+typedef struct VideoRateControl {
+    VideoEncoderRateControlCbs cbs;
+    video_rate_control_set_video_bit_rate_t set_video_bit_rate;
+    void *opaque;
+
+    /* True if the encoder output follows the video bit rate closely,
+     * otherwise the video bit rate is set above the network bit rate to
+     * make up for encoders which stay well below their target.
+     */
+    bool exact_encoder;
+
+    /* Spice's initial bit rate estimation in bits per second. */
+    uint64_t starting_bit_rate;
+
+    /* The size of the frames, to cap the bit rate. */
+    uint32_t width;
+    uint32_t height;
+    uint32_t bpp;
+
+    /* ---------- Encoded frame statistics ---------- */
+
+    VideoRateControlFrame history[VIDEO_RATE_CONTROL_HISTORY_SIZE];
+    uint32_t history_first;
+    uint32_t history_last;
+
+    /* The statistics are computed on the frames since stat_first */
+    uint32_t stat_first;
+    uint64_t stat_duration_sum;
+    uint64_t stat_size_sum;
+    uint32_t stat_size_max;
+
+    /* ---------- Encoder bit rate control ---------- */
+
+    /* The bit rate the encoder was asked to produce. */
+    uint64_t video_bit_rate;
+
+    /* The bit rate target for the outgoing network stream. (bits per second) */
+    uint64_t bit_rate;
+
+    /* A virtual buffer allows short term variations of the bit rate,
+     * frames are dropped once it is full.
+     */
+    int32_t vbuffer_size;
+    int32_t vbuffer_free;
+
+    /* When dropping frames, the minimum mm_time of the next frame to
+     * encode. Otherwise set to zero.
+     */
+    uint32_t next_frame_mm_time;
+
+    /* ---------- Network bit rate control ---------- */
+
+    /* The mm_time of the last bit rate change. */
+    uint32_t last_change;
+
+    /* The bit rate is probed between these with an AIMD scheme. */
+    uint64_t max_bit_rate;
+    uint64_t min_bit_rate;
+    VideoRateControlStatus status;
+    uint64_t bit_rate_step;
+    uint32_t increase_interval;
+
+    /* ---------- Client and server feedback ---------- */
+
+    bool has_client_reports;
+    int32_t last_video_margin;
+    int32_t max_video_margin;
+    uint32_t max_audio_margin;
+
+    /* How many frames were dropped by the server since the last encoded frame. */
+    uint32_t server_drops;
+} VideoRateControl;
+
+void video_rate_control_init(VideoRateControl *rate_control,
+                             const VideoEncoderRateControlCbs *cbs,
+                             uint64_t starting_bit_rate,
+                             bool exact_encoder,
+                             video_rate_control_set_video_bit_rate_t set_video_bit_rate,
+                             void *opaque);
+
+/* Sets the size and depth of the frames, bpp being the bits per pixel.
+ * The first call starts the bit rate control.
+ */
+void video_rate_control_set_video_format(VideoRateControl *rate_control,
+                                         uint32_t width, uint32_t height,
+                                         uint32_t bpp, uint32_t frame_mm_time);
+
+/* Returns true if the frame must be dropped to not exceed the bit rate */
+bool video_rate_control_drop_frame(VideoRateControl *rate_control, uint32_t frame_mm_time);
+
+/* Accounts for a frame of @size bytes encoded in @duration nanoseconds */
+void video_rate_control_add_frame(VideoRateControl *rate_control, uint32_t frame_mm_time,
+                                  uint64_t duration, uint32_t size);
+
+/* See VideoEncoder.client_stream_report() */
+void video_rate_control_client_stream_report(VideoRateControl *rate_control,
+                                             uint32_t num_frames, uint32_t num_drops,
+                                             uint32_t start_frame_mm_time,
+                                             uint32_t end_frame_mm_time,
+                                             int32_t video_margin, uint32_t audio_margin);
+
+/* See VideoEncoder.notify_server_frame_drop() */
+void video_rate_control_server_frame_drop(VideoRateControl *rate_control);
+
+/* Returns the bit rate of the recent frames */
+uint64_t video_rate_control_get_effective_bit_rate(const VideoRateControl *rate_control);
+
+/* Returns the source frame rate which may change at any time */
+uint32_t video_rate_control_get_source_fps(const VideoRateControl *rate_control);
+
+/* Tells the client how long it takes for the frames to reach it */
+void video_rate_control_update_client_playback_delay(VideoRateControl *rate_control);
+
+SPICE_END_DECLS
+
+#endif /* VIDEO_RATE_CONTROL_H_ */
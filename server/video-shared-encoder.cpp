@@ -0,0 +1,604 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <common/region.h>
+
+#include "red-common.h"
+#include "glib-compat.h"
+#include "video-key-frame.h"
+#include "video-shared-encoder.h"
+
+/*
+ * The first client sending a frame encodes it, the others find it in a
+ * small cache of the recent frames. The encoded frames of inter frame
+ * codecs depend on the previous ones so each client must receive all of
+ * them: a client joining the stream waits for a key frame and a client
+ * which misses a frame, or reports drops the others do not have,
+ * continues with its own encoder.
+ */
+
+/* how many recent frames are kept for the clients which did not send them yet */
+#define SHARED_ENCODER_MAX_FRAMES 3
+/* a client only joins a shared encoder if its bit rate is within this
+ * factor of the shared stream bit rate */
+#define SHARED_ENCODER_MAX_BIT_RATE_RATIO 2
+
+struct SharedVideoBuffer {
+    VideoBuffer base;
+    VideoBuffer *buffer;
+    gint refs;
+};
+
+struct SharedEncoderFrame {
+    gpointer bitmap_opaque; /* referenced, nullptr if the slot is free */
+    VideoEncodeResults result;
+    SharedVideoBuffer *buffer;
+    uint32_t seq;
+    bool key_frame;
+    /* number of subscribers which did not send the frame yet */
+    int pending;
+};
+
+struct VideoSharedEncoder {
+    /* where the stream keeps the encoder new clients subscribe to */
+    VideoSharedEncoder **owner;
+    VideoEncoder *encoder;
+    uint64_t starting_bit_rate;
+    bitmap_ref_t bitmap_ref;
+    bitmap_unref_t bitmap_unref;
+    GList *subscribers;
+    int num_subscribers;
+    /* sequence number of the next encoded frame */
+    uint32_t seq;
+    /* a key frame was requested and was not encoded yet, the clients
+     * joining meanwhile wait for the same one */
+    bool key_frame_requested;
+    SharedEncoderFrame frames[SHARED_ENCODER_MAX_FRAMES];
+    int next_frame;
+};
+
+/* The VideoEncoder of a client using a shared encoder. Once the client
+ * cannot follow the others it uses its own private encoder. */
+struct SharedEncoderSubscriber {
+    VideoEncoder base;
+    VideoSharedEncoderClient client;
+    VideoSharedEncoder *shared;
+    VideoEncoder *private_encoder;
+    /* sequence number of the next frame the client can decode */
+    uint32_t next_seq;
+    /* the client joined a running stream and can only start decoding it
+     * from a key frame */
+    bool waiting_key_frame;
+    /* the part of the frames the client displays, nullptr for all */
+    SpiceClipRects *visible;
+};
+
+static void shared_video_buffer_free(VideoBuffer *video_buffer)
+{
+    SharedVideoBuffer *buffer = SPICE_CONTAINEROF(video_buffer, SharedVideoBuffer, base);
+
+    if (g_atomic_int_dec_and_test(&buffer->refs)) {
+        buffer->buffer->free(buffer->buffer);
+        g_free(buffer);
+    }
+}
+
+static SharedVideoBuffer *shared_video_buffer_new(VideoBuffer *video_buffer)
+{
+    auto buffer = g_new0(SharedVideoBuffer, 1);
+
+    buffer->base.data = video_buffer->data;
+    buffer->base.size = video_buffer->size;
+    buffer->base.free = shared_video_buffer_free;
+    buffer->buffer = video_buffer;
+    buffer->refs = 1;
+    return buffer;
+}
+
+static VideoBuffer *shared_video_buffer_ref(SharedVideoBuffer *buffer)
+{
+    g_atomic_int_inc(&buffer->refs);
+    return &buffer->base;
+}
+
+static void shared_encoder_release_frame(VideoSharedEncoder *shared, SharedEncoderFrame *frame)
+{
+    if (!frame->bitmap_opaque) {
+        return;
+    }
+    shared->bitmap_unref(frame->bitmap_opaque);
+    frame->bitmap_opaque = nullptr;
+    if (frame->buffer) {
+        shared_video_buffer_free(&frame->buffer->base);
+        frame->buffer = nullptr;
+    }
+}
+
+static SharedEncoderFrame *shared_encoder_find_frame(VideoSharedEncoder *shared,
+                                                     gpointer bitmap_opaque)
+{
+    for (auto &frame : shared->frames) {
+        if (frame.bitmap_opaque == bitmap_opaque) {
+            return &frame;
+        }
+    }
+    return nullptr;
+}
+
+static uint32_t shared_encoder_get_roundtrip_ms(void *opaque)
+{
+    auto shared = static_cast<VideoSharedEncoder *>(opaque);
+    uint32_t roundtrip = 0;
+
+    /* the slowest client decides of the playback delay */
+    for (GList *l = shared->subscribers; l != nullptr; l = l->next) {
+        auto sub = static_cast<SharedEncoderSubscriber *>(l->data);
+        roundtrip = MAX(roundtrip, sub->client.cbs.get_roundtrip_ms(sub->client.cbs.opaque));
+    }
+    return roundtrip;
+}
+
+static uint32_t shared_encoder_get_source_fps(void *opaque)
+{
+    auto shared = static_cast<VideoSharedEncoder *>(opaque);
+
+    /* the clients receive the same stream */
+    if (!shared->subscribers) {
+        return 0;
+    }
+    auto sub = static_cast<SharedEncoderSubscriber *>(shared->subscribers->data);
+    return sub->client.cbs.get_source_fps(sub->client.cbs.opaque);
+}
+
+static uint64_t shared_encoder_get_link_bit_rate(void *opaque)
+{
+    auto shared = static_cast<VideoSharedEncoder *>(opaque);
+    uint64_t bit_rate = 0;
+
+    /* the slowest known link caps the bit rate */
+    for (GList *l = shared->subscribers; l != nullptr; l = l->next) {
+        auto sub = static_cast<SharedEncoderSubscriber *>(l->data);
+        uint64_t link_bit_rate = sub->client.cbs.get_link_bit_rate(sub->client.cbs.opaque);
+        if (link_bit_rate && (!bit_rate || link_bit_rate < bit_rate)) {
+            bit_rate = link_bit_rate;
+        }
+    }
+    return bit_rate;
+}
+
+static void shared_encoder_update_client_playback_delay(void *opaque, uint32_t delay_ms)
+{
+    auto shared = static_cast<VideoSharedEncoder *>(opaque);
+
+    for (GList *l = shared->subscribers; l != nullptr; l = l->next) {
+        auto sub = static_cast<SharedEncoderSubscriber *>(l->data);
+        sub->client.cbs.update_client_playback_delay(sub->client.cbs.opaque, delay_ms);
+    }
+}
+
+static void shared_encoder_free(VideoSharedEncoder *shared)
+{
+    spice_assert(shared->subscribers == nullptr);
+
+    for (auto &frame : shared->frames) {
+        shared_encoder_release_frame(shared, &frame);
+    }
+    if (shared->encoder) {
+        shared->encoder->destroy(shared->encoder);
+    }
+    /* the stream may have been stopped and reused already */
+    if (*shared->owner == shared) {
+        *shared->owner = nullptr;
+    }
+    g_free(shared);
+}
+
+static bool shared_encoder_can_join(VideoSharedEncoder *shared,
+                                    const VideoSharedEncoderClient *client, uint64_t bit_rate)
+{
+    VideoEncoder *encoder = shared->encoder;
+    uint64_t shared_bit_rate = encoder->get_bit_rate(encoder);
+
+    if (!client->supports_codec(client->opaque, encoder->codec_type)) {
+        return false;
+    }
+    if (shared_bit_rate == 0) {
+        shared_bit_rate = shared->starting_bit_rate;
+    }
+    return bit_rate <= shared_bit_rate * SHARED_ENCODER_MAX_BIT_RATE_RATIO &&
+           shared_bit_rate <= bit_rate * SHARED_ENCODER_MAX_BIT_RATE_RATIO;
+}
+
+/* Asks for a key frame, once for all the clients waiting for one. The
+ * GStreamer encoder for instance rebuilds its pipeline to get it. */
+static void shared_encoder_request_key_frame(VideoSharedEncoder *shared)
+{
+    VideoEncoder *encoder = shared->encoder;
+
+    if (!shared->key_frame_requested) {
+        shared->key_frame_requested = true;
+        encoder->request_key_frame(encoder);
+    }
+}
+
+static VideoEncoder *shared_subscriber_get_encoder(SharedEncoderSubscriber *sub)
+{
+    return sub->shared ? sub->shared->encoder : sub->private_encoder;
+}
+
+/* The shared encoder encodes the union of what its subscribers display */
+static void shared_encoder_update_visible_region(VideoSharedEncoder *shared)
+{
+    VideoEncoder *encoder = shared->encoder;
+    QRegion region;
+
+    if (!encoder->set_visible_region) {
+        return;
+    }
+    region_init(&region);
+    for (GList *l = shared->subscribers; l != nullptr; l = l->next) {
+        auto sub = static_cast<SharedEncoderSubscriber *>(l->data);
+
+        if (!sub->visible) {
+            region_destroy(&region);
+            encoder->set_visible_region(encoder, nullptr);
+            return;
+        }
+        for (uint32_t i = 0; i < sub->visible->num_rects; i++) {
+            region_add(&region, &sub->visible->rects[i]);
+        }
+    }
+
+    int n_rects = pixman_region32_n_rects(&region);
+    auto visible = static_cast<SpiceClipRects *>(
+        g_malloc(sizeof(SpiceClipRects) + n_rects * sizeof(SpiceRect)));
+    visible->num_rects = n_rects;
+    region_ret_rects(&region, visible->rects, n_rects);
+    encoder->set_visible_region(encoder, visible);
+    g_free(visible);
+    region_destroy(&region);
+}
+
+static void shared_subscriber_leave(SharedEncoderSubscriber *sub)
+{
+    VideoSharedEncoder *shared = sub->shared;
+
+    shared->subscribers = g_list_remove(shared->subscribers, sub);
+    shared->num_subscribers--;
+    sub->shared = nullptr;
+    if (shared->num_subscribers == 0) {
+        shared_encoder_free(shared);
+    } else {
+        shared_encoder_update_visible_region(shared);
+    }
+}
+
+/* The client cannot follow the shared stream, give it its own encoder
+ * which starts with a key frame and adapts to its bit rate. */
+static void shared_subscriber_use_private_encoder(SharedEncoderSubscriber *sub)
+{
+    VideoEncoder *encoder = sub->shared->encoder;
+    uint64_t bit_rate = encoder->get_bit_rate(encoder);
+
+    if (bit_rate == 0) {
+        bit_rate = sub->shared->starting_bit_rate;
+    }
+    spice_debug("client %p leaves the shared encoder", sub->client.opaque);
+    shared_subscriber_leave(sub);
+
+    sub->private_encoder = sub->client.create_encoder(sub->client.opaque, sub->base.codec_type,
+                                                      bit_rate, &sub->client.cbs);
+    if (sub->private_encoder && sub->private_encoder->set_visible_region) {
+        sub->private_encoder->set_visible_region(sub->private_encoder, sub->visible);
+    }
+}
+
+/* Passes the next frame of the shared stream to the subscriber */
+static VideoEncodeResults shared_subscriber_take_frame(SharedEncoderSubscriber *sub,
+                                                       SharedEncoderFrame *frame,
+                                                       VideoBuffer **outbuf)
+{
+    sub->next_seq = frame->seq + 1;
+    if (sub->waiting_key_frame) {
+        if (!frame->key_frame) {
+            /* the client could not decode it */
+            return VIDEO_ENCODER_FRAME_DROP;
+        }
+        sub->waiting_key_frame = false;
+    }
+    *outbuf = shared_video_buffer_ref(frame->buffer);
+    return VIDEO_ENCODER_FRAME_ENCODE_DONE;
+}
+
+static VideoEncodeResults shared_encoder_encode_frame(VideoSharedEncoder *shared,
+                                                      SharedEncoderSubscriber *sub,
+                                                      uint32_t frame_mm_time,
+                                                      const SpiceBitmap *bitmap,
+                                                      const SpiceRect *src, int top_down,
+                                                      gpointer bitmap_opaque,
+                                                      VideoBuffer **outbuf)
+{
+    VideoEncoder *encoder = shared->encoder;
+    VideoBuffer *buffer = nullptr;
+    VideoEncodeResults ret;
+    bool key_frame = false;
+
+    ret = encoder->encode_frame(encoder, frame_mm_time, bitmap, src, top_down,
+                                bitmap_opaque, &buffer);
+    if (ret == VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+        key_frame = video_is_key_frame(encoder->codec_type,
+                                       static_cast<const uint8_t *>(buffer->data), buffer->size);
+        if (key_frame) {
+            shared->key_frame_requested = false;
+        }
+    }
+    if (shared->num_subscribers == 1 && !sub->waiting_key_frame) {
+        /* nobody else needs the frame */
+        if (ret == VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+            sub->next_seq = ++shared->seq;
+            *outbuf = buffer;
+        }
+        return ret;
+    }
+
+    SharedEncoderFrame *frame = &shared->frames[shared->next_frame];
+    shared->next_frame = (shared->next_frame + 1) % SHARED_ENCODER_MAX_FRAMES;
+    shared_encoder_release_frame(shared, frame);
+    shared->bitmap_ref(bitmap_opaque);
+    frame->bitmap_opaque = bitmap_opaque;
+    frame->result = ret;
+    frame->key_frame = key_frame;
+    frame->pending = shared->num_subscribers - 1;
+    if (ret == VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+        frame->seq = shared->seq++;
+        frame->buffer = shared_video_buffer_new(buffer);
+        ret = shared_subscriber_take_frame(sub, frame, outbuf);
+    }
+    if (frame->pending <= 0) {
+        shared_encoder_release_frame(shared, frame);
+    }
+    return ret;
+}
+
+static VideoEncodeResults shared_subscriber_encode_frame(VideoEncoder *video_encoder,
+                                                         uint32_t frame_mm_time,
+                                                         const SpiceBitmap *bitmap,
+                                                         const SpiceRect *src, int top_down,
+                                                         gpointer bitmap_opaque,
+                                                         VideoBuffer **outbuf)
+{
+    SharedEncoderSubscriber *sub = SPICE_CONTAINEROF(video_encoder, SharedEncoderSubscriber, base);
+    VideoSharedEncoder *shared = sub->shared;
+
+    if (shared) {
+        /* any frame of an intra frame codec can be decoded on its own */
+        bool intra_only = shared->encoder->request_key_frame == nullptr;
+        SharedEncoderFrame *frame = shared_encoder_find_frame(shared, bitmap_opaque);
+
+        if (frame && frame->result == VIDEO_ENCODER_FRAME_ENCODE_DONE && !intra_only &&
+            frame->seq < sub->next_seq) {
+            /* encoded before the client joined */
+            return VIDEO_ENCODER_FRAME_DROP;
+        }
+        if (frame && (frame->result != VIDEO_ENCODER_FRAME_ENCODE_DONE || intra_only ||
+                      frame->seq == sub->next_seq)) {
+            VideoEncodeResults ret = frame->result;
+
+            if (ret == VIDEO_ENCODER_FRAME_ENCODE_DONE) {
+                ret = shared_subscriber_take_frame(sub, frame, outbuf);
+            }
+            if (--frame->pending <= 0) {
+                shared_encoder_release_frame(shared, frame);
+            }
+            return ret;
+        }
+        if (!frame && (intra_only || sub->next_seq == shared->seq)) {
+            return shared_encoder_encode_frame(shared, sub, frame_mm_time, bitmap, src,
+                                               top_down, bitmap_opaque, outbuf);
+        }
+        /* the client missed a frame the others got */
+        shared_subscriber_use_private_encoder(sub);
+    }
+
+    if (!sub->private_encoder) {
+        return VIDEO_ENCODER_FRAME_UNSUPPORTED;
+    }
+    return sub->private_encoder->encode_frame(sub->private_encoder, frame_mm_time, bitmap,
+                                              src, top_down, bitmap_opaque, outbuf);
+}
+
+static void shared_subscriber_client_stream_report(VideoEncoder *video_encoder,
+                                                   uint32_t num_frames, uint32_t num_drops,
+                                                   uint32_t start_frame_mm_time,
+                                                   uint32_t end_frame_mm_time,
+                                                   int32_t end_frame_delay,
+                                                   uint32_t audio_delay)
+{
+    SharedEncoderSubscriber *sub = SPICE_CONTAINEROF(video_encoder, SharedEncoderSubscriber, base);
+
+    if (sub->shared && sub->shared->num_subscribers > 1 && num_drops > 0) {
+        /* the report refers to the frames of the shared encoder so it is
+         * not passed on to the new one */
+        shared_subscriber_use_private_encoder(sub);
+        return;
+    }
+    VideoEncoder *encoder = shared_subscriber_get_encoder(sub);
+    if (encoder) {
+        encoder->client_stream_report(encoder, num_frames, num_drops,
+                                      start_frame_mm_time, end_frame_mm_time,
+                                      end_frame_delay, audio_delay);
+    }
+}
+
+static void shared_subscriber_notify_server_frame_drop(VideoEncoder *video_encoder)
+{
+    SharedEncoderSubscriber *sub = SPICE_CONTAINEROF(video_encoder, SharedEncoderSubscriber, base);
+
+    if (sub->shared && sub->shared->num_subscribers > 1) {
+        shared_subscriber_use_private_encoder(sub);
+        return;
+    }
+    VideoEncoder *encoder = shared_subscriber_get_encoder(sub);
+    if (encoder) {
+        encoder->notify_server_frame_drop(encoder);
+    }
+}
+
+static uint64_t shared_subscriber_get_bit_rate(VideoEncoder *video_encoder)
+{
+    SharedEncoderSubscriber *sub = SPICE_CONTAINEROF(video_encoder, SharedEncoderSubscriber, base);
+    VideoEncoder *encoder = shared_subscriber_get_encoder(sub);
+
+    return encoder ? encoder->get_bit_rate(encoder) : 0;
+}
+
+static void shared_subscriber_get_stats(VideoEncoder *video_encoder, VideoEncoderStats *stats)
+{
+    SharedEncoderSubscriber *sub = SPICE_CONTAINEROF(video_encoder, SharedEncoderSubscriber, base);
+    VideoEncoder *encoder = shared_subscriber_get_encoder(sub);
+
+    if (encoder) {
+        encoder->get_stats(encoder, stats);
+    }
+}
+
+static void shared_subscriber_request_key_frame(VideoEncoder *video_encoder)
+{
+    SharedEncoderSubscriber *sub = SPICE_CONTAINEROF(video_encoder, SharedEncoderSubscriber, base);
+
+    if (sub->shared) {
+        shared_encoder_request_key_frame(sub->shared);
+    } else if (sub->private_encoder && sub->private_encoder->request_key_frame) {
+        sub->private_encoder->request_key_frame(sub->private_encoder);
+    }
+}
+
+static void shared_subscriber_set_visible_region(VideoEncoder *video_encoder,
+                                                 const SpiceClipRects *visible)
+{
+    SharedEncoderSubscriber *sub = SPICE_CONTAINEROF(video_encoder, SharedEncoderSubscriber, base);
+
+    g_free(sub->visible);
+    sub->visible = visible ? static_cast<SpiceClipRects *>(
+        g_memdup2(visible, sizeof(SpiceClipRects) + visible->num_rects * sizeof(SpiceRect))) :
+        nullptr;
+    if (sub->shared) {
+        shared_encoder_update_visible_region(sub->shared);
+    } else if (sub->private_encoder && sub->private_encoder->set_visible_region) {
+        sub->private_encoder->set_visible_region(sub->private_encoder, visible);
+    }
+}
+
+static void shared_subscriber_destroy(VideoEncoder *video_encoder)
+{
+    SharedEncoderSubscriber *sub = SPICE_CONTAINEROF(video_encoder, SharedEncoderSubscriber, base);
+
+    if (sub->shared) {
+        shared_subscriber_leave(sub);
+    }
+    if (sub->private_encoder) {
+        sub->private_encoder->destroy(sub->private_encoder);
+    }
+    g_free(sub->visible);
+    g_free(sub);
+}
+
+/* Creates the shared encoder with @sub as its first subscriber */
+static VideoSharedEncoder *shared_encoder_new(VideoSharedEncoder **owner,
+                                              SharedEncoderSubscriber *sub,
+                                              uint64_t starting_bit_rate,
+                                              bitmap_ref_t bitmap_ref,
+                                              bitmap_unref_t bitmap_unref)
+{
+    auto shared = g_new0(VideoSharedEncoder, 1);
+    VideoEncoderRateControlCbs cbs;
+
+    shared->owner = owner;
+    shared->starting_bit_rate = starting_bit_rate;
+    shared->bitmap_ref = bitmap_ref;
+    shared->bitmap_unref = bitmap_unref;
+    /* the encoder may query the rate control callbacks right away */
+    shared->subscribers = g_list_prepend(shared->subscribers, sub);
+    shared->num_subscribers = 1;
+    sub->shared = shared;
+
+    cbs.opaque = shared;
+    cbs.get_roundtrip_ms = shared_encoder_get_roundtrip_ms;
+    cbs.get_source_fps = shared_encoder_get_source_fps;
+    cbs.update_client_playback_delay = shared_encoder_update_client_playback_delay;
+    cbs.get_link_bit_rate = shared_encoder_get_link_bit_rate;
+    shared->encoder = sub->client.create_encoder(sub->client.opaque, SpiceVideoCodecType(0),
+                                                 starting_bit_rate, &cbs);
+    if (!shared->encoder) {
+        shared_subscriber_leave(sub);
+        return nullptr;
+    }
+    *owner = shared;
+    return shared;
+}
+
+VideoEncoder *video_shared_encoder_subscribe(VideoSharedEncoder **owner,
+                                             const VideoSharedEncoderClient *client,
+                                             uint64_t bit_rate,
+                                             bitmap_ref_t bitmap_ref,
+                                             bitmap_unref_t bitmap_unref)
+{
+    VideoSharedEncoder *shared = *owner;
+
+    if (shared && !shared_encoder_can_join(shared, client, bit_rate)) {
+        VideoEncoderRateControlCbs cbs = client->cbs;
+
+        return client->create_encoder(client->opaque, SpiceVideoCodecType(0), bit_rate, &cbs);
+    }
+
+    auto sub = g_new0(SharedEncoderSubscriber, 1);
+    sub->client = *client;
+    if (!shared) {
+        shared = shared_encoder_new(owner, sub, bit_rate, bitmap_ref, bitmap_unref);
+        if (!shared) {
+            g_free(sub);
+            return nullptr;
+        }
+    } else {
+        sub->shared = shared;
+        shared->subscribers = g_list_prepend(shared->subscribers, sub);
+        shared->num_subscribers++;
+        /* the client can only decode the stream from a key frame on */
+        if (shared->seq > 0 && shared->encoder->request_key_frame) {
+            sub->waiting_key_frame = true;
+            shared_encoder_request_key_frame(shared);
+        }
+    }
+
+    VideoEncoder *encoder = shared->encoder;
+    sub->base.destroy = shared_subscriber_destroy;
+    sub->base.encode_frame = shared_subscriber_encode_frame;
+    sub->base.client_stream_report = shared_subscriber_client_stream_report;
+    sub->base.notify_server_frame_drop = shared_subscriber_notify_server_frame_drop;
+    sub->base.get_bit_rate = shared_subscriber_get_bit_rate;
+    sub->base.get_stats = shared_subscriber_get_stats;
+    sub->base.request_key_frame = encoder->request_key_frame ?
+                                  shared_subscriber_request_key_frame : nullptr;
+    sub->base.set_visible_region = shared_subscriber_set_visible_region;
+    sub->base.codec_type = encoder->codec_type;
+    sub->next_seq = shared->seq;
+    /* the new client may display parts the others do not */
+    shared_encoder_update_visible_region(shared);
+    return &sub->base;
+}
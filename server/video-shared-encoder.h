@@ -0,0 +1,71 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VIDEO_SHARED_ENCODER_H_
+#define VIDEO_SHARED_ENCODER_H_
+
+#include "video-encoder.h"
+
+#include "push-visibility.h"
+
+/* An encoder shared by the clients receiving a stream at a similar bit
+ * rate, so each frame is only encoded once.
+ */
+struct VideoSharedEncoder;
+
+/* Creates an encoder for the client, for @codec_type or, if it is 0, for
+ * the codec the client prefers. */
+typedef VideoEncoder *(*video_shared_encoder_create_proc)(void *opaque,
+                                                         SpiceVideoCodecType codec_type,
+                                                         uint64_t starting_bit_rate,
+                                                         VideoEncoderRateControlCbs *cbs);
+
+/* Whether the client can decode a stream encoded with @codec_type */
+typedef bool (*video_shared_encoder_supports_proc)(void *opaque,
+                                                   SpiceVideoCodecType codec_type);
+
+struct VideoSharedEncoderClient {
+    void *opaque;
+    video_shared_encoder_create_proc create_encoder;
+    video_shared_encoder_supports_proc supports_codec;
+    /* The rate control callbacks of the client alone, the shared encoder
+     * combines those of all its clients. */
+    VideoEncoderRateControlCbs cbs;
+};
+
+/* Returns the encoder of a client starting to receive a stream.
+ *
+ * The client subscribes to *@shared if it supports its codec and its bit
+ * rate is close enough, *@shared being created if it is nullptr. Otherwise
+ * the client gets its own encoder. Either way the returned encoder is
+ * destroyed as usual, *@shared is freed and reset to nullptr once its last
+ * subscriber is destroyed.
+ *
+ * The frames are identified by the bitmap_opaque passed to encode_frame(),
+ * @bitmap_ref and @bitmap_unref keep the recent ones for the subscribers
+ * which did not send them yet.
+ */
+VideoEncoder *video_shared_encoder_subscribe(VideoSharedEncoder **shared,
+                                             const VideoSharedEncoderClient *client,
+                                             uint64_t bit_rate,
+                                             bitmap_ref_t bitmap_ref,
+                                             bitmap_unref_t bitmap_unref);
+
+#include "pop-visibility.h"
+
+#endif /* VIDEO_SHARED_ENCODER_H_ */
@@ -16,10 +16,12 @@
 */
 #include <config.h>
 
+#include "glib-compat.h"
 #include "video-stream.h"
 #include "display-channel-private.h"
 #include "main-channel-client.h"
 #include "red-client.h"
+#include "video-shared-encoder.h"
 
 #define FPS_TEST_INTERVAL 1
 #define FOREACH_STREAMS(display, item)                  \
@@ -28,6 +30,56 @@
 static void video_stream_unref(DisplayChannel *display, VideoStream *stream);
 static void video_stream_agent_unref(DisplayChannel *display, VideoStreamAgent *agent);
 
+static void video_stream_agent_init_stat(VideoStreamAgent *agent, int stream_id)
+{
+    DisplayChannel *display = DCC_TO_DC(agent->dcc);
+    RedsState *reds = display->get_server();
+    VideoStreamAgentStat *stat = &agent->stat;
+    char name[SPICE_STAT_NODE_NAME_MAX];
+
+    /* a new stream may reuse the id before the old one is destroyed */
+    video_stream_agent_remove_stat(agent);
+
+    /* each client has its own agent for the stream */
+    snprintf(name, sizeof(name), "stream[%d:%u]", stream_id,
+             display->priv->stream_stat_serial++ % 100000000);
+    stat_init_node(&stat->node, reds, display->get_stat_node(), name, TRUE);
+#ifdef RED_STATISTICS
+    if (stat->node.ref == INVALID_STAT_REF) {
+        /* the stat file is full, don't add the counters at the top level */
+        return;
+    }
+#endif
+    stat_init_counter(&stat->frames_in, reds, &stat->node, "frames_in", TRUE);
+    stat_init_counter(&stat->frames_encoded, reds, &stat->node, "frames_encoded", TRUE);
+    stat_init_counter(&stat->server_drops, reds, &stat->node, "server_drops", TRUE);
+    stat_init_counter(&stat->client_drops, reds, &stat->node, "client_drops", TRUE);
+    stat_init_counter(&stat->encode_time_us, reds, &stat->node, "encode_time_us", TRUE);
+    stat_init_counter(&stat->bytes_sent, reds, &stat->node, "bytes_sent", TRUE);
+    stat_init_counter(&stat->playback_delay_ms, reds, &stat->node, "playback_delay_ms", TRUE);
+    agent->has_stat = true;
+}
+
+void video_stream_agent_remove_stat(VideoStreamAgent *agent)
+{
+    if (!agent->has_stat) {
+        return;
+    }
+
+    RedsState *reds = DCC_TO_DC(agent->dcc)->get_server();
+    VideoStreamAgentStat *stat = &agent->stat;
+
+    stat_remove_counter(reds, &stat->frames_in);
+    stat_remove_counter(reds, &stat->frames_encoded);
+    stat_remove_counter(reds, &stat->server_drops);
+    stat_remove_counter(reds, &stat->client_drops);
+    stat_remove_counter(reds, &stat->encode_time_us);
+    stat_remove_counter(reds, &stat->bytes_sent);
+    stat_remove_counter(reds, &stat->playback_delay_ms);
+    stat_remove_node(reds, &stat->node);
+    agent->has_stat = false;
+}
+
 static void video_stream_agent_stats_print(VideoStreamAgent *agent)
 {
 #ifdef STREAM_STATS
@@ -43,7 +95,8 @@ static void video_stream_agent_stats_print(VideoStreamAgent *agent)
                 "#out-frames=%" PRIu64 " out/in=%.2f #drops=%" PRIu64 " (#pipe=%" PRIu64 " "
                 "#fps=%" PRIu64 ") out-avg-fps=%.2f passed-mm-time(sec)=%.2f "
                 "size-total(MB)=%.2f size-per-sec(Mbps)=%.2f size-per-frame(KBpf)=%.2f "
-                "avg-quality=%.2f start-bit-rate(Mbps)=%.2f end-bit-rate(Mbps)=%.2f",
+                "avg-quality=%.2f start-bit-rate(Mbps)=%.2f end-bit-rate(Mbps)=%.2f "
+                "copy-per-frame(KBpf)=%.2f #buffer-allocs=%" PRIu64,
                 agent, agent->stream->width, agent->stream->height,
                 stats->num_input_frames,
                 stats->num_input_frames / passed_mm_time,
@@ -60,7 +113,9 @@ static void video_stream_agent_stats_print(VideoStreamAgent *agent)
                 stats->size_sent / 1000.0 / stats->num_frames_sent,
                 encoder_stats.avg_quality,
                 encoder_stats.starting_bit_rate / (1024.0 * 1024),
-                encoder_stats.cur_bit_rate / (1024.0 * 1024));
+                encoder_stats.cur_bit_rate / (1024.0 * 1024),
+                encoder_stats.avg_copy_size / 1000.0,
+                encoder_stats.num_buffer_allocs);
 #endif
 }
 
@@ -304,6 +359,7 @@ static void attach_stream(DisplayChannel *display, Drawable *drawable, VideoStre
             dcc_video_stream_agent_clip(dcc, agent);
         }
         region_destroy(&clip_in_draw_dest);
+        stat_inc_counter(agent->stat.frames_in, 1);
 #ifdef STREAM_STATS
         agent->stats.num_input_frames++;
 #endif
@@ -345,6 +401,7 @@ static void before_reattach_stream(DisplayChannel *display,
         agent = dcc_get_video_stream_agent(dcc, index);
 
         if (dcc->pipe_item_is_linked(dpi)) {
+            stat_inc_counter(agent->stat.server_drops, 1);
 #ifdef STREAM_STATS
             agent->stats.num_drops_pipe++;
 #endif
@@ -403,6 +460,7 @@ static void display_channel_create_stream(DisplayChannel *display, Drawable *dra
     }
     stream->num_input_frames = 0;
     stream->input_fps_start_time = drawable->creation_time;
+    stream->shared_encoder = nullptr;
     display->priv->streams_size_total += stream->width * stream->height;
     display->priv->stream_count++;
     FOREACH_DCC(display, dcc) {
@@ -667,6 +725,14 @@ static uint32_t get_source_fps(void *opaque)
     return agent->stream->input_fps;
 }
 
+static uint64_t get_link_bit_rate(void *opaque)
+{
+    auto agent = static_cast<VideoStreamAgent *>(opaque);
+    MainChannelClient *mcc = agent->dcc->get_client()->get_main();
+
+    return mcc->is_network_info_initialized() ? mcc->get_bitrate_per_sec() : 0;
+}
+
 static void update_client_playback_delay(void *opaque, uint32_t delay_ms)
 {
     auto agent = static_cast<VideoStreamAgent *>(opaque);
@@ -677,6 +743,7 @@ static void update_client_playback_delay(void *opaque, uint32_t delay_ms)
     dcc_update_streams_max_latency(dcc, agent);
 
     agent->client_required_latency = delay_ms;
+    stat_set_counter(agent->stat.playback_delay_ms, delay_ms);
     if (delay_ms > dcc_get_max_stream_latency(dcc)) {
         dcc_set_max_stream_latency(dcc, delay_ms);
     }
@@ -734,6 +801,98 @@ static VideoEncoder* dcc_create_video_encoder(DisplayChannelClient *dcc,
     return nullptr;
 }
 
+static void video_stream_agent_init_rate_control_cbs(VideoStreamAgent *agent,
+                                                     VideoEncoderRateControlCbs *cbs)
+{
+    cbs->opaque = agent;
+    cbs->get_roundtrip_ms = get_roundtrip_ms;
+    cbs->get_source_fps = get_source_fps;
+    cbs->update_client_playback_delay = update_client_playback_delay;
+    cbs->get_link_bit_rate = get_link_bit_rate;
+}
+
+/* Whether the client can decode a stream encoded with codec_type */
+static bool dcc_supports_video_codec(DisplayChannelClient *dcc, SpiceVideoCodecType codec_type)
+{
+    GArray *video_codecs;
+    int i;
+
+    if (!dcc->test_remote_cap(SPICE_DISPLAY_CAP_MULTI_CODEC)) {
+        /* Old clients only support MJPEG */
+        return codec_type == SPICE_VIDEO_CODEC_TYPE_MJPEG;
+    }
+    video_codecs = dcc_get_preferred_video_codecs_for_encoding(dcc);
+    for (i = 0; i < video_codecs->len; i++) {
+        RedVideoCodec* video_codec = &g_array_index (video_codecs, RedVideoCodec, i);
+
+        if (video_codec->type == codec_type && dcc->test_remote_cap(video_codec->cap)) {
+            return true;
+        }
+    }
+    return codec_type == SPICE_VIDEO_CODEC_TYPE_MJPEG &&
+           dcc->test_remote_cap(SPICE_DISPLAY_CAP_CODEC_MJPEG);
+}
+
+/* Like dcc_create_video_encoder() but for a codec the client is known to support */
+static VideoEncoder* dcc_create_video_encoder_for_codec(DisplayChannelClient *dcc,
+                                                        SpiceVideoCodecType codec_type,
+                                                        uint64_t starting_bit_rate,
+                                                        VideoEncoderRateControlCbs *cbs)
+{
+    GArray *video_codecs;
+    int i;
+
+    video_codecs = dcc_get_preferred_video_codecs_for_encoding(dcc);
+    for (i = 0; i < video_codecs->len; i++) {
+        RedVideoCodec* video_codec = &g_array_index (video_codecs, RedVideoCodec, i);
+
+        if (video_codec->type != codec_type) {
+            continue;
+        }
+        VideoEncoder* video_encoder = video_codec->create(video_codec->type, starting_bit_rate, cbs, bitmap_ref, bitmap_unref);
+        if (video_encoder) {
+            return video_encoder;
+        }
+    }
+    if (codec_type == SPICE_VIDEO_CODEC_TYPE_MJPEG) {
+        return mjpeg_encoder_new(SPICE_VIDEO_CODEC_TYPE_MJPEG, starting_bit_rate, cbs, bitmap_ref, bitmap_unref);
+    }
+    return nullptr;
+}
+
+static VideoEncoder *dcc_create_client_video_encoder(void *opaque,
+                                                     SpiceVideoCodecType codec_type,
+                                                     uint64_t starting_bit_rate,
+                                                     VideoEncoderRateControlCbs *cbs)
+{
+    auto dcc = static_cast<DisplayChannelClient *>(opaque);
+
+    if (!codec_type) {
+        return dcc_create_video_encoder(dcc, starting_bit_rate, cbs);
+    }
+    return dcc_create_video_encoder_for_codec(dcc, codec_type, starting_bit_rate, cbs);
+}
+
+static bool dcc_client_supports_video_codec(void *opaque, SpiceVideoCodecType codec_type)
+{
+    return dcc_supports_video_codec(static_cast<DisplayChannelClient *>(opaque), codec_type);
+}
+
+/* A helper for dcc_create_stream(). The clients receiving the stream at a
+ * similar bit rate share a single encoder. */
+static VideoEncoder *video_stream_agent_create_encoder(VideoStreamAgent *agent,
+                                                       uint64_t bit_rate)
+{
+    VideoSharedEncoderClient client;
+
+    client.opaque = agent->dcc;
+    client.create_encoder = dcc_create_client_video_encoder;
+    client.supports_codec = dcc_client_supports_video_codec;
+    video_stream_agent_init_rate_control_cbs(agent, &client.cbs);
+    return video_shared_encoder_subscribe(&agent->stream->shared_encoder, &client, bit_rate,
+                                          bitmap_ref, bitmap_unref);
+}
+
 void dcc_create_stream(DisplayChannelClient *dcc, VideoStream *stream)
 {
     int stream_id = display_channel_get_video_stream_id(DCC_TO_DC(dcc), stream);
@@ -746,15 +905,10 @@ void dcc_create_stream(DisplayChannelClient *dcc, VideoStream *stream)
         region_clone(&agent->clip, &agent->vis_region);
     }
     agent->dcc = dcc;
-
-    VideoEncoderRateControlCbs video_cbs;
-    video_cbs.opaque = agent;
-    video_cbs.get_roundtrip_ms = get_roundtrip_ms;
-    video_cbs.get_source_fps = get_source_fps;
-    video_cbs.update_client_playback_delay = update_client_playback_delay;
+    video_stream_agent_init_stat(agent, stream_id);
 
     uint64_t initial_bit_rate = get_initial_bit_rate(dcc, stream);
-    agent->video_encoder = dcc_create_video_encoder(dcc, initial_bit_rate, &video_cbs);
+    agent->video_encoder = video_stream_agent_create_encoder(agent, initial_bit_rate);
     dcc->pipe_add(video_stream_create_item_new(agent));
 
     if (dcc->test_remote_cap(SPICE_DISPLAY_CAP_STREAM_REPORT)) {
@@ -773,6 +927,61 @@ void dcc_create_stream(DisplayChannelClient *dcc, VideoStream *stream)
 #endif
 }
 
+/* Tells the video encoder which part of the stream the client displays,
+ * @clip being in surface coordinates like in the STREAM_CLIP messages, or
+ * nullptr if the stream is not clipped.
+ */
+void video_stream_agent_update_visible_region(VideoStreamAgent *agent,
+                                              const SpiceClipRects *clip)
+{
+    VideoEncoder *encoder = agent->video_encoder;
+    VideoStream *stream = agent->stream;
+    const SpiceRect *dest = &stream->dest_area;
+    const int64_t dest_width = dest->right - dest->left;
+    const int64_t dest_height = dest->bottom - dest->top;
+
+    if (!encoder || !encoder->set_visible_region || dest_width <= 0 || dest_height <= 0) {
+        return;
+    }
+    if (!clip) {
+        encoder->set_visible_region(encoder, nullptr);
+        return;
+    }
+    for (uint32_t i = 0; i < clip->num_rects; i++) {
+        const SpiceRect *rect = &clip->rects[i];
+        if (rect->left <= dest->left && rect->top <= dest->top &&
+            rect->right >= dest->right && rect->bottom >= dest->bottom) {
+            encoder->set_visible_region(encoder, nullptr);
+            return;
+        }
+    }
+
+    /* The frames may be scaled to the destination area, round outwards to
+     * keep all the frame pixels contributing to the visible ones.
+     */
+    auto visible = static_cast<SpiceClipRects *>(
+        g_malloc(sizeof(SpiceClipRects) + clip->num_rects * sizeof(SpiceRect)));
+    visible->num_rects = 0;
+    for (uint32_t i = 0; i < clip->num_rects; i++) {
+        const SpiceRect *rect = &clip->rects[i];
+        int64_t left = MAX(rect->left, dest->left) - dest->left;
+        int64_t top = MAX(rect->top, dest->top) - dest->top;
+        int64_t right = MIN(rect->right, dest->right) - dest->left;
+        int64_t bottom = MIN(rect->bottom, dest->bottom) - dest->top;
+
+        if (left >= right || top >= bottom) {
+            continue;
+        }
+        SpiceRect *frame_rect = &visible->rects[visible->num_rects++];
+        frame_rect->left = left * stream->width / dest_width;
+        frame_rect->top = top * stream->height / dest_height;
+        frame_rect->right = (right * stream->width + dest_width - 1) / dest_width;
+        frame_rect->bottom = (bottom * stream->height + dest_height - 1) / dest_height;
+    }
+    encoder->set_visible_region(encoder, visible);
+    g_free(visible);
+}
+
 void video_stream_agent_stop(VideoStreamAgent *agent)
 {
     DisplayChannelClient *dcc = agent->dcc;
@@ -782,6 +991,7 @@ void video_stream_agent_stop(VideoStreamAgent *agent)
         agent->video_encoder->destroy(agent->video_encoder);
         agent->video_encoder = nullptr;
     }
+    video_stream_agent_remove_stat(agent);
 }
 
 RedUpgradeItem::~RedUpgradeItem()
@@ -46,6 +46,7 @@
 #define MAX_FPS 30
 
 struct VideoStream;
+struct VideoSharedEncoder;
 
 #ifdef STREAM_STATS
 struct StreamStats {
@@ -60,6 +61,25 @@ struct StreamStats {
 };
 #endif
 
+/* The live statistics of a stream agent, exported in the stat file so the
+ * playback of each client can be followed while it happens.
+ * NUM_STREAM_STAT_NODES must be updated when a counter is added.
+ */
+struct VideoStreamAgentStat {
+    RedStatNode node;
+    RedStatCounter frames_in;
+    RedStatCounter frames_encoded;
+    /* frames dropped because the pipe is full or by the rate control */
+    RedStatCounter server_drops;
+    /* frames the client reported as arriving too late */
+    RedStatCounter client_drops;
+    /* the time spent encoding and the size of the encoded frames, divided
+     * by frames_encoded they give the averages */
+    RedStatCounter encode_time_us;
+    RedStatCounter bytes_sent;
+    RedStatCounter playback_delay_ms;
+};
+
 struct VideoStreamAgent {
     QRegion vis_region; /* the part of the surface area that is currently occupied by video
                            fragments */
@@ -79,6 +99,8 @@ struct VideoStreamAgent {
 #ifdef STREAM_STATS
     StreamStats stats;
 #endif
+    bool has_stat;
+    VideoStreamAgentStat stat;
 };
 
 struct VideoStreamClipItem: public RedPipeItem {
@@ -121,6 +143,10 @@ struct VideoStream {
     uint32_t num_input_frames;
     uint64_t input_fps_start_time;
     uint32_t input_fps;
+
+    /* the encoder shared by the clients receiving the stream at a
+     * similar bit rate, nullptr if there is none */
+    VideoSharedEncoder *shared_encoder;
 };
 
 void display_channel_init_video_streams(DisplayChannel *display);
@@ -136,6 +162,9 @@ void video_stream_detach_behind(DisplayChannel *display, QRegion *region,
 GArray *video_stream_parse_preferred_codecs(SpiceMsgcDisplayPreferredVideoCodecType *msg);
 
 void video_stream_agent_stop(VideoStreamAgent *agent);
+void video_stream_agent_remove_stat(VideoStreamAgent *agent);
+void video_stream_agent_update_visible_region(VideoStreamAgent *agent,
+                                              const SpiceClipRects *clip);
 
 void video_stream_detach_drawable(VideoStream *stream);
 
@@ -0,0 +1,98 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+#include <config.h>
+
+#include <stdlib.h>
+
+#include "glib-compat.h"
+#include "red-common.h"
+#include "video-visible-region.h"
+
+static int compare_rect_left(const void *a, const void *b)
+{
+    const SpiceRect *rect_a = (const SpiceRect *)a;
+    const SpiceRect *rect_b = (const SpiceRect *)b;
+
+    return (rect_a->left > rect_b->left) - (rect_a->left < rect_b->left);
+}
+
+void video_visible_region_set(VideoVisibleRegion *region, const SpiceClipRects *visible)
+{
+    video_visible_region_clear(region);
+    if (!visible) {
+        return;
+    }
+
+    region->clipped = true;
+    region->num_rects = visible->num_rects;
+    region->rects = (SpiceRect *)g_memdup2(visible->rects,
+                                           visible->num_rects * sizeof(SpiceRect));
+    qsort(region->rects, region->num_rects, sizeof(SpiceRect), compare_rect_left);
+}
+
+void video_visible_region_clear(VideoVisibleRegion *region)
+{
+    g_free(region->rects);
+    region->rects = NULL;
+    region->num_rects = 0;
+    region->clipped = false;
+}
+
+bool video_visible_region_next_span(const VideoVisibleRegion *region, uint32_t y,
+                                    uint32_t width, uint32_t *x, uint32_t *end)
+{
+    const int64_t line = y;
+    uint32_t i;
+
+    if (!region->clipped) {
+        *end = width;
+        return *x < width;
+    }
+
+    /* The rectangles are sorted by their left coordinate so the first one
+     * on the line that ends after x starts the span, and the following ones
+     * can only extend it.
+     */
+    for (i = 0; i < region->num_rects; i++) {
+        const SpiceRect *rect = &region->rects[i];
+        if (line >= rect->top && line < rect->bottom && rect->right > (int64_t)*x) {
+            break;
+        }
+    }
+    if (i == region->num_rects) {
+        return false;
+    }
+
+    int64_t start = MAX(region->rects[i].left, (int64_t)*x);
+    int64_t stop = region->rects[i].right;
+    for (i++; i < region->num_rects && region->rects[i].left <= stop; i++) {
+        const SpiceRect *rect = &region->rects[i];
+        if (line >= rect->top && line < rect->bottom) {
+            stop = MAX(stop, rect->right);
+        }
+    }
+
+    start = MAX(start, 0);
+    stop = MIN(stop, (int64_t)width);
+    if (start >= stop) {
+        return false;
+    }
+    *x = start;
+    *end = stop;
+    return true;
+}
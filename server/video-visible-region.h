@@ -0,0 +1,56 @@
+/* -*- Mode: C; c-basic-offset: 4; indent-tabs-mode: nil -*- */
+/*
+   Copyright (C) 2024 Red Hat, Inc.
+
+   This library is free software; you can redistribute it and/or
+   modify it under the terms of the GNU Lesser General Public
+   License as published by the Free Software Foundation; either
+   version 2.1 of the License, or (at your option) any later version.
+
+   This library is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+   Lesser General Public License for more details.
+
+   You should have received a copy of the GNU Lesser General Public
+   License along with this library; if not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef VIDEO_VISIBLE_REGION_H_
+#define VIDEO_VISIBLE_REGION_H_
+
+#include <stdbool.h>
+#include <inttypes.h>
+#include <common/draw.h>
+
+SPICE_BEGIN_DECLS
+
+/* The part of the frames the client displays, in frame coordinates with
+ * the origin at the top left corner of the picture.
+ * See VideoEncoder.set_visible_region().
+ */
+typedef struct VideoVisibleRegion {
+    /* False if the whole frames are visible */
+    bool clipped;
+    uint32_t num_rects;
+    /* Sorted by their left coordinate */
+    SpiceRect *rects;
+} VideoVisibleRegion;
+
+/* Copies @visible, NULL meaning that the whole frames are visible */
+void video_visible_region_set(VideoVisibleRegion *region, const SpiceClipRects *visible);
+
+/* Frees the rectangles, making the whole frames visible */
+void video_visible_region_clear(VideoVisibleRegion *region);
+
+/* Finds the first visible span of line @y of a @width pixels wide frame
+ * that ends after *x.
+ * Returns false if there is none, otherwise the span goes from *x to
+ * *end, excluded.
+ */
+bool video_visible_region_next_span(const VideoVisibleRegion *region, uint32_t y,
+                                    uint32_t width, uint32_t *x, uint32_t *end);
+
+SPICE_END_DECLS
+
+#endif /* VIDEO_VISIBLE_REGION_H_ */
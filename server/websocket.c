@@ -31,6 +31,7 @@
 #endif
 
 #include <glib.h>
+#include <zlib.h>
 
 #include <common/log.h>
 #include <common/mem.h>
@@ -48,6 +49,7 @@
 
 #define FIN_FLAG        0x80
 #define RSV_MASK        0x70
+#define RSV1_FLAG       0x40
 #define TYPE_MASK       0x0F
 #define CONTROL_FRAME_MASK 0x8
 
@@ -68,6 +70,10 @@
 
 #define WEBSOCKET_MAX_HEADER_SIZE (1 + 9 + 4)
 
+/* permessage-deflate, see RFC 7692 */
+#define DEFLATE_TAIL "\x00\x00\xff\xff"
+#define DEFLATE_TAIL_LEN 4
+
 #define MAX_CONTROL_DATA 125
 #define CONTROL_HDR_LEN 2
 
@@ -85,10 +91,15 @@ typedef struct {
 
 typedef struct {
     uint8_t type, fin, unfinished;
+    /* the unfinished message is compressed */
+    bool unfinished_compressed;
     uint8_t header[WEBSOCKET_MAX_HEADER_SIZE];
     int header_pos;
     bool frame_ready:1;
     bool masked:1;
+    bool compressed:1;
+    /* end of the compressed message passed to the decompressor */
+    bool compressed_tail:1;
     uint8_t mask[4];
     uint64_t relayed;
     uint64_t expected_len;
@@ -106,6 +117,20 @@ struct RedsWebSocket {
     WebSocketControl pong;
     WebSocketControl pending_pong;
 
+    /* permessage-deflate extension state */
+    bool deflate_enabled;
+    /* reset the contexts after each message */
+    bool compress_no_context_takeover;
+    bool decompress_no_context_takeover;
+    z_stream compress_stream;
+    z_stream decompress_stream;
+    /* compressed frame being sent */
+    uint8_t *compressed;
+    size_t compressed_size;
+    size_t compressed_pos, compressed_len;
+    size_t compressed_input_len;
+    uint8_t decompress_buf[4096];
+
     void *raw_stream;
     websocket_read_cb_t raw_read;
     websocket_write_cb_t raw_write;
@@ -251,16 +276,19 @@ static char *generate_reply_key(char *buf)
 static void websocket_clear_frame(websocket_frame_t *frame)
 {
     uint8_t unfinished = frame->unfinished;
+    bool unfinished_compressed = frame->unfinished_compressed;
     memset(frame, 0, sizeof(*frame));
     frame->unfinished = unfinished;
+    frame->unfinished_compressed = unfinished_compressed;
 }
 
 /* Extract a frame header of data from a set of data transmitted by
     a WebSocket client. Returns success or error */
-static bool websocket_get_frame_header(websocket_frame_t *frame)
+static bool websocket_get_frame_header(websocket_frame_t *frame, bool deflate_enabled)
 {
     int fin;
     int used = 0;
+    bool compressed;
 
     if (frame_bytes_needed(frame) > 0) {
         return true;
@@ -268,10 +296,17 @@ static bool websocket_get_frame_header(websocket_frame_t *frame)
 
     fin = frame->fin = frame->header[0] & FIN_FLAG;
     frame->type = frame->header[0] & TYPE_MASK;
+    compressed = !!(frame->header[0] & RSV1_FLAG);
     used++;
 
-    // reserved bits are not expected
-    if (frame->header[0] & RSV_MASK) {
+    // reserved bits are not expected, beside RSV1 marking
+    // compressed messages if permessage-deflate is enabled
+    if (frame->header[0] & (deflate_enabled ? RSV_MASK & ~RSV1_FLAG : RSV_MASK)) {
+        return false;
+    }
+    // only the first frame of a data message can be marked as compressed
+    if (compressed &&
+        (frame->type == CONTINUATION_FRAME || (frame->type & CONTROL_FRAME_MASK) != 0)) {
         return false;
     }
     // control commands cannot be split
@@ -293,10 +328,13 @@ static bool websocket_get_frame_header(websocket_frame_t *frame)
                 return false;
             }
             frame->type = frame->unfinished;
+            compressed = frame->unfinished_compressed;
         } else if (frame->unfinished) {
             return false;
         }
         frame->unfinished = fin ? 0 : frame->type;
+        frame->unfinished_compressed = fin ? false : compressed;
+        frame->compressed = compressed;
     }
 
     frame->expected_len = extract_length(frame->header + used, &used);
@@ -316,14 +354,108 @@ static bool websocket_get_frame_header(websocket_frame_t *frame)
     return true;
 }
 
+/* Unmask the data received from the client.
+ * Most of the data are processed a word at a time, the loop
+ * is simple enough to be vectorized by the compiler. */
 static void relay_data(uint8_t* buf, size_t size, websocket_frame_t *frame)
 {
-    if (frame->masked) {
-        size_t i;
-        for (i = 0; i < size; i++) {
-            *buf++ ^= frame->mask[(frame->relayed + i) % 4];
+    unsigned pos;
+    uint64_t mask;
+    uint8_t mask_bytes[8];
+    unsigned i;
+
+    if (!frame->masked) {
+        return;
+    }
+
+    pos = frame->relayed % 4;
+
+    /* align the buffer */
+    for (; size > 0 && ((uintptr_t) buf % sizeof(mask)) != 0; size--) {
+        *buf++ ^= frame->mask[pos++ % 4];
+    }
+
+    if (size >= sizeof(mask)) {
+        /* mask rotated to start at current position */
+        for (i = 0; i < sizeof(mask_bytes); i++) {
+            mask_bytes[i] = frame->mask[(pos + i) % 4];
+        }
+        memcpy(&mask, mask_bytes, sizeof(mask));
+
+        for (; size >= sizeof(mask); size -= sizeof(mask), buf += sizeof(mask)) {
+            uint64_t data;
+            memcpy(&data, buf, sizeof(data));
+            data ^= mask;
+            memcpy(buf, &data, sizeof(data));
         }
     }
+
+    /* as the word size is a multiple of 4 pos is still valid */
+    for (; size > 0; size--) {
+        *buf++ ^= frame->mask[pos++ % 4];
+    }
+}
+
+/* Read and decompress the data of a compressed message.
+ * Returns the number of bytes decompressed to buf, *done is set when
+ * all the data of the frame were decompressed.
+ * If no data could be decompressed returns the result of the
+ * failed read. */
+static int websocket_read_compressed(RedsWebSocket *ws, uint8_t *buf, size_t len, bool *done)
+{
+    websocket_frame_t *frame = &ws->read_frame;
+    z_stream *strm = &ws->decompress_stream;
+    int rc, ret;
+
+    *done = false;
+    strm->next_out = buf;
+    strm->avail_out = len;
+    while (strm->avail_out > 0) {
+        /* inflate first, if the output buffer was filled by the previous
+         * call it can hold more data even if all the input was consumed */
+        uInt avail_out = strm->avail_out;
+        ret = inflate(strm, Z_SYNC_FLUSH);
+        if (ret == Z_STREAM_END) {
+            /* the sender terminated the stream, next message starts a new one */
+            inflateReset(strm);
+            strm->avail_in = 0;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            spice_warning("invalid WebSocket compressed data");
+            ws->closed = true;
+            errno = EIO;
+            return -1;
+        }
+        if (strm->avail_in > 0 || strm->avail_out != avail_out) {
+            continue;
+        }
+
+        /* no more output without more input */
+        if (frame->relayed < frame->expected_len) {
+            rc = ws->raw_read(ws->raw_stream, ws->decompress_buf,
+                              MIN(sizeof(ws->decompress_buf),
+                                  frame->expected_len - frame->relayed));
+            if (rc <= 0) {
+                if (strm->avail_out < len) {
+                    break;
+                }
+                return rc;
+            }
+            relay_data(ws->decompress_buf, rc, frame);
+            frame->relayed += rc;
+            strm->next_in = ws->decompress_buf;
+            strm->avail_in = rc;
+        } else if (frame->fin && !frame->compressed_tail) {
+            /* the sender removes the tail of the last deflate block */
+            frame->compressed_tail = true;
+            strm->next_in = (Bytef *) DEFLATE_TAIL;
+            strm->avail_in = DEFLATE_TAIL_LEN;
+        } else {
+            *done = true;
+            break;
+        }
+    }
+
+    return len - strm->avail_out;
 }
 
 int websocket_read(RedsWebSocket *ws, uint8_t *buf, size_t len, unsigned *flags)
@@ -352,7 +484,7 @@ int websocket_read(RedsWebSocket *ws, uint8_t *buf, size_t len, unsigned *flags)
             }
             frame->header_pos += rc;
 
-            if (!websocket_get_frame_header(frame)) {
+            if (!websocket_get_frame_header(frame, ws->deflate_enabled)) {
                 ws->closed = true;
                 errno = EIO;
                 return -1;
@@ -371,6 +503,28 @@ int websocket_read(RedsWebSocket *ws, uint8_t *buf, size_t len, unsigned *flags)
             send_pending_data(ws);
             return 0;
         }
+        if ((frame->type == BINARY_FRAME || frame->type == TEXT_FRAME) && frame->compressed) {
+            bool done;
+
+            rc = websocket_read_compressed(ws, buf, len, &done);
+            if (rc < 0 || (rc == 0 && !done)) {
+                goto read_error;
+            }
+            n += rc;
+            buf += rc;
+            len -= rc;
+            *flags = frame->type;
+            if (!done) {
+                continue;
+            }
+
+            *flags |= frame->fin;
+            if (frame->fin && ws->decompress_no_context_takeover) {
+                inflateReset(&ws->decompress_stream);
+            }
+            websocket_clear_frame(frame);
+            break;
+        }
         if (frame->type == BINARY_FRAME || frame->type == TEXT_FRAME) {
             rc = 0;
             if (frame->expected_len > frame->relayed) {
@@ -541,12 +695,17 @@ static int send_data_header(RedsWebSocket *ws, uint64_t len, uint8_t type)
     return send_data_header_left(ws);
 }
 
+static inline bool compressed_frame_pending(const RedsWebSocket *ws)
+{
+    return ws->compressed_pos < ws->compressed_len;
+}
+
 static int send_pending_data(RedsWebSocket *ws)
 {
     int rc;
 
     /* don't send while we are sending a data frame */
-    if (ws->write_remainder) {
+    if (ws->write_remainder || compressed_frame_pending(ws)) {
         return 1;
     }
 
@@ -588,11 +747,97 @@ static int send_pending_data(RedsWebSocket *ws)
     return 1;
 }
 
+/* Check if a new message can be sent compressed */
+static bool can_compress(const RedsWebSocket *ws, unsigned flags)
+{
+    /* messages are compressed as a whole, only if not fragmented */
+    return ws->deflate_enabled && (flags & WEBSOCKET_COMPRESS) && (flags & FIN_FLAG) &&
+           !ws->send_unfinished && ws->write_remainder == 0 &&
+           ws->write_header_pos >= ws->write_header_len;
+}
+
+/* Write the pending compressed frame.
+ * Like SASL encoding the caller sees either all its data written
+ * or nothing, so it has to retry with the same data. */
+static int send_compressed_frame(RedsWebSocket *ws)
+{
+    int rc = ws->raw_write(ws->raw_stream, ws->compressed + ws->compressed_pos,
+                           ws->compressed_len - ws->compressed_pos);
+    if (rc <= 0) {
+        return rc;
+    }
+    ws->compressed_pos += rc;
+    if (compressed_frame_pending(ws)) {
+        errno = EAGAIN;
+        return -1;
+    }
+    ws->compressed_pos = ws->compressed_len = 0;
+    return ws->compressed_input_len;
+}
+
+static int write_compressed(RedsWebSocket *ws, const struct iovec *iov, int iovcnt, unsigned flags)
+{
+    z_stream *strm = &ws->compress_stream;
+    uint8_t header[WEBSOCKET_MAX_HEADER_SIZE];
+    size_t len = 0, out_len;
+    int header_len;
+    int i, ret;
+
+    for (i = 0; i < iovcnt; i++) {
+        len += iov[i].iov_len;
+    }
+
+    /* the header is written before the data once the size is known */
+    if (ws->compressed_size < WEBSOCKET_MAX_HEADER_SIZE + len + 64) {
+        ws->compressed_size = WEBSOCKET_MAX_HEADER_SIZE + len + 64;
+        ws->compressed = g_realloc(ws->compressed, ws->compressed_size);
+    }
+    strm->next_out = ws->compressed + WEBSOCKET_MAX_HEADER_SIZE;
+    strm->avail_out = ws->compressed_size - WEBSOCKET_MAX_HEADER_SIZE;
+
+    for (i = 0; i < iovcnt; i++) {
+        int flush = i == iovcnt - 1 ? Z_SYNC_FLUSH : Z_NO_FLUSH;
+
+        strm->next_in = iov[i].iov_base;
+        strm->avail_in = iov[i].iov_len;
+        do {
+            if (strm->avail_out == 0) {
+                size_t used = strm->next_out - ws->compressed;
+                ws->compressed_size *= 2;
+                ws->compressed = g_realloc(ws->compressed, ws->compressed_size);
+                strm->next_out = ws->compressed + used;
+                strm->avail_out = ws->compressed_size - used;
+            }
+            ret = deflate(strm, flush);
+            spice_assert(ret == Z_OK || ret == Z_BUF_ERROR);
+        } while (strm->avail_in > 0 || strm->avail_out == 0);
+    }
+
+    /* remove the tail of the flushed block, the receiver adds it back */
+    out_len = strm->next_out - (ws->compressed + WEBSOCKET_MAX_HEADER_SIZE);
+    spice_assert(out_len >= DEFLATE_TAIL_LEN &&
+                 memcmp(strm->next_out - DEFLATE_TAIL_LEN, DEFLATE_TAIL, DEFLATE_TAIL_LEN) == 0);
+    out_len -= DEFLATE_TAIL_LEN;
+    if (ws->compress_no_context_takeover) {
+        deflateReset(strm);
+    }
+
+    header_len = fill_header(header, out_len, flags);
+    header[0] |= RSV1_FLAG;
+    ws->compressed_pos = WEBSOCKET_MAX_HEADER_SIZE - header_len;
+    ws->compressed_len = WEBSOCKET_MAX_HEADER_SIZE + out_len;
+    ws->compressed_input_len = len;
+    memcpy(ws->compressed + ws->compressed_pos, header, header_len);
+
+    return send_compressed_frame(ws);
+}
+
 /* Write a WebSocket frame with the enclosed data out. */
 int websocket_writev(RedsWebSocket *ws, const struct iovec *iov, int iovcnt, unsigned flags)
 {
     uint64_t len;
     int rc;
+    struct iovec iov_buf[16];
     struct iovec *iov_out;
     int iov_out_cnt;
     int i;
@@ -601,10 +846,16 @@ int websocket_writev(RedsWebSocket *ws, const struct iovec *iov, int iovcnt, uns
         errno = EPIPE;
         return -1;
     }
+    if (compressed_frame_pending(ws)) {
+        return send_compressed_frame(ws);
+    }
     rc = send_pending_data(ws);
     if (rc <= 0) {
         return rc;
     }
+    if (iovcnt > 0 && can_compress(ws, flags)) {
+        return write_compressed(ws, iov, iovcnt, flags);
+    }
     if (ws->write_remainder > 0) {
         constrain_iov((struct iovec *) iov, iovcnt, &iov_out, &iov_out_cnt, ws->write_remainder);
         rc = ws->raw_writev(ws->raw_stream, iov_out, iov_out_cnt);
@@ -619,7 +870,8 @@ int websocket_writev(RedsWebSocket *ws, const struct iovec *iov, int iovcnt, uns
     }
 
     iov_out_cnt = iovcnt + 1;
-    iov_out = g_malloc(iov_out_cnt * sizeof(*iov_out));
+    iov_out = iov_out_cnt <= G_N_ELEMENTS(iov_buf) ?
+        iov_buf : g_new(struct iovec, iov_out_cnt);
 
     for (i = 0, len = 0; i < iovcnt; i++) {
         len += iov[i].iov_len;
@@ -631,7 +883,9 @@ int websocket_writev(RedsWebSocket *ws, const struct iovec *iov, int iovcnt, uns
     iov_out[0].iov_len = ws->write_header_len;
     iov_out[0].iov_base = ws->write_header;
     rc = ws->raw_writev(ws->raw_stream, iov_out, iov_out_cnt);
-    g_free(iov_out);
+    if (iov_out != iov_buf) {
+        g_free(iov_out);
+    }
     if (rc <= 0) {
         ws->write_header_len = 0;
         return rc;
@@ -639,7 +893,7 @@ int websocket_writev(RedsWebSocket *ws, const struct iovec *iov, int iovcnt, uns
 
     /* this can happen if we can't write the header */
     if (SPICE_UNLIKELY(rc < ws->write_header_len)) {
-        ws->write_header_pos = ws->write_header_len - rc;
+        ws->write_header_pos = rc;
         errno = EAGAIN;
         return -1;
     }
@@ -658,6 +912,13 @@ int websocket_write(RedsWebSocket *ws, const void *buf, size_t len, unsigned fla
 {
     int rc;
 
+    /* send header and data with a single system call,
+     * compressed messages are sent by websocket_writev too */
+    if (ws->raw_writev || compressed_frame_pending(ws) || can_compress(ws, flags)) {
+        struct iovec iov = { (void *) buf, len };
+        return websocket_writev(ws, &iov, 1, flags);
+    }
+
     if (ws->closed) {
         errno = EPIPE;
         return -1;
@@ -725,21 +986,173 @@ static bool websocket_is_start(char *buf, bool *p_has_prototol)
     return true;
 }
 
-static void websocket_create_reply(char *buf, char *outbuf, bool has_protocol)
+bool websocket_deflate_config_parse(WebSocketDeflateConfig *config, const char *str)
+{
+    gchar **options = g_strsplit(str, ",", -1);
+    bool ok = true;
+    int i;
+
+    config->window_bits = WEBSOCKET_DEFLATE_MAX_WINDOW_BITS;
+    config->no_context_takeover = false;
+
+    for (i = 0; options[i] != NULL && ok; i++) {
+        const char *option = g_strstrip(options[i]);
+        int pos = -1;
+
+        if (strcmp(option, "") == 0) {
+            continue;
+        }
+        if (strcmp(option, "no_context_takeover") == 0) {
+            config->no_context_takeover = true;
+            continue;
+        }
+        if (sscanf(option, "window_bits=%d%n", &config->window_bits, &pos) != 1 ||
+            option[pos] != 0 ||
+            config->window_bits < WEBSOCKET_DEFLATE_MIN_WINDOW_BITS ||
+            config->window_bits > WEBSOCKET_DEFLATE_MAX_WINDOW_BITS) {
+            ok = false;
+        }
+    }
+    g_strfreev(options);
+    return ok;
+}
+
+/* Negotiated parameters of permessage-deflate extension */
+typedef struct {
+    int window_bits;
+    bool server_no_context_takeover;
+    bool client_no_context_takeover;
+    bool has_server_max_window_bits;
+} WebSocketDeflateParams;
+
+/* Parse a single permessage-deflate offer ("param; param=value; ...")
+ * checking it's acceptable */
+static bool parse_deflate_offer(const char *offer, const WebSocketDeflateConfig *config,
+                                WebSocketDeflateParams *params)
+{
+    gchar **tokens = g_strsplit(offer, ";", -1);
+    bool ok = true;
+    int i;
+
+    memset(params, 0, sizeof(*params));
+    params->window_bits = config->window_bits;
+    params->server_no_context_takeover = config->no_context_takeover;
+
+    if (tokens[0] == NULL || strcmp(g_strstrip(tokens[0]), "permessage-deflate") != 0) {
+        g_strfreev(tokens);
+        return false;
+    }
+
+    for (i = 1; tokens[i] != NULL && ok; i++) {
+        char *name = g_strstrip(tokens[i]);
+        char *value = strchr(name, '=');
+        int bits = -1;
+
+        if (value) {
+            *value++ = 0;
+            g_strchomp(name);
+            value = g_strstrip(value);
+            /* values can be quoted */
+            if (value[0] == '"' && strlen(value) >= 2 && value[strlen(value) - 1] == '"') {
+                value[strlen(value) - 1] = 0;
+                value++;
+            }
+            bits = atoi(value);
+        }
+
+        if (strcmp(name, "server_no_context_takeover") == 0 && !value) {
+            params->server_no_context_takeover = true;
+        } else if (strcmp(name, "client_no_context_takeover") == 0 && !value) {
+            params->client_no_context_takeover = true;
+        } else if (strcmp(name, "server_max_window_bits") == 0 && value &&
+                   !params->has_server_max_window_bits) {
+            /* zlib cannot compress with a window of 8 bits */
+            ok = bits >= WEBSOCKET_DEFLATE_MIN_WINDOW_BITS &&
+                 bits <= WEBSOCKET_DEFLATE_MAX_WINDOW_BITS;
+            params->window_bits = MIN(params->window_bits, bits);
+            params->has_server_max_window_bits = true;
+        } else if (strcmp(name, "client_max_window_bits") == 0) {
+            /* we can decompress any window size, no need to limit it */
+            ok = !value || (bits >= 8 && bits <= WEBSOCKET_DEFLATE_MAX_WINDOW_BITS);
+        } else {
+            ok = false;
+        }
+    }
+    g_strfreev(tokens);
+    return ok;
+}
+
+/* Find an acceptable permessage-deflate offer in the request */
+static bool websocket_find_deflate_offer(const char *buf, const WebSocketDeflateConfig *config,
+                                         WebSocketDeflateParams *params)
+{
+    const char *extensions = find_str(buf, "\nSec-WebSocket-Extensions:");
+    const char *end;
+    bool found = false;
+
+    if (!extensions || !(end = strchr(extensions, '\r'))) {
+        return false;
+    }
+
+    gchar *value = g_strndup(extensions, end - extensions);
+    gchar **offers = g_strsplit(value, ",", -1);
+    for (int i = 0; offers[i] != NULL && !found; i++) {
+        found = parse_deflate_offer(offers[i], config, params);
+    }
+    g_strfreev(offers);
+    g_free(value);
+    return found;
+}
+
+static bool websocket_deflate_init(RedsWebSocket *ws, const WebSocketDeflateParams *params)
+{
+    if (deflateInit2(&ws->compress_stream, Z_DEFAULT_COMPRESSION, Z_DEFLATED,
+                     -params->window_bits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+        return false;
+    }
+    if (inflateInit2(&ws->decompress_stream, -WEBSOCKET_DEFLATE_MAX_WINDOW_BITS) != Z_OK) {
+        deflateEnd(&ws->compress_stream);
+        return false;
+    }
+    ws->deflate_enabled = true;
+    ws->compress_no_context_takeover = params->server_no_context_takeover;
+    ws->decompress_no_context_takeover = params->client_no_context_takeover;
+    return true;
+}
+
+static void websocket_create_reply(char *buf, char *outbuf, bool has_protocol,
+                                   const WebSocketDeflateParams *deflate_params)
 {
     char *key;
+    char extensions[256] = "";
+
+    if (deflate_params) {
+        snprintf(extensions, sizeof(extensions),
+                 "Sec-WebSocket-Extensions: permessage-deflate%s%s",
+                 deflate_params->server_no_context_takeover ? "; server_no_context_takeover" : "",
+                 deflate_params->client_no_context_takeover ? "; client_no_context_takeover" : "");
+        if (deflate_params->has_server_max_window_bits ||
+            deflate_params->window_bits < WEBSOCKET_DEFLATE_MAX_WINDOW_BITS) {
+            size_t used = strlen(extensions);
+            snprintf(extensions + used, sizeof(extensions) - used,
+                     "; server_max_window_bits=%d", deflate_params->window_bits);
+        }
+        g_strlcat(extensions, "\r\n", sizeof(extensions));
+    }
 
     key = generate_reply_key(buf);
     sprintf(outbuf, "HTTP/1.1 101 Switching Protocols\r\n"
                     "Upgrade: WebSocket\r\n"
                     "Connection: Upgrade\r\n"
-                    "Sec-WebSocket-Accept: %s\r\n%s\r\n", key,
-                    has_protocol ? "Sec-WebSocket-Protocol: binary\r\n": "");
+                    "Sec-WebSocket-Accept: %s\r\n%s%s\r\n", key,
+                    has_protocol ? "Sec-WebSocket-Protocol: binary\r\n": "",
+                    extensions);
     g_free(key);
 }
 
 RedsWebSocket *websocket_new(const void *buf, size_t len, void *stream, websocket_read_cb_t read_cb,
-                             websocket_write_cb_t write_cb, websocket_writev_cb_t writev_cb)
+                             websocket_write_cb_t write_cb, websocket_writev_cb_t writev_cb,
+                             const WebSocketDeflateConfig *deflate_config)
 {
     char rbuf[4096];
 
@@ -773,15 +1186,19 @@ RedsWebSocket *websocket_new(const void *buf, size_t len, void *stream, websocke
     }
 
     char outbuf[1024];
+    RedsWebSocket *ws = g_new0(RedsWebSocket, 1);
+    WebSocketDeflateParams deflate_params;
+    bool use_deflate = deflate_config &&
+                       websocket_find_deflate_offer(rbuf, deflate_config, &deflate_params) &&
+                       websocket_deflate_init(ws, &deflate_params);
 
-    websocket_create_reply(rbuf, outbuf, has_protocol);
+    websocket_create_reply(rbuf, outbuf, has_protocol, use_deflate ? &deflate_params : NULL);
     rc = write_cb(stream, outbuf, strlen(outbuf));
     if (rc != strlen(outbuf)) {
+        websocket_free(ws);
         return NULL;
     }
 
-    RedsWebSocket *ws = g_new0(RedsWebSocket, 1);
-
     ws->raw_stream = stream;
     ws->raw_read = read_cb;
     ws->raw_write = write_cb;
@@ -793,7 +1210,20 @@ RedsWebSocket *websocket_new(const void *buf, size_t len, void *stream, websocke
     return ws;
 }
 
+bool websocket_is_deflate_enabled(const RedsWebSocket *ws)
+{
+    return ws->deflate_enabled;
+}
+
 void websocket_free(RedsWebSocket *ws)
 {
+    if (!ws) {
+        return;
+    }
+    if (ws->deflate_enabled) {
+        deflateEnd(&ws->compress_stream);
+        inflateEnd(&ws->decompress_stream);
+    }
+    g_free(ws->compressed);
     g_free(ws);
 }
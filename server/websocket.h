@@ -19,6 +19,7 @@
 #define WEBSOCKET_H_
 
 #include <stdint.h>
+#include <stdbool.h>
 #include <spice/macros.h>
 
 #include "sys-socket.h"
@@ -34,13 +35,42 @@ typedef struct RedsWebSocket RedsWebSocket;
 enum {
     WEBSOCKET_TEXT = 1,
     WEBSOCKET_BINARY= 2,
+    /* write only, compress the message if permessage-deflate
+     * extension was negotiated */
+    WEBSOCKET_COMPRESS = 0x40,
     WEBSOCKET_FINAL = 0x80,
     WEBSOCKET_TEXT_FINAL = WEBSOCKET_TEXT | WEBSOCKET_FINAL,
     WEBSOCKET_BINARY_FINAL = WEBSOCKET_BINARY | WEBSOCKET_FINAL,
 };
 
+/* Configuration of the permessage-deflate extension (RFC 7692) */
+typedef struct {
+    /* maximum size of the LZ77 window used to compress, 9 to 15 bits */
+    int window_bits;
+    /* reset compression context after each message, the client
+     * needs less memory but the compression is less effective */
+    bool no_context_takeover;
+} WebSocketDeflateConfig;
+
+#define WEBSOCKET_DEFLATE_MIN_WINDOW_BITS 9
+#define WEBSOCKET_DEFLATE_MAX_WINDOW_BITS 15
+
+/**
+ * Parse the configuration of the permessage-deflate extension.
+ * The string contains a comma separated list of options:
+ * "window_bits=N" and "no_context_takeover".
+ * Returns false if the string is not valid.
+ */
+bool websocket_deflate_config_parse(WebSocketDeflateConfig *config, const char *str);
+
+/**
+ * Create a WebSocket handling the client handshake.
+ * If @deflate_config is not NULL the permessage-deflate extension
+ * is accepted if offered by the client.
+ */
 RedsWebSocket *websocket_new(const void *buf, size_t len, void *stream, websocket_read_cb_t read_cb,
-                             websocket_write_cb_t write_cb, websocket_writev_cb_t writev_cb);
+                             websocket_write_cb_t write_cb, websocket_writev_cb_t writev_cb,
+                             const WebSocketDeflateConfig *deflate_config);
 void websocket_free(RedsWebSocket *ws);
 
 /**
@@ -52,6 +82,9 @@ int websocket_read(RedsWebSocket *ws, uint8_t *buf, size_t len, unsigned *flags)
 int websocket_write(RedsWebSocket *ws, const void *buf, size_t len, unsigned flags);
 int websocket_writev(RedsWebSocket *ws, const struct iovec *iov, int iovcnt, unsigned flags);
 
+/* Returns true if permessage-deflate extension was negotiated */
+bool websocket_is_deflate_enabled(const RedsWebSocket *ws);
+
 SPICE_END_DECLS
 
 #endif